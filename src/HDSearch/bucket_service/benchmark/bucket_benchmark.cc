@@ -0,0 +1,598 @@
+/* Microbenchmarks of the bucket server's leaf compute on synthetic data,
+   without gRPC servers or a load generator:
+   kernel: one distance kernel (scalar, SSE4, AVX2, AVX-512 variants of the
+   fp32, fp16 and int8 kernels) over each candidate's row.
+   queue: CustomPriorityQueue, offered one distance per candidate.
+   engine: DistCalc::DistanceCalculation() over a shard kept as fp32 rows
+   (with or without early abandon), int8, fp16 or PQ codes, for batches of
+   queries (several queries take the batched GEMM path when their candidate
+   lists overlap enough).
+   Every configuration reports ns per candidate, GB/s of candidate data
+   (the bytes a candidate takes in its layout) and, when perf_event_open is
+   allowed, cycles, instructions and cache misses per candidate. Results are
+   written as JSON, for regression tracking.*/
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "bucket_service/benchmark/perf_counters.h"
+#include "bucket_service/src/candidate_preprocessor.h"
+#include "bucket_service/src/dist_calc.h"
+#include "bucket_service/src/distance_kernels.h"
+
+// Candidate sets a configuration cycles through, so rows are not all cached.
+#define NUM_CANDIDATE_SETS 16
+// A configuration runs at least this many passes over a candidate set.
+#define MIN_REPETITIONS 3
+// Same re-rank factor as a bucket server's default.
+#define BENCHMARK_RERANK_FACTOR 4
+// PQ codebooks are trained on up to this many points.
+#define PQ_MAX_TRAINING_POINTS 4096
+#define PQ_TRAINING_ITERATIONS 8
+
+struct BenchmarkArgs {
+    std::vector<unsigned> dimensions = {128, 960, 2048};
+    std::vector<unsigned> k = {10, 100};
+    std::vector<unsigned> candidates = {100, 1000, 10000};
+    std::vector<unsigned> batch_sizes = {1, 8};
+    std::vector<std::string> layouts = {"fp32", "early_abandon", "int8", "fp16", "pq", "pq_rerank"};
+    std::vector<std::string> isas = {"scalar", "sse4", "avx2", "avx512"};
+    std::vector<std::string> suites = {"kernel", "queue", "engine"};
+    // Size of the synthetic shard.
+    unsigned shard_mb = 256;
+    unsigned min_time_ms = 100;
+    unsigned seed = 1;
+    // Empty: JSON goes to stdout.
+    std::string output_file_name = "";
+};
+
+// Time, candidates and counters of one configuration.
+struct Measurement {
+    uint64_t repetitions = 0;
+    uint64_t candidates = 0;
+    double seconds = 0;
+    double counters[PerfCounters::NUM_COUNTERS];
+};
+
+struct Result {
+    std::string suite;
+    std::string name;
+    std::string isa;
+    unsigned dimensions = 0;
+    unsigned k = 0;
+    unsigned candidates = 0;
+    unsigned batch_size = 0;
+    double bytes_per_candidate = 0;
+    Measurement measurement;
+};
+
+/* Synthetic shard: dimension d has a standard deviation that decreases with
+   d, like a shard whose dimensions were ordered by decreasing variance
+   (what early abandon is meant for).*/
+struct SyntheticShard {
+    unsigned dimension = 0;
+    size_t size = 0;
+    MultiplePoints dataset;
+    std::unique_ptr<QuantizedPoints> int8_dataset;
+    std::unique_ptr<QuantizedPoints> fp16_dataset;
+    std::unique_ptr<ProductQuantizer> pq_dataset;
+};
+
+static std::vector<std::string> SplitList(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+static std::vector<unsigned> SplitNumberList(const std::string &list)
+{
+    std::vector<unsigned> numbers;
+    for(const std::string &item : SplitList(list))
+    {
+        numbers.push_back(std::stoul(item, nullptr, 0));
+    }
+    return numbers;
+}
+
+static bool Contains(const std::vector<std::string> &items, const std::string &item)
+{
+    return std::find(items.begin(), items.end(), item) != items.end();
+}
+
+static BenchmarkArgs ParseBenchmarkCommandLine(const int argc, char** argv)
+{
+    BenchmarkArgs args;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string flag = argv[i];
+        std::string value = "";
+        size_t equals = flag.find('=');
+        if (equals != std::string::npos) {
+            value = flag.substr(equals + 1);
+            flag = flag.substr(0, equals);
+        }
+        try
+        {
+            if (flag == "--dimensions") {
+                args.dimensions = SplitNumberList(value);
+            } else if (flag == "--k") {
+                args.k = SplitNumberList(value);
+            } else if (flag == "--candidates") {
+                args.candidates = SplitNumberList(value);
+            } else if (flag == "--batch_sizes") {
+                args.batch_sizes = SplitNumberList(value);
+            } else if (flag == "--layouts") {
+                args.layouts = SplitList(value);
+            } else if (flag == "--isas") {
+                args.isas = SplitList(value);
+            } else if (flag == "--suites") {
+                args.suites = SplitList(value);
+            } else if (flag == "--shard_mb") {
+                args.shard_mb = std::stoul(value, nullptr, 0);
+            } else if (flag == "--min_time_ms") {
+                args.min_time_ms = std::stoul(value, nullptr, 0);
+            } else if (flag == "--seed") {
+                args.seed = std::stoul(value, nullptr, 0);
+            } else if (flag == "--output") {
+                args.output_file_name = value;
+            } else {
+                CHECK(false, "Format: ./<bucket_benchmark> [--suites=kernel,queue,engine] [--dimensions=128,960,2048] [--k=10,100] [--candidates=100,1000,10000] [--batch_sizes=1,8] [--layouts=fp32,early_abandon,int8,fp16,pq,pq_rerank] [--isas=scalar,sse4,avx2,avx512] [--shard_mb=256] [--min_time_ms=100] [--seed=1] [--output=<JSON file, stdout if not given>]\n");
+            }
+        }
+        catch (...)
+        {
+            CHECK(false, "ERROR: Enter a valid number for benchmark flag " << flag << "\n");
+        }
+    }
+    for(unsigned dimension : args.dimensions)
+    {
+        // PQ subspaces of 16 dimensions, and rows without padding.
+        CHECK(((dimension > 0) && ((dimension % 32) == 0)), "ERROR: Dimensions must be multiples of 32\n");
+    }
+    for(const std::string &layout : args.layouts)
+    {
+        CHECK((layout == "fp32" || layout == "early_abandon" || layout == "int8" || layout == "fp16" || layout == "pq" || layout == "pq_rerank"), "ERROR: Layouts must be fp32, early_abandon, int8, fp16, pq or pq_rerank\n");
+    }
+    CHECK((args.shard_mb > 0), "ERROR: Shard size must be positive\n");
+    return args;
+}
+
+static void FillSyntheticPoints(const unsigned dimension,
+        std::mt19937* rng,
+        MultiplePoints* points)
+{
+    std::normal_distribution<float> normal(0.0, 1.0);
+    for(unsigned i = 0; i < points->GetSize(); i++)
+    {
+        float* row = points->GetMutableRowAtIndex(i);
+        for(unsigned d = 0; d < dimension; d++)
+        {
+            row[d] = normal(*rng) / sqrtf(1.0 + d / 16.0);
+        }
+    }
+}
+
+static void CreateSyntheticShard(const BenchmarkArgs &args,
+        const unsigned dimension,
+        std::mt19937* rng,
+        SyntheticShard* shard)
+{
+    shard->dimension = dimension;
+    shard->size = std::max<size_t>(((size_t)args.shard_mb << 20) / (dimension * sizeof(float)), 1);
+    shard->dataset.Resize(shard->size, dimension);
+    FillSyntheticPoints(dimension, rng, &shard->dataset);
+    shard->dataset.ComputeSquaredNorms();
+    // dimension % 16 == 0: the rows are contiguous, as the quantizers want.
+    const float* rows = shard->dataset.GetRowAtIndex(0);
+    if (Contains(args.layouts, "int8")) {
+        shard->int8_dataset.reset(new QuantizedPoints());
+        shard->int8_dataset->Quantize(rows, shard->size, dimension, INT8_STORAGE, false);
+    }
+    if (Contains(args.layouts, "fp16")) {
+        shard->fp16_dataset.reset(new QuantizedPoints());
+        shard->fp16_dataset->Quantize(rows, shard->size, dimension, FP16_STORAGE, false);
+    }
+    if (Contains(args.layouts, "pq") || Contains(args.layouts, "pq_rerank")) {
+        // Subspaces of 16 dimensions, or the largest even count that fits.
+        unsigned num_subspaces = std::min<unsigned>(dimension / 16, PQ_MAX_SUBSPACES);
+        while ((dimension % num_subspaces) != 0 || (num_subspaces % 2) != 0)
+        {
+            num_subspaces--;
+        }
+        shard->pq_dataset.reset(new ProductQuantizer());
+        shard->pq_dataset->Train(rows,
+                std::min<size_t>(shard->size, PQ_MAX_TRAINING_POINTS),
+                dimension,
+                num_subspaces,
+                PQ_TRAINING_ITERATIONS,
+                args.seed);
+        shard->pq_dataset->Encode(rows, shard->size, false);
+    }
+}
+
+/* NUM_CANDIDATE_SETS sets of batch_size candidate lists, each of
+   num_candidates uniformly drawn point IDs, preprocessed (sorted and
+   deduplicated) like a bucket server does.*/
+static void CreateCandidateSets(const size_t shard_size,
+        const unsigned num_candidates,
+        const unsigned batch_size,
+        std::mt19937* rng,
+        std::vector<std::vector<std::vector<uint32_t>>>* candidate_sets)
+{
+    std::uniform_int_distribution<uint32_t> uniform(0, shard_size - 1);
+    CandidatePreprocessor candidate_preprocessor;
+    candidate_sets->assign(NUM_CANDIDATE_SETS, std::vector<std::vector<uint32_t>>(batch_size));
+    for(auto &candidate_set : *candidate_sets)
+    {
+        for(auto &point_ids : candidate_set)
+        {
+            point_ids.resize(num_candidates);
+            for(auto &point_id : point_ids)
+            {
+                point_id = uniform(*rng);
+            }
+            candidate_preprocessor.Preprocess(shard_size, &point_ids);
+        }
+    }
+}
+
+/* Runs pass(set) over the candidate sets in turn, after one warm up pass,
+   until min_time_ms have passed and at least MIN_REPETITIONS passes ran.
+   pass returns the number of candidates it processed.*/
+template <typename Pass>
+static Measurement Measure(const BenchmarkArgs &args,
+        PerfCounters* perf_counters,
+        const Pass &pass)
+{
+    pass(0);
+    Measurement measurement;
+    std::chrono::steady_clock::duration min_time = std::chrono::milliseconds(args.min_time_ms);
+    std::chrono::steady_clock::duration elapsed(0);
+    perf_counters->Start();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while ((measurement.repetitions < MIN_REPETITIONS) || (elapsed < min_time))
+    {
+        measurement.candidates += pass(measurement.repetitions % NUM_CANDIDATE_SETS);
+        measurement.repetitions++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    perf_counters->Stop();
+    measurement.seconds = std::chrono::duration<double>(elapsed).count();
+    for(int i = 0; i < PerfCounters::NUM_COUNTERS; i++)
+    {
+        measurement.counters[i] = perf_counters->GetValue((PerfCounters::Counter)i);
+    }
+    return measurement;
+}
+
+static std::string ResultToJson(const Result &result)
+{
+    const Measurement &measurement = result.measurement;
+    double candidates = std::max<double>(measurement.candidates, 1);
+    std::ostringstream json;
+    json << "{\"suite\": \"" << result.suite << "\""
+        << ", \"name\": \"" << result.name << "\""
+        << ", \"isa\": \"" << result.isa << "\""
+        << ", \"dimensions\": " << result.dimensions
+        << ", \"k\": " << result.k
+        << ", \"candidates\": " << result.candidates
+        << ", \"batch_size\": " << result.batch_size
+        << ", \"repetitions\": " << measurement.repetitions
+        << ", \"candidates_processed\": " << measurement.candidates
+        << ", \"seconds\": " << measurement.seconds
+        << ", \"ns_per_candidate\": " << (measurement.seconds * 1e9 / candidates)
+        << ", \"gb_per_s\": " << ((result.bytes_per_candidate * measurement.candidates) / measurement.seconds / 1e9);
+    for(int i = 0; i < PerfCounters::NUM_COUNTERS; i++)
+    {
+        json << ", \"" << PerfCounters::GetName((PerfCounters::Counter)i) << "_per_candidate\": ";
+        if (measurement.counters[i] < 0) {
+            json << "null";
+        } else {
+            json << (measurement.counters[i] / candidates);
+        }
+    }
+    json << "}";
+    return json.str();
+}
+
+static void ReportResult(const Result &result, std::vector<std::string>* results_json)
+{
+    results_json->push_back(ResultToJson(result));
+    // Progress goes to stderr, stdout may carry the JSON.
+    std::cerr << result.suite << " " << result.name << " " << result.isa
+        << " d=" << result.dimensions << " k=" << result.k
+        << " candidates=" << result.candidates << " batch=" << result.batch_size
+        << ": " << (result.measurement.seconds * 1e9 / std::max<double>(result.measurement.candidates, 1))
+        << " ns/candidate\n";
+}
+
+static inline size_t RoundUp(const size_t value, const size_t multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+// Keeps kernel results alive, so that the compiler cannot drop the calls.
+static volatile float kernel_sink;
+
+static void RunKernelSuite(const BenchmarkArgs &args,
+        const SyntheticShard &shard,
+        std::mt19937* rng,
+        PerfCounters* perf_counters,
+        std::vector<std::string>* results_json)
+{
+    const unsigned dimension = shard.dimension;
+    // fp16 and int8 copies of the shard, in the kernels' padded row formats.
+    const size_t half_stride = RoundUp(dimension, 16);
+    const size_t int8_stride = RoundUp(dimension, 64);
+    std::vector<uint16_t> half_rows(shard.size * half_stride, 0);
+    std::vector<uint8_t> int8_rows(shard.size * int8_stride, 0);
+    std::uniform_int_distribution<int> code(0, 127);
+    for(size_t i = 0; i < shard.size; i++)
+    {
+        const float* row = shard.dataset.GetRowAtIndex(i);
+        for(unsigned d = 0; d < dimension; d++)
+        {
+            half_rows[i * half_stride + d] = FloatToHalf(row[d]);
+            int8_rows[i * int8_stride + d] = code(*rng);
+        }
+    }
+    MultiplePoints query;
+    query.Resize(1, dimension);
+    FillSyntheticPoints(dimension, rng, &query);
+    std::vector<int8_t> int8_query(int8_stride, 0);
+    for(unsigned d = 0; d < dimension; d++)
+    {
+        int8_query[d] = code(*rng) - 64;
+    }
+
+    for(const std::string &isa : args.isas)
+    {
+        DistanceKernels kernels;
+        if (!GetDistanceKernelsForIsa(isa, &kernels)) {
+            std::cerr << "Skipping " << isa << " kernels: not supported by this CPU\n";
+            continue;
+        }
+        for(unsigned num_candidates : args.candidates)
+        {
+            std::vector<std::vector<std::vector<uint32_t>>> candidate_sets;
+            CreateCandidateSets(shard.size, num_candidates, 1, rng, &candidate_sets);
+            const float* query_row = query.GetRowAtIndex(0);
+            Result result;
+            result.suite = "kernel";
+            result.isa = isa;
+            result.dimensions = dimension;
+            result.candidates = num_candidates;
+            result.batch_size = 1;
+
+            result.name = "squared_l2";
+            result.bytes_per_candidate = dimension * sizeof(float);
+            result.measurement = Measure(args, perf_counters, [&](const unsigned set) {
+                    const std::vector<uint32_t> &point_ids = candidate_sets[set][0];
+                    float sum = 0;
+                    for(uint32_t point_id : point_ids)
+                    {
+                        sum += kernels.squared_l2(query_row, shard.dataset.GetRowAtIndex(point_id), dimension);
+                    }
+                    kernel_sink = sum;
+                    return (uint64_t)point_ids.size();
+                    });
+            ReportResult(result, results_json);
+
+            result.name = "inner_product";
+            result.measurement = Measure(args, perf_counters, [&](const unsigned set) {
+                    const std::vector<uint32_t> &point_ids = candidate_sets[set][0];
+                    float sum = 0;
+                    for(uint32_t point_id : point_ids)
+                    {
+                        sum += kernels.inner_product(query_row, shard.dataset.GetRowAtIndex(point_id), dimension);
+                    }
+                    kernel_sink = sum;
+                    return (uint64_t)point_ids.size();
+                    });
+            ReportResult(result, results_json);
+
+            result.name = "half_squared_l2";
+            result.bytes_per_candidate = dimension * sizeof(uint16_t);
+            result.measurement = Measure(args, perf_counters, [&](const unsigned set) {
+                    const std::vector<uint32_t> &point_ids = candidate_sets[set][0];
+                    float sum = 0;
+                    for(uint32_t point_id : point_ids)
+                    {
+                        sum += kernels.half_squared_l2(query_row, &half_rows[point_id * half_stride], half_stride);
+                    }
+                    kernel_sink = sum;
+                    return (uint64_t)point_ids.size();
+                    });
+            ReportResult(result, results_json);
+
+            result.name = "int8_inner_product";
+            result.bytes_per_candidate = int8_stride;
+            result.measurement = Measure(args, perf_counters, [&](const unsigned set) {
+                    const std::vector<uint32_t> &point_ids = candidate_sets[set][0];
+                    int32_t sum = 0;
+                    for(uint32_t point_id : point_ids)
+                    {
+                        sum += kernels.int8_inner_product(&int8_rows[point_id * int8_stride], int8_query.data(), int8_stride);
+                    }
+                    kernel_sink = sum;
+                    return (uint64_t)point_ids.size();
+                    });
+            ReportResult(result, results_json);
+        }
+    }
+}
+
+static void RunQueueSuite(const BenchmarkArgs &args,
+        std::mt19937* rng,
+        PerfCounters* perf_counters,
+        std::vector<std::string>* results_json)
+{
+    std::uniform_real_distribution<float> uniform(0.0, 1.0);
+    CustomPriorityQueue queue;
+    for(unsigned num_candidates : args.candidates)
+    {
+        std::vector<std::vector<float>> distance_sets(NUM_CANDIDATE_SETS, std::vector<float>(num_candidates));
+        for(auto &distances : distance_sets)
+        {
+            for(auto &distance : distances)
+            {
+                distance = uniform(*rng);
+            }
+        }
+        for(unsigned k : args.k)
+        {
+            Result result;
+            result.suite = "queue";
+            result.name = "offer";
+            result.isa = "none";
+            result.k = k;
+            result.candidates = num_candidates;
+            result.batch_size = 1;
+            result.bytes_per_candidate = sizeof(float);
+            result.measurement = Measure(args, perf_counters, [&](const unsigned set) {
+                    const std::vector<float> &distances = distance_sets[set];
+                    queue.Reset(k);
+                    for(uint32_t i = 0; i < distances.size(); i++)
+                    {
+                        queue.Offer(i, distances[i]);
+                    }
+                    kernel_sink = queue.GetWorstDistance();
+                    return (uint64_t)distances.size();
+                    });
+            ReportResult(result, results_json);
+        }
+    }
+}
+
+// Bytes a candidate takes in a layout.
+static double GetBytesPerCandidate(const SyntheticShard &shard, const std::string &layout)
+{
+    if (layout == "int8") {
+        return RoundUp(shard.dimension, 64);
+    } else if (layout == "fp16") {
+        return shard.dimension * sizeof(uint16_t);
+    } else if (layout == "pq" || layout == "pq_rerank") {
+        return shard.pq_dataset->GetNumSubspaces() / 2;
+    }
+    return shard.dimension * sizeof(float);
+}
+
+static void RunEngineSuite(const BenchmarkArgs &args,
+        const SyntheticShard &shard,
+        std::mt19937* rng,
+        PerfCounters* perf_counters,
+        std::vector<std::string>* results_json)
+{
+    for(unsigned batch_size : args.batch_sizes)
+    {
+        MultiplePoints queries;
+        queries.Resize(batch_size, shard.dimension);
+        FillSyntheticPoints(shard.dimension, rng, &queries);
+        for(unsigned num_candidates : args.candidates)
+        {
+            std::vector<std::vector<std::vector<uint32_t>>> candidate_sets;
+            CreateCandidateSets(shard.size, num_candidates, batch_size, rng, &candidate_sets);
+            for(const std::string &layout : args.layouts)
+            {
+                for(unsigned k : args.k)
+                {
+                    DistCalc knn_answer;
+                    if (layout == "early_abandon") {
+                        knn_answer.UseEarlyAbandon(true);
+                    } else if (layout == "int8") {
+                        knn_answer.UseQuantizedDataset(shard.int8_dataset.get(), BENCHMARK_RERANK_FACTOR);
+                    } else if (layout == "fp16") {
+                        knn_answer.UseQuantizedDataset(shard.fp16_dataset.get(), BENCHMARK_RERANK_FACTOR);
+                    } else if (layout == "pq") {
+                        knn_answer.UsePqDataset(shard.pq_dataset.get(), PQ_APPROXIMATE, 0);
+                    } else if (layout == "pq_rerank") {
+                        knn_answer.UsePqDataset(shard.pq_dataset.get(), PQ_RERANK, BENCHMARK_RERANK_FACTOR);
+                    }
+                    Result result;
+                    result.suite = "engine";
+                    result.name = layout;
+                    result.isa = GetDistanceKernels().isa;
+                    result.dimensions = shard.dimension;
+                    result.k = k;
+                    result.candidates = num_candidates;
+                    result.batch_size = batch_size;
+                    result.bytes_per_candidate = GetBytesPerCandidate(shard, layout);
+                    result.measurement = Measure(args, perf_counters, [&](const unsigned set) {
+                            const std::vector<std::vector<uint32_t>> &point_ids_vec = candidate_sets[set];
+                            knn_answer.DistanceCalculation(shard.dataset, queries, point_ids_vec, k);
+                            uint64_t candidates = 0;
+                            for(const auto &point_ids : point_ids_vec)
+                            {
+                                candidates += point_ids.size();
+                            }
+                            return candidates;
+                            });
+                    ReportResult(result, results_json);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchmarkArgs args = ParseBenchmarkCommandLine(argc, argv);
+    std::mt19937 rng(args.seed);
+    PerfCounters perf_counters;
+    bool perf_counters_open = perf_counters.Open();
+    if (!perf_counters_open) {
+        std::cerr << "perf_event_open is not allowed: hardware counters are reported as null\n";
+    }
+
+    std::vector<std::string> results_json;
+    if (Contains(args.suites, "queue")) {
+        RunQueueSuite(args, &rng, &perf_counters, &results_json);
+    }
+    if (Contains(args.suites, "kernel") || Contains(args.suites, "engine")) {
+        for(unsigned dimension : args.dimensions)
+        {
+            SyntheticShard shard;
+            CreateSyntheticShard(args, dimension, &rng, &shard);
+            if (Contains(args.suites, "kernel")) {
+                RunKernelSuite(args, shard, &rng, &perf_counters, &results_json);
+            }
+            if (Contains(args.suites, "engine")) {
+                RunEngineSuite(args, shard, &rng, &perf_counters, &results_json);
+            }
+        }
+    }
+
+    std::ostringstream json;
+    json << "{\"engine_isa\": \"" << GetDistanceKernels().isa << "\""
+        << ", \"shard_mb\": " << args.shard_mb
+        << ", \"seed\": " << args.seed
+        << ", \"perf_counters\": " << (perf_counters_open ? "true" : "false")
+        << ", \"results\": [\n";
+    for(size_t i = 0; i < results_json.size(); i++)
+    {
+        json << "  " << results_json[i] << ((i + 1 < results_json.size()) ? ",\n" : "\n");
+    }
+    json << "]}\n";
+    if (args.output_file_name.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream output(args.output_file_name);
+        CHECK((output.good()), "ERROR: Could not create the output JSON file\n");
+        output << json.str();
+    }
+    return 0;
+}
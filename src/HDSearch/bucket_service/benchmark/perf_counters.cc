@@ -0,0 +1,94 @@
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf_counters.h"
+
+static int OpenCounter(const uint32_t type, const uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // This thread, on any CPU.
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+PerfCounters::~PerfCounters()
+{
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (fds_[i] >= 0) {
+            close(fds_[i]);
+        }
+    }
+}
+
+bool PerfCounters::Open()
+{
+    fds_[CYCLES] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fds_[INSTRUCTIONS] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds_[CACHE_MISSES] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    fds_[L1D_READ_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    bool any_open = false;
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+        any_open = any_open || (fds_[i] >= 0);
+    }
+    return any_open;
+}
+
+void PerfCounters::Start()
+{
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (fds_[i] >= 0) {
+            ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::Stop()
+{
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (fds_[i] >= 0) {
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+        values_[i] = -1;
+        // Value, time enabled, time running.
+        uint64_t data[3];
+        if ((fds_[i] < 0) || (read(fds_[i], data, sizeof(data)) != sizeof(data)) || (data[2] == 0)) {
+            continue;
+        }
+        values_[i] = (double)data[0] * ((double)data[1] / (double)data[2]);
+    }
+}
+
+const char* PerfCounters::GetName(const Counter counter)
+{
+    switch (counter) {
+        case CYCLES:
+            return "cycles";
+        case INSTRUCTIONS:
+            return "instructions";
+        case CACHE_MISSES:
+            return "cache_misses";
+        case L1D_READ_MISSES:
+            return "l1d_read_misses";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __PERF_COUNTERS_H_INCLUDED__
+#define __PERF_COUNTERS_H_INCLUDED__
+
+/* Hardware counters of the calling thread, read with perf_event_open (no
+   libpfm or perf tool needed). Only user space is counted, so that the
+   counters also work with kernel.perf_event_paranoid = 2. A counter the
+   machine or container does not provide is left out: its value is -1.*/
+class PerfCounters
+{
+    public:
+        enum Counter {
+            CYCLES = 0,
+            INSTRUCTIONS = 1,
+            // Last level cache misses.
+            CACHE_MISSES = 2,
+            L1D_READ_MISSES = 3,
+            NUM_COUNTERS = 4
+        };
+        PerfCounters() = default;
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+        ~PerfCounters();
+        // Opens the counters. Out: true if at least one could be opened.
+        bool Open();
+        // Zeroes and starts the counters.
+        void Start();
+        // Stops the counters and reads them.
+        void Stop();
+        /* Value of a counter between the last Start() and Stop(), scaled up
+           if the kernel multiplexed it; -1 if the counter is not available.*/
+        double GetValue(const Counter counter) const { return values_[counter]; }
+        static const char* GetName(const Counter counter);
+    private:
+        int fds_[NUM_COUNTERS] = {-1, -1, -1, -1};
+        double values_[NUM_COUNTERS] = {-1, -1, -1, -1};
+};
+#endif //__PERF_COUNTERS_H_INCLUDED__
@@ -1,18 +1,25 @@
 /* Author: Akshitha Sriraman
    Ph.D. Candidate at the University of Michigan - Ann Arbor*/
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <omp.h>
 #include <string>
 #include <sys/time.h>
 #include <thread>
+#include <vector>
 #include <grpc++/grpc++.h>
+#include <google/protobuf/arena.h>
 #include "bucket_service/service/helper_files/server_helper.h"
 #include "bucket_service/service/helper_files/timing.h"
 #include "bucket_service/src/utils.h"
 
 using grpc::Server;
+using grpc::ServerAsyncReaderWriter;
 using grpc::ServerAsyncResponseWriter;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
@@ -24,20 +31,134 @@ using bucket::PointIdList;
 using bucket::NearestNeighborRequest;
 using bucket::TimingDataInMicro;
 using bucket::NearestNeighborResponse;
+using bucket::NearestNeighborRequestBatch;
+using bucket::NearestNeighborResponseBatch;
 using bucket::DistanceService;
+using bucket::ShardMutationRequest;
+using bucket::ShardMutationResponse;
 
 /* Make dataset a global, so that the dataset can be loaded
-   even before the server starts running. */
+   even before the server starts running. Once loaded, it moves into the
+   first shard snapshot.*/
 MultiplePoints dataset;
+/* Most recent versions of the shard, the latest first. Requests pick one
+   with their index_view, so that a request that straddles a mutation can
+   still be answered from the version its other buckets used. The holder is
+   replaced (never modified) by MutateShard: requests load it atomically and
+   never wait for a writer.*/
+#define SHARD_SNAPSHOT_HISTORY 2
+struct ShardSnapshots {
+    std::shared_ptr<const ShardSnapshot> versions[SHARD_SNAPSHOT_HISTORY];
+};
+std::shared_ptr<const ShardSnapshots> shard_snapshots;
+// Serializes the writers (MutateShard calls).
+std::mutex shard_mutation_mutex;
+/* Binary dataset file, mapped so that queries that belong to other
+   shards can be read. Not open when the dataset comes from a text file.*/
+DatasetFile corpus;
+// Global point ID of dataset's first point.
+uint32_t shard_start = 0;
+/* Persistent workers that help with the candidate scan of large queries
+   when cores are idle.*/
+TaskPool task_pool;
+unsigned int intra_query_min_candidates = 0;
+/* int8/fp16 codes of the shard, when it is not kept as fp32 (dataset is
+   then empty, and exact distances read the corpus).*/
+QuantizedPoints quantized_dataset;
+// PQ codes of the shard, with PQ storage (dataset is then empty too).
+ProductQuantizer pq_dataset;
+PointStorage storage = FP32_STORAGE;
+/* With early abandon, the shard's dimensions are reordered by decreasing
+   variance: dimension_order[d] is the original dimension now at d.*/
+bool early_abandon = false;
+std::vector<unsigned> dimension_order;
+// Number of points in this server's shard, whatever its storage.
+uint32_t num_shard_points = 0;
+unsigned int rerank_factor = 0;
+unsigned int point_dimension = 0;
+/* Top-K answers of recent (query, candidates) pairs, shared by all request
+   handlers. Disabled unless --knn_cache_bytes is given.*/
+KnnCache knn_cache;
+
+/* Bytes of the arena block that every call starts with (a few thousand
+   point IDs); larger requests make the arena grow.*/
+#define CALL_ARENA_INITIAL_BLOCK_BYTES (32 * 1024)
 
 std::string ip_port = "";
 unsigned int bucket_parallelism = 0;
+/* Threading of the RPC layer: completion queues the bucket_parallelism
+   poller threads are spread over, whether pollers (and request workers)
+   are pinned to cores, how long pollers spin before blocking, and the number
+   of worker threads requests are handed off to (0: pollers process them).*/
+unsigned int completion_queues = 1;
+bool pin_pollers = false;
+unsigned int busy_poll_us = 0;
+unsigned int request_workers = 0;
+NumaMode numa_mode = NUMA_OFF;
 
 int num_cores = 0, bucket_server_num = 0, num_bucket_servers = 0;
 
-void ProcessRequest(NearestNeighborRequest &request,
+/* In: index view of a request (0: latest).
+   Out: the snapshot of that version (the latest one if it is no longer
+   kept), and whether it is the latest one.*/
+std::shared_ptr<const ShardSnapshot> GetShardSnapshot(const uint64_t index_view, bool* latest)
+{
+    std::shared_ptr<const ShardSnapshots> snapshots = std::atomic_load(&shard_snapshots);
+    *latest = true;
+    if (index_view == 0) {
+        return snapshots->versions[0];
+    }
+    for(unsigned i = 0; i < SHARD_SNAPSHOT_HISTORY; i++)
+    {
+        if (snapshots->versions[i] && (snapshots->versions[i]->index_view == index_view)) {
+            *latest = (i == 0);
+            return snapshots->versions[i];
+        }
+    }
+    return snapshots->versions[0];
+}
+
+Status MutateShard(const ShardMutationRequest &request,
+        ShardMutationResponse* reply)
+{
+    if (storage != FP32_STORAGE) {
+        return Status(grpc::StatusCode::FAILED_PRECONDITION, "Shard mutations need fp32 storage");
+    }
+    std::lock_guard<std::mutex> lock(shard_mutation_mutex);
+    std::shared_ptr<const ShardSnapshots> snapshots = std::atomic_load(&shard_snapshots);
+    std::shared_ptr<ShardSnapshot> next(new ShardSnapshot());
+    std::string error;
+    if (!ApplyShardMutations(request,
+                *snapshots->versions[0],
+                shard_start,
+                dimension_order,
+                next.get(),
+                &error)) {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, error);
+    }
+    PlaceShardSnapshot(numa_mode, next.get());
+    std::shared_ptr<ShardSnapshots> next_snapshots(new ShardSnapshots());
+    next_snapshots->versions[0] = next;
+    for(unsigned i = 1; i < SHARD_SNAPSHOT_HISTORY; i++)
+    {
+        next_snapshots->versions[i] = snapshots->versions[i - 1];
+    }
+    std::atomic_store(&shard_snapshots, std::shared_ptr<const ShardSnapshots>(next_snapshots));
+    // After the new snapshot is visible: see ProcessRequest.
+    knn_cache.Invalidate();
+    reply->set_index_view(next->index_view);
+    reply->set_num_points(next->dataset.GetSize());
+    reply->set_num_deleted(next->num_deleted);
+    return Status::OK;
+}
+
+/* A rejected request gets a reply that only carries its request id: on a
+   stream, which has no per-request status, it is answered without neighbors.*/
+Status ProcessRequest(NearestNeighborRequest &request,
         NearestNeighborResponse* reply)
 {
+    // This core is taken: the task pool only lends out idle cores.
+    TaskPool::BusyScope busy(&task_pool);
     /* If the index server is asking for util info,
        it means the time period has expired, so 
        the bucket must read /proc/stat to provide user, system, io, and idle times.*/
@@ -59,31 +180,59 @@ void ProcessRequest(NearestNeighborRequest &request,
        piggyback message.*/
     reply->set_request_id(request.request_id());
 
+    // Every query comes with its own list of candidate points.
+    if (request.maybe_neighbor_list_size() != request.queries_size()) {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, "Expected one candidate list per query");
+    }
+
     /* Get the current idle time and total time
        so as to calculate the CPU util when the bucket is done.*/
     size_t idle_time_initial = 0, total_time_initial = 0, idle_time_final = 0, total_time_final = 0;
     //GetCpuTimes(&idle_time_initial, &total_time_initial);
 
-    // Unpack received queries and point IDs
-    Point p(dataset.GetPointAtIndex(0).GetSize(), 0.0);
-    MultiplePoints queries(request.queries_size(), p);
-    std::vector<std::vector<uint32_t>> point_ids_vec;
+    /* Unpack received queries and point IDs. The containers belong to this
+       thread and keep their capacity from one request to the next, so the
+       unpack stage does not allocate once they have grown.*/
+    /* The generation is read before the snapshot: answers computed on a
+       snapshot that a mutation replaces are then never cached.*/
+    uint64_t cache_generation = knn_cache.GetGeneration();
+    bool latest_snapshot;
+    std::shared_ptr<const ShardSnapshot> snapshot = GetShardSnapshot(request.index_view(), &latest_snapshot);
+    // With a replicated shard, the copy on this thread's node.
+    const MultiplePoints &shard = GetLocalShard(*snapshot);
+    uint32_t num_points = (storage == FP32_STORAGE) ? shard.GetSize() : num_shard_points;
+    static thread_local MultiplePoints queries;
+    queries.Resize(request.queries_size(), point_dimension);
+    static thread_local std::vector<std::vector<uint32_t>> point_ids_vec;
     uint32_t bucket_server_id, shard_size;
     uint64_t start_time, end_time;
     start_time = GetTimeInMicro();
     UnpackBucketServiceRequestAsync(request,
-            dataset,
+            shard,
+            corpus,
+            shard_start,
             &queries,
             &point_ids_vec,
             &bucket_server_id,
             &shard_size,
             reply);
+    uint32_t number_of_nearest_neighbors = (uint32_t)request.requested_neighbor_count();
+    /* Queries read from the mapped corpus still have their dimensions in
+       the original order (with a text dataset they come from the
+       reordered shard).*/
+    if (early_abandon && corpus.IsOpen()) {
+        queries.PermuteDimensions(dimension_order);
+    }
+    /* Remove duplicate point IDs and sort them, so that every row is read
+       once and in address order.*/
+    PreprocessPointIDs(num_points, point_ids_vec);
+    if (snapshot->num_deleted != 0) {
+        RemoveDeletedPointIDs(snapshot->deleted, point_ids_vec);
+    }
     end_time = GetTimeInMicro();
     reply->mutable_timing_data_in_micro()->set_unpack_bucket_req_time_in_micro((end_time - start_time));
     /* Next piggy back message - sent the received query back to the 
        index server. Helps to merge async responses.*/
-    // Remove duplicate point IDs.
-    //RemoveDuplicatePointIDs(point_ids_vec);
 
     // Dataset dimension must be equal to queries dimension.
 #if 0
@@ -91,24 +240,78 @@ void ProcessRequest(NearestNeighborRequest &request,
             queries.GetPointDimension());
 #endif
 
-    // Calculate the top K distances for all queries.
-    DistCalc knn_answer;
-    uint32_t number_of_nearest_neighbors = (uint32_t)request.requested_neighbor_count();
+    /* Queries answered by the cache keep an empty candidate list, so only
+       the misses are scanned.*/
+    static thread_local std::vector<KnnCacheKey> cache_keys;
+    static thread_local std::vector<char> cache_hits;
+    static thread_local DistCalc cached_answers;
+    unsigned num_cache_hits = 0;
+    // Only answers from the latest snapshot are cached.
+    bool use_cache = knn_cache.IsEnabled() && latest_snapshot;
+    if (use_cache) {
+        // The search mode only changes the answers of a PQ shard.
+        uint32_t search_mode = (storage == PQ_STORAGE) ? (uint32_t)request.search_mode() : (uint32_t)bucket::EXACT;
+        num_cache_hits = LookupKnnCache(&knn_cache,
+                request,
+                search_mode,
+                &point_ids_vec,
+                &cache_keys,
+                &cache_hits,
+                &cached_answers);
+        reply->mutable_timing_data_in_micro()->set_cache_hits(num_cache_hits);
+        reply->mutable_timing_data_in_micro()->set_cache_misses(point_ids_vec.size() - num_cache_hits);
+    }
+
+    // Calculate the top K distances for all queries (answers reuse their capacity too).
+    static thread_local DistCalc knn_answer;
+    knn_answer.UseTaskPool(&task_pool, intra_query_min_candidates);
+    knn_answer.UseEarlyAbandon(early_abandon);
+    if (storage == PQ_STORAGE) {
+        /* Requests pick how the PQ shard is searched: exact requests read
+           the fp32 rows from the corpus.*/
+        switch (request.search_mode())
+        {
+            case bucket::PQ:
+                knn_answer.UsePqDataset(&pq_dataset, PQ_APPROXIMATE, 0);
+                break;
+            case bucket::PQ_RERANK:
+                knn_answer.UsePqDataset(&pq_dataset, PQ_RERANK, std::max(rerank_factor, 1u));
+                break;
+            default:
+                knn_answer.UsePqDataset(&pq_dataset, PQ_EXACT, 0);
+                break;
+        }
+    } else if (storage != FP32_STORAGE) {
+        knn_answer.UseQuantizedDataset(&quantized_dataset, rerank_factor);
+    }
     start_time = GetTimeInMicro();
     CalculateKNN(queries,
-            dataset,
+            shard,
             point_ids_vec,
             number_of_nearest_neighbors,
-            num_cores,
             &knn_answer);
+    if (use_cache) {
+        UpdateKnnCache(&knn_cache,
+                cache_generation,
+                cache_keys,
+                cache_hits,
+                cached_answers,
+                &knn_answer);
+    }
     end_time = GetTimeInMicro();
     reply->mutable_timing_data_in_micro()->set_calculate_knn_time_in_micro((end_time - start_time));
+    uint64_t candidates_evaluated = 0;
+    for(size_t q = 0; q < point_ids_vec.size(); q++)
+    {
+        candidates_evaluated += point_ids_vec[q].size();
+    }
+    reply->mutable_timing_data_in_micro()->set_candidates_evaluated(candidates_evaluated);
+    reply->mutable_timing_data_in_micro()->set_dimensions_evaluated(knn_answer.GetDimensionsEvaluated());
 
     // Convert K-NN into form suitable for GRPC.
     start_time = GetTimeInMicro();
     PackBucketServiceResponse(knn_answer,
-            bucket_server_id,
-            shard_size,
+            shard_start,
             reply);
     end_time = GetTimeInMicro();
     reply->mutable_timing_data_in_micro()->set_pack_bucket_resp_time_in_micro((end_time - start_time));
@@ -117,7 +320,8 @@ void ProcessRequest(NearestNeighborRequest &request,
     const float total_time_delta = total_time_final - total_time_initial;
     const float cpu_util = (100.0 * (1.0 - (idle_time_delta/total_time_delta)));
     reply->mutable_timing_data_in_micro()->set_cpu_util(cpu_util);
-    reply->set_index_view(request.index_view());
+    reply->set_index_view(snapshot->index_view);
+    return Status::OK;
 }
 
 // Logic and data behind the server's behavior.
@@ -125,8 +329,23 @@ class ServiceImpl final {
     public:
         ~ServiceImpl() {
             server_->Shutdown();
-            // Always shutdown the completion queue after the server.
-            cq_->Shutdown();
+            // Always shutdown the completion queues after the server.
+            for(auto& cq : cqs_)
+            {
+                cq->Shutdown();
+            }
+            for(auto& handoff_queue : handoff_queues_)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(handoff_queue->mutex);
+                    handoff_queue->stop = true;
+                }
+                handoff_queue->cv.notify_all();
+            }
+            for(auto& worker : workers_)
+            {
+                worker.join();
+            }
         }
         // There is no shutdown handling in this code.
         void Run() {
@@ -143,38 +362,78 @@ class ServiceImpl final {
             // Register "service_" as the instance through which we'll communicate with
             // clients. In this case it corresponds to an *asynchronous* service.
             builder.RegisterService(&service_);
-            // Get hold of the completion queue used for the asynchronous communication
-            // with the gRPC runtime.
-            cq_ = builder.AddCompletionQueue();
+            /* Get hold of the completion queues used for the asynchronous communication
+               with the gRPC runtime. Poller thread i serves queue i % number of
+               queues, so with one queue per poller no two threads contend on
+               (or are woken up by) the same queue.*/
+            unsigned int num_cqs = completion_queues;
+            if ((num_cqs == 0) || (num_cqs > bucket_parallelism)) {
+                num_cqs = bucket_parallelism;
+            }
+            for(unsigned int i = 0; i < num_cqs; i++)
+            {
+                cqs_.emplace_back(builder.AddCompletionQueue());
+            }
             // Finally assemble the server.
             server_ = builder.BuildAndStart();
             std::cout << "Server listening on " << server_address << std::endl;
+            /* Workers take the cores after the pollers'. In a NUMA mode, every
+               node has its own handoff queue and workers, and the pollers
+               and workers are spread over the nodes.*/
+            unsigned int num_handoff_queues = (numa_mode != NUMA_OFF) ? GetNumNumaNodes() : 1;
+            for(unsigned int i = 0; i < num_handoff_queues; i++)
+            {
+                handoff_queues_.emplace_back(new HandoffQueue());
+            }
+            for(unsigned int i = 0; i < request_workers; i++)
+            {
+                workers_.emplace_back(&ServiceImpl::WorkerLoop, this, i);
+            }
             // Proceed to the server's main loop.
             if (bucket_parallelism == 1) {
-                HandleRpcs();
+                HandleRpcs(0);
             }
             omp_set_dynamic(0);
             omp_set_num_threads(bucket_parallelism);
             omp_set_nested(2);
 #pragma omp parallel
             {
-                HandleRpcs();
+                HandleRpcs(omp_get_thread_num());
             }
         }    
     private:
+        // Completion queue tags: the state machine of one call, whatever its RPC.
+        class RpcCallData {
+            public:
+                virtual ~RpcCallData() {}
+                // ok: whether the operation the tag stands for succeeded.
+                virtual void Proceed(bool ok) = 0;
+        };
+
+        // A request handed off to the request workers.
+        class HandoffTask {
+            public:
+                virtual ~HandoffTask() {}
+                virtual void Process() = 0;
+        };
+
         // Class encompasing the state and logic needed to serve a request.
-        class CallData {
+        class CallData final : public RpcCallData, public HandoffTask {
             public:
                 // Take in the "service" instance (in this case representing an asynchronous
                 // server) and the completion queue "cq" used for asynchronous communication
                 // with the gRPC runtime.
-                CallData(DistanceService::AsyncService* service, ServerCompletionQueue* cq)
-                    : service_(service), cq_(cq), responder_(&ctx_), status_(CREATE) {
+                CallData(ServiceImpl* server, ServerCompletionQueue* cq)
+                    : server_(server), service_(&server->service_), cq_(cq),
+                    arena_(GetArenaOptions(arena_block_)),
+                    request_(google::protobuf::Arena::CreateMessage<NearestNeighborRequest>(&arena_)),
+                    reply_(google::protobuf::Arena::CreateMessage<NearestNeighborResponse>(&arena_)),
+                    responder_(&ctx_), status_(CREATE) {
                         // Invoke the serving logic right away.
-                        Proceed();
+                        Proceed(true);
                     }
 
-                void Proceed() {
+                void Proceed(bool ok) override {
                     if (status_ == CREATE) {
                         // Make this instance progress to the PROCESS state.
                         status_ = PROCESS;
@@ -184,27 +443,44 @@ class ServiceImpl final {
                         // the tag uniquely identifying the request (so that different CallData
                         // instances can serve different requests concurrently), in this case
                         // the memory address of this CallData instance.
-                        service_->RequestGetNearestNeighbors(&ctx_, &request_, &responder_, cq_, cq_,
+                        service_->RequestGetNearestNeighbors(&ctx_, request_, &responder_, cq_, cq_,
                                 this);
                     } else if (status_ == PROCESS) {
                         // Spawn a new CallData instance to serve new clients while we process
                         // the one for this CallData. The instance will deallocate itself as
                         // part of its FINISH state.
-                        new CallData(service_, cq_);
-                        // The actual processing.
-                        ProcessRequest(request_, &reply_);
-                        // And we are done! Let the gRPC runtime know we've finished, using the
-                        // memory address of this instance as the uniquely identifying tag for
-                        // the event.
-                        status_ = FINISH;
-                        responder_.Finish(reply_, Status::OK, this);
+                        new CallData(server_, cq_);
+                        // The actual processing, here or on a request worker.
+                        if (server_->workers_.empty()) {
+                            Process();
+                        } else {
+                            server_->HandOff(this, server_->GetHandoffQueue(*request_));
+                        }
                     } else {
                         //GPR_ASSERT(status_ == FINISH);
                         // Once in the FINISH state, deallocate ourselves (CallData).
                         delete this;
                     }
                 }
+                void Process() override {
+                    Status status = ProcessRequest(*request_, reply_);
+                    // And we are done! Let the gRPC runtime know we've finished, using the
+                    // memory address of this instance as the uniquely identifying tag for
+                    // the event.
+                    status_ = FINISH;
+                    responder_.Finish(*reply_, status, this);
+                }
             private:
+                // The arena starts in a block that is part of this CallData.
+                static google::protobuf::ArenaOptions GetArenaOptions(char* initial_block)
+                {
+                    google::protobuf::ArenaOptions options;
+                    options.initial_block = initial_block;
+                    options.initial_block_size = CALL_ARENA_INITIAL_BLOCK_BYTES;
+                    return options;
+                }
+                // Server that owns the completion queue (and the request workers).
+                ServiceImpl* server_;
                 // The means of communication with the gRPC runtime for an asynchronous
                 // server.
                 DistanceService::AsyncService* service_;
@@ -215,10 +491,15 @@ class ServiceImpl final {
                 // client.
                 ServerContext ctx_;
 
+                /* The request and reply (and all their sub-messages and repeated
+                   fields) live in this arena: they are freed at once with the
+                   CallData, instead of one heap allocation/free each.*/
+                char arena_block_[CALL_ARENA_INITIAL_BLOCK_BYTES];
+                google::protobuf::Arena arena_;
                 // What we get from the client.
-                NearestNeighborRequest request_;
+                NearestNeighborRequest* request_;
                 // What we send back to the client.
-                NearestNeighborResponse reply_;
+                NearestNeighborResponse* reply_;
 
                 // The means to get back to the client.
                 ServerAsyncResponseWriter<NearestNeighborResponse> responder_;
@@ -228,10 +509,241 @@ class ServiceImpl final {
                 CallStatus status_;  // The current serving state.
         };
 
+        /* State of a MutateShard call. Mutations are rare and run inline
+           (only this poller waits for the copy of the shard).*/
+        class MutateCallData final : public RpcCallData {
+            public:
+                MutateCallData(ServiceImpl* server, ServerCompletionQueue* cq)
+                    : server_(server), cq_(cq), responder_(&ctx_), status_(CREATE) {
+                        Proceed(true);
+                    }
+
+                void Proceed(bool ok) override {
+                    if (status_ == CREATE) {
+                        status_ = PROCESS;
+                        server_->service_.RequestMutateShard(&ctx_, &request_, &responder_, cq_, cq_,
+                                this);
+                    } else if (status_ == PROCESS) {
+                        // Keep accepting mutations while this one is applied.
+                        new MutateCallData(server_, cq_);
+                        Status status = MutateShard(request_, &reply_);
+                        status_ = FINISH;
+                        responder_.Finish(reply_, status, this);
+                    } else {
+                        delete this;
+                    }
+                }
+            private:
+                ServiceImpl* server_;
+                ServerCompletionQueue* cq_;
+                ServerContext ctx_;
+                ShardMutationRequest request_;
+                ShardMutationResponse reply_;
+                ServerAsyncResponseWriter<ShardMutationResponse> responder_;
+                enum CallStatus { CREATE, PROCESS, FINISH };
+                CallStatus status_;
+        };
+
+        /* State of a StreamNearestNeighbors call: a long-lived stream on
+           which a mid tier thread sends batches of requests. A read and a
+           write are in flight at once: the next batch is read while one is
+           processed (so other pollers can process it meanwhile), and the
+           replies computed while a frame is being sent go out together in the
+           next frame. With request workers, each request of a batch is handed
+           off like a unary call.*/
+        class StreamCallData final {
+            public:
+                StreamCallData(ServiceImpl* server, ServerCompletionQueue* cq)
+                    : server_(server), cq_(cq), stream_(&ctx_),
+                    connect_tag_(this, &StreamCallData::OnConnect),
+                    read_tag_(this, &StreamCallData::OnRead),
+                    write_tag_(this, &StreamCallData::OnWrite),
+                    finish_tag_(this, &StreamCallData::OnFinish) {
+                        server_->service_.RequestStreamNearestNeighbors(&ctx_, &stream_, cq_, cq_,
+                                &connect_tag_);
+                    }
+            private:
+                // Completion queue tag of one of the stream's operations.
+                class Tag final : public RpcCallData {
+                    public:
+                        Tag(StreamCallData* call, void (StreamCallData::*handler)(bool))
+                            : call_(call), handler_(handler) {}
+                        void Proceed(bool ok) override {
+                            (call_->*handler_)(ok);
+                        }
+                    private:
+                        StreamCallData* call_;
+                        void (StreamCallData::*handler_)(bool);
+                };
+
+                void OnConnect(bool ok) {
+                    if (!ok) {
+                        // The server is shutting down.
+                        delete this;
+                        return;
+                    }
+                    // Keep accepting streams.
+                    new StreamCallData(server_, cq_);
+                    stream_.Read(&read_batch_, &read_tag_);
+                }
+
+                void OnRead(bool ok) {
+                    NearestNeighborRequestBatch batch;
+                    if (!ok) {
+                        // The mid tier closed its side: finish once every reply is sent.
+                        bool finish = false;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex_);
+                            reads_done_ = true;
+                            finish = ShouldFinish();
+                        }
+                        MaybeFinish(finish);
+                        return;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        requests_in_process_ += read_batch_.requests_size();
+                        batch.Swap(&read_batch_);
+                    }
+                    stream_.Read(&read_batch_, &read_tag_);
+                    if (!server_->workers_.empty()) {
+                        /* Each request goes through the same handoff (and NUMA
+                           steering) as a unary call.*/
+                        for(int i = 0; i < batch.requests_size(); i++)
+                        {
+                            StreamRequest* stream_request = new StreamRequest(this);
+                            stream_request->request.Swap(batch.mutable_requests(i));
+                            server_->HandOff(stream_request, server_->GetHandoffQueue(stream_request->request));
+                        }
+                        return;
+                    }
+                    NearestNeighborResponseBatch replies;
+                    for(int i = 0; i < batch.requests_size(); i++)
+                    {
+                        ProcessRequest(*batch.mutable_requests(i), replies.add_responses());
+                    }
+                    AddReplies(&replies);
+                }
+
+                /* A request of the stream, processed on a request worker. Its
+                   reply joins the stream's next frame.*/
+                class StreamRequest final : public HandoffTask {
+                    public:
+                        explicit StreamRequest(StreamCallData* call) : call_(call) {}
+                        void Process() override {
+                            NearestNeighborResponseBatch replies;
+                            ProcessRequest(request, replies.add_responses());
+                            call_->AddReplies(&replies);
+                            delete this;
+                        }
+                        NearestNeighborRequest request;
+                    private:
+                        StreamCallData* call_;
+                };
+
+                // Queues the replies of processed requests for the next frame.
+                void AddReplies(NearestNeighborResponseBatch* replies) {
+                    bool finish = false;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        requests_in_process_ -= replies->responses_size();
+                        if (!broken_) {
+                            for(int i = 0; i < replies->responses_size(); i++)
+                            {
+                                pending_.add_responses()->Swap(replies->mutable_responses(i));
+                            }
+                            if (!write_in_flight_) {
+                                StartWrite();
+                            }
+                        }
+                        finish = ShouldFinish();
+                    }
+                    MaybeFinish(finish);
+                }
+
+                void OnWrite(bool ok) {
+                    bool finish = false;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        write_in_flight_ = false;
+                        in_flight_.Clear();
+                        if (!ok) {
+                            // The stream is broken: the pending reply will never get through.
+                            broken_ = true;
+                            pending_.Clear();
+                        } else if (pending_.responses_size() != 0) {
+                            StartWrite();
+                        }
+                        finish = ShouldFinish();
+                    }
+                    MaybeFinish(finish);
+                }
+
+                void OnFinish(bool ok) {
+                    delete this;
+                }
+
+                // Sends the pending replies as one frame (mutex_ is held).
+                void StartWrite() {
+                    in_flight_.Swap(&pending_);
+                    write_in_flight_ = true;
+                    stream_.Write(in_flight_, &write_tag_);
+                }
+
+                /* Whether the call can end: nothing is left to read, process or
+                   send (mutex_ is held). Returns true only once.*/
+                bool ShouldFinish() {
+                    if (reads_done_ && !finishing_ && (requests_in_process_ == 0)
+                            && !write_in_flight_ && (pending_.responses_size() == 0)) {
+                        finishing_ = true;
+                        return true;
+                    }
+                    return false;
+                }
+
+                /* Ends the call if ShouldFinish() said so. mutex_ must not be
+                   held: OnFinish deletes this call (and its mutex_), possibly
+                   on another poller, as soon as Finish() is issued.*/
+                void MaybeFinish(const bool finish) {
+                    if (finish) {
+                        stream_.Finish(Status::OK, &finish_tag_);
+                    }
+                }
+
+                ServiceImpl* server_;
+                ServerCompletionQueue* cq_;
+                ServerContext ctx_;
+                ServerAsyncReaderWriter<NearestNeighborResponseBatch, NearestNeighborRequestBatch> stream_;
+                Tag connect_tag_;
+                Tag read_tag_;
+                Tag write_tag_;
+                Tag finish_tag_;
+                std::mutex mutex_;
+                // Batch the next read lands in.
+                NearestNeighborRequestBatch read_batch_;
+                // Frame being written, and replies waiting for the next frame.
+                NearestNeighborResponseBatch in_flight_;
+                NearestNeighborResponseBatch pending_;
+                // Requests read but not answered yet.
+                unsigned int requests_in_process_ = 0;
+                bool write_in_flight_ = false;
+                bool reads_done_ = false;
+                bool broken_ = false;
+                bool finishing_ = false;
+        };
+
         // This can be run in multiple threads if needed.
-        void HandleRpcs() {
+        void HandleRpcs(const unsigned int poller) {
+            if (numa_mode != NUMA_OFF) {
+                PinThreadToNumaNode(poller % GetNumNumaNodes());
+            } else if (pin_pollers) {
+                PinThreadToCore(poller);
+            }
+            ServerCompletionQueue* cq = cqs_[poller % cqs_.size()].get();
             // Spawn a new CallData instance to serve new clients.
-            new CallData(&service_, cq_.get());
+            new CallData(this, cq);
+            new MutateCallData(this, cq);
+            new StreamCallData(this, cq);
             void* tag;  // uniquely identifies a request.
             bool ok;
             while (true) {
@@ -239,65 +751,191 @@ class ServiceImpl final {
                 // event is uniquely identified by its tag, which in this case is the
                 // memory address of a CallData instance.
                 // The return value of Next should always be checked. This return value
-                // tells us whether there is any kind of event or cq_ is shutting down.
-                //GPR_ASSERT(cq_->Next(&tag, &ok));
-                cq_->Next(&tag, &ok);
-                /*auto r = cq_->AsyncNext(&tag, &ok, gpr_time_0(GPR_CLOCK_REALTIME));
-                  if (r == ServerCompletionQueue::GOT_EVENT) {
-                //GPR_ASSERT(ok);
-                static_cast<CallData*>(tag)->Proceed();
+                // tells us whether there is any kind of event or cq is shutting down.
+                if (!NextEvent(cq, &tag, &ok)) {
+                    break;
                 }
-                if (r == ServerCompletionQueue::TIMEOUT) continue;*/
                 //GPR_ASSERT(ok);
-                static_cast<CallData*>(tag)->Proceed();
+                static_cast<RpcCallData*>(tag)->Proceed(ok);
+            }
+        }
+
+        /* Waits for the next event of a completion queue. With busy polling,
+           the queue is first polled without blocking for busy_poll_us, so that
+           a request that arrives in the meantime does not pay for the thread's
+           wakeup. Returns false once the queue is shut down.*/
+        bool NextEvent(ServerCompletionQueue* cq, void** tag, bool* ok) {
+            if (busy_poll_us != 0) {
+                uint64_t deadline = GetTimeInMicro() + busy_poll_us;
+                do {
+                    ServerCompletionQueue::NextStatus status = cq->AsyncNext(tag, ok, gpr_time_0(GPR_CLOCK_REALTIME));
+                    if (status == ServerCompletionQueue::GOT_EVENT) {
+                        return true;
+                    }
+                    if (status == ServerCompletionQueue::SHUTDOWN) {
+                        return false;
+                    }
+                } while (GetTimeInMicro() < deadline);
+            }
+            return cq->Next(tag, ok);
+        }
+
+        /* Handoff queue (i.e node) a request goes to: with a split shard, the
+           node that holds most of its candidates, otherwise the poller's own.*/
+        unsigned int GetHandoffQueue(const NearestNeighborRequest &request) {
+            if (numa_mode == NUMA_SPLIT) {
+                std::shared_ptr<const ShardSnapshots> snapshots = std::atomic_load(&shard_snapshots);
+                return GetRequestNumaNode(request, shard_start, snapshots->versions[0]->dataset.GetSize());
             }
+            return (numa_mode == NUMA_REPLICATE) ? GetCurrentNumaNode() : 0;
         }
 
-        std::unique_ptr<ServerCompletionQueue> cq_;
+        // Queues a request for the request workers (the poller goes back to polling).
+        void HandOff(HandoffTask* task, const unsigned int queue) {
+            HandoffQueue* handoff_queue = handoff_queues_[queue].get();
+            {
+                std::lock_guard<std::mutex> lock(handoff_queue->mutex);
+                handoff_queue->calls.push_back(task);
+            }
+            handoff_queue->cv.notify_one();
+        }
+
+        void WorkerLoop(const unsigned int worker) {
+            unsigned int queue = 0;
+            if (numa_mode != NUMA_OFF) {
+                // Round-robin over the nodes, so that every queue has a worker.
+                queue = worker % GetNumNumaNodes();
+                PinThreadToNumaNode(queue);
+            } else if (pin_pollers && ((bucket_parallelism + request_workers) <= GetNumProcs())) {
+                // Without a core of its own, a worker is left to the scheduler.
+                PinThreadToCore(bucket_parallelism + worker);
+            }
+            HandoffQueue* handoff_queue = handoff_queues_[queue].get();
+            while (true) {
+                HandoffTask* task;
+                {
+                    std::unique_lock<std::mutex> lock(handoff_queue->mutex);
+                    handoff_queue->cv.wait(lock, [handoff_queue] { return handoff_queue->stop || !handoff_queue->calls.empty(); });
+                    if (handoff_queue->calls.empty()) {
+                        return;
+                    }
+                    task = handoff_queue->calls.front();
+                    handoff_queue->calls.pop_front();
+                }
+                task->Process();
+            }
+        }
+
+        std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
         DistanceService::AsyncService service_;
         std::unique_ptr<Server> server_;
+        // Requests handed off by the pollers, when there are request workers.
+        struct HandoffQueue {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<HandoffTask*> calls;
+            bool stop = false;
+        };
+        std::vector<std::thread> workers_;
+        std::vector<std::unique_ptr<HandoffQueue>> handoff_queues_;
 };
 
 int main(int argc, char** argv) {
-    std::string dataset_file_name;
-    if (argc == 7) {
-        try
-        {
-            dataset_file_name = argv[1];
-        }
-        catch(...)
-        {
-            CHECK(false, "Enter a valid string for dataset file path\n");
-        }
-    } else {
-        CHECK(false, "Format: ./<bucket_server> <dataset file path> <IP address:Port Number> <Mode 1 - read dataset from text file OR Mode 2 - read dataset from binary file <number of bucket server threads> <num of cores: -1 if you want all cores on the machine> <bucket server number> <number of bucket servers in the system>\n");
-    }
+    struct BucketServerCommandLineArgs* bucket_server_command_line_args = ParseBucketServerCommandLine(argc, argv);
+    std::string dataset_file_name = bucket_server_command_line_args->dataset_file_name;
     // Load the bucket server IP
-    ip_port = argv[2];
+    ip_port = bucket_server_command_line_args->ip_port;
     // Create dataset.
-    int mode = atoi(argv[3]);
+    int mode = bucket_server_command_line_args->mode;
 
-    num_cores = atoi(argv[4]);
+    num_cores = bucket_server_command_line_args->num_cores;
 
     if ( (num_cores == -1) || (num_cores > GetNumProcs()) ) {
         num_cores = GetNumProcs();
     }
 
     bucket_parallelism = num_cores;
-    bucket_server_num = atoi(argv[5]);
-    num_bucket_servers = atoi(argv[6]);
+    bucket_server_num = bucket_server_command_line_args->bucket_server_num;
+    num_bucket_servers = bucket_server_command_line_args->num_bucket_servers;
+    intra_query_min_candidates = bucket_server_command_line_args->intra_query_min_candidates;
+    completion_queues = bucket_server_command_line_args->completion_queues;
+    pin_pollers = bucket_server_command_line_args->pin_pollers;
+    busy_poll_us = bucket_server_command_line_args->busy_poll_us;
+    request_workers = bucket_server_command_line_args->request_workers;
+    numa_mode = bucket_server_command_line_args->numa_mode;
 
-    if (mode == 1)
+    storage = bucket_server_command_line_args->storage;
+    rerank_factor = bucket_server_command_line_args->rerank_factor;
+    if (storage == PQ_STORAGE) {
+        CHECK((mode == 2), "ERROR: PQ storage needs a binary dataset file (mode 2)\n");
+        CreatePqDatasetFromBinaryFile(dataset_file_name,
+                bucket_server_num,
+                num_bucket_servers,
+                bucket_server_command_line_args->dimensions,
+                bucket_server_command_line_args->pq_codebook_file_name,
+                bucket_server_command_line_args->huge_pages,
+                &corpus,
+                &pq_dataset,
+                &shard_start);
+        point_dimension = pq_dataset.GetPointDimension();
+        num_shard_points = pq_dataset.GetSize();
+    } else if (storage != FP32_STORAGE) {
+        CHECK((mode == 2), "ERROR: int8/fp16 storage needs a binary dataset file (mode 2)\n");
+        CreateQuantizedDatasetFromBinaryFile(dataset_file_name,
+                bucket_server_num,
+                num_bucket_servers,
+                bucket_server_command_line_args->dimensions,
+                storage,
+                bucket_server_command_line_args->huge_pages,
+                &corpus,
+                &quantized_dataset,
+                &shard_start);
+        point_dimension = quantized_dataset.GetPointDimension();
+        num_shard_points = quantized_dataset.GetSize();
+    } else if (mode == 1)
     {
         CreatePointsFromFile(dataset_file_name, &dataset);
+        point_dimension = dataset.GetPointDimension();
+        num_shard_points = dataset.GetSize();
     } else if (mode == 2) {
         CreateDatasetFromBinaryFile(dataset_file_name, 
                 bucket_server_num,
                 num_bucket_servers,
-                &dataset);
+                bucket_server_command_line_args->dimensions,
+                bucket_server_command_line_args->populate,
+                bucket_server_command_line_args->huge_pages,
+                &corpus,
+                &dataset,
+                &shard_start);
+        point_dimension = corpus.GetPointDimension();
+        num_shard_points = dataset.GetSize();
     } else {
         CHECK(false, "ERROR: Argument 3 - Mode can either be 1 (text file) or 2 (binary file\n");
     }
+    early_abandon = bucket_server_command_line_args->early_abandon;
+    if (early_abandon) {
+        /* High variance dimensions first: they hold most of a distance, so
+           partial sums pass the K-th best distance early.*/
+        dataset.GetDimensionsByDecreasingVariance(&dimension_order);
+        dataset.PermuteDimensions(dimension_order);
+    }
+    /* Squared norms of the dataset rows, used when a request with several
+       queries computes its distances as one tile (see DistCalc).*/
+    dataset.ComputeSquaredNorms();
+    // Version 0 of the shard; MutateShard publishes the next ones.
+    std::shared_ptr<ShardSnapshot> snapshot(new ShardSnapshot());
+    snapshot->dataset = std::move(dataset);
+    snapshot->deleted.assign(snapshot->dataset.GetSize(), false);
+    PlaceShardSnapshot(numa_mode, snapshot.get());
+    std::shared_ptr<ShardSnapshots> snapshots(new ShardSnapshots());
+    snapshots->versions[0] = snapshot;
+    shard_snapshots = snapshots;
+    /* One worker per core besides the request's own thread. Workers only
+       pick up work when a request lends them idle cores.*/
+    if ((intra_query_min_candidates != 0) && (num_cores > 1)) {
+        task_pool.Start(num_cores - 1, num_cores);
+    }
+    knn_cache.Initialize(bucket_server_command_line_args->knn_cache_bytes);
     ServiceImpl server;
     server.Run();
     return 0;
@@ -65,43 +65,17 @@ void ReadPointIDsFromFile(const std::string &point_ids_file_name,
 
 }
 
-void CreateBucketServiceRequest(const MultiplePoints &queries,
-        const std::vector<std::vector<uint32_t>> &point_ids,
+void CreateBucketServiceRequest(const std::vector<std::vector<uint32_t>> &point_ids,
         const unsigned queries_size,
         const unsigned number_of_nearest_neighbors,
-        const int dimension,
         const uint32_t bucket_server_id,
         const int shard_size,
         const bool util_present,
         NearestNeighborRequest* request)
 {
-#if 0
-    // Add each query to the query list.
-    for(int i = 0; i < queries_size; i++)
-    {
-        DataPoint* single_query_point = request->add_queries();
-        PointIdList* point_id_single_query = request->add_maybe_neighbor_list();
-        // Add individual dimensions of a query.
-        int num_point_ids = point_ids[i].size();
-        if (dimension > num_point_ids) {
-            for(int j = 0; j < dimension; j++)
-            {
-                single_query_point->add_data_point(queries.GetPointAtIndex(i).GetValueAtIndex(j));
-                if (j < num_point_ids) {
-                    point_id_single_query->add_point_id(point_ids[i][j]);
-                }
-            }
-        } else {
-            for(int j = 0; j < num_point_ids; j++)
-            {               
-                point_id_single_query->add_point_id(point_ids[i][j]);
-                if (j < dimension) {
-                    single_query_point->add_data_point(queries.GetPointAtIndex(i).GetValueAtIndex(j));
-                }
-            }                                               
-        }
-    }
-#endif
+    /* The same request goes to every bucket server, only its candidate
+       lists differ: drop the previous bucket's lists first.*/
+    request->clear_maybe_neighbor_list();
     for(int i = 0; i < queries_size; i++)
     {
         PointIdList* point_id_single_query = request->add_maybe_neighbor_list();
@@ -127,23 +101,18 @@ void CreateBucketServiceRequest(const MultiplePoints &queries,
 
 
 void UnpackBucketServiceResponse(const NearestNeighborResponse &reply, 
-        const unsigned number_of_nearest_neighbors,
         DistCalc* knn_answer, 
         BucketTimingInfo* bucket_timing_info,
         BucketUtil* bucket_util)
 {
-    uint32_t id_value = 0;
     PointIDs point_ids_per_query;
+    std::vector<float> distances_per_query;
     for(int i = 0; i < reply.neighbor_ids_size(); i++)
     {
-        point_ids_per_query.assign(reply.neighbor_ids(i).point_id_size(), 0);
-        for(int j = 0; j < reply.neighbor_ids(i).point_id_size(); j++)
-        {
-            id_value = reply.neighbor_ids(i).point_id(j);
-            point_ids_per_query[j] = id_value;
-        }
-        knn_answer->AddValueToBack(point_ids_per_query);
-        point_ids_per_query.clear();
+        const PointIdList &neighbors = reply.neighbor_ids(i);
+        point_ids_per_query.assign(neighbors.point_id().begin(), neighbors.point_id().end());
+        distances_per_query.assign(neighbors.distance().begin(), neighbors.distance().end());
+        knn_answer->AddValueToBack(point_ids_per_query, distances_per_query);
     }
     UnpackTimingInfo(reply, bucket_timing_info);
     UnpackUtilInfo(reply, bucket_util);
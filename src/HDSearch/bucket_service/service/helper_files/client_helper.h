@@ -42,16 +42,13 @@ BucketClientCommandLineArgs* ParseBucketClientCommandLine(const int &argc,
 void ReadPointIDsFromFile(const std::string &point_ids_file_name, 
         std::vector<std::vector<uint32_t> >* point_ids);
 /* Packs data that needs to be sent to the bucket server, into a 
-   protobuf message. 
-In: queries, point IDs, queries_size, number of neighbors that must
-be computed, number of dimensions of each point, ID of the bucket server,
-shard size.
+   protobuf message. Queries travel to the bucket server as point IDs.
+In: point IDs, queries_size, number of neighbors that must
+be computed, ID of the bucket server, shard size.
 Out: Protobuf message - request.*/ 
-void CreateBucketServiceRequest(const MultiplePoints &queries, 
-        const std::vector<std::vector<uint32_t>> &point_ids, 
+void CreateBucketServiceRequest(const std::vector<std::vector<uint32_t>> &point_ids, 
         const unsigned queries_size, 
         const unsigned number_of_nearest_neighbors, 
-        const int dimension,
         const uint32_t bucket_server_id,
         const int shard_size,
         const bool util_present,
@@ -59,10 +56,9 @@ void CreateBucketServiceRequest(const MultiplePoints &queries,
 /* Convert the bucket server's protobuf response message
    into a bunch of different response values.
 In: Reply from the bucket server, number of nearest neighbors.
-Out: k-nn answers for all queries, timing info: unpacking bucket server req,
+Out: k-nn answers (with their distances) for all queries, timing info: unpacking bucket server req,
 knn distance calc time, packing bucket server respose time (in micro).*/ 
 void UnpackBucketServiceResponse(const bucket::NearestNeighborResponse &reply, 
-        const unsigned number_of_nearest_neighbors,
         DistCalc* knn_answer,
         BucketTimingInfo* bucket_timing_info,
         BucketUtil* bucket_util);
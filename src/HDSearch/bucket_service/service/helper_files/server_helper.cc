@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <string>
+#include <sys/mman.h>
 #include "server_helper.h"
 
 using grpc::Server;
@@ -12,148 +15,498 @@ using bucket::TimingDataInMicro;
 using bucket::NearestNeighborResponse;
 using bucket::DistanceService;
 
-void CreateDatasetFromBinaryFile(const std::string &file_name, 
-        const int bucket_server_num,
-        const int num_bucket_servers, 
-        MultiplePoints* dataset)
+BucketServerCommandLineArgs* ParseBucketServerCommandLine(const int argc, char** argv)
 {
-    int dataset_dimensions = 2048;
-    std::cout << "Assuming 2048 dimensions\n";
-    FILE *dataset_binary = fopen(file_name.c_str(), "r");
-    if(!dataset_binary)
-    {
-        CHECK(false, "ERROR: Could not open dataset file\n");
-    }
-    /* Get the size of the file, so that we can initialize number
-       of points, given 2048 dimensions.*/
-    std::ifstream stream_to_get_size(file_name, std::ios::binary | std::ios::in);
-    stream_to_get_size.seekg(0, std::ios::end);
-    long size = stream_to_get_size.tellg();
-    long dataset_size = (size/sizeof(float))/dataset_dimensions;
-    CHECK((dataset_size >= 0), "ERROR: Negative number of points in the dataset\n");
-    /* Initialize dataset to contain 0s, 
-       this is so that we can directly index every point/value after this.*/
-    Point p(dataset_dimensions, 0.0);
-    dataset->Resize(dataset_size, p);
-
-    //Read each point (dimensions = 2048) and create a set of multiple points.
-    float values[dataset_dimensions];
-    long shard_size = dataset_size/num_bucket_servers;
-    long start_index = bucket_server_num * shard_size;
-    long end_index = (bucket_server_num + 1) * shard_size;
-    /* If this is the last bucket server, get it to cover all points til the end,
-       if note - just focus on it's shard. This is to prevent points from being ignored
-       when the data set does not shard evenly.*/
-    if (bucket_server_num == (num_bucket_servers - 1)) {
-        end_index = dataset_size;
-    }
-
-    for(long i = start_index; i < end_index; i++)
+    struct BucketServerCommandLineArgs* bucket_server_command_line_args = new struct BucketServerCommandLineArgs();
+    if (argc >= 7) {
+        try
+        {
+            bucket_server_command_line_args->dataset_file_name = argv[1];
+            bucket_server_command_line_args->ip_port = argv[2];
+            bucket_server_command_line_args->mode = std::stoi(argv[3], nullptr, 0);
+            bucket_server_command_line_args->num_cores = std::stoi(argv[4], nullptr, 0);
+            bucket_server_command_line_args->bucket_server_num = std::stoi(argv[5], nullptr, 0);
+            bucket_server_command_line_args->num_bucket_servers = std::stoi(argv[6], nullptr, 0);
+        }
+        catch (...)
+        {
+            CHECK(false, "Enter a valid string for dataset file path/ IP address:port/ valid number for mode/ num of cores/ bucket server number/ number of bucket servers");
+        }
+    } else {
+        CHECK(false, "Format: ./<bucket_server> <dataset file path> <IP address:Port Number> <Mode 1 - read dataset from text file OR Mode 2 - read dataset from binary file> <num of cores: -1 if you want all cores on the machine> <bucket server number> <number of bucket servers in the system> [--dimensions=<dimensions of a legacy binary dataset>] [--populate] [--huge_pages] [--early_abandon] [--intra_query_min_candidates=<split a query's candidate scan across idle cores above this many candidates, 0 to disable>] [--storage=fp32|int8|fp16|pq] [--pq_codebook=<codebook file, for pq storage>] [--rerank_factor=<re-rank this many x K approximate candidates with fp32 distances>] [--knn_cache_bytes=<memory budget of the k-NN result cache, 0 to disable>] [--completion_queues=<number of completion queues, 0 for one per thread>] [--pin_pollers] [--busy_poll_us=<spin on the completion queue this long before blocking>] [--request_workers=<hand requests off to this many worker threads, 0 to process them in the pollers>] [--numa=off|replicate|split]\n");
+    }
+    CHECK(((bucket_server_command_line_args->num_bucket_servers > 0) && (bucket_server_command_line_args->bucket_server_num >= 0) && (bucket_server_command_line_args->bucket_server_num < bucket_server_command_line_args->num_bucket_servers)), "ERROR: Bucket server number must be between 0 and the number of bucket servers - 1\n");
+
+    // Optional flags: --name or --name=value.
+    for(int i = 7; i < argc; i++)
     {
-        if(fread(values, sizeof(float), dataset_dimensions, dataset_binary) == dataset_dimensions)
+        std::string flag = argv[i];
+        std::string value = "";
+        size_t equals = flag.find('=');
+        if (equals != std::string::npos) {
+            value = flag.substr(equals + 1);
+            flag = flag.substr(0, equals);
+        }
+        try
         {
-            p.CreatePointFromFloatArray(values, dataset_dimensions);
-            dataset->SetPoint(i, p);
-        } else {
-            break;
+            if (flag == "--dimensions") {
+                bucket_server_command_line_args->dimensions = std::stoul(value, nullptr, 0);
+            } else if (flag == "--populate") {
+                bucket_server_command_line_args->populate = true;
+            } else if (flag == "--huge_pages") {
+                bucket_server_command_line_args->huge_pages = true;
+            } else if (flag == "--early_abandon") {
+                bucket_server_command_line_args->early_abandon = true;
+            } else if (flag == "--storage") {
+                CHECK((ParsePointStorage(value, &bucket_server_command_line_args->storage)), "ERROR: Storage must be fp32, int8, fp16 or pq\n");
+            } else if (flag == "--pq_codebook") {
+                bucket_server_command_line_args->pq_codebook_file_name = value;
+            } else if (flag == "--rerank_factor") {
+                bucket_server_command_line_args->rerank_factor = std::stoul(value, nullptr, 0);
+            } else if (flag == "--knn_cache_bytes") {
+                bucket_server_command_line_args->knn_cache_bytes = std::stoull(value, nullptr, 0);
+            } else if (flag == "--completion_queues") {
+                bucket_server_command_line_args->completion_queues = std::stoul(value, nullptr, 0);
+            } else if (flag == "--pin_pollers") {
+                bucket_server_command_line_args->pin_pollers = true;
+            } else if (flag == "--busy_poll_us") {
+                bucket_server_command_line_args->busy_poll_us = std::stoul(value, nullptr, 0);
+            } else if (flag == "--request_workers") {
+                bucket_server_command_line_args->request_workers = std::stoul(value, nullptr, 0);
+            } else if (flag == "--numa") {
+                CHECK((ParseNumaMode(value, &bucket_server_command_line_args->numa_mode)), "ERROR: NUMA mode must be off, replicate or split\n");
+            } else if (flag == "--intra_query_min_candidates") {
+                bucket_server_command_line_args->intra_query_min_candidates = std::stoul(value, nullptr, 0);
+            } else {
+                CHECK(false, "ERROR: Unknown bucket server flag " << flag << "\n");
+            }
+        }
+        catch (...)
+        {
+            CHECK(false, "ERROR: Enter a valid number for bucket server flag " << flag << "\n");
         }
     }
+    CHECK(((bucket_server_command_line_args->storage == FP32_STORAGE) || !bucket_server_command_line_args->early_abandon), "ERROR: Early abandon needs fp32 storage\n");
+    CHECK(((bucket_server_command_line_args->storage != PQ_STORAGE) || (bucket_server_command_line_args->pq_codebook_file_name != "")), "ERROR: PQ storage needs --pq_codebook\n");
+    CHECK(((bucket_server_command_line_args->storage == FP32_STORAGE) || (bucket_server_command_line_args->numa_mode == NUMA_OFF)), "ERROR: NUMA placement needs fp32 storage\n");
+    /* Workers are spread over the nodes round-robin: each node's handoff
+       queue needs at least one of them.*/
+    CHECK(((bucket_server_command_line_args->numa_mode == NUMA_OFF) || (bucket_server_command_line_args->request_workers == 0) || (bucket_server_command_line_args->request_workers >= GetNumNumaNodes())), "ERROR: A NUMA mode needs --request_workers=0 or at least one request worker per node (" << GetNumNumaNodes() << " nodes)\n");
+    // Requests only reach the node that holds their candidates through the workers.
+    CHECK(((bucket_server_command_line_args->numa_mode != NUMA_SPLIT) || (bucket_server_command_line_args->request_workers > 0)), "ERROR: --numa=split needs --request_workers\n");
+    return bucket_server_command_line_args;
+}
+
+void CreateDatasetFromBinaryFile(const std::string &file_name, 
+        const int bucket_server_num,
+        const int num_bucket_servers, 
+        const unsigned int legacy_dimensions,
+        const bool populate,
+        const bool huge_pages,
+        DatasetFile* corpus,
+        MultiplePoints* dataset,
+        uint32_t* shard_start)
+{
+    corpus->Open(file_name, legacy_dimensions);
+    uint64_t start_index = 0, end_index = 0;
+    corpus->GetShardRange(bucket_server_num, num_bucket_servers, &start_index, &end_index);
+    std::cout << "Loading points " << start_index << " to " << end_index << " of " << corpus->GetSize() << " (" << corpus->GetPointDimension() << " dimensions)\n";
+    CHECK((end_index <= UINT32_MAX), "ERROR: Point IDs must fit in 32 bits\n");
+    /* Only this bucket server's shard is copied into memory. Point IDs
+       in the dataset are local: global ID - shard_start.*/
+    dataset->UseHugePages(huge_pages);
+    corpus->MaterializeRange(start_index, end_index, populate, dataset);
+    *shard_start = (uint32_t)start_index;
+}
+
+void CreateQuantizedDatasetFromBinaryFile(const std::string &file_name,
+        const int bucket_server_num,
+        const int num_bucket_servers,
+        const unsigned int legacy_dimensions,
+        const PointStorage storage,
+        const bool huge_pages,
+        DatasetFile* corpus,
+        QuantizedPoints* quantized_dataset,
+        uint32_t* shard_start)
+{
+    corpus->Open(file_name, legacy_dimensions);
+    uint64_t start_index = 0, end_index = 0;
+    corpus->GetShardRange(bucket_server_num, num_bucket_servers, &start_index, &end_index);
+    std::cout << "Quantizing points " << start_index << " to " << end_index << " of " << corpus->GetSize() << " (" << corpus->GetPointDimension() << " dimensions)\n";
+    CHECK((end_index <= UINT32_MAX), "ERROR: Point IDs must fit in 32 bits\n");
+    corpus->AdviseRange(start_index, end_index, MADV_SEQUENTIAL);
+    quantized_dataset->Quantize(corpus->GetPointViewAtIndex(start_index).GetData(),
+            end_index - start_index,
+            corpus->GetPointDimension(),
+            storage,
+            huge_pages);
+    /* The fp32 points are only read again to re-rank a few candidates:
+       drop them from memory, they fault back in from the file on demand.*/
+    corpus->AdviseRange(start_index, end_index, MADV_DONTNEED);
+    corpus->AdviseRange(start_index, end_index, MADV_RANDOM);
+    std::cout << "Quantized shard takes " << quantized_dataset->GetMemorySize() << " bytes\n";
+    *shard_start = (uint32_t)start_index;
+}
+
+void CreatePqDatasetFromBinaryFile(const std::string &file_name,
+        const int bucket_server_num,
+        const int num_bucket_servers,
+        const unsigned int legacy_dimensions,
+        const std::string &codebook_file_name,
+        const bool huge_pages,
+        DatasetFile* corpus,
+        ProductQuantizer* pq_dataset,
+        uint32_t* shard_start)
+{
+    corpus->Open(file_name, legacy_dimensions);
+    pq_dataset->LoadCodebook(codebook_file_name);
+    CHECK((pq_dataset->GetPointDimension() == corpus->GetPointDimension()), "ERROR: PQ codebook dimensions do not match the dataset\n");
+    uint64_t start_index = 0, end_index = 0;
+    corpus->GetShardRange(bucket_server_num, num_bucket_servers, &start_index, &end_index);
+    std::cout << "PQ encoding points " << start_index << " to " << end_index << " of " << corpus->GetSize() << " (" << pq_dataset->GetNumSubspaces() << " subspaces)\n";
+    CHECK((end_index <= UINT32_MAX), "ERROR: Point IDs must fit in 32 bits\n");
+    corpus->AdviseRange(start_index, end_index, MADV_SEQUENTIAL);
+    pq_dataset->Encode(corpus->GetPointViewAtIndex(start_index).GetData(),
+            end_index - start_index,
+            huge_pages);
+    // As with int8/fp16 codes, the fp32 points are only read to re-rank.
+    corpus->AdviseRange(start_index, end_index, MADV_DONTNEED);
+    corpus->AdviseRange(start_index, end_index, MADV_RANDOM);
+    std::cout << "PQ encoded shard takes " << pq_dataset->GetMemorySize() << " bytes\n";
+    *shard_start = (uint32_t)start_index;
 }
 
 void UnpackBucketServiceRequest(const NearestNeighborRequest &request, 
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
+        const uint32_t shard_start,
         MultiplePoints* queries, 
         std::vector<std::vector<uint32_t>>* point_ids_vec, 
         uint32_t* bucket_server_id,
         uint32_t* shard_size)
 {
 
-    UnpackQueries(request, dataset, queries);
+    UnpackQueries(request, dataset, corpus, queries);
     *bucket_server_id = (uint32_t)request.bucket_server_id();
     *shard_size = (int)request.shard_size();
-    UnpackPointIDs(request, *bucket_server_id, *shard_size, point_ids_vec);
+    UnpackPointIDs(request, shard_start, point_ids_vec);
 }
 
 void UnpackBucketServiceRequestAsync(const bucket::NearestNeighborRequest &request,
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
+        const uint32_t shard_start,
         MultiplePoints* queries,
         std::vector<std::vector<uint32_t>>* point_ids_vec,
         uint32_t* bucket_server_id,
         uint32_t* shard_size,
         bucket::NearestNeighborResponse* reply)
 {
-    UnpackQueriesAsync(request, dataset, queries, reply);
+    UnpackQueriesAsync(request, dataset, corpus, queries, reply);
     *bucket_server_id = (uint32_t)request.bucket_server_id();
     *shard_size = (int)request.shard_size();
-    UnpackPointIDs(request, *bucket_server_id, *shard_size, point_ids_vec);
+    UnpackPointIDs(request, shard_start, point_ids_vec);
+}
+
+/* Queries are IDs of the whole corpus, so they usually live in another
+   shard. When the dataset was mapped from a binary file, read the query
+   from the mapping, otherwise the dataset holds the whole corpus.*/
+static inline PointView GetQueryPoint(const MultiplePoints &dataset,
+        const DatasetFile &corpus,
+        const uint64_t query_id)
+{
+    if (corpus.IsOpen()) {
+        return corpus.GetPointViewAtIndex(query_id);
+    }
+    return dataset.GetPointViewAtIndex(query_id);
 }
 
 void UnpackQueries(const bucket::NearestNeighborRequest &request, 
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
         MultiplePoints* queries)
 {
-    Point p(dataset.GetPointAtIndex(0).GetSize(), 0.0);
     uint64_t value = 0;
     for(int i = 0; i < request.queries_size(); i++)
     {
         value = request.queries(i);
-        p = dataset.GetPointAtIndex(value);
-        queries->SetPoint(i, p);
+        queries->SetPoint(i, GetQueryPoint(dataset, corpus, value));
     }
 }
 
 void UnpackQueriesAsync(const bucket::NearestNeighborRequest &request,
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
         MultiplePoints* queries,
         bucket::NearestNeighborResponse* reply)
 {
-    Point p(dataset.GetPointAtIndex(0).GetSize(), 0.0);
-    uint64_t value = 0;
+    // The query IDs go back as they came, in one copy.
+    reply->mutable_queries()->CopyFrom(request.queries());
+    const uint64_t* query_ids = request.queries().data();
     for(int i = 0; i < request.queries_size(); i++)
     {
-        value = request.queries(i);
-        reply->add_queries(value);
-        p = dataset.GetPointAtIndex(value);
-        queries->SetPoint(i, p);
+        queries->SetPoint(i, GetQueryPoint(dataset, corpus, query_ids[i]));
     }
-
 }
 
 void UnpackPointIDs(const NearestNeighborRequest &request, 
-        const uint32_t bucket_server_id,
-        const int shard_size,
+        const uint32_t shard_start,
         std::vector<std::vector<uint32_t>>* point_ids_vec)
 {
-
-    uint32_t id_value;
-    std::vector<uint32_t> point_ids_per_query;
-
-    // UnPacking Point IDs.
+    /* One list per query. Lists keep their capacity when the caller reuses
+       point_ids_vec, so a request usually does not allocate here.*/
     int num_queries = request.maybe_neighbor_list_size();
-    int num_ids = 0;
+    point_ids_vec->resize(num_queries);
     for(int i = 0; i < num_queries; i++)
     {
-        num_ids = request.maybe_neighbor_list(i).point_id_size();
-        for(int j = 0; j < num_ids; j++)
+        // Read straight from the repeated field's array.
+        const google::protobuf::RepeatedField<uint32_t> &ids = request.maybe_neighbor_list(i).point_id();
+        const uint32_t* ids_data = ids.data();
+        std::vector<uint32_t> &point_ids = (*point_ids_vec)[i];
+        point_ids.resize(ids.size());
+        for(int j = 0; j < ids.size(); j++)
         {
-            id_value = request.maybe_neighbor_list(i).point_id(j);
-            //id_value = id_value - (bucket_server_id * shard_size);
-            point_ids_per_query.push_back(id_value);
+            // Global point ID -> index into this bucket's shard.
+            point_ids[j] = ids_data[j] - shard_start;
         }
-        point_ids_vec->push_back(point_ids_per_query);
-        if (num_queries > 1) {
-            point_ids_per_query.clear();
+    }
+}
+
+void PreprocessPointIDs(const uint32_t num_shard_points,
+        std::vector<std::vector<uint32_t> > &point_ids_vec)
+{
+    // Bitmap & sort scratch, reused by every request of this thread.
+    static thread_local CandidatePreprocessor candidate_preprocessor;
+    for(size_t i = 0; i < point_ids_vec.size(); i++)
+    {
+        candidate_preprocessor.Preprocess(num_shard_points, &point_ids_vec[i]);
+    }
+}
+
+void PlaceShardSnapshot(const NumaMode numa_mode, ShardSnapshot* snapshot)
+{
+    unsigned num_nodes = GetNumNumaNodes();
+    if (num_nodes == 1) {
+        return;
+    }
+    if (numa_mode == NUMA_SPLIT) {
+        snapshot->dataset.SplitAcrossNumaNodes();
+    } else if (numa_mode == NUMA_REPLICATE) {
+        // Every copy is made (i.e first touched) by a thread of its node.
+        std::vector<MultiplePoints> &replicas = snapshot->node_replicas;
+        replicas.resize(num_nodes);
+        RunOnEveryNumaNode([snapshot, &replicas](unsigned node) {
+                replicas[node] = snapshot->dataset;
+                });
+        snapshot->dataset = std::move(replicas[0]);
+    }
+}
+
+const MultiplePoints& GetLocalShard(const ShardSnapshot &snapshot)
+{
+    if (snapshot.node_replicas.empty()) {
+        return snapshot.dataset;
+    }
+    unsigned node = GetCurrentNumaNode();
+    return ((node == 0) || (node >= snapshot.node_replicas.size())) ? snapshot.dataset : snapshot.node_replicas[node];
+}
+
+unsigned GetRequestNumaNode(const bucket::NearestNeighborRequest &request,
+        const uint32_t shard_start,
+        const uint32_t num_points)
+{
+    unsigned num_nodes = GetNumNumaNodes();
+    if (num_nodes == 1) {
+        return 0;
+    }
+    size_t num_ids = 0;
+    for(int q = 0; q < request.maybe_neighbor_list_size(); q++)
+    {
+        num_ids += request.maybe_neighbor_list(q).point_id_size();
+    }
+    // Every step-th point ID of the request.
+    size_t step = std::max((size_t)1, num_ids / NUMA_STEERING_SAMPLE_SIZE);
+    std::vector<unsigned> node_counts(num_nodes, 0);
+    size_t position = 0;
+    for(int q = 0; q < request.maybe_neighbor_list_size(); q++)
+    {
+        const google::protobuf::RepeatedField<uint32_t> &point_ids = request.maybe_neighbor_list(q).point_id();
+        for(; position < (size_t)point_ids.size(); position += step)
+        {
+            uint32_t index = point_ids.Get(position) - shard_start;
+            if ((point_ids.Get(position) >= shard_start) && (index < num_points)) {
+                node_counts[GetNumaNodeOfRow(index, num_points, num_nodes)]++;
+            }
+        }
+        position -= point_ids.size();
+    }
+    return std::max_element(node_counts.begin(), node_counts.end()) - node_counts.begin();
+}
+
+void RemoveDeletedPointIDs(const std::vector<bool> &deleted,
+        std::vector<std::vector<uint32_t> > &point_ids_vec)
+{
+    for(size_t i = 0; i < point_ids_vec.size(); i++)
+    {
+        std::vector<uint32_t> &point_ids = point_ids_vec[i];
+        // Keeps the (sorted) order of the remaining IDs.
+        point_ids.erase(std::remove_if(point_ids.begin(),
+                    point_ids.end(),
+                    [&deleted](const uint32_t point_id) { return deleted[point_id]; }),
+                point_ids.end());
+    }
+}
+
+bool ApplyShardMutations(const bucket::ShardMutationRequest &request,
+        const ShardSnapshot &current,
+        const uint32_t shard_start,
+        const std::vector<unsigned> &dimension_order,
+        ShardSnapshot* next,
+        std::string* error)
+{
+    uint64_t index_view = (request.index_view() != 0) ? request.index_view() : (current.index_view + 1);
+    if (index_view <= current.index_view) {
+        *error = "Index view " + std::to_string(index_view) + " is not newer than the shard's " + std::to_string(current.index_view);
+        return false;
+    }
+    const unsigned dimension = current.dataset.GetPointDimension();
+    size_t size = current.dataset.GetSize();
+    /* Make room for the appended points at once: growing the copy point by
+       point would reallocate (and copy) the whole shard again.*/
+    size_t num_appends = 0;
+    for(int i = 0; i < request.mutations_size(); i++)
+    {
+        const bucket::PointMutation &mutation = request.mutations(i);
+        if ((mutation.operation() == bucket::PointMutation::INSERT)
+                && (mutation.point_id() >= shard_start)
+                && (mutation.point_id() - shard_start >= size)) {
+            num_appends++;
+        }
+    }
+    next->dataset = current.dataset;
+    if (num_appends != 0) {
+        next->dataset.Resize(size + num_appends, dimension);
+    }
+    next->deleted = current.deleted;
+    next->deleted.resize(size + num_appends, false);
+    next->num_deleted = current.num_deleted;
+    next->index_view = index_view;
+    std::vector<float> values(dimension);
+    for(int i = 0; i < request.mutations_size(); i++)
+    {
+        const bucket::PointMutation &mutation = request.mutations(i);
+        std::string point = "Point " + std::to_string(mutation.point_id());
+        if (mutation.point_id() < shard_start) {
+            *error = point + " is not in this shard";
+            return false;
+        }
+        // Points up to size are in the shard so far (appended ones included).
+        size_t index = mutation.point_id() - shard_start;
+        bool in_shard = (index < size) && !next->deleted[index];
+        if (mutation.operation() != bucket::PointMutation::DELETE) {
+            if ((unsigned)mutation.data_point_size() != dimension) {
+                *error = point + " does not have " + std::to_string(dimension) + " dimensions";
+                return false;
+            }
+            for(unsigned d = 0; d < dimension; d++)
+            {
+                values[d] = mutation.data_point(dimension_order.empty() ? d : dimension_order[d]);
+            }
+        }
+        PointView value(values.data(), dimension);
+        switch (mutation.operation())
+        {
+            case bucket::PointMutation::INSERT:
+                if (index == size) {
+                    next->dataset.SetPoint(index, value);
+                    size++;
+                } else if ((index < size) && next->deleted[index]) {
+                    next->dataset.SetPoint(index, value);
+                    next->deleted[index] = false;
+                    next->num_deleted--;
+                } else {
+                    *error = point + " is neither deleted nor right after the shard";
+                    return false;
+                }
+                break;
+            case bucket::PointMutation::UPDATE:
+                if (!in_shard) {
+                    *error = point + " is not in this shard";
+                    return false;
+                }
+                next->dataset.SetPoint(index, value);
+                break;
+            case bucket::PointMutation::DELETE:
+                if (!in_shard) {
+                    *error = point + " is not in this shard";
+                    return false;
+                }
+                next->deleted[index] = true;
+                next->num_deleted++;
+                break;
+            default:
+                *error = point + ": unknown operation";
+                return false;
         }
     }
+    return true;
 }
 
-void RemoveDuplicatePointIDs(std::vector<std::vector<uint32_t> > &point_ids_vec)
+unsigned LookupKnnCache(KnnCache* knn_cache,
+        const bucket::NearestNeighborRequest &request,
+        const uint32_t search_mode,
+        std::vector<std::vector<uint32_t>>* point_ids_vec,
+        std::vector<KnnCacheKey>* cache_keys,
+        std::vector<char>* cache_hits,
+        DistCalc* cached_answers)
 {
-    uint32_t point_ids_size = point_ids_vec.size();
-    for(int i = 0; i < point_ids_size; i++)
+    // A candidate list without its query has no key: it is never cached.
+    size_t num_queries = std::min((size_t)request.queries_size(), point_ids_vec->size());
+    cache_keys->resize(num_queries);
+    cache_hits->assign(num_queries, 0);
+    cached_answers->Initialize(num_queries, PointIDs());
+    static thread_local PointIDs point_ids;
+    static thread_local std::vector<float> distances;
+    unsigned num_hits = 0;
+    for(size_t q = 0; q < num_queries; q++)
     {
-        std::set<uint32_t> point_id_set(point_ids_vec[i].begin(), point_ids_vec[i].end());
-        point_ids_vec[i].assign(point_id_set.begin(), point_id_set.end());
+        std::vector<uint32_t> &candidates = (*point_ids_vec)[q];
+        KnnCacheKey &key = (*cache_keys)[q];
+        key.query_id = request.queries(q);
+        key.candidates_hash = KnnCache::HashPointIDs(candidates);
+        key.num_candidates = candidates.size();
+        key.number_of_nearest_neighbors = request.requested_neighbor_count();
+        key.search_mode = search_mode;
+        if (knn_cache->Lookup(key, &point_ids, &distances)) {
+            (*cache_hits)[q] = 1;
+            cached_answers->AddKnnAnswer(point_ids, distances, q);
+            // Nothing to scan: the empty list leaves an empty answer.
+            candidates.clear();
+            num_hits++;
+        }
+    }
+    return num_hits;
+}
+
+void UpdateKnnCache(KnnCache* knn_cache,
+        const uint64_t generation,
+        const std::vector<KnnCacheKey> &cache_keys,
+        const std::vector<char> &cache_hits,
+        const DistCalc &cached_answers,
+        DistCalc* knn_answer)
+{
+    for(size_t q = 0; q < cache_keys.size(); q++)
+    {
+        if (cache_hits[q]) {
+            knn_answer->AddKnnAnswer(cached_answers.GetValueAtIndex(q),
+                    cached_answers.GetDistancesAtIndex(q),
+                    q);
+        } else {
+            knn_cache->Insert(cache_keys[q],
+                    generation,
+                    knn_answer->GetValueAtIndex(q),
+                    knn_answer->GetDistancesAtIndex(q));
+        }
     }
 }
 
@@ -161,32 +514,35 @@ void CalculateKNN(const MultiplePoints &queries,
         const MultiplePoints &dataset, 
         const std::vector<std::vector<uint32_t>> &point_ids_vec, 
         const uint32_t number_of_nearest_neighbors,
-        const int num_cores,
         DistCalc* knn_answer)
 {
     knn_answer->DistanceCalculation(dataset, 
             queries, 
             point_ids_vec, 
-            (unsigned)number_of_nearest_neighbors,
-            num_cores);
+            (unsigned)number_of_nearest_neighbors);
 }
 
 void PackBucketServiceResponse(const DistCalc &knn_answer, 
-        const uint32_t bucket_server_id,
-        const uint32_t shard_size,
+        const uint32_t shard_start,
         NearestNeighborResponse* reply)
 {
     int knn_answer_size = knn_answer.GetSize();
-    int neighbor_ids_size = 0;
+    reply->mutable_neighbor_ids()->Reserve(knn_answer_size);
     for(int i = 0; i < knn_answer_size; i++)
     {
+        const PointIDs &answer = knn_answer.GetValueAtIndex(i);
+        const std::vector<float> &distances = knn_answer.GetDistancesAtIndex(i);
         PointIdList* knn = reply->add_neighbor_ids();
-        neighbor_ids_size = knn_answer.GetValueAtIndex(i).size();
-        for(int j = 0; j < neighbor_ids_size; j++)
+        // Size the repeated field once, then write the IDs in place.
+        google::protobuf::RepeatedField<uint32_t>* point_ids = knn->mutable_point_id();
+        point_ids->Resize(answer.size(), 0);
+        uint32_t* point_ids_data = point_ids->mutable_data();
+        for(size_t j = 0; j < answer.size(); j++)
         {
-            knn->add_point_id((uint32_t)(knn_answer.GetValueAtIndex(i).at(j)));
-            //knn->add_point_id((uint32_t)(knn_answer.GetValueAtIndex(i).at(j) + (bucket_server_id * shard_size)));
+            // Shard index -> global point ID.
+            point_ids_data[j] = answer[j] + shard_start;
         }
+        knn->mutable_distance()->Add(distances.begin(), distances.end());
     }
 }
 
@@ -1,25 +1,141 @@
 #ifndef __SERVER_HELPER_H_INCLUDED__
 #define __SERVER_HELPER_H_INCLUDED__
 
+#include "bucket_service/src/dataset_file.h"
 #include "bucket_service/src/dist_calc.h"
+#include "bucket_service/src/knn_cache.h"
+#include "bucket_service/src/numa_placement.h"
 #include "protoc_files/bucket.grpc.pb.h"
 
-/* Create a dataset, given a binary file containing float values.
-   Dimensions of all points are 2048.
-In: name of the dataset file
-Out: dataset in the form of MultiplePoints.*/
+/* Contains data from the user: 6 positional arguments, followed by
+   optional flags of the form --name or --name=value.*/
+struct BucketServerCommandLineArgs {
+    std::string dataset_file_name = "";
+    std::string ip_port = "";
+    int mode = 2;
+    int num_cores = -1;
+    int bucket_server_num = 0;
+    int num_bucket_servers = 1;
+    // Dimensions of each point in a legacy (headerless) binary dataset.
+    unsigned int dimensions = 2048;
+    // Prefault this bucket server's shard with MAP_POPULATE.
+    bool populate = false;
+    // Back the in-memory shard with transparent huge pages.
+    bool huge_pages = false;
+    /* Spread a request (or the candidate scan of one query) with at least
+       this many point IDs across idle cores (0: never split).*/
+    unsigned int intra_query_min_candidates = 4096;
+    /* Keep the shard as fp32, or as int8/fp16/PQ codes (fp32 rows stay in
+       the mapped file).*/
+    PointStorage storage = FP32_STORAGE;
+    // Codebook to encode the shard with, for PQ storage (see tools/train_pq).
+    std::string pq_codebook_file_name = "";
+    /* Order the shard's dimensions by decreasing variance and give up on a
+       candidate once its partial distance exceeds the K-th best (fp32 only).*/
+    bool early_abandon = false;
+    /* With int8/fp16 storage (or PQ_RERANK requests), re-rank the rerank_factor x K best approximate
+       candidates with exact fp32 distances (0: no re-ranking).*/
+    unsigned int rerank_factor = 4;
+    // Memory budget of the k-NN result cache, in bytes (0: no cache).
+    uint64_t knn_cache_bytes = 0;
+    /* Completion queues the poller threads are spread over (0: one per
+       poller thread, so that no two pollers share a queue).*/
+    unsigned int completion_queues = 1;
+    // Pin every poller (and request worker) thread to its own core.
+    bool pin_pollers = false;
+    /* Poll the completion queue without blocking for up to this many
+       microseconds after the last event, before sleeping in it (0: always block).*/
+    unsigned int busy_poll_us = 0;
+    /* Hand requests off from the pollers to this many worker threads
+       (0: pollers process requests inline).*/
+    unsigned int request_workers = 0;
+    /* Replicate the (fp32) shard on every NUMA node, or split it across
+       them and steer requests to the node with most of their candidates.*/
+    NumaMode numa_mode = NUMA_OFF;
+};
+
+/* One version of a bucket server's fp32 shard. A snapshot is never
+   modified once requests can see it: mutations are applied to a copy,
+   which then replaces it (requests that hold the old one finish on it).
+   Deleted points keep their row, so that point IDs do not move, and are
+   dropped from the candidates.*/
+struct ShardSnapshot {
+    MultiplePoints dataset;
+    /* With NUMA_REPLICATE, a copy of the dataset on every node but node 0
+       (which holds dataset itself); entry 0 is empty.*/
+    std::vector<MultiplePoints> node_replicas;
+    std::vector<bool> deleted;
+    uint32_t num_deleted = 0;
+    // Version of the shard (0 is the one loaded at startup).
+    uint64_t index_view = 0;
+};
+
+/* Parse the bucket server command line.
+In: argc, argv
+Out: command line arguments (must be freed by the caller).*/
+BucketServerCommandLineArgs* ParseBucketServerCommandLine(const int argc, char** argv);
+
+/* Create the dataset shard of this bucket server, given a binary dataset
+   file (self-describing header or legacy raw float values). The file
+   stays mapped so that queries from other shards can be read from it.
+In: name of the dataset file, bucket server number, number of bucket servers,
+dimensions of a legacy file, whether to prefault the shard/use huge pages.
+Out: mapped corpus, this server's shard in the form of MultiplePoints, 
+global point ID of the first point in the shard.*/
 void CreateDatasetFromBinaryFile(const std::string &file_name, 
         const int bucket_server_num,
         const int num_bucket_servers,
-        MultiplePoints* dataset);
+        const unsigned int legacy_dimensions,
+        const bool populate,
+        const bool huge_pages,
+        DatasetFile* corpus,
+        MultiplePoints* dataset,
+        uint32_t* shard_start);
+
+/* Same as CreateDatasetFromBinaryFile(), but the shard is kept as int8 or
+   fp16 codes. Its fp32 points are not copied: they stay in the mapped file,
+   and are paged back in only to re-rank.
+In: name of the dataset file, bucket server number, number of bucket servers,
+dimensions of a legacy file, storage (int8/fp16), whether to use huge pages.
+Out: mapped corpus, this server's quantized shard, global point ID of the
+first point in the shard.*/
+void CreateQuantizedDatasetFromBinaryFile(const std::string &file_name,
+        const int bucket_server_num,
+        const int num_bucket_servers,
+        const unsigned int legacy_dimensions,
+        const PointStorage storage,
+        const bool huge_pages,
+        DatasetFile* corpus,
+        QuantizedPoints* quantized_dataset,
+        uint32_t* shard_start);
+
+/* Same as CreateQuantizedDatasetFromBinaryFile(), but the shard is
+   encoded with a product quantization codebook.
+In: name of the dataset file, bucket server number, number of bucket servers,
+dimensions of a legacy file, name of the codebook file, whether to use huge
+pages.
+Out: mapped corpus, this server's PQ encoded shard, global point ID of the
+first point in the shard.*/
+void CreatePqDatasetFromBinaryFile(const std::string &file_name,
+        const int bucket_server_num,
+        const int num_bucket_servers,
+        const unsigned int legacy_dimensions,
+        const std::string &codebook_file_name,
+        const bool huge_pages,
+        DatasetFile* corpus,
+        ProductQuantizer* pq_dataset,
+        uint32_t* shard_start);
 
 /* Unpack protobuf message request from the index into a vector of query 
    points, set of point IDs for each query, and bucket server ID.
-In: protobuf message request.
+In: protobuf message request, dataset shard, mapped corpus, global point ID
+of the first point in the shard.
 Out: vector of queries, set of point IDs for each query, bucket server ID,
 shard size*/ 
 void UnpackBucketServiceRequest(const bucket::NearestNeighborRequest &request, 
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
+        const uint32_t shard_start,
         MultiplePoints* queries, 
         std::vector<std::vector<uint32_t>>* point_ids_vec,
         uint32_t* bucket_server_id,
@@ -29,6 +145,8 @@ void UnpackBucketServiceRequest(const bucket::NearestNeighborRequest &request,
    added to the bucket reply.*/
 void UnpackBucketServiceRequestAsync(const bucket::NearestNeighborRequest &request,
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
+        const uint32_t shard_start,
         MultiplePoints* queries,
         std::vector<std::vector<uint32_t>>* point_ids_vec,
         uint32_t* bucket_server_id,
@@ -37,38 +155,104 @@ void UnpackBucketServiceRequestAsync(const bucket::NearestNeighborRequest &reque
 /* Unpack protobuf message request from the index into a vector of query 
    points. This functionality of this function is a subset of the above 
    function.
-In: protobuf message request.
+In: protobuf message request, dataset shard, mapped corpus (if it is not
+open, the dataset must hold the whole corpus).
 Out: vector of query points.*/
 void UnpackQueries(const bucket::NearestNeighborRequest &request, 
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
         MultiplePoints* queries);
 
 /* Same as above function but populates a piggy back message 
    to the server.*/
 void UnpackQueriesAsync(const bucket::NearestNeighborRequest &request,
         const MultiplePoints &dataset,
+        const DatasetFile &corpus,
         MultiplePoints* queries,
         bucket::NearestNeighborResponse* reply);
 /* Unpack protobuf message request from the index into a 
    set of point IDs for each query. This functionality of this function is a 
    subset of the above function.
-In: protobuf message request, bucket server ID, shard size.
-Out: set of point IDs for each query.
-Note: Bucket server ID and shard size are required inputs, so that the bucket
-knows which corresponding piece of the dataset it must bring into memory.*/
+In: protobuf message request, global point ID of the first point in the shard.
+Out: set of point IDs for each query, as indices into this bucket's shard.
+Note: The index server sends global point IDs, so the shard start is required
+to find the corresponding point in the piece of the dataset held in memory.*/
 void UnpackPointIDs(const bucket::NearestNeighborRequest &request, 
-        const uint32_t bucket_server_id,
-        const int shard_size,
+        const uint32_t shard_start,
         std::vector<std::vector<uint32_t>>* point_ids_vec);
 
-/* Remove duplicate point IDs. It is possible for duplicate point IDs to be
-   present even with a single hash table because of the use of multiple
-   xor masks. A design choice would be to store list of sorted vectors in each
-   bucket so that each list gets sent a corresponding bucket server. But, this
-   alters the underlying data structure way too much. TODO: must thing about this.
-In: Pointer to the vector that needs to be modified
-Out: Modified unique vector.*/
-void RemoveDuplicatePointIDs(std::vector<std::vector<uint32_t> > &point_ids_vec);
+/* Prepare the point IDs of every query for the distance scan: remove
+   duplicates (several hash tables/probes or xor masks can return the same
+   point, and it could then fill more than one of the K spots), and sort
+   them so that the shard is read in address order (see
+   CandidatePreprocessor). Point IDs outside the shard are dropped.
+In: number of points in this bucket's shard, point IDs of every query.
+Out: sorted, unique point IDs of every query.*/
+void PreprocessPointIDs(const uint32_t num_shard_points,
+        std::vector<std::vector<uint32_t> > &point_ids_vec);
+
+/* Answer the queries of a request that are in the k-NN cache. Their point
+   IDs are cleared, so that only the misses are scanned.
+In: k-NN cache, request, sorted unique point IDs of every query, the search
+mode the request is scored with.
+Out: cache key of every query, whether it hit, the cached answers (hits
+only), point IDs of the misses. Returns the number of hits.*/
+unsigned LookupKnnCache(KnnCache* knn_cache,
+        const bucket::NearestNeighborRequest &request,
+        const uint32_t search_mode,
+        std::vector<std::vector<uint32_t>>* point_ids_vec,
+        std::vector<KnnCacheKey>* cache_keys,
+        std::vector<char>* cache_hits,
+        DistCalc* cached_answers);
+
+/* Complete the answers of a request after the misses were scanned: hits
+   are copied from the cached answers, misses are added to the cache.
+In: k-NN cache, generation of the cache when the request was looked up,
+cache keys, hits and cached answers (see LookupKnnCache).
+Out: K-NN for each query point.*/
+void UpdateKnnCache(KnnCache* knn_cache,
+        const uint64_t generation,
+        const std::vector<KnnCacheKey> &cache_keys,
+        const std::vector<char> &cache_hits,
+        const DistCalc &cached_answers,
+        DistCalc* knn_answer);
+
+/* Place a shard snapshot's points on the NUMA nodes (see NumaMode).
+In: NUMA mode, snapshot.
+Out: the snapshot, replicated or split across nodes.*/
+void PlaceShardSnapshot(const NumaMode numa_mode, ShardSnapshot* snapshot);
+
+/* Points of a snapshot that the calling thread should read: its own node's
+   replica, with NUMA_REPLICATE.*/
+const MultiplePoints& GetLocalShard(const ShardSnapshot &snapshot);
+
+/* Node that holds most of a request's candidates, when the shard is split
+   across nodes (estimated from at most NUMA_STEERING_SAMPLE_SIZE point IDs).
+In: request, global point ID of the first point in the shard, number of
+points in the shard.*/
+#define NUMA_STEERING_SAMPLE_SIZE 256
+unsigned GetRequestNumaNode(const bucket::NearestNeighborRequest &request,
+        const uint32_t shard_start,
+        const uint32_t num_points);
+
+/* Drop the point IDs of deleted points.
+In: deleted flag of every point in the shard, point IDs of every query.
+Out: point IDs of every query, without the deleted ones.*/
+void RemoveDeletedPointIDs(const std::vector<bool> &deleted,
+        std::vector<std::vector<uint32_t> > &point_ids_vec);
+
+/* Apply a batch of mutations to a copy of the current shard snapshot.
+   Inserted and updated values are reordered like the shard's dimensions.
+In: mutation request, current snapshot, global point ID of the first point
+in the shard, order of the shard's dimensions (empty: original order).
+Out: the new snapshot, or false and a description of the first invalid
+mutation (the batch is then not applied).*/
+bool ApplyShardMutations(const bucket::ShardMutationRequest &request,
+        const ShardSnapshot &current,
+        const uint32_t shard_start,
+        const std::vector<unsigned> &dimension_order,
+        ShardSnapshot* next,
+        std::string* error);
 
 /* Given a batch of query points, the dataset shard, the point IDs
    for which distance calculations must be performed, the number of
@@ -81,15 +265,14 @@ void CalculateKNN(const MultiplePoints &queries,
         const MultiplePoints &dataset, 
         const std::vector<std::vector<uint32_t>> &point_ids_vec, 
         const uint32_t number_of_nearest_neighbors,
-        const int num_cores,
         DistCalc* knn_answer);
 /* Pack the k-NN for each query point into a protobuf reply message
    so that we can ship it off to the index server.
-In: K-NN for each query point.
-Out: protobuf reply message to the index server. */
+In: K-NN for each query point (shard indices), global point ID of the 
+first point in the shard.
+Out: protobuf reply message to the index server (global point IDs). */
 void PackBucketServiceResponse(const DistCalc &knn_answer, 
-        const uint32_t bucket_server_id,
-        const uint32_t shard_size,
+        const uint32_t shard_start,
         bucket::NearestNeighborResponse* reply);
 
 /* Creates a set of points from the text file name provided.
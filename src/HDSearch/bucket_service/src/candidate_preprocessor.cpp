@@ -0,0 +1,79 @@
+#include <algorithm>
+#include "candidate_preprocessor.h"
+
+void CandidatePreprocessor::NewEpoch(const uint32_t num_points)
+{
+    size_t num_words = ((size_t)num_points + 63)/64;
+    if (word_epochs_.size() < num_words) {
+        // New words start in epoch 0, which is never current.
+        word_epochs_.resize(num_words, 0);
+        words_.resize(num_words, 0);
+    }
+    epoch_++;
+    if (epoch_ == 0) {
+        // Wrapped around: words tagged long ago would look current.
+        std::fill(word_epochs_.begin(), word_epochs_.end(), 0);
+        epoch_ = 1;
+    }
+}
+
+void CandidatePreprocessor::Preprocess(const uint32_t num_points, std::vector<uint32_t>* point_ids)
+{
+    NewEpoch(num_points);
+    uint32_t* ids = point_ids->data();
+    size_t num_ids = point_ids->size();
+    size_t num_unique = 0;
+    for(size_t i = 0; i < num_ids; i++)
+    {
+        uint32_t point_id = ids[i];
+        if ((point_id < num_points) && TestAndSet(point_id)) {
+            ids[num_unique++] = point_id;
+        }
+    }
+    point_ids->resize(num_unique);
+    RadixSort(num_points, point_ids);
+}
+
+void CandidatePreprocessor::RadixSort(const uint32_t num_points, std::vector<uint32_t>* point_ids)
+{
+    size_t num_ids = point_ids->size();
+    if (num_ids < CANDIDATE_RADIX_SORT_MIN_SIZE) {
+        std::sort(point_ids->begin(), point_ids->end());
+        return;
+    }
+    // Only as many passes as the largest point ID needs.
+    unsigned key_bits = 1;
+    while ((key_bits < 32) && ((num_points - 1) >> key_bits) != 0)
+    {
+        key_bits++;
+    }
+    scratch_.resize(num_ids);
+    uint32_t* source = point_ids->data();
+    uint32_t* destination = scratch_.data();
+    const uint32_t mask = (1u << CANDIDATE_RADIX_BITS) - 1;
+    size_t counts[1u << CANDIDATE_RADIX_BITS];
+    for(unsigned shift = 0; shift < key_bits; shift += CANDIDATE_RADIX_BITS)
+    {
+        std::fill(counts, counts + mask + 1, 0);
+        for(size_t i = 0; i < num_ids; i++)
+        {
+            counts[(source[i] >> shift) & mask]++;
+        }
+        size_t offset = 0;
+        for(uint32_t digit = 0; digit <= mask; digit++)
+        {
+            size_t count = counts[digit];
+            counts[digit] = offset;
+            offset += count;
+        }
+        for(size_t i = 0; i < num_ids; i++)
+        {
+            destination[counts[(source[i] >> shift) & mask]++] = source[i];
+        }
+        std::swap(source, destination);
+    }
+    if (source != point_ids->data()) {
+        // Odd number of passes: the sorted IDs are in the scratch space.
+        point_ids->swap(scratch_);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef __CANDIDATE_PREPROCESSOR_H_INCLUDED__
+#define __CANDIDATE_PREPROCESSOR_H_INCLUDED__
+
+#include <stdint.h>
+#include <vector>
+
+// Bits sorted per pass of the radix sort (2048 counters fit in L1).
+#define CANDIDATE_RADIX_BITS 11
+// Shorter lists are sorted with std::sort, the counters would dominate.
+#define CANDIDATE_RADIX_SORT_MIN_SIZE 256
+
+/* Prepares the candidate point IDs of a query for the distance scan:
+   duplicates (several hash tables or probes can return the same point)
+   are removed with a bitmap over the shard, and the remaining IDs are
+   radix sorted so that rows are read in increasing address order.
+   The bitmap is never cleared: every 64-bit word carries the epoch it was
+   last written in, and a word from an older epoch reads as empty, so a
+   list costs O(list size) whatever the shard size.
+   Not thread safe: keep one per thread.*/
+class CandidatePreprocessor
+{
+    public:
+        CandidatePreprocessor() = default;
+        /* In: number of points in the shard, point IDs (indices into the shard).
+           Out: the point IDs, sorted and without duplicates. IDs that are
+           not in the shard are dropped.*/
+        void Preprocess(const uint32_t num_points, std::vector<uint32_t>* point_ids);
+    private:
+        // Starts a new (empty) bitmap for a shard of num_points.
+        void NewEpoch(const uint32_t num_points);
+        // Marks a point ID, returns true if it was not marked in this epoch.
+        bool TestAndSet(const uint32_t point_id)
+        {
+            uint32_t word = point_id >> 6;
+            uint64_t bit = (uint64_t)1 << (point_id & 63);
+            if (word_epochs_[word] != epoch_) {
+                word_epochs_[word] = epoch_;
+                words_[word] = bit;
+                return true;
+            }
+            if ((words_[word] & bit) != 0) {
+                return false;
+            }
+            words_[word] |= bit;
+            return true;
+        }
+        // LSD radix sort of point IDs below num_points.
+        void RadixSort(const uint32_t num_points, std::vector<uint32_t>* point_ids);
+
+        std::vector<uint64_t> words_;
+        std::vector<uint32_t> word_epochs_;
+        uint32_t epoch_ = 0;
+        std::vector<uint32_t> scratch_;
+};
+#endif //__CANDIDATE_PREPROCESSOR_H_INCLUDED__
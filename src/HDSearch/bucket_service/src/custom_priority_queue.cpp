@@ -1,34 +1,88 @@
 #include "custom_priority_queue.h"
 
-bool CustomPriorityQueue::IsEmpty() const
+void CustomPriorityQueue::Reset(const unsigned capacity)
 {
-    return knn_priority_queue_.empty();
-}
-
-unsigned CustomPriorityQueue::GetSize() const
-{
-    return knn_priority_queue_.size();
+    if (heap_.size() < capacity) {
+        heap_.resize(capacity);
+    }
+    capacity_ = capacity;
+    size_ = 0;
 }
 
 void CustomPriorityQueue::AddToPriorityQueue(PointIDDistPair &knn_point)
 {
-    knn_priority_queue_.push(knn_point);
+    Offer(knn_point.first, knn_point.second);
 }
 
 void CustomPriorityQueue::RemoveTopElement()
 {
-    CHECK(!knn_priority_queue_.empty(), "ERROR: Tring to remove an element from a NULL data structure\n"); 
-        knn_priority_queue_.pop();
+    CHECK((size_ != 0), "ERROR: Tring to remove an element from a NULL data structure\n");
+    size_--;
+    if (size_ != 0) {
+        heap_[0] = heap_[size_];
+        SiftDown(0);
+    }
 }
 
 uint32_t CustomPriorityQueue::GetTopPointID() const
 {
-    CHECK(!knn_priority_queue_.empty(), "ERROR: Tring to get an element from a NULL data structure\n"); 
-        return knn_priority_queue_.top().first;
+    CHECK((size_ != 0), "ERROR: Tring to get an element from a NULL data structure\n");
+    return heap_[0].first;
 }
 
 float CustomPriorityQueue::GetTopDistance() const
 {
-    CHECK(!knn_priority_queue_.empty(), "ERROR: Tring to get an element from a NULL data structure\n"); 
-        return  knn_priority_queue_.top().second;
+    CHECK((size_ != 0), "ERROR: Tring to get an element from a NULL data structure\n");
+    return heap_[0].second;
+}
+
+void CustomPriorityQueue::ExtractSorted(std::vector<uint32_t>* point_ids,
+        std::vector<float>* distances)
+{
+    point_ids->resize(size_);
+    distances->resize(size_);
+    // Popping the farthest pair each time fills the output back to front.
+    while (size_ != 0)
+    {
+        (*point_ids)[size_ - 1] = heap_[0].first;
+        (*distances)[size_ - 1] = heap_[0].second;
+        RemoveTopElement();
+    }
+}
+
+void CustomPriorityQueue::SiftUp(unsigned index)
+{
+    PointIDDistPair element = heap_[index];
+    while (index > 0)
+    {
+        unsigned parent = (index - 1)/2;
+        if (!IsCloser(heap_[parent], element)) {
+            break;
+        }
+        heap_[index] = heap_[parent];
+        index = parent;
+    }
+    heap_[index] = element;
+}
+
+void CustomPriorityQueue::SiftDown(unsigned index)
+{
+    PointIDDistPair element = heap_[index];
+    while (true)
+    {
+        unsigned child = (2 * index) + 1;
+        if (child >= size_) {
+            break;
+        }
+        // Pick the farther of the two children.
+        if (((child + 1) < size_) && IsCloser(heap_[child], heap_[child + 1])) {
+            child++;
+        }
+        if (!IsCloser(element, heap_[child])) {
+            break;
+        }
+        heap_[index] = heap_[child];
+        index = child;
+    }
+    heap_[index] = element;
 }
@@ -1,7 +1,8 @@
 #ifndef __CUSTOM_PRIORITY_QUEUE_INCLUDED__
 #define __CUSTOM_PRIORITY_QUEUE_INCLUDED__
 
-#include <queue>
+#include <limits>
+#include <vector>
 #include "multiple_points.h"
 
 typedef std::pair<uint32_t, float> PointIDDistPair;
@@ -15,16 +16,49 @@ class CompareDist
         }
 };
 
-// Class implementation right now, because we might change the data structure.
+/* Bounded max-heap that keeps the "capacity" closest <point ID, distance>
+   pairs offered to it: the root is the worst pair kept so far, so a new
+   candidate only costs one compare unless it beats the root.
+   Storage is a flat array sized once by Reset(), so a queue that is reused
+   across queries/requests (e.g one per thread) never allocates.
+   Ties on distance are broken by point ID so results are deterministic.*/
 class CustomPriorityQueue
 {
     public:
         CustomPriorityQueue() = default;
+        // Empties the queue and sets how many pairs it keeps (k).
+        void Reset(const unsigned capacity);
         // Checks & returns true if the priority queue is empty.
-        bool IsEmpty() const;
+        bool IsEmpty() const { return size_ == 0; }
         // Returns the size of the priority queue.
-        unsigned GetSize() const;
-        // Adds a pair of <Point, dist> to the priority queue.
+        unsigned GetSize() const { return size_; }
+        unsigned GetCapacity() const { return capacity_; }
+        bool IsFull() const { return size_ == capacity_; }
+        /* Offers a candidate: kept if the queue is not full yet or if it is
+           closer than the current worst pair, which then gets evicted.
+           Returns true if the candidate was kept.*/
+        bool Offer(const uint32_t point_id, const float distance)
+        {
+            if (size_ < capacity_) {
+                heap_[size_] = std::make_pair(point_id, distance);
+                SiftUp(size_);
+                size_++;
+                return true;
+            }
+            if ((capacity_ == 0) || !IsCloser(point_id, distance, heap_[0])) {
+                return false;
+            }
+            heap_[0] = std::make_pair(point_id, distance);
+            SiftDown(0);
+            return true;
+        }
+        /* Largest distance a candidate may have and still be kept:
+           infinity until the queue is full.*/
+        float GetWorstDistance() const
+        {
+            return IsFull() ? heap_[0].second : std::numeric_limits<float>::infinity();
+        }
+        // Adds a pair of <Point, dist> to the priority queue (bounded: see Offer).
         void AddToPriorityQueue(PointIDDistPair &knn_point);
         // Removes the pair <Point, dist> with the largest distance from query.
         void RemoveTopElement();
@@ -32,13 +66,27 @@ class CustomPriorityQueue
         uint32_t GetTopPointID() const;
         // Returns the largest distance from query.
         float GetTopDistance() const;
+        /* Moves the pairs out of the queue, closest first, and empties it.
+        Out: point IDs and their distances, in increasing order of distance.*/
+        void ExtractSorted(std::vector<uint32_t>* point_ids,
+                std::vector<float>* distances);
     private:
-        // Priority queue of a pair of the Point and its distance from query.
-        std::priority_queue<PointIDDistPair, 
-            std::vector<PointIDDistPair>, 
-            CompareDist> knn_priority_queue_;
+        // a is closer than b (ties broken by point ID).
+        static bool IsCloser(const uint32_t point_id,
+                const float distance,
+                const PointIDDistPair &b)
+        {
+            return (distance < b.second) || ((distance == b.second) && (point_id < b.first));
+        }
+        static bool IsCloser(const PointIDDistPair &a, const PointIDDistPair &b)
+        {
+            return IsCloser(a.first, a.second, b);
+        }
+        void SiftUp(unsigned index);
+        void SiftDown(unsigned index);
+        // Max-heap of <point ID, distance> pairs, heap_[0] is the farthest.
+        std::vector<PointIDDistPair> heap_;
+        unsigned size_ = 0;
+        unsigned capacity_ = 0;
 };
 #endif //__CUSTOM_PRIORITY_QUEUE_INCLUDED__
-
-
-
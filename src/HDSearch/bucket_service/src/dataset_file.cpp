@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dataset_file.h"
+
+void GetEvenShardRange(const uint64_t num_points,
+        const unsigned int shard_num,
+        const unsigned int num_shards,
+        uint64_t* start_index,
+        uint64_t* end_index)
+{
+    CHECK((shard_num < num_shards), "ERROR: Shard number must be smaller than the number of shards\n");
+    uint64_t shard_size = num_points/num_shards;
+    *start_index = shard_num * shard_size;
+    *end_index = (shard_num + 1) * shard_size;
+    /* If this is the last shard, get it to cover all points til the end.
+       This is to prevent points from being ignored when the data set
+       does not shard evenly.*/
+    if (shard_num == (num_shards - 1)) {
+        *end_index = num_points;
+    }
+}
+
+void WriteDatasetFileHeader(FILE* file,
+        const uint64_t num_points,
+        const uint32_t dimensions,
+        const uint32_t num_shards)
+{
+    DatasetFileHeader header;
+    memset(header.magic, 0, sizeof(header.magic));
+    memcpy(header.magic, DATASET_FILE_MAGIC, strlen(DATASET_FILE_MAGIC));
+    header.num_points = num_points;
+    header.dimensions = dimensions;
+    header.num_shards = num_shards;
+    std::vector<uint64_t> shard_table(num_shards + 1, 0);
+    for(unsigned int i = 0; i < num_shards; i++)
+    {
+        GetEvenShardRange(num_points, i, num_shards, &shard_table[i], &shard_table[i + 1]);
+    }
+    uint64_t header_size = sizeof(header) + shard_table.size() * sizeof(uint64_t);
+    header.data_offset = ((header_size + DATASET_FILE_DATA_ALIGNMENT - 1)/DATASET_FILE_DATA_ALIGNMENT) * DATASET_FILE_DATA_ALIGNMENT;
+
+    std::vector<char> padding(header.data_offset - header_size, 0);
+    CHECK((fwrite(&header, sizeof(header), 1, file) == 1), "ERROR: Could not write dataset file header\n");
+    CHECK((fwrite(shard_table.data(), sizeof(uint64_t), shard_table.size(), file) == shard_table.size()), "ERROR: Could not write dataset shard table\n");
+    CHECK((fwrite(padding.data(), 1, padding.size(), file) == padding.size()), "ERROR: Could not write dataset file header\n");
+}
+
+DatasetFile::~DatasetFile()
+{
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_size_);
+    }
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+void DatasetFile::Open(const std::string &file_name,
+        const unsigned int legacy_dimensions)
+{
+    CHECK((mapping_ == nullptr), "ERROR: Dataset file is already open\n");
+    fd_ = open(file_name.c_str(), O_RDONLY);
+    CHECK((fd_ != -1), "ERROR: Could not open dataset file\n");
+    struct stat file_stat;
+    CHECK((fstat(fd_, &file_stat) == 0), "ERROR: Could not get the size of the dataset file\n");
+    mapping_size_ = file_stat.st_size;
+    CHECK((mapping_size_ != 0), "Dataset/Queries cannot be an empty file");
+    mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    CHECK((mapping_ != MAP_FAILED), "ERROR: Could not mmap dataset file\n");
+    /* Points are read at random (queries, candidate IDs), so read-ahead
+       would only pull in pages that are never used.*/
+    madvise(mapping_, mapping_size_, MADV_RANDOM);
+
+    const char* file_start = static_cast<const char*>(mapping_);
+    DatasetFileHeader header;
+    if ((mapping_size_ >= sizeof(header))
+            && (memcmp(file_start, DATASET_FILE_MAGIC, strlen(DATASET_FILE_MAGIC) + 1) == 0)) {
+        memcpy(&header, file_start, sizeof(header));
+        CHECK((header.version == DATASET_FILE_VERSION), "ERROR: Unsupported dataset file version\n");
+        CHECK((header.dtype == FLOAT32), "ERROR: Unsupported dataset value type\n");
+        CHECK((header.dimensions != 0), "ERROR: Dataset file header has 0 dimensions\n");
+        uint64_t table_end = sizeof(header) + (header.num_shards + 1) * sizeof(uint64_t);
+        CHECK((table_end <= header.data_offset), "ERROR: Dataset shard table overlaps the points\n");
+        CHECK(((header.data_offset + header.num_points * header.dimensions * sizeof(float)) <= mapping_size_), "ERROR: Dataset file is shorter than its header says\n");
+        legacy_ = false;
+        num_points_ = header.num_points;
+        dimensions_ = header.dimensions;
+        data_offset_ = header.data_offset;
+        shard_table_.resize(header.num_shards + 1);
+        memcpy(shard_table_.data(), file_start + sizeof(header), shard_table_.size() * sizeof(uint64_t));
+    } else {
+        CHECK((legacy_dimensions != 0), "ERROR: Number of dataset dimensions cannot be 0\n");
+        std::cout << "Legacy dataset file: assuming " << legacy_dimensions << " dimensions\n";
+        legacy_ = true;
+        dimensions_ = legacy_dimensions;
+        num_points_ = (mapping_size_/sizeof(float))/dimensions_;
+        data_offset_ = 0;
+    }
+    data_ = reinterpret_cast<const float*>(file_start + data_offset_);
+}
+
+void DatasetFile::GetShardRange(const unsigned int bucket_server_num,
+        const unsigned int num_bucket_servers,
+        uint64_t* start_index,
+        uint64_t* end_index) const
+{
+    if (shard_table_.size() == (num_bucket_servers + 1)) {
+        CHECK((bucket_server_num < num_bucket_servers), "ERROR: Shard number must be smaller than the number of shards\n");
+        *start_index = shard_table_[bucket_server_num];
+        *end_index = shard_table_[bucket_server_num + 1];
+        CHECK(((*start_index <= *end_index) && (*end_index <= num_points_)), "ERROR: Dataset shard table is corrupt\n");
+    } else {
+        GetEvenShardRange(num_points_, bucket_server_num, num_bucket_servers, start_index, end_index);
+    }
+}
+
+void DatasetFile::AdviseRange(const uint64_t start_index,
+        const uint64_t end_index,
+        const int advice) const
+{
+    CHECK(((start_index <= end_index) && (end_index <= num_points_)), "ERROR: Dataset range is out of bounds\n");
+    // madvise() wants a page aligned start.
+    uintptr_t range_start = (uintptr_t)(data_ + start_index * dimensions_);
+    uintptr_t range_end = (uintptr_t)(data_ + end_index * dimensions_);
+    uintptr_t page_start = range_start - (range_start % sysconf(_SC_PAGESIZE));
+    if (range_end > page_start) {
+        madvise(reinterpret_cast<void*>(page_start), range_end - page_start, advice);
+    }
+}
+
+void DatasetFile::MaterializeRange(const uint64_t start_index,
+        const uint64_t end_index,
+        const bool populate,
+        MultiplePoints* dataset) const
+{
+    CHECK(((start_index <= end_index) && (end_index <= num_points_)), "ERROR: Dataset range is out of bounds\n");
+    uint64_t num_points = end_index - start_index;
+    size_t row_bytes = dimensions_ * sizeof(float);
+    dataset->Resize(num_points, dimensions_);
+    if (num_points == 0) {
+        return;
+    }
+
+    const char* range = reinterpret_cast<const char*>(data_ + start_index * dimensions_);
+    void* populated_mapping = nullptr;
+    size_t populated_size = 0;
+    if (populate) {
+        // mmap offsets must be page aligned.
+        uint64_t range_offset = data_offset_ + start_index * row_bytes;
+        uint64_t page_offset = range_offset - (range_offset % sysconf(_SC_PAGESIZE));
+        populated_size = (range_offset - page_offset) + num_points * row_bytes;
+        populated_mapping = mmap(nullptr, populated_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd_, page_offset);
+        if (populated_mapping == MAP_FAILED) {
+            std::cout << "Could not populate the dataset shard, reading it lazily\n";
+            populated_mapping = nullptr;
+        } else {
+            range = static_cast<const char*>(populated_mapping) + (range_offset - page_offset);
+        }
+    } else {
+        AdviseRange(start_index, end_index, MADV_SEQUENTIAL);
+    }
+
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < (long)num_points; i++)
+    {
+        memcpy(dataset->GetMutableRowAtIndex(i), range + i * row_bytes, row_bytes);
+    }
+
+    if (populated_mapping != nullptr) {
+        munmap(populated_mapping, populated_size);
+    }
+}
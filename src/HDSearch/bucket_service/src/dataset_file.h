@@ -0,0 +1,106 @@
+#ifndef __DATASET_FILE_H_INCLUDED__
+#define __DATASET_FILE_H_INCLUDED__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "multiple_points.h"
+
+/* On-disk layout of a versioned HDSearch dataset file:
+   [DatasetFileHeader][num_shards + 1 uint64 shard boundaries][padding]
+   [num_points * dimensions values, row-major, starting at data_offset].
+   data_offset is page aligned so that any shard can be mmap'ed directly.
+   Files that do not start with DATASET_FILE_MAGIC are treated as the
+   legacy format: raw float32 values and nothing else.*/
+#define DATASET_FILE_MAGIC "HDSDATA"
+#define DATASET_FILE_VERSION 1
+#define DATASET_FILE_DATA_ALIGNMENT 4096
+
+// Type of each value stored in the file.
+enum DatasetDType { FLOAT32 = 0 };
+
+struct DatasetFileHeader {
+    char magic[8];
+    uint32_t version = DATASET_FILE_VERSION;
+    uint32_t dtype = FLOAT32;
+    uint64_t num_points = 0;
+    uint32_t dimensions = 0;
+    uint32_t num_shards = 0;
+    uint64_t data_offset = 0;
+};
+
+/* Splits num_points between num_shards shards the same way the mid-tier
+   assigns point IDs to bucket servers: equal shards, and the last shard
+   takes the left over points.
+In: number of points, shard number, number of shards.
+Out: first point ID of the shard, one past the last point ID of the shard.*/
+void GetEvenShardRange(const uint64_t num_points,
+        const unsigned int shard_num,
+        const unsigned int num_shards,
+        uint64_t* start_index,
+        uint64_t* end_index);
+
+/* Writes a header and an evenly split shard table for num_shards shards,
+   followed by zero padding up to the data offset. The caller then writes
+   the points themselves.*/
+void WriteDatasetFileHeader(FILE* file,
+        const uint64_t num_points,
+        const uint32_t dimensions,
+        const uint32_t num_shards);
+
+/* Read-only memory mapping of a dataset file. The whole file gets mapped
+   lazily, so any point (e.g a query that lives in another shard) can be
+   read without loading the corpus. Only the pages that are touched are
+   brought into memory.*/
+class DatasetFile
+{
+    public:
+        DatasetFile() = default;
+        DatasetFile(const DatasetFile&) = delete;
+        DatasetFile& operator=(const DatasetFile&) = delete;
+        ~DatasetFile();
+        /* Map a dataset file. Legacy (headerless) files are assumed to
+           hold float32 points of legacy_dimensions each.*/
+        void Open(const std::string &file_name,
+                const unsigned int legacy_dimensions);
+        bool IsOpen() const { return mapping_ != nullptr; }
+        bool IsLegacy() const { return legacy_; }
+        // Total number of points in the file.
+        uint64_t GetSize() const { return num_points_; }
+        unsigned int GetPointDimension() const { return dimensions_; }
+        /* Point ID range owned by a bucket server: taken from the file's
+           shard table when it was written for num_bucket_servers shards,
+           otherwise the even split.*/
+        void GetShardRange(const unsigned int bucket_server_num,
+                const unsigned int num_bucket_servers,
+                uint64_t* start_index,
+                uint64_t* end_index) const;
+        // View of any point in the file, straight from the mapping.
+        PointView GetPointViewAtIndex(const uint64_t index) const
+        {
+            return PointView(data_ + index * dimensions_, dimensions_);
+        }
+        // madvise() the pages that hold points [start_index, end_index).
+        void AdviseRange(const uint64_t start_index,
+                const uint64_t end_index,
+                const int advice) const;
+        /* Copy points [start_index, end_index) into dataset (local IDs
+           start at 0). With populate, the range is mapped separately with
+           MAP_POPULATE so that it is faulted in with one call.*/
+        void MaterializeRange(const uint64_t start_index,
+                const uint64_t end_index,
+                const bool populate,
+                MultiplePoints* dataset) const;
+    private:
+        int fd_ = -1;
+        void* mapping_ = nullptr;
+        size_t mapping_size_ = 0;
+        const float* data_ = nullptr;
+        uint64_t data_offset_ = 0;
+        uint64_t num_points_ = 0;
+        unsigned int dimensions_ = 0;
+        bool legacy_ = false;
+        // Shard boundaries from the header (num_shards + 1 entries).
+        std::vector<uint64_t> shard_table_;
+};
+#endif //__DATASET_FILE_H_INCLUDED__
@@ -1,414 +1,433 @@
+#include <algorithm>
 #include <cmath>
 //#include <limits>
 #include <omp.h>
 
 #include "dist_calc.h"
-#include "immintrin.h"
+#include "distance_kernels.h"
 #include "utils.h"
 
-#ifndef SIMD
-#include "mkl_cblas.h"
-#endif
-
-// To use MKL, you can run these commands from a terminal.
-// This is where the paths are on caen, they will obviously be different if you're
-// on a different machine.
-//
-// export LD_LIBRARY_PATH=/usr/caen/intel-2017/mkl/lib/intel64:$LD_LIBRARY_PATH
-// export LD_LIBRARY_PATH=/opt/caen/matlab-2016a/sys/os/glnxa64:$LD_LIBRARY_PATH
-//
-// Also, for some reason the first time you run a program with mkl it is very slow
-// but all future runs are fast.
-//
-// Also, compiler flags:
-//      icc -O3 --std=c++11 -mavx -mavx2 -pthread -fopenmp -mkl knn_test.cpp src/*.cpp service/timing.cc -o knn_test
-
 /* All assertions on the critical path have been commented out. Remove comments
    if you only care about accuracy of result.*/
 
-struct QueriesShardThreadArgs {
-    int tid;
-    MultiplePoints dataset;
-    MultiplePoints queries;
-    std::vector<std::vector<uint32_t>> point_ids_vec;
-    /* This parameter is needed to refer to the private member variable
-       knn_all_queries_ of the DistCalc class.*/
-    DistCalc* knn_all_queries;
-    unsigned number_of_nearest_neighbors;
-    unsigned int num_procs;
-};
-
-struct DatasetShardThreadArgs {
-    int tid;
-    MultiplePoints dataset;
-    Point query_point;
-    std::vector<uint32_t> point_id_vec;
-    unsigned int num_procs;
-    std::vector<PointIDDistPair>* point_id_dist_pair_vec;
-    DistCalc* this_obj;
-};
-
 void DistCalc::DistanceCalculation(const MultiplePoints &dataset, 
         const MultiplePoints &queries, 
         const std::vector<std::vector<uint32_t>> &point_ids_vec, 
-        const unsigned number_of_nearest_neighbors,
-        int num_cores)
+        const unsigned number_of_nearest_neighbors)
 {
-    // A.S quick code start
-    PointIDs point_ids_result_per_query(1, 0);
-    knn_all_queries_.assign(1,
-            point_ids_result_per_query);
-    GetNN(dataset, queries.GetPointAtIndex(0), point_ids_vec[0], num_cores);
-    // A.S quick code end
-#if 0
-    /* Initialize a data structure to hold knn for each query 
-       and another data structure to hold knn for all queries.*/
-    int num_points = std::min<int>(number_of_nearest_neighbors, dataset.GetSize());
     unsigned queries_size = queries.GetSize();
-    PointIDs point_ids_result_per_query(num_points, 0);
-    knn_all_queries_.assign(queries_size,
-            point_ids_result_per_query);
-    /* Get the number of concurrent threads that can be supported on the system,
-       so that so many threads can be launched for parallel distance 
-       computations.*/
-    unsigned int num_procs = GetNumProcs();
-    /* Restrict distance computations to this same thread if there aren't 
-       sufficient number of queries. (helps while streaming instead of
-       batching queries).*/
-    // if (queries_size <= num_procs) {
-    CustomPriorityQueue knn_priority_queue;
-
-    // Writing some quick code for 1 query and 1 NN
-    if ((number_of_nearest_neighbors == 1) && (queries_size == 1)) {
-        GetNN(dataset, queries.GetPointAtIndex(0), point_ids_vec[0], num_cores);
+    // Every query writes its answer into its own preallocated slot.
+    knn_all_queries_.resize(queries_size);
+    knn_all_distances_.resize(queries_size);
+    dimensions_evaluated_.assign(queries_size, 0);
+    if ((queries_size > 1)
+            && !early_abandon_
+            && (quantized_dataset_ == nullptr)
+            && (pq_dataset_ == nullptr)
+            && BatchedDistanceCalculation(dataset,
+                queries,
+                point_ids_vec,
+                number_of_nearest_neighbors)) {
+        return;
+    }
+    /* Large batches spread their queries over the cores that are idle. One
+       task per query, so idle threads steal queries one at a time and a
+       query with a long candidate list does not hold up a fixed range.*/
+    unsigned num_helpers = 0;
+    if ((queries_size > 1) && (task_pool_ != nullptr) && (parallel_min_candidates_ != 0)) {
+        size_t num_point_ids = 0;
+        for(size_t q = 0; q < point_ids_vec.size(); q++)
+        {
+            num_point_ids += point_ids_vec[q].size();
+        }
+        if (num_point_ids >= parallel_min_candidates_) {
+            num_helpers = std::min(std::min(task_pool_->GetIdleCores(), task_pool_->GetNumWorkers()), queries_size - 1);
+        }
+    }
+    if (num_helpers != 0) {
+        task_pool_->Run(queries_size, num_helpers, [&](unsigned q) {
+                CalculateQueryKnn(dataset, queries, point_ids_vec, number_of_nearest_neighbors, q);
+            });
     } else {
-
-        // Following code holds good for multiple queries, and multiple NNs.
-        // Iterate through all queries.
-        for(int q = 0; q < queries_size; q++)
+        for(unsigned q = 0; q < queries_size; q++)
         {
-            CalculateShardedKnn(dataset,
-                    queries.GetPointAtIndex(q), 
-                    point_ids_vec.at(q), 
-                    number_of_nearest_neighbors,
-                    &knn_priority_queue);
-            /* Convert priority queue into a vector of points &
-               Clear priority queue. */
-            int idx = 0;
-            while(!knn_priority_queue.IsEmpty())
-            {
-                point_ids_result_per_query[idx] = knn_priority_queue.GetTopPointID();
-                idx++;
-                knn_priority_queue.RemoveTopElement();
-            }
-            // The priority queue must now be empty.
-            //assert(knn_priority_queue.GetSize() == 0);
-            // Push the answer vector into the final result vector.
-            knn_all_queries_[q] = point_ids_result_per_query;
+            CalculateQueryKnn(dataset, queries, point_ids_vec, number_of_nearest_neighbors, q);
         }
     }
-        /* Otherwise queries are in a batch and distance computations
-           must therefore be sharded across threads.*/
-        // } else {
-        //     CreateThreadsShardingQueries(&dataset, 
-        //             &queries, 
-        //             number_of_nearest_neighbors,
-        //             num_procs,
-        //             point_ids_vec);
-        // }
-        // Invariant: size of resultant vector must be size of query vector.
-        //assert(knn_all_queries_.size() == queries_size);
-#endif
+    // Invariant: size of resultant vector must be size of query vector.
+    //assert(knn_all_queries_.size() == queries_size);
 }
 
-void DistCalc::GetNN(const MultiplePoints &dataset,
-        const Point &query_point,
-        const std::vector<uint32_t> &point_id_vec,
-        const int num_cores)
+void DistCalc::CalculateQueryKnn(const MultiplePoints &dataset,
+        const MultiplePoints &queries,
+        const std::vector<std::vector<uint32_t>> &point_ids_vec,
+        const unsigned number_of_nearest_neighbors,
+        const unsigned query_index)
 {
-    int num_ids = point_id_vec.size();
-    if (num_ids == 0) {
-        PointIDs point_ids_result_per_query(1, 0);
-        point_ids_result_per_query[0] = 0;
-        knn_all_queries_[0] = point_ids_result_per_query;
-        return;
-    }
-    /* Quick ret for the common case of one buckt srv and one NN.*/
-    if ( (dataset.GetSize() == 1) && (num_ids == 1) ) {
-        PointIDs point_ids_result_per_query(1, 0);
-        point_ids_result_per_query[0] = point_id_vec[0];
-        knn_all_queries_[0] = point_ids_result_per_query;
-        return;
+    /* Bounded heap reused by every query this thread ever handles,
+       so the k-NN search does not allocate per request.*/
+    static thread_local CustomPriorityQueue knn_priority_queue;
+    knn_priority_queue.Reset(number_of_nearest_neighbors);
+    /* A query without a candidate list (or with an empty one)
+       gets an empty answer.*/
+    if (query_index < point_ids_vec.size()) {
+        const std::vector<uint32_t> &point_id_vec = point_ids_vec[query_index];
+        // Large candidate lists are split across the cores that are idle.
+        unsigned num_helpers = 0;
+        if ((task_pool_ != nullptr)
+                && (parallel_min_candidates_ != 0)
+                && (point_id_vec.size() >= parallel_min_candidates_)) {
+            num_helpers = std::min(task_pool_->GetIdleCores(), task_pool_->GetNumWorkers());
+        }
+        if (pq_dataset_ != nullptr) {
+            CalculatePqKnn(queries.GetPointViewAtIndex(query_index),
+                    point_id_vec,
+                    number_of_nearest_neighbors,
+                    &knn_priority_queue);
+        } else if (quantized_dataset_ != nullptr) {
+            CalculateQuantizedKnn(queries.GetPointViewAtIndex(query_index),
+                    point_id_vec,
+                    number_of_nearest_neighbors,
+                    &knn_priority_queue);
+        } else if (num_helpers != 0) {
+            dimensions_evaluated_[query_index] = ParallelCalculateKnn(dataset,
+                    queries.GetPointViewAtIndex(query_index),
+                    point_id_vec,
+                    number_of_nearest_neighbors,
+                    num_helpers,
+                    &knn_priority_queue);
+        } else {
+            dimensions_evaluated_[query_index] = CalculateKnn(dataset,
+                    queries.GetPointViewAtIndex(query_index),
+                    point_id_vec,
+                    &knn_priority_queue);
+        }
     }
+    // Closest first.
+    knn_priority_queue.ExtractSorted(&knn_all_queries_[query_index],
+            &knn_all_distances_[query_index]);
+}
 
-    std::vector<float> min_dists(num_ids, 0.0);
-    for(int i = 0; i < num_ids; i++)
+uint64_t DistCalc::GetDimensionsEvaluated() const
+{
+    uint64_t dimensions_evaluated = 0;
+    for(size_t q = 0; q < dimensions_evaluated_.size(); q++)
     {
-        min_dists[i] = EuclideanDistance(query_point, dataset.GetPointAtIndex(point_id_vec[i]));
+        dimensions_evaluated += dimensions_evaluated_[q];
     }
+    return dimensions_evaluated;
+}
 
+void DistCalc::UseTaskPool(TaskPool* task_pool, const unsigned min_candidates)
+{
+    task_pool_ = task_pool;
+    parallel_min_candidates_ = min_candidates;
+}
 
-#if 0
-    int paralellization = std::min(num_ids, num_cores);
-    int tid = -1;
-    int stride = num_ids/paralellization;
-    std::vector<float> min_dists(num_ids, 0.0);
-#pragma omp parallel num_threads(paralellization) private(paralellization, tid)
-    {
-        tid = omp_get_thread_num();
-        int start_index = tid * stride;
-        int end_index = (tid + 1) * stride;
-        if (tid == (paralellization - 1)) {
-            end_index = point_id_vec.size();
-        }
-        float euc_dist = 0.0;
+void DistCalc::UseQuantizedDataset(const QuantizedPoints* quantized_dataset,
+        const unsigned rerank_factor)
+{
+    quantized_dataset_ = quantized_dataset;
+    rerank_factor_ = rerank_factor;
+}
 
-#pragma omp parallel for
-        for(int i = start_index; i < end_index; i++)
+void DistCalc::CalculateQuantizedKnn(const PointView &query_point,
+        const std::vector<uint32_t> &point_id_vec,
+        const unsigned number_of_nearest_neighbors,
+        CustomPriorityQueue* knn_priority_queue)
+{
+    static thread_local QuantizedQuery prepared_query;
+    static thread_local CustomPriorityQueue approximate_priority_queue;
+    static thread_local PointIDs rerank_point_ids;
+    static thread_local std::vector<float> rerank_distances;
+
+    quantized_dataset_->PrepareQuery(query_point, &prepared_query);
+    if (rerank_factor_ == 0) {
+        for(uint32_t point_id : point_id_vec)
         {
-            euc_dist = EuclideanDistance(query_point, dataset.GetPointAtIndex(point_id_vec[i]));
-            min_dists[i] = euc_dist;
+            knn_priority_queue->Offer(point_id,
+                    quantized_dataset_->ApproximateSquaredDistance(prepared_query, point_id));
         }
+        return;
+    }
+    approximate_priority_queue.Reset(number_of_nearest_neighbors * rerank_factor_);
+    for(uint32_t point_id : point_id_vec)
+    {
+        approximate_priority_queue.Offer(point_id,
+                quantized_dataset_->ApproximateSquaredDistance(prepared_query, point_id));
+    }
+    // Only the shortlist touches the (possibly cold) fp32 rows.
+    approximate_priority_queue.ExtractSorted(&rerank_point_ids, &rerank_distances);
+    for(uint32_t point_id : rerank_point_ids)
+    {
+        knn_priority_queue->Offer(point_id,
+                SquaredEuclideanDistance(query_point,
+                    quantized_dataset_->GetFullPrecisionPointAtIndex(point_id)));
     }
-#endif
-
-    int min_index = distance(min_dists.begin(), min_element(min_dists.begin(),min_dists.end()));
-
-    PointIDs point_ids_result_per_query(1, 0);
-    // The answer is the point id at the location of the min
-    point_ids_result_per_query[0] = point_id_vec[min_index];
-    knn_all_queries_[0] = point_ids_result_per_query;
-
 }
 
+void DistCalc::UsePqDataset(const ProductQuantizer* pq_dataset,
+        const PqSearchMode mode,
+        const unsigned rerank_factor)
+{
+    pq_dataset_ = pq_dataset;
+    pq_mode_ = mode;
+    pq_rerank_factor_ = rerank_factor;
+}
 
-void DistCalc::CreateThreadsShardingQueries(const MultiplePoints* dataset, 
-        const MultiplePoints* queries,
-        const unsigned int number_of_nearest_neighbors, 
-        const unsigned int num_procs,
-        const std::vector<std::vector<uint32_t>> &point_ids_vec)
+void DistCalc::CalculatePqKnn(const PointView &query_point,
+        const std::vector<uint32_t> &point_id_vec,
+        const unsigned number_of_nearest_neighbors,
+        CustomPriorityQueue* knn_priority_queue)
 {
-    pthread_t threads[num_procs];
-    struct QueriesShardThreadArgs* thread_args = new struct QueriesShardThreadArgs[num_procs];
-    // Launch num_procs number of threads.
-    for(int i = 0; i < num_procs; i++)
+    static thread_local PqQuery prepared_query;
+    static thread_local std::vector<float> approximate_distances;
+    static thread_local CustomPriorityQueue approximate_priority_queue;
+    static thread_local PointIDs rerank_point_ids;
+    static thread_local std::vector<float> rerank_distances;
+
+    if (pq_mode_ == PQ_EXACT) {
+        for(uint32_t point_id : point_id_vec)
+        {
+            knn_priority_queue->Offer(point_id,
+                    SquaredEuclideanDistance(query_point,
+                        pq_dataset_->GetFullPrecisionPointAtIndex(point_id)));
+        }
+        return;
+    }
+    pq_dataset_->PrepareQuery(query_point, &prepared_query);
+    // The lookup kernel scores candidates in blocks, so do the whole list at once.
+    approximate_distances.resize(point_id_vec.size());
+    pq_dataset_->ApproximateSquaredDistances(prepared_query,
+            point_id_vec.data(),
+            point_id_vec.size(),
+            approximate_distances.data());
+    if ((pq_mode_ == PQ_APPROXIMATE) || (pq_rerank_factor_ == 0)) {
+        for(size_t i = 0; i < point_id_vec.size(); i++)
+        {
+            knn_priority_queue->Offer(point_id_vec[i], approximate_distances[i]);
+        }
+        return;
+    }
+    approximate_priority_queue.Reset(number_of_nearest_neighbors * pq_rerank_factor_);
+    for(size_t i = 0; i < point_id_vec.size(); i++)
     {
-        thread_args[i].tid = i;
-        thread_args[i].dataset = *dataset;
-        thread_args[i].queries = *queries;
-        thread_args[i].number_of_nearest_neighbors = number_of_nearest_neighbors;
-        thread_args[i].num_procs = num_procs;
-        thread_args[i].point_ids_vec = point_ids_vec;
-        /* K-NN answers for each query is filled up to the corresponding
-           location of knn_all_queries_ by each worker thread. Hence, we need
-           a pointer to the DistCalc object.*/
-        thread_args[i].knn_all_queries = this;
-        CHECK(!(pthread_create(&threads[i],
-                        NULL,
-                        &QueriesShardedDistanceCalculation,
-                        (void*) &(thread_args[i]))),
-                "ERROR: Unable to create thread to distance calculations in order to compute K-NN\n");
+        approximate_priority_queue.Offer(point_id_vec[i], approximate_distances[i]);
     }
-    //This allows all threads to spawn before waiting for them to finish
-    for(int i = 0; i < num_procs; i++){
-        CHECK(!(pthread_join(threads[i],
-                        NULL)),
-                "ERROR: pthread_join failed while waiting for threads that launched ShardedDistanceComputation to complete\n");
+    approximate_priority_queue.ExtractSorted(&rerank_point_ids, &rerank_distances);
+    for(uint32_t point_id : rerank_point_ids)
+    {
+        knn_priority_queue->Offer(point_id,
+                SquaredEuclideanDistance(query_point,
+                    pq_dataset_->GetFullPrecisionPointAtIndex(point_id)));
     }
 }
 
-void* QueriesShardedDistanceCalculation(void* parameter)
+uint64_t DistCalc::ParallelCalculateKnn(const MultiplePoints &dataset,
+        const PointView &query_point,
+        const std::vector<uint32_t> &point_id_vec,
+        const unsigned number_of_nearest_neighbors,
+        const unsigned num_helpers,
+        CustomPriorityQueue* knn_priority_queue)
 {
-    struct QueriesShardThreadArgs* thread_args = (QueriesShardThreadArgs*) parameter;
-    PointIDs point_ids_result_per_query;
-    unsigned queries_size = thread_args->queries.GetSize();
-    // Create a priority queue.
-    CustomPriorityQueue knn_priority_queue;
-    int offset = (queries_size/thread_args->num_procs);
-    int begin = thread_args->tid * offset;
-    int end;
-    /* It's possible for the queries to not be completely divisible by the 
-       number of processors. In this case, have the last thread take care of 
-       the left-over queries.*/  
-    if(thread_args->tid == thread_args->num_procs - 1) {
-        end = queries_size - 1;
-    } else {
-        end = ((thread_args->tid + 1) * offset) - 1;
+    // Per-task heaps & merge scratch, reused by every query of this thread.
+    static thread_local std::vector<CustomPriorityQueue> task_priority_queues;
+    static thread_local PointIDs task_point_ids;
+    static thread_local std::vector<float> task_distances;
+    static thread_local std::vector<uint64_t> task_dimensions_evaluated;
+
+    size_t num_point_ids = point_id_vec.size();
+    unsigned num_tasks = std::min((size_t)((num_helpers + 1) * INTRA_QUERY_TASKS_PER_THREAD), num_point_ids);
+    if (task_priority_queues.size() < num_tasks) {
+        task_priority_queues.resize(num_tasks);
     }
-    for(int q = begin; q <= end; q++)
+    if (task_dimensions_evaluated.size() < num_tasks) {
+        task_dimensions_evaluated.resize(num_tasks);
+    }
+    CustomPriorityQueue* task_queues = task_priority_queues.data();
+    uint64_t* task_dimensions = task_dimensions_evaluated.data();
+    task_pool_->Run(num_tasks, num_helpers, [&](unsigned task) {
+            size_t begin = (num_point_ids * task)/num_tasks;
+            size_t end = (num_point_ids * (task + 1))/num_tasks;
+            task_queues[task].Reset(number_of_nearest_neighbors);
+            task_dimensions[task] = ScanCandidates(dataset,
+                    query_point,
+                    point_id_vec.data() + begin,
+                    end - begin,
+                    &task_queues[task]);
+        });
+
+    // Merge: the global top-k is the top-k of the per-task top-k's.
+    uint64_t dimensions_evaluated = 0;
+    for(unsigned task = 0; task < num_tasks; task++)
     {
-        thread_args->knn_all_queries->CalculateKnn(thread_args->dataset, 
-                thread_args->queries.GetPointAtIndex(q), 
-                thread_args->point_ids_vec.at(q), 
-                thread_args->number_of_nearest_neighbors,
-                &knn_priority_queue);
-        /* Convert priority queue into a vector of points &
-           Clear priority queue. */
-        while(!knn_priority_queue.IsEmpty())
+        dimensions_evaluated += task_dimensions[task];
+        task_queues[task].ExtractSorted(&task_point_ids, &task_distances);
+        for(size_t i = 0; i < task_point_ids.size(); i++)
         {
-            point_ids_result_per_query.push_back(knn_priority_queue.GetTopPointID());
-            knn_priority_queue.RemoveTopElement();
+            if (!knn_priority_queue->Offer(task_point_ids[i], task_distances[i])) {
+                // Sorted closest first: the rest of this task cannot be kept either.
+                break;
+            }
         }
-        // The priority queue must now be empty.
-        //assert(knn_priority_queue.GetSize() == 0);
-
-        /* Push the answer vector into the 
-           final result vector (to which we have a pointer).*/
-        thread_args->knn_all_queries->AddKnnAnswer(point_ids_result_per_query, q);
-        point_ids_result_per_query.clear();
     }
+    return dimensions_evaluated;
 }
 
-void DistCalc::CalculateKnn(const MultiplePoints &dataset, 
-        const Point &query_point, 
-        const std::vector<uint32_t> &point_id_vec, 
-        const unsigned number_of_nearest_neighbors,
-        CustomPriorityQueue* knn_priority_queue)
+bool DistCalc::BatchedDistanceCalculation(const MultiplePoints &dataset,
+        const MultiplePoints &queries,
+        const std::vector<std::vector<uint32_t>> &point_ids_vec,
+        const unsigned number_of_nearest_neighbors)
 {
-    float distance = 0.0;
-    PointIDDistPair point_id_dist_pair;
-    Point dataset_point;
-    int num_point_ids = point_id_vec.size();
-    // Iterate through the set of point IDs.
-    for(int d = 0; d < num_point_ids; d++)
+    // Scratch space reused across requests handled by this thread.
+    static thread_local CustomPriorityQueue knn_priority_queue;
+    static thread_local std::vector<uint32_t> candidate_union;
+    static thread_local CandidatePreprocessor candidate_preprocessor;
+    static thread_local std::vector<const float*> query_rows, candidate_rows;
+    static thread_local std::vector<float> query_norms, candidate_norms, tile;
+
+    unsigned queries_size = queries.GetSize();
+    unsigned num_lists = std::min((size_t)queries_size, point_ids_vec.size());
+    if ((num_lists < 2) || (dataset.GetSize() == 0)
+            || (queries.GetPointDimension() != dataset.GetPointDimension())) {
+        return false;
+    }
+    size_t num_pairs = 0;
+    candidate_union.clear();
+    for(unsigned q = 0; q < num_lists; q++)
     {
-        dataset_point = dataset.GetPointAtIndex(point_id_vec[d]);
-        // Calculate distance between dataset point at point ID (candidate) and the query point.
-        distance = EuclideanDistance(query_point, dataset_point);
-        // Make a pair of the dataset point and its corresponding distance.
-        point_id_dist_pair = std::make_pair(point_id_vec[d], distance);
-        // Check if there's an empty spot in the priority queue.
-        if (knn_priority_queue->GetSize() < number_of_nearest_neighbors) {
-            // Populate the priority queue.
-            knn_priority_queue->AddToPriorityQueue(point_id_dist_pair);
-        } else {
-            // Compare current distance with the largest distance in the queue.
-            if (knn_priority_queue->GetTopDistance() > distance) {
-                // Insert this distance in the queue and remove previous value.
-                knn_priority_queue->RemoveTopElement();
-                knn_priority_queue->AddToPriorityQueue(point_id_dist_pair);
+        num_pairs += point_ids_vec[q].size();
+        candidate_union.insert(candidate_union.end(), point_ids_vec[q].begin(), point_ids_vec[q].end());
+    }
+    candidate_preprocessor.Preprocess(dataset.GetSize(), &candidate_union);
+    size_t union_size = candidate_union.size();
+    size_t tile_size = (size_t)num_lists * union_size;
+    if ((num_pairs == 0)
+            || (tile_size > (BATCHED_DISTANCE_MAX_WORK_RATIO * num_pairs))
+            || (tile_size > BATCHED_DISTANCE_MAX_TILE_SIZE)) {
+        return false;
+    }
+
+    /* Rows are zero padded up to the stride, so the tile and the norms can
+       run over the whole stride with aligned loads and no tails.*/
+    unsigned stride = dataset.GetStride();
+    query_rows.resize(num_lists);
+    query_norms.resize(num_lists);
+    for(unsigned q = 0; q < num_lists; q++)
+    {
+        query_rows[q] = queries.GetRowAtIndex(q);
+        query_norms[q] = InnerProduct(query_rows[q], query_rows[q], stride);
+    }
+    candidate_rows.resize(union_size);
+    candidate_norms.resize(union_size);
+    for(size_t c = 0; c < union_size; c++)
+    {
+        candidate_rows[c] = dataset.GetRowAtIndex(candidate_union[c]);
+        candidate_norms[c] = dataset.HasSquaredNorms()
+            ? dataset.GetSquaredNormAtIndex(candidate_union[c])
+            : InnerProduct(candidate_rows[c], candidate_rows[c], stride);
+    }
+    tile.resize(tile_size);
+    GetDistanceKernels().inner_product_tile(query_rows.data(),
+            num_lists,
+            candidate_rows.data(),
+            union_size,
+            stride,
+            tile.data());
+
+    // Per-query top-k, over the query's own candidates only.
+    for(unsigned q = 0; q < queries_size; q++)
+    {
+        knn_priority_queue.Reset(number_of_nearest_neighbors);
+        if (q < num_lists) {
+            // The tile computed every pair of this query's row in full.
+            dimensions_evaluated_[q] = (uint64_t)union_size * dataset.GetPointDimension();
+            const float* inner_products = tile.data() + (size_t)q * union_size;
+            for(uint32_t point_id : point_ids_vec[q])
+            {
+                size_t c = std::lower_bound(candidate_union.begin(), candidate_union.end(), point_id) - candidate_union.begin();
+                // Rounding can take the distance of (near) duplicates below 0.
+                float distance = std::max(0.0f, query_norms[q] + candidate_norms[c] - (2 * inner_products[c]));
+                knn_priority_queue.Offer(point_id, distance);
             }
         }
-        // Invariant: Once populated, the size of priority queue <= K.
-        //assert(knn_priority_queue->GetSize() <= number_of_nearest_neighbors);
+        knn_priority_queue.ExtractSorted(&knn_all_queries_[q],
+                &knn_all_distances_[q]);
     }
+    return true;
 }
 
-void DistCalc::CalculateShardedKnn(const MultiplePoints &dataset, 
-        const Point &query_point, 
+uint64_t DistCalc::CalculateKnn(const MultiplePoints &dataset, 
+        const PointView &query_point, 
         const std::vector<uint32_t> &point_id_vec, 
-        const unsigned number_of_nearest_neighbors,
         CustomPriorityQueue* knn_priority_queue)
 {
-    unsigned int num_point_id = point_id_vec.size();
-    float distance = 0.0;
-    Point dataset_point = Point();
-    PointIDDistPair point_id_dist_pair = std::make_pair(1, distance);
-    std::vector<PointIDDistPair> point_id_dist_pair_vec(num_point_id, 
-            point_id_dist_pair);
-    int num_procs = GetNumProcs();
-    CHECK((num_procs > 0), "ERROR: Number of available processors cannot be 0\n");
-    /*Because this function gets called only when queries are streamed,
-      it is good to parallelize by sharding distance calculations.*/
-#pragma omp parallel num_threads(num_procs - 1)
-    {
-#pragma omp for private(distance) private(dataset_point)
-        for(int p = 0; p < num_point_id; p++)
-        {
-            dataset_point = dataset.GetPointAtIndex(point_id_vec[p]);
-            float distance = EuclideanDistance(query_point, dataset_point);
-            point_id_dist_pair_vec[p] = std::make_pair(point_id_vec[p], distance);
-        }
-    }
+    return ScanCandidates(dataset,
+            query_point,
+            point_id_vec.data(),
+            point_id_vec.size(),
+            knn_priority_queue);
+}
 
-    for(int i = 0; i < num_point_id; i++)
+uint64_t DistCalc::ScanCandidates(const MultiplePoints &dataset,
+        const PointView &query_point,
+        const uint32_t* point_ids,
+        const size_t num_point_ids,
+        CustomPriorityQueue* knn_priority_queue) const
+{
+    uint64_t dimensions_evaluated = 0;
+    const BoundedSquaredL2Kernel bounded_squared_l2 = GetDistanceKernels().bounded_squared_l2;
+    // Iterate through the set of point IDs.
+    for(size_t d = 0; d < num_point_ids; d++)
     {
-        point_id_dist_pair = point_id_dist_pair_vec[i];
-        distance = std::get<1>(point_id_dist_pair);
-        // Check if there's an empty spot in the priority queue.
-        if (knn_priority_queue->GetSize() < number_of_nearest_neighbors) {
-            // Populate the priority queue.
-            knn_priority_queue->AddToPriorityQueue(point_id_dist_pair);
+        if ((d + CANDIDATE_PREFETCH_DISTANCE) < num_point_ids) {
+            dataset.PrefetchPointAtIndex(point_ids[d + CANDIDATE_PREFETCH_DISTANCE]);
+        }
+        // Calculate distance between dataset point at point ID (candidate) and the query point.
+        PointView dataset_point = dataset.GetPointViewAtIndex(point_ids[d]);
+        float distance = 0.0;
+        if (early_abandon_) {
+            unsigned dimensions = 0;
+            distance = bounded_squared_l2(query_point.GetData(),
+                    dataset_point.GetData(),
+                    dataset_point.GetSize(),
+                    knn_priority_queue->GetWorstDistance(),
+                    &dimensions);
+            dimensions_evaluated += dimensions;
         } else {
-            // Compare current distance with the largest distance in the queue.
-            if (knn_priority_queue->GetTopDistance() > distance) {
-                // Insert this distance in the queue and remove previous value.
-                knn_priority_queue->RemoveTopElement();
-                knn_priority_queue->AddToPriorityQueue(point_id_dist_pair);
-            }
+            distance = SquaredEuclideanDistance(query_point, dataset_point);
+            dimensions_evaluated += dataset_point.GetSize();
         }
-        // Invariant: Once populated, the size of priority queue <= K.
-        assert(knn_priority_queue->GetSize() <= number_of_nearest_neighbors);
+        /* Kept only if the queue has an empty spot or if it is closer
+           than the largest distance in the queue (an abandoned partial
+           distance is already farther).*/
+        knn_priority_queue->Offer(point_ids[d], distance);
     }
+    return dimensions_evaluated;
 }
 
-void DistCalc::AddKnnAnswer(PointIDs& answer_curr_query, 
+void DistCalc::AddKnnAnswer(const PointIDs &answer_curr_query, 
+        const std::vector<float> &distances_curr_query,
         const unsigned index)
 {
     knn_all_queries_[index] = answer_curr_query;
+    knn_all_distances_[index] = distances_curr_query;
 }
 
-float DistCalc::EuclideanDistance(const Point &query, 
-        const Point &dataset_point) const
+float DistCalc::SquaredEuclideanDistance(const PointView &query, 
+        const PointView &dataset_point) const
 {
-    unsigned int dimensions = dataset_point.GetSize();
     /* Invariant: dimensions must be the same to calaculate euclidean distance.
        Commenting invariant to gain some time.*/
-    //assert(query.GetSize() == dimensions);
-#ifndef SIMD
-    Point dataset_tmp = dataset_point;
-    cblas_saxpy(2048, -1, (float *) &query.point_[0], 1, (float*) &dataset_tmp.point_[0], 1);
-    return cblas_snrm2(2048, &dataset_tmp.point_[0], 1);
-
-#else
-    float sum = 0.0;
-    if(dimensions >= 16)
-    {
-        __m256 d_point, q_point, sub, square;
-        for(int i = 0; i < (dimensions - 7); i+=8)
-        {
-            d_point = _mm256_set_ps(dataset_point.GetValueAtIndex(i+7), 
-                    dataset_point.GetValueAtIndex(i+6),
-                    dataset_point.GetValueAtIndex(i+5),
-                    dataset_point.GetValueAtIndex(i+4),
-                    dataset_point.GetValueAtIndex(i+3),
-                    dataset_point.GetValueAtIndex(i+2),
-                    dataset_point.GetValueAtIndex(i+1),
-                    dataset_point.GetValueAtIndex(i));
-            q_point = _mm256_set_ps(query.GetValueAtIndex(i+7),
-                    query.GetValueAtIndex(i+6),
-                    query.GetValueAtIndex(i+5),
-                    query.GetValueAtIndex(i+4),
-                    query.GetValueAtIndex(i+3),
-                    query.GetValueAtIndex(i+2),
-                    query.GetValueAtIndex(i+1),
-                    query.GetValueAtIndex(i));
-            sub = _mm256_sub_ps(d_point, q_point);
-            square = _mm256_mul_ps(sub, sub);
-            const __m128 x128 = _mm_add_ps(_mm256_extractf128_ps(square, 1), _mm256_castps256_ps128(square));
-            const __m128 x64 = _mm_add_ps(x128, _mm_movehl_ps(x128, x128));
-            const __m128 x32 = _mm_add_ss(x64, _mm_shuffle_ps(x64, x64, 0x55));
-            sum += _mm_cvtss_f32(x32);
-        }
-    } else {
-        sum = 0.0;
-        float per_dim_difference = 0.0;
-        for(int i = 0; i < dimensions; i++)
-        {
-            per_dim_difference = (dataset_point.GetValueAtIndex(i) - query.GetValueAtIndex(i));
-            sum += per_dim_difference*per_dim_difference;
-        }
-    }
-    // CHECK((isinf(sum) == 0), "ERROR: Euclidean Distance- Sum reaches infinity\n");
-    // CHECK((sum >= 0.0), "ERROR: Distance between two points is complex\n");
-    return sqrt(sum);
-#endif
+    //assert(query.GetSize() == dataset_point.GetSize());
+    return SquaredL2Distance(query.GetData(), dataset_point.GetData(), dataset_point.GetSize());
 }
 
 void DistCalc::Initialize(const int size, 
         const PointIDs &point_ids)
 {
     knn_all_queries_.assign(size, point_ids);
+    knn_all_distances_.assign(size, std::vector<float>());
 }
 
 unsigned DistCalc::GetSize() const
@@ -416,11 +435,16 @@ unsigned DistCalc::GetSize() const
     return knn_all_queries_.size();
 }
 
-PointIDs DistCalc::GetValueAtIndex(const int index) const
+const PointIDs& DistCalc::GetValueAtIndex(const int index) const
 {
     return knn_all_queries_[index];
 }
 
+const std::vector<float>& DistCalc::GetDistancesAtIndex(const int index) const
+{
+    return knn_all_distances_[index];
+}
+
 void DistCalc::AddValueToIndex(const int index, const PointIDs &value)
 {
     knn_all_queries_[index] = value;
@@ -429,4 +453,12 @@ void DistCalc::AddValueToIndex(const int index, const PointIDs &value)
 void DistCalc::AddValueToBack(const PointIDs &value)
 {
     knn_all_queries_.push_back(value);
+    knn_all_distances_.push_back(std::vector<float>());
+}
+
+void DistCalc::AddValueToBack(const PointIDs &value,
+        const std::vector<float> &distances)
+{
+    knn_all_queries_.push_back(value);
+    knn_all_distances_.push_back(distances);
 }
@@ -4,66 +4,174 @@
 #include <math.h>
 #include <mutex>
 #include <unistd.h>
+#include "candidate_preprocessor.h"
 #include "custom_priority_queue.h"
+#include "product_quantizer.h"
+#include "quantized_points.h"
+#include "task_pool.h"
 
-/* This is the function called by individual worker threads and 
-   is therefore not a member of the DistCalc class.*/
-void* QueriesShardedDistanceCalculation(void* parameter);
+/* A request with several queries computes the distances of all queries to
+   the union of their candidates as one tile (a GEMM), which reads every
+   candidate row once per tile instead of once per query. The tile also
+   computes the pairs a query did not ask for, so it is only used when the
+   candidate lists overlap: queries x union <= ratio x sum of list sizes.*/
+#define BATCHED_DISTANCE_MAX_WORK_RATIO 4
+// Largest tile (in floats) a thread keeps around for batched distances.
+#define BATCHED_DISTANCE_MAX_TILE_SIZE (1 << 22)
+
+/* The candidate scan prefetches the row this many candidates ahead, so
+   that (sorted, see CandidatePreprocessor) row fetches overlap with the
+   distance computations.*/
+#define CANDIDATE_PREFETCH_DISTANCE 4
+
+/* A query whose candidate scan is split across the task pool is cut into
+   this many tasks per thread, so that threads which finish early can steal.*/
+#define INTRA_QUERY_TASKS_PER_THREAD 2
 
 typedef std::vector<uint32_t> PointIDs;
+
+// How a query is answered over a PQ encoded shard (see UsePqDataset).
+enum PqSearchMode {
+    // Approximate (lookup table) distances only.
+    PQ_APPROXIMATE = 0,
+    // Approximate shortlist, re-ranked with exact distances.
+    PQ_RERANK = 1,
+    // Exact distances over the fp32 rows, the codes are not used.
+    PQ_EXACT = 2
+};
+
 class DistCalc 
 {
     public:
         DistCalc() = default;
-        // Calculates the k-nn points for all queries.
+        /* Lets DistanceCalculation() use the idle cores of the task pool:
+           the queries of a batch with at least min_candidates point IDs in
+           total are spread over them, and so is the candidate scan of a
+           query with at least min_candidates point IDs (0 or no pool: the
+           calling thread does everything).*/
+        void UseTaskPool(TaskPool* task_pool, const unsigned min_candidates);
+        /* Makes DistanceCalculation() search a quantized shard instead of
+           the dataset it is given: the rerank_factor x K candidates with the
+           smallest approximate distances are re-ranked with exact (fp32)
+           distances (rerank_factor 0: approximate distances only).*/
+        void UseQuantizedDataset(const QuantizedPoints* quantized_dataset,
+                const unsigned rerank_factor);
+        /* Makes DistanceCalculation() search a PQ encoded shard instead of
+           the dataset it is given. PQ_RERANK re-ranks the rerank_factor x K
+           candidates with the smallest approximate distances. Takes
+           precedence over UseQuantizedDataset().*/
+        void UsePqDataset(const ProductQuantizer* pq_dataset,
+                const PqSearchMode mode,
+                const unsigned rerank_factor);
+        /* Makes the exact (fp32) scans give up on a candidate as soon as its
+           partial distance exceeds the K-th best distance so far (see
+           BoundedSquaredL2Kernel). Meant for a dataset & queries whose
+           dimensions were ordered by decreasing variance. Disables the
+           batched (GEMM) path, which computes every distance in full.*/
+        void UseEarlyAbandon(const bool early_abandon) { early_abandon_ = early_abandon; }
+        /* Number of dimensions the exact (fp32) scans of the last
+           DistanceCalculation() summed, over all queries & candidates.*/
+        uint64_t GetDimensionsEvaluated() const;
+        /* Calculates the k-nn points for all queries: for every query, the
+           (up to) K candidates from its point ID list that are closest to it,
+           closest first, along with their squared distances.*/
         void DistanceCalculation(const MultiplePoints &dataset, 
                 const MultiplePoints &queries, 
                 const std::vector<std::vector<uint32_t>> &point_ids_vec, 
-                const unsigned number_of_nearest_neighbors,
-                const int num_cores);
+                const unsigned number_of_nearest_neighbors);
 
-        /* Faster function when only one NN needs to be computed for
-           one query.*/
-        void GetNN(const MultiplePoints &dataset,
-                const Point &query_point,
+        /* K-nn of the query at query_index, written into its slot of
+           knn_all_queries_ (which must have been sized).*/
+        void CalculateQueryKnn(const MultiplePoints &dataset,
+                const MultiplePoints &queries,
+                const std::vector<std::vector<uint32_t>> &point_ids_vec,
+                const unsigned number_of_nearest_neighbors,
+                const unsigned query_index);
+        /* Offers every candidate point ID of one query to the priority queue,
+           which must have been Reset() to K.
+           Out: number of dimensions evaluated.*/
+        uint64_t CalculateKnn(const MultiplePoints &dataset, 
+                const PointView &query_point, 
                 const std::vector<uint32_t> &point_id_vec,
-                const int num_cores);
-
-        void CreateThreadsShardingQueries(const MultiplePoints* dataset,
-                const MultiplePoints* queries,
-                const unsigned int number_of_nearest_neighbors,
-                const unsigned int num_procs,
-                const std::vector<std::vector<uint32_t>> &point_ids_vec);
-        // Calculates k-points between one query and all points in the dataset.
-        void CalculateKnn(const MultiplePoints &dataset, 
-                const Point &query_point, 
+                CustomPriorityQueue *knn_priority_queue);
+        /* Same as CalculateKnn(), over the quantized shard (see
+           UseQuantizedDataset).*/
+        void CalculateQuantizedKnn(const PointView &query_point,
+                const std::vector<uint32_t> &point_id_vec,
+                const unsigned number_of_nearest_neighbors,
+                CustomPriorityQueue *knn_priority_queue);
+        /* Same as CalculateKnn(), over the PQ encoded shard (see
+           UsePqDataset).*/
+        void CalculatePqKnn(const PointView &query_point,
                 const std::vector<uint32_t> &point_id_vec,
                 const unsigned number_of_nearest_neighbors,
                 CustomPriorityQueue *knn_priority_queue);
-        void CalculateShardedKnn(const MultiplePoints &dataset,
-                const Point &query_point,
+        /* Same as CalculateKnn(), with the candidates split into tasks that
+           run on the calling thread and num_helpers pool workers. Each task
+           keeps its own top-k, and the task heaps are merged at the end.*/
+        uint64_t ParallelCalculateKnn(const MultiplePoints &dataset,
+                const PointView &query_point,
                 const std::vector<uint32_t> &point_id_vec,
                 const unsigned number_of_nearest_neighbors,
-                CustomPriorityQueue* knn_priority_queue);
+                const unsigned num_helpers,
+                CustomPriorityQueue *knn_priority_queue);
+        /* Exact scan of point_ids[0 .. num_point_ids - 1], offered to the
+           priority queue (early abandon when enabled).
+           Out: number of dimensions evaluated.*/
+        uint64_t ScanCandidates(const MultiplePoints &dataset,
+                const PointView &query_point,
+                const uint32_t* point_ids,
+                const size_t num_point_ids,
+                CustomPriorityQueue* knn_priority_queue) const;
+        /* Batched k-nn for several queries (see BATCHED_DISTANCE_MAX_WORK_RATIO):
+           distances are ||q||^2 + ||x||^2 - 2 q.x over a tile of inner
+           products. Uses the dataset's squared norms when it has them.
+           Out: true if the batch was handled, false if the caller should
+           compute the queries one by one.*/
+        bool BatchedDistanceCalculation(const MultiplePoints &dataset,
+                const MultiplePoints &queries,
+                const std::vector<std::vector<uint32_t>> &point_ids_vec,
+                const unsigned number_of_nearest_neighbors);
         // Add the K-NN result to each query in the batch.
-        void AddKnnAnswer(PointIDs& answer_curr_query, 
+        void AddKnnAnswer(const PointIDs &answer_curr_query, 
+                const std::vector<float> &distances_curr_query,
                 const unsigned index);
-        // Calculates euclidean distance between a query & dataset point.
-        float EuclideanDistance(const Point &query, 
-                const Point &dataset_point) const;
+        /* Calculates the squared euclidean distance between a query & 
+           dataset point. It ranks points like the euclidean distance, so
+           k-NN never needs the sqrt.*/
+        float SquaredEuclideanDistance(const PointView &query, 
+                const PointView &dataset_point) const;
         // Initializes knn_all_queries_ with a given size & value.
         void Initialize(const int size, 
                 const PointIDs &point_ids);
         // Returns size of knn_all_queries_.
         unsigned GetSize() const;
-        // Returns the MultiplePoints at the given index of knn_all_queries_.
-        PointIDs GetValueAtIndex(const int index) const;
+        // Returns the K-NN point IDs at the given index of knn_all_queries_.
+        const PointIDs& GetValueAtIndex(const int index) const;
+        /* Returns the squared distances of the K-NN at the given index
+           (empty if the answer came without distances).*/
+        const std::vector<float>& GetDistancesAtIndex(const int index) const;
         // Adds given value to given index of knn_all_queries_.
         void AddValueToIndex(const int index, const PointIDs &value);
         // Adds value to the back of the vector knn_all_queries_.
         void AddValueToBack(const PointIDs &value);
+        // Same as above, along with the squared distances of the points.
+        void AddValueToBack(const PointIDs &value,
+                const std::vector<float> &distances);
     private:
+        TaskPool* task_pool_ = nullptr;
+        unsigned parallel_min_candidates_ = 0;
+        const QuantizedPoints* quantized_dataset_ = nullptr;
+        unsigned rerank_factor_ = 0;
+        const ProductQuantizer* pq_dataset_ = nullptr;
+        PqSearchMode pq_mode_ = PQ_APPROXIMATE;
+        unsigned pq_rerank_factor_ = 0;
+        bool early_abandon_ = false;
+        // Dimensions evaluated for each query of the last DistanceCalculation().
+        std::vector<uint64_t> dimensions_evaluated_;
         // Data structure that holds k-nn (MultiplePoints) for all queries.
         std::vector<PointIDs> knn_all_queries_;
+        // Squared distance of each point in knn_all_queries_.
+        std::vector<std::vector<float>> knn_all_distances_;
 };
 #endif //__DIST_CALC_H_INCLUDED__
@@ -0,0 +1,986 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "distance_kernels.h"
+
+/* Each SIMD variant is a template on whether both inputs are aligned to the
+   vector width, so aligned loads can be used without a branch per load.
+   This macro defines the entry point that picks the instantiation.*/
+#define DEFINE_ALIGNMENT_DISPATCH(kernel, alignment, target_isa) \
+    __attribute__((target(target_isa))) \
+    static float kernel(const float* a, const float* b, const unsigned int dimensions) \
+    { \
+        if (((((uintptr_t)a) | ((uintptr_t)b)) % alignment) == 0) { \
+            return kernel##Impl<true>(a, b, dimensions); \
+        } \
+        return kernel##Impl<false>(a, b, dimensions); \
+    }
+
+static float CosineFromSums(const float dot, const float norm_a, const float norm_b)
+{
+    if ((norm_a == 0.0) || (norm_b == 0.0)) {
+        return 1.0;
+    }
+    return 1.0 - (dot/std::sqrt(norm_a * norm_b));
+}
+
+/* Scalar. Four independent accumulators so that the adds of consecutive
+   dimensions do not wait on each other.*/
+
+static float SquaredL2Scalar(const float* a, const float* b, const unsigned int dimensions)
+{
+    float sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    unsigned int i = 0;
+    for(; i + 4 <= dimensions; i += 4)
+    {
+        float d0 = a[i] - b[i], d1 = a[i + 1] - b[i + 1];
+        float d2 = a[i + 2] - b[i + 2], d3 = a[i + 3] - b[i + 3];
+        sum0 += d0 * d0;
+        sum1 += d1 * d1;
+        sum2 += d2 * d2;
+        sum3 += d3 * d3;
+    }
+    for(; i < dimensions; i++)
+    {
+        float d = a[i] - b[i];
+        sum0 += d * d;
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+static float InnerProductScalar(const float* a, const float* b, const unsigned int dimensions)
+{
+    float sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    unsigned int i = 0;
+    for(; i + 4 <= dimensions; i += 4)
+    {
+        sum0 += a[i] * b[i];
+        sum1 += a[i + 1] * b[i + 1];
+        sum2 += a[i + 2] * b[i + 2];
+        sum3 += a[i + 3] * b[i + 3];
+    }
+    for(; i < dimensions; i++)
+    {
+        sum0 += a[i] * b[i];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+static float CosineScalar(const float* a, const float* b, const unsigned int dimensions)
+{
+    float dot = 0.0, norm_a = 0.0, norm_b = 0.0;
+    for(unsigned int i = 0; i < dimensions; i++)
+    {
+        dot += a[i] * b[i];
+        norm_a += a[i] * a[i];
+        norm_b += b[i] * b[i];
+    }
+    return CosineFromSums(dot, norm_a, norm_b);
+}
+
+// SSE4: 4 floats per register.
+
+template <bool kAligned>
+__attribute__((target("sse4.1")))
+static inline __m128 LoadSse(const float* p)
+{
+    return kAligned ? _mm_load_ps(p) : _mm_loadu_ps(p);
+}
+
+__attribute__((target("sse4.1")))
+static inline float HorizontalSumSse(const __m128 v)
+{
+    __m128 shuffled = _mm_movehdup_ps(v);
+    __m128 sums = _mm_add_ps(v, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    sums = _mm_add_ss(sums, shuffled);
+    return _mm_cvtss_f32(sums);
+}
+
+template <bool kAligned>
+__attribute__((target("sse4.1")))
+static float SquaredL2SseImpl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    __m128 sum2 = _mm_setzero_ps(), sum3 = _mm_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 16 <= dimensions; i += 16)
+    {
+        __m128 d0 = _mm_sub_ps(LoadSse<kAligned>(a + i), LoadSse<kAligned>(b + i));
+        __m128 d1 = _mm_sub_ps(LoadSse<kAligned>(a + i + 4), LoadSse<kAligned>(b + i + 4));
+        __m128 d2 = _mm_sub_ps(LoadSse<kAligned>(a + i + 8), LoadSse<kAligned>(b + i + 8));
+        __m128 d3 = _mm_sub_ps(LoadSse<kAligned>(a + i + 12), LoadSse<kAligned>(b + i + 12));
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+        sum2 = _mm_add_ps(sum2, _mm_mul_ps(d2, d2));
+        sum3 = _mm_add_ps(sum3, _mm_mul_ps(d3, d3));
+    }
+    for(; i + 4 <= dimensions; i += 4)
+    {
+        __m128 d0 = _mm_sub_ps(LoadSse<kAligned>(a + i), LoadSse<kAligned>(b + i));
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+    }
+    float sum = HorizontalSumSse(_mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3)));
+    for(; i < dimensions; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+DEFINE_ALIGNMENT_DISPATCH(SquaredL2Sse, 16, "sse4.1")
+
+template <bool kAligned>
+__attribute__((target("sse4.1")))
+static float InnerProductSseImpl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+    __m128 sum2 = _mm_setzero_ps(), sum3 = _mm_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 16 <= dimensions; i += 16)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(LoadSse<kAligned>(a + i), LoadSse<kAligned>(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(LoadSse<kAligned>(a + i + 4), LoadSse<kAligned>(b + i + 4)));
+        sum2 = _mm_add_ps(sum2, _mm_mul_ps(LoadSse<kAligned>(a + i + 8), LoadSse<kAligned>(b + i + 8)));
+        sum3 = _mm_add_ps(sum3, _mm_mul_ps(LoadSse<kAligned>(a + i + 12), LoadSse<kAligned>(b + i + 12)));
+    }
+    for(; i + 4 <= dimensions; i += 4)
+    {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(LoadSse<kAligned>(a + i), LoadSse<kAligned>(b + i)));
+    }
+    float sum = HorizontalSumSse(_mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3)));
+    for(; i < dimensions; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+DEFINE_ALIGNMENT_DISPATCH(InnerProductSse, 16, "sse4.1")
+
+template <bool kAligned>
+__attribute__((target("sse4.1")))
+static float CosineSseImpl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m128 dot0 = _mm_setzero_ps(), norm_a0 = _mm_setzero_ps(), norm_b0 = _mm_setzero_ps();
+    __m128 dot1 = _mm_setzero_ps(), norm_a1 = _mm_setzero_ps(), norm_b1 = _mm_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 8 <= dimensions; i += 8)
+    {
+        __m128 a0 = LoadSse<kAligned>(a + i), b0 = LoadSse<kAligned>(b + i);
+        __m128 a1 = LoadSse<kAligned>(a + i + 4), b1 = LoadSse<kAligned>(b + i + 4);
+        dot0 = _mm_add_ps(dot0, _mm_mul_ps(a0, b0));
+        norm_a0 = _mm_add_ps(norm_a0, _mm_mul_ps(a0, a0));
+        norm_b0 = _mm_add_ps(norm_b0, _mm_mul_ps(b0, b0));
+        dot1 = _mm_add_ps(dot1, _mm_mul_ps(a1, b1));
+        norm_a1 = _mm_add_ps(norm_a1, _mm_mul_ps(a1, a1));
+        norm_b1 = _mm_add_ps(norm_b1, _mm_mul_ps(b1, b1));
+    }
+    float dot = HorizontalSumSse(_mm_add_ps(dot0, dot1));
+    float norm_a = HorizontalSumSse(_mm_add_ps(norm_a0, norm_a1));
+    float norm_b = HorizontalSumSse(_mm_add_ps(norm_b0, norm_b1));
+    for(; i < dimensions; i++)
+    {
+        dot += a[i] * b[i];
+        norm_a += a[i] * a[i];
+        norm_b += b[i] * b[i];
+    }
+    return CosineFromSums(dot, norm_a, norm_b);
+}
+DEFINE_ALIGNMENT_DISPATCH(CosineSse, 16, "sse4.1")
+
+// AVX2 + FMA: 8 floats per register, fused multiply-add.
+
+template <bool kAligned>
+__attribute__((target("avx2,fma")))
+static inline __m256 LoadAvx2(const float* p)
+{
+    return kAligned ? _mm256_load_ps(p) : _mm256_loadu_ps(p);
+}
+
+__attribute__((target("avx2,fma")))
+static inline float HorizontalSumAvx2(const __m256 v)
+{
+    __m128 sums = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuffled = _mm_movehdup_ps(sums);
+    sums = _mm_add_ps(sums, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    sums = _mm_add_ss(sums, shuffled);
+    return _mm_cvtss_f32(sums);
+}
+
+template <bool kAligned>
+__attribute__((target("avx2,fma")))
+static float SquaredL2Avx2Impl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps(), sum3 = _mm256_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 32 <= dimensions; i += 32)
+    {
+        __m256 d0 = _mm256_sub_ps(LoadAvx2<kAligned>(a + i), LoadAvx2<kAligned>(b + i));
+        __m256 d1 = _mm256_sub_ps(LoadAvx2<kAligned>(a + i + 8), LoadAvx2<kAligned>(b + i + 8));
+        __m256 d2 = _mm256_sub_ps(LoadAvx2<kAligned>(a + i + 16), LoadAvx2<kAligned>(b + i + 16));
+        __m256 d3 = _mm256_sub_ps(LoadAvx2<kAligned>(a + i + 24), LoadAvx2<kAligned>(b + i + 24));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+        sum2 = _mm256_fmadd_ps(d2, d2, sum2);
+        sum3 = _mm256_fmadd_ps(d3, d3, sum3);
+    }
+    for(; i + 8 <= dimensions; i += 8)
+    {
+        __m256 d0 = _mm256_sub_ps(LoadAvx2<kAligned>(a + i), LoadAvx2<kAligned>(b + i));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    }
+    float sum = HorizontalSumAvx2(_mm256_add_ps(_mm256_add_ps(sum0, sum1), _mm256_add_ps(sum2, sum3)));
+    for(; i < dimensions; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+DEFINE_ALIGNMENT_DISPATCH(SquaredL2Avx2, 32, "avx2,fma")
+
+template <bool kAligned>
+__attribute__((target("avx2,fma")))
+static float InnerProductAvx2Impl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps(), sum3 = _mm256_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 32 <= dimensions; i += 32)
+    {
+        sum0 = _mm256_fmadd_ps(LoadAvx2<kAligned>(a + i), LoadAvx2<kAligned>(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(LoadAvx2<kAligned>(a + i + 8), LoadAvx2<kAligned>(b + i + 8), sum1);
+        sum2 = _mm256_fmadd_ps(LoadAvx2<kAligned>(a + i + 16), LoadAvx2<kAligned>(b + i + 16), sum2);
+        sum3 = _mm256_fmadd_ps(LoadAvx2<kAligned>(a + i + 24), LoadAvx2<kAligned>(b + i + 24), sum3);
+    }
+    for(; i + 8 <= dimensions; i += 8)
+    {
+        sum0 = _mm256_fmadd_ps(LoadAvx2<kAligned>(a + i), LoadAvx2<kAligned>(b + i), sum0);
+    }
+    float sum = HorizontalSumAvx2(_mm256_add_ps(_mm256_add_ps(sum0, sum1), _mm256_add_ps(sum2, sum3)));
+    for(; i < dimensions; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+DEFINE_ALIGNMENT_DISPATCH(InnerProductAvx2, 32, "avx2,fma")
+
+template <bool kAligned>
+__attribute__((target("avx2,fma")))
+static float CosineAvx2Impl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m256 dot0 = _mm256_setzero_ps(), norm_a0 = _mm256_setzero_ps(), norm_b0 = _mm256_setzero_ps();
+    __m256 dot1 = _mm256_setzero_ps(), norm_a1 = _mm256_setzero_ps(), norm_b1 = _mm256_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 16 <= dimensions; i += 16)
+    {
+        __m256 a0 = LoadAvx2<kAligned>(a + i), b0 = LoadAvx2<kAligned>(b + i);
+        __m256 a1 = LoadAvx2<kAligned>(a + i + 8), b1 = LoadAvx2<kAligned>(b + i + 8);
+        dot0 = _mm256_fmadd_ps(a0, b0, dot0);
+        norm_a0 = _mm256_fmadd_ps(a0, a0, norm_a0);
+        norm_b0 = _mm256_fmadd_ps(b0, b0, norm_b0);
+        dot1 = _mm256_fmadd_ps(a1, b1, dot1);
+        norm_a1 = _mm256_fmadd_ps(a1, a1, norm_a1);
+        norm_b1 = _mm256_fmadd_ps(b1, b1, norm_b1);
+    }
+    float dot = HorizontalSumAvx2(_mm256_add_ps(dot0, dot1));
+    float norm_a = HorizontalSumAvx2(_mm256_add_ps(norm_a0, norm_a1));
+    float norm_b = HorizontalSumAvx2(_mm256_add_ps(norm_b0, norm_b1));
+    for(; i < dimensions; i++)
+    {
+        dot += a[i] * b[i];
+        norm_a += a[i] * a[i];
+        norm_b += b[i] * b[i];
+    }
+    return CosineFromSums(dot, norm_a, norm_b);
+}
+DEFINE_ALIGNMENT_DISPATCH(CosineAvx2, 32, "avx2,fma")
+
+/* AVX-512: 16 floats per register. The last partial register is
+   handled with a masked load instead of a scalar loop.*/
+
+template <bool kAligned>
+__attribute__((target("avx512f")))
+static inline __m512 LoadAvx512(const float* p)
+{
+    return kAligned ? _mm512_load_ps(p) : _mm512_loadu_ps(p);
+}
+
+__attribute__((target("avx512f")))
+static inline __mmask16 TailMaskAvx512(const unsigned int remaining)
+{
+    return (__mmask16)((1u << remaining) - 1);
+}
+
+template <bool kAligned>
+__attribute__((target("avx512f")))
+static float SquaredL2Avx512Impl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps(), sum3 = _mm512_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 64 <= dimensions; i += 64)
+    {
+        __m512 d0 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i), LoadAvx512<kAligned>(b + i));
+        __m512 d1 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i + 16), LoadAvx512<kAligned>(b + i + 16));
+        __m512 d2 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i + 32), LoadAvx512<kAligned>(b + i + 32));
+        __m512 d3 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i + 48), LoadAvx512<kAligned>(b + i + 48));
+        sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+        sum2 = _mm512_fmadd_ps(d2, d2, sum2);
+        sum3 = _mm512_fmadd_ps(d3, d3, sum3);
+    }
+    for(; i + 16 <= dimensions; i += 16)
+    {
+        __m512 d0 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i), LoadAvx512<kAligned>(b + i));
+        sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+    }
+    if (i < dimensions) {
+        __mmask16 mask = TailMaskAvx512(dimensions - i);
+        __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(sum0, sum1), _mm512_add_ps(sum2, sum3)));
+}
+DEFINE_ALIGNMENT_DISPATCH(SquaredL2Avx512, 64, "avx512f")
+
+template <bool kAligned>
+__attribute__((target("avx512f")))
+static float InnerProductAvx512Impl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps(), sum3 = _mm512_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 64 <= dimensions; i += 64)
+    {
+        sum0 = _mm512_fmadd_ps(LoadAvx512<kAligned>(a + i), LoadAvx512<kAligned>(b + i), sum0);
+        sum1 = _mm512_fmadd_ps(LoadAvx512<kAligned>(a + i + 16), LoadAvx512<kAligned>(b + i + 16), sum1);
+        sum2 = _mm512_fmadd_ps(LoadAvx512<kAligned>(a + i + 32), LoadAvx512<kAligned>(b + i + 32), sum2);
+        sum3 = _mm512_fmadd_ps(LoadAvx512<kAligned>(a + i + 48), LoadAvx512<kAligned>(b + i + 48), sum3);
+    }
+    for(; i + 16 <= dimensions; i += 16)
+    {
+        sum0 = _mm512_fmadd_ps(LoadAvx512<kAligned>(a + i), LoadAvx512<kAligned>(b + i), sum0);
+    }
+    if (i < dimensions) {
+        __mmask16 mask = TailMaskAvx512(dimensions - i);
+        sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(sum0, sum1), _mm512_add_ps(sum2, sum3)));
+}
+DEFINE_ALIGNMENT_DISPATCH(InnerProductAvx512, 64, "avx512f")
+
+template <bool kAligned>
+__attribute__((target("avx512f")))
+static float CosineAvx512Impl(const float* a, const float* b, const unsigned int dimensions)
+{
+    __m512 dot0 = _mm512_setzero_ps(), norm_a0 = _mm512_setzero_ps(), norm_b0 = _mm512_setzero_ps();
+    __m512 dot1 = _mm512_setzero_ps(), norm_a1 = _mm512_setzero_ps(), norm_b1 = _mm512_setzero_ps();
+    unsigned int i = 0;
+    for(; i + 32 <= dimensions; i += 32)
+    {
+        __m512 a0 = LoadAvx512<kAligned>(a + i), b0 = LoadAvx512<kAligned>(b + i);
+        __m512 a1 = LoadAvx512<kAligned>(a + i + 16), b1 = LoadAvx512<kAligned>(b + i + 16);
+        dot0 = _mm512_fmadd_ps(a0, b0, dot0);
+        norm_a0 = _mm512_fmadd_ps(a0, a0, norm_a0);
+        norm_b0 = _mm512_fmadd_ps(b0, b0, norm_b0);
+        dot1 = _mm512_fmadd_ps(a1, b1, dot1);
+        norm_a1 = _mm512_fmadd_ps(a1, a1, norm_a1);
+        norm_b1 = _mm512_fmadd_ps(b1, b1, norm_b1);
+    }
+    for(; i < dimensions; i += 16)
+    {
+        __mmask16 mask = TailMaskAvx512(std::min(16u, dimensions - i));
+        __m512 a0 = _mm512_maskz_loadu_ps(mask, a + i), b0 = _mm512_maskz_loadu_ps(mask, b + i);
+        dot0 = _mm512_fmadd_ps(a0, b0, dot0);
+        norm_a0 = _mm512_fmadd_ps(a0, a0, norm_a0);
+        norm_b0 = _mm512_fmadd_ps(b0, b0, norm_b0);
+    }
+    return CosineFromSums(_mm512_reduce_add_ps(_mm512_add_ps(dot0, dot1)),
+            _mm512_reduce_add_ps(_mm512_add_ps(norm_a0, norm_a1)),
+            _mm512_reduce_add_ps(_mm512_add_ps(norm_b0, norm_b1)));
+}
+DEFINE_ALIGNMENT_DISPATCH(CosineAvx512, 64, "avx512f")
+
+/* Inner product tiles. Dimensions are processed in blocks small enough for
+   a block of query rows and a block of point rows to stay in L1, and each
+   block of kQueries x kPoints pairs is accumulated in registers (one vector
+   accumulator per pair, reduced once per dimension block).*/
+#define TILE_DIMENSION_BLOCK 512
+
+static void InnerProductTileScalar(const float* const* queries,
+        const unsigned int num_queries,
+        const float* const* points,
+        const unsigned int num_points,
+        const unsigned int padded_dimensions,
+        float* tile)
+{
+    for(unsigned int q = 0; q < num_queries; q++)
+    {
+        for(unsigned int p = 0; p < num_points; p++)
+        {
+            tile[q * num_points + p] = InnerProductScalar(queries[q], points[p], padded_dimensions);
+        }
+    }
+}
+
+template <int kQueries, int kPoints>
+__attribute__((target("avx2,fma")))
+static inline void InnerProductMicroTileAvx2(const float* const* queries,
+        const float* const* points,
+        const unsigned int dimension_begin,
+        const unsigned int dimension_end,
+        float* tile,
+        const unsigned int tile_stride)
+{
+    __m256 sums[kQueries][kPoints];
+    for(int i = 0; i < kQueries; i++)
+    {
+        for(int j = 0; j < kPoints; j++)
+        {
+            sums[i][j] = _mm256_setzero_ps();
+        }
+    }
+    for(unsigned int k = dimension_begin; k < dimension_end; k += 8)
+    {
+        __m256 point_values[kPoints];
+        for(int j = 0; j < kPoints; j++)
+        {
+            point_values[j] = _mm256_load_ps(points[j] + k);
+        }
+        for(int i = 0; i < kQueries; i++)
+        {
+            __m256 query_values = _mm256_load_ps(queries[i] + k);
+            for(int j = 0; j < kPoints; j++)
+            {
+                sums[i][j] = _mm256_fmadd_ps(query_values, point_values[j], sums[i][j]);
+            }
+        }
+    }
+    for(int i = 0; i < kQueries; i++)
+    {
+        for(int j = 0; j < kPoints; j++)
+        {
+            tile[i * tile_stride + j] += HorizontalSumAvx2(sums[i][j]);
+        }
+    }
+}
+
+// Points in the 4-query micro tile: 8 accumulators + 6 loads fit in 16 ymm registers.
+template <int kQueries>
+__attribute__((target("avx2,fma")))
+static inline void InnerProductQueryBlockAvx2(const float* const* queries,
+        const float* const* points,
+        const unsigned int num_points,
+        const unsigned int dimension_begin,
+        const unsigned int dimension_end,
+        float* tile,
+        const unsigned int tile_stride)
+{
+    unsigned int p = 0;
+    for(; p + 2 <= num_points; p += 2)
+    {
+        InnerProductMicroTileAvx2<kQueries, 2>(queries, points + p, dimension_begin, dimension_end, tile + p, tile_stride);
+    }
+    if (p < num_points) {
+        InnerProductMicroTileAvx2<kQueries, 1>(queries, points + p, dimension_begin, dimension_end, tile + p, tile_stride);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void InnerProductTileAvx2(const float* const* queries,
+        const unsigned int num_queries,
+        const float* const* points,
+        const unsigned int num_points,
+        const unsigned int padded_dimensions,
+        float* tile)
+{
+    memset(tile, 0, (size_t)num_queries * num_points * sizeof(float));
+    for(unsigned int k = 0; k < padded_dimensions; k += TILE_DIMENSION_BLOCK)
+    {
+        unsigned int k_end = std::min(padded_dimensions, k + TILE_DIMENSION_BLOCK);
+        unsigned int q = 0;
+        for(; q + 4 <= num_queries; q += 4)
+        {
+            InnerProductQueryBlockAvx2<4>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+        }
+        switch (num_queries - q) {
+            case 3:
+                InnerProductQueryBlockAvx2<3>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+                break;
+            case 2:
+                InnerProductQueryBlockAvx2<2>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+                break;
+            case 1:
+                InnerProductQueryBlockAvx2<1>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+                break;
+        }
+    }
+}
+
+template <int kQueries, int kPoints>
+__attribute__((target("avx512f")))
+static inline void InnerProductMicroTileAvx512(const float* const* queries,
+        const float* const* points,
+        const unsigned int dimension_begin,
+        const unsigned int dimension_end,
+        float* tile,
+        const unsigned int tile_stride)
+{
+    __m512 sums[kQueries][kPoints];
+    for(int i = 0; i < kQueries; i++)
+    {
+        for(int j = 0; j < kPoints; j++)
+        {
+            sums[i][j] = _mm512_setzero_ps();
+        }
+    }
+    for(unsigned int k = dimension_begin; k < dimension_end; k += 16)
+    {
+        __m512 point_values[kPoints];
+        for(int j = 0; j < kPoints; j++)
+        {
+            point_values[j] = _mm512_load_ps(points[j] + k);
+        }
+        for(int i = 0; i < kQueries; i++)
+        {
+            __m512 query_values = _mm512_load_ps(queries[i] + k);
+            for(int j = 0; j < kPoints; j++)
+            {
+                sums[i][j] = _mm512_fmadd_ps(query_values, point_values[j], sums[i][j]);
+            }
+        }
+    }
+    for(int i = 0; i < kQueries; i++)
+    {
+        for(int j = 0; j < kPoints; j++)
+        {
+            tile[i * tile_stride + j] += _mm512_reduce_add_ps(sums[i][j]);
+        }
+    }
+}
+
+// 4 x 4 micro tile: 16 accumulators + 5 loads out of 32 zmm registers.
+template <int kQueries>
+__attribute__((target("avx512f")))
+static inline void InnerProductQueryBlockAvx512(const float* const* queries,
+        const float* const* points,
+        const unsigned int num_points,
+        const unsigned int dimension_begin,
+        const unsigned int dimension_end,
+        float* tile,
+        const unsigned int tile_stride)
+{
+    unsigned int p = 0;
+    for(; p + 4 <= num_points; p += 4)
+    {
+        InnerProductMicroTileAvx512<kQueries, 4>(queries, points + p, dimension_begin, dimension_end, tile + p, tile_stride);
+    }
+    for(; p < num_points; p++)
+    {
+        InnerProductMicroTileAvx512<kQueries, 1>(queries, points + p, dimension_begin, dimension_end, tile + p, tile_stride);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void InnerProductTileAvx512(const float* const* queries,
+        const unsigned int num_queries,
+        const float* const* points,
+        const unsigned int num_points,
+        const unsigned int padded_dimensions,
+        float* tile)
+{
+    memset(tile, 0, (size_t)num_queries * num_points * sizeof(float));
+    for(unsigned int k = 0; k < padded_dimensions; k += TILE_DIMENSION_BLOCK)
+    {
+        unsigned int k_end = std::min(padded_dimensions, k + TILE_DIMENSION_BLOCK);
+        unsigned int q = 0;
+        for(; q + 4 <= num_queries; q += 4)
+        {
+            InnerProductQueryBlockAvx512<4>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+        }
+        switch (num_queries - q) {
+            case 3:
+                InnerProductQueryBlockAvx512<3>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+                break;
+            case 2:
+                InnerProductQueryBlockAvx512<2>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+                break;
+            case 1:
+                InnerProductQueryBlockAvx512<1>(queries + q, points, num_points, k, k_end, tile + q * num_points, num_points);
+                break;
+        }
+    }
+}
+
+/* Quantized kernels. Rows are zero padded to a multiple of 64 bytes, so
+   there are no tails.*/
+
+uint16_t FloatToHalf(const float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude >= 0x7f800000) {
+        // Inf or NaN.
+        return sign | ((magnitude > 0x7f800000) ? 0x7e00 : 0x7c00);
+    }
+    if (magnitude >= 0x477ff000) {
+        // Rounds to a value above the largest half (65504).
+        return sign | 0x7c00;
+    }
+    if (magnitude < 0x38800000) {
+        // Subnormal half (or 0): multiples of 2^-24.
+        float subnormal;
+        memcpy(&subnormal, &magnitude, sizeof(subnormal));
+        return sign | (uint16_t)lrintf(subnormal * 16777216.0f);
+    }
+    // Rebias the exponent (127 -> 15) and round the 13 dropped bits to even.
+    magnitude += 0xc8000fff + ((magnitude >> 13) & 1);
+    return sign | (magnitude >> 13);
+}
+
+float HalfToFloat(const uint16_t value)
+{
+    unsigned int exponent = (value >> 10) & 0x1f;
+    unsigned int mantissa = value & 0x3ff;
+    float magnitude;
+    if (exponent == 0) {
+        magnitude = std::ldexp((float)mantissa, -24);
+    } else if (exponent == 0x1f) {
+        magnitude = (mantissa == 0) ? INFINITY : NAN;
+    } else {
+        magnitude = std::ldexp((float)(mantissa | 0x400), (int)exponent - 25);
+    }
+    return (value & 0x8000) ? -magnitude : magnitude;
+}
+
+static int32_t Int8InnerProductScalar(const uint8_t* a, const int8_t* b, const unsigned int dimensions)
+{
+    int32_t sum = 0;
+    for(unsigned int i = 0; i < dimensions; i++)
+    {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return sum;
+}
+
+static float HalfSquaredL2Scalar(const float* a, const uint16_t* b, const unsigned int dimensions)
+{
+    float sum = 0.0;
+    for(unsigned int i = 0; i < dimensions; i++)
+    {
+        float diff = a[i] - HalfToFloat(b[i]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static int32_t Int8InnerProductAvx2(const uint8_t* a, const int8_t* b, const unsigned int dimensions)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum0 = _mm256_setzero_si256(), sum1 = _mm256_setzero_si256();
+    for(unsigned int i = 0; i < dimensions; i += 64)
+    {
+        // u8 x s8 -> pairs summed to s16 -> pairs summed to s32.
+        __m256i products0 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(a + i)),
+                _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i products1 = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(a + i + 32)),
+                _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(products0, ones));
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(products1, ones));
+    }
+    __m256i sum = _mm256_add_epi32(sum0, sum1);
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4e));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xb1));
+    return _mm_cvtsi128_si32(sum128);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static float HalfSquaredL2Avx2(const float* a, const uint16_t* b, const unsigned int dimensions)
+{
+    __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+    for(unsigned int i = 0; i < dimensions; i += 16)
+    {
+        __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(a + i),
+                _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))));
+        __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8),
+                _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i + 8))));
+        sum0 = _mm256_fmadd_ps(diff0, diff0, sum0);
+        sum1 = _mm256_fmadd_ps(diff1, diff1, sum1);
+    }
+    return HorizontalSumAvx2(_mm256_add_ps(sum0, sum1));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int32_t Int8InnerProductAvx512(const uint8_t* a, const int8_t* b, const unsigned int dimensions)
+{
+    const __m512i ones = _mm512_set1_epi16(1);
+    __m512i sum = _mm512_setzero_si512();
+    for(unsigned int i = 0; i < dimensions; i += 64)
+    {
+        __m512i products = _mm512_maddubs_epi16(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        sum = _mm512_add_epi32(sum, _mm512_madd_epi16(products, ones));
+    }
+    return _mm512_reduce_add_epi32(sum);
+}
+
+// VNNI: u8 x s8 products summed straight into s32 lanes, one instruction.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t Int8InnerProductVnni(const uint8_t* a, const int8_t* b, const unsigned int dimensions)
+{
+    __m512i sum0 = _mm512_setzero_si512(), sum1 = _mm512_setzero_si512();
+    unsigned int i = 0;
+    for(; i + 128 <= dimensions; i += 128)
+    {
+        sum0 = _mm512_dpbusd_epi32(sum0, _mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        sum1 = _mm512_dpbusd_epi32(sum1, _mm512_loadu_si512(a + i + 64), _mm512_loadu_si512(b + i + 64));
+    }
+    if (i < dimensions) {
+        sum0 = _mm512_dpbusd_epi32(sum0, _mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+    }
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+static float HalfSquaredL2Avx512(const float* a, const uint16_t* b, const unsigned int dimensions)
+{
+    __m512 sum = _mm512_setzero_ps();
+    for(unsigned int i = 0; i < dimensions; i += 16)
+    {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i),
+                _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(b + i))));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    return _mm512_reduce_add_ps(sum);
+}
+
+static void PqLookupScalar(const uint8_t* tables,
+        const unsigned int num_subspaces,
+        const uint8_t* codes,
+        uint16_t* sums)
+{
+    for(unsigned int i = 0; i < PQ_LOOKUP_BLOCK_SIZE; i++)
+    {
+        uint16_t sum = 0;
+        for(unsigned int j = 0; j < num_subspaces/2; j++)
+        {
+            uint8_t code = codes[j * PQ_LOOKUP_BLOCK_SIZE + i];
+            sum += tables[(2 * j) * 16 + (code & 0x0f)];
+            sum += tables[(2 * j + 1) * 16 + (code >> 4)];
+        }
+        sums[i] = sum;
+    }
+}
+
+/* A subspace's 16-entry table sits in both 128-bit lanes, so one shuffle
+   looks up the codes of all 32 points of the block.*/
+__attribute__((target("avx2")))
+static void PqLookupAvx2(const uint8_t* tables,
+        const unsigned int num_subspaces,
+        const uint8_t* codes,
+        uint16_t* sums)
+{
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i sums_low = _mm256_setzero_si256(), sums_high = _mm256_setzero_si256();
+    for(unsigned int j = 0; j < num_subspaces/2; j++)
+    {
+        __m256i code_bytes = _mm256_loadu_si256((const __m256i*)(codes + j * PQ_LOOKUP_BLOCK_SIZE));
+        __m256i even_codes = _mm256_and_si256(code_bytes, low_nibbles);
+        __m256i odd_codes = _mm256_and_si256(_mm256_srli_epi16(code_bytes, 4), low_nibbles);
+        __m256i even_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(tables + (2 * j) * 16)));
+        __m256i odd_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(tables + (2 * j + 1) * 16)));
+        __m256i even_distances = _mm256_shuffle_epi8(even_table, even_codes);
+        __m256i odd_distances = _mm256_shuffle_epi8(odd_table, odd_codes);
+        // Widen to 16 bits before adding: 8-bit sums would overflow.
+        sums_low = _mm256_add_epi16(sums_low, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(even_distances)));
+        sums_high = _mm256_add_epi16(sums_high, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(even_distances, 1)));
+        sums_low = _mm256_add_epi16(sums_low, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(odd_distances)));
+        sums_high = _mm256_add_epi16(sums_high, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(odd_distances, 1)));
+    }
+    _mm256_storeu_si256((__m256i*)sums, sums_low);
+    _mm256_storeu_si256((__m256i*)(sums + 16), sums_high);
+}
+
+/* Early abandon: the squared_l2 kernel of each instruction set, one block
+   at a time.*/
+#define DEFINE_BOUNDED_SQUARED_L2(kernel, block_kernel, target_isa) \
+    __attribute__((target(target_isa))) \
+    static float kernel(const float* a, const float* b, const unsigned int dimensions, \
+            const float bound, unsigned int* dimensions_evaluated) \
+    { \
+        float sum = 0.0; \
+        unsigned int i = 0; \
+        while (i < dimensions) \
+        { \
+            unsigned int block = std::min(dimensions - i, (unsigned int)EARLY_ABANDON_BLOCK_DIMENSIONS); \
+            sum += block_kernel(a + i, b + i, block); \
+            i += block; \
+            if (sum > bound) { \
+                break; \
+            } \
+        } \
+        *dimensions_evaluated = i; \
+        return sum; \
+    }
+
+static float BoundedSquaredL2Scalar(const float* a, const float* b, const unsigned int dimensions,
+        const float bound, unsigned int* dimensions_evaluated)
+{
+    float sum = 0.0;
+    unsigned int i = 0;
+    while (i < dimensions)
+    {
+        unsigned int block = std::min(dimensions - i, (unsigned int)EARLY_ABANDON_BLOCK_DIMENSIONS);
+        sum += SquaredL2Scalar(a + i, b + i, block);
+        i += block;
+        if (sum > bound) {
+            break;
+        }
+    }
+    *dimensions_evaluated = i;
+    return sum;
+}
+DEFINE_BOUNDED_SQUARED_L2(BoundedSquaredL2Sse, SquaredL2Sse, "sse4.1")
+DEFINE_BOUNDED_SQUARED_L2(BoundedSquaredL2Avx2, SquaredL2Avx2, "avx2,fma")
+
+/* AVX-512 gets its own loop: the partial sums stay in vector registers for
+   the whole distance and are only reduced for the check after each block.
+   Calling SquaredL2Avx512 per block left the sum in zmm16+ on return, and
+   the non-AVX caller then paid an AVX to SSE transition for every row.*/
+template <bool kAligned>
+__attribute__((target("avx512f")))
+static float BoundedSquaredL2Avx512Impl(const float* a, const float* b, const unsigned int dimensions,
+        const float bound, unsigned int* dimensions_evaluated)
+{
+    __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps(), sum3 = _mm512_setzero_ps();
+    float sum = 0.0;
+    unsigned int i = 0;
+    while (i < dimensions)
+    {
+        unsigned int block_end = std::min(dimensions, i + (unsigned int)EARLY_ABANDON_BLOCK_DIMENSIONS);
+        for(; i + 64 <= block_end; i += 64)
+        {
+            __m512 d0 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i), LoadAvx512<kAligned>(b + i));
+            __m512 d1 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i + 16), LoadAvx512<kAligned>(b + i + 16));
+            __m512 d2 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i + 32), LoadAvx512<kAligned>(b + i + 32));
+            __m512 d3 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i + 48), LoadAvx512<kAligned>(b + i + 48));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+            sum2 = _mm512_fmadd_ps(d2, d2, sum2);
+            sum3 = _mm512_fmadd_ps(d3, d3, sum3);
+        }
+        for(; i + 16 <= block_end; i += 16)
+        {
+            __m512 d0 = _mm512_sub_ps(LoadAvx512<kAligned>(a + i), LoadAvx512<kAligned>(b + i));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        }
+        if (i < block_end) {
+            __mmask16 mask = TailMaskAvx512(block_end - i);
+            __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+            sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+            i = block_end;
+        }
+        sum = _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(sum0, sum1), _mm512_add_ps(sum2, sum3)));
+        if (sum > bound) {
+            break;
+        }
+    }
+    *dimensions_evaluated = i;
+    // Leave a clean upper state for the (non-AVX) caller.
+    _mm256_zeroupper();
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float BoundedSquaredL2Avx512(const float* a, const float* b, const unsigned int dimensions,
+        const float bound, unsigned int* dimensions_evaluated)
+{
+    if (((((uintptr_t)a) | ((uintptr_t)b)) % 64) == 0) {
+        return BoundedSquaredL2Avx512Impl<true>(a, b, dimensions, bound, dimensions_evaluated);
+    }
+    return BoundedSquaredL2Avx512Impl<false>(a, b, dimensions, bound, dimensions_evaluated);
+}
+
+/* Level of an instruction set name (scalar 0, sse4 1, avx2 2, avx512 3),
+   or -1 if the name is unknown.*/
+static int GetIsaLevel(const char* isa)
+{
+    if (strcmp(isa, "scalar") == 0) {
+        return 0;
+    } else if (strcmp(isa, "sse4") == 0) {
+        return 1;
+    } else if (strcmp(isa, "avx2") == 0) {
+        return 2;
+    } else if (strcmp(isa, "avx512") == 0) {
+        return 3;
+    }
+    return -1;
+}
+
+/* Picks the widest instruction set that the CPU supports, up to
+   max_level (see GetIsaLevel).*/
+static DistanceKernels SelectDistanceKernels(const int max_level)
+{
+    const DistanceKernels scalar = {&SquaredL2Scalar, &InnerProductScalar, &CosineScalar, &InnerProductTileScalar,
+        &Int8InnerProductScalar, &HalfSquaredL2Scalar, &PqLookupScalar, &BoundedSquaredL2Scalar, "scalar"};
+    const DistanceKernels sse4 = {&SquaredL2Sse, &InnerProductSse, &CosineSse, &InnerProductTileScalar,
+        &Int8InnerProductScalar, &HalfSquaredL2Scalar, &PqLookupScalar, &BoundedSquaredL2Sse, "sse4"};
+    const DistanceKernels avx2 = {&SquaredL2Avx2, &InnerProductAvx2, &CosineAvx2, &InnerProductTileAvx2,
+        &Int8InnerProductAvx2, &HalfSquaredL2Avx2, &PqLookupAvx2, &BoundedSquaredL2Avx2, "avx2"};
+    DistanceKernels avx512 = {&SquaredL2Avx512, &InnerProductAvx512, &CosineAvx512, &InnerProductTileAvx512,
+        &Int8InnerProductAvx512, &HalfSquaredL2Avx512, &PqLookupAvx2, &BoundedSquaredL2Avx512, "avx512"};
+
+    __builtin_cpu_init();
+    if ((max_level >= 3) && __builtin_cpu_supports("avx512f")) {
+        // Byte instructions are not part of AVX-512F.
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) {
+            avx512.int8_inner_product = &Int8InnerProductVnni;
+        } else if (!__builtin_cpu_supports("avx512bw")) {
+            avx512.int8_inner_product = &Int8InnerProductAvx2;
+        }
+        return avx512;
+    }
+    if ((max_level >= 2) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+            && __builtin_cpu_supports("f16c")) {
+        return avx2;
+    }
+    if ((max_level >= 1) && __builtin_cpu_supports("sse4.1")) {
+        return sse4;
+    }
+    return scalar;
+}
+
+bool GetDistanceKernelsForIsa(const std::string &isa, DistanceKernels* kernels)
+{
+    int level = GetIsaLevel(isa.c_str());
+    if (level < 0) {
+        return false;
+    }
+    *kernels = SelectDistanceKernels(level);
+    // The CPU lacks the instruction set if a narrower one was picked.
+    return isa == kernels->isa;
+}
+
+/* Setting the HDSEARCH_DISTANCE_ISA environment variable to scalar, sse4,
+   avx2 or avx512 caps the choice (e.g to compare variants).*/
+const DistanceKernels& GetDistanceKernels()
+{
+    static const DistanceKernels kernels = [] {
+        const char* isa_cap = getenv("HDSEARCH_DISTANCE_ISA");
+        int max_level = (isa_cap != NULL) ? GetIsaLevel(isa_cap) : -1;
+        return SelectDistanceKernels((max_level < 0) ? 3 : max_level);
+    }();
+    return kernels;
+}
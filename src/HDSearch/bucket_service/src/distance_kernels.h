@@ -0,0 +1,124 @@
+#ifndef __DISTANCE_KERNELS_H_INCLUDED__
+#define __DISTANCE_KERNELS_H_INCLUDED__
+
+#include <stdint.h>
+#include <string>
+
+/* Distance kernels between two float vectors of the same dimension.
+   Each kernel has a scalar, SSE4, AVX2+FMA and AVX-512 variant; the best
+   variant the CPU supports is picked once (cpuid) when the program starts,
+   so binaries do not have to be built for a particular machine.
+   Kernels use aligned loads when both vectors are 64-byte aligned (rows of
+   MultiplePoints always are) and fall back to unaligned loads otherwise.*/
+
+typedef float (*DistanceKernel)(const float* a,
+        const float* b,
+        const unsigned int dimensions);
+
+/* Inner products of every query with every point, as a cache-blocked
+   matrix multiply: tile[q * num_points + p] = <queries[q], points[p]>.
+   Rows must be 64-byte aligned, and padded_dimensions a multiple of 16 with
+   zeros beyond the real dimensions (i.e rows of MultiplePoints, with
+   MultiplePoints::GetStride() as padded_dimensions).*/
+typedef void (*InnerProductTileKernel)(const float* const* queries,
+        const unsigned int num_queries,
+        const float* const* points,
+        const unsigned int num_points,
+        const unsigned int padded_dimensions,
+        float* tile);
+
+/* Inner product of 7-bit codes (0 - 127) with signed 8-bit codes, exact in
+   32-bit integers: 7-bit codes keep the pairwise sums of maddubs from
+   saturating. dimensions must be a multiple of 64 (rows zero padded).*/
+typedef int32_t (*Int8InnerProductKernel)(const uint8_t* a,
+        const int8_t* b,
+        const unsigned int dimensions);
+
+/* Squared euclidean distance between a float vector and a half precision
+   (IEEE fp16) vector. dimensions must be a multiple of 16 (rows zero padded).*/
+typedef float (*HalfSquaredL2Kernel)(const float* a,
+        const uint16_t* b,
+        const unsigned int dimensions);
+
+// Points scored together by a PqLookupKernel.
+#define PQ_LOOKUP_BLOCK_SIZE 32
+
+/* Product quantization lookups for a block of PQ_LOOKUP_BLOCK_SIZE points:
+   sums[i] = sum over subspaces m of tables[m * 16 + (code of point i in m)].
+   codes is transposed: byte j of point i is codes[j * PQ_LOOKUP_BLOCK_SIZE + i],
+   holding subspaces 2j & 2j+1 in its low & high nibble. num_subspaces is even.*/
+typedef void (*PqLookupKernel)(const uint8_t* tables,
+        const unsigned int num_subspaces,
+        const uint8_t* codes,
+        uint16_t* sums);
+
+// Dimensions between two checks of a BoundedSquaredL2Kernel's partial sum.
+#define EARLY_ABANDON_BLOCK_DIMENSIONS 128
+
+/* Squared euclidean distance that gives up once it is known to exceed
+   bound: the partial sum is checked after every block of
+   EARLY_ABANDON_BLOCK_DIMENSIONS dimensions (with dimensions ordered by
+   decreasing variance, the first blocks hold most of the distance).
+Out: the full distance, or a partial sum > bound if it gave up; the number
+of dimensions summed.*/
+typedef float (*BoundedSquaredL2Kernel)(const float* a,
+        const float* b,
+        const unsigned int dimensions,
+        const float bound,
+        unsigned int* dimensions_evaluated);
+
+struct DistanceKernels {
+    /* Squared euclidean distance. Ranks points exactly like the
+       euclidean distance, without the sqrt.*/
+    DistanceKernel squared_l2;
+    // Inner (dot) product.
+    DistanceKernel inner_product;
+    // Cosine distance: 1 - cos(a, b).
+    DistanceKernel cosine;
+    // Queries x points inner products (GEMM).
+    InnerProductTileKernel inner_product_tile;
+    // maddubs (AVX2/AVX-512BW) or VNNI int8 inner product.
+    Int8InnerProductKernel int8_inner_product;
+    // F16C (AVX2) or AVX-512 fp16 to fp32 conversion + squared euclidean distance.
+    HalfSquaredL2Kernel half_squared_l2;
+    // pshufb (AVX2) table lookups of 4-bit PQ codes.
+    PqLookupKernel pq_lookup;
+    // Early-abandon squared euclidean distance.
+    BoundedSquaredL2Kernel bounded_squared_l2;
+    // Name of the instruction set the kernels were chosen for.
+    const char* isa;
+};
+
+// IEEE half precision conversions (round to nearest even).
+uint16_t FloatToHalf(const float value);
+float HalfToFloat(const uint16_t value);
+
+// Returns the kernels chosen for this CPU.
+const DistanceKernels& GetDistanceKernels();
+
+/* Kernels of one instruction set: "scalar", "sse4", "avx2" or "avx512"
+   (e.g to benchmark the variants against each other).
+Out: false if the name is unknown or the CPU does not support it.*/
+bool GetDistanceKernelsForIsa(const std::string &isa, DistanceKernels* kernels);
+
+inline float SquaredL2Distance(const float* a,
+        const float* b,
+        const unsigned int dimensions)
+{
+    return GetDistanceKernels().squared_l2(a, b, dimensions);
+}
+
+inline float InnerProduct(const float* a,
+        const float* b,
+        const unsigned int dimensions)
+{
+    return GetDistanceKernels().inner_product(a, b, dimensions);
+}
+
+inline float CosineDistance(const float* a,
+        const float* b,
+        const unsigned int dimensions)
+{
+    return GetDistanceKernels().cosine(a, b, dimensions);
+}
+#endif //__DISTANCE_KERNELS_H_INCLUDED__
@@ -0,0 +1,173 @@
+#include "knn_cache.h"
+
+static inline uint64_t Mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t KnnCacheKeyHash::operator()(const KnnCacheKey &key) const
+{
+    uint64_t h = Mix(key.query_id ^ key.candidates_hash);
+    h = Mix(h ^ (((uint64_t)key.number_of_nearest_neighbors << 32) | key.num_candidates));
+    return (size_t)Mix(h ^ key.search_mode);
+}
+
+uint64_t KnnCache::HashPointIDs(const std::vector<uint32_t> &point_ids)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for(size_t i = 0; i < point_ids.size(); i++)
+    {
+        h = (h ^ point_ids[i]) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return Mix(h);
+}
+
+void KnnCache::Initialize(const uint64_t budget_bytes)
+{
+    budget_bytes_ = budget_bytes;
+    shard_budget_bytes_ = budget_bytes / KNN_CACHE_NUM_SHARDS;
+    shards_.clear();
+    if (budget_bytes_ == 0) {
+        return;
+    }
+    for(unsigned i = 0; i < KNN_CACHE_NUM_SHARDS; i++)
+    {
+        shards_.emplace_back(new Shard());
+    }
+}
+
+KnnCache::Shard& KnnCache::GetShard(const KnnCacheKey &key)
+{
+    // High bits pick the shard, the shard's hash table uses the whole hash.
+    uint64_t h = KnnCacheKeyHash()(key);
+    return *shards_[(h >> 40) & (KNN_CACHE_NUM_SHARDS - 1)];
+}
+
+bool KnnCache::Lookup(const KnnCacheKey &key,
+        std::vector<uint32_t>* point_ids,
+        std::vector<float>* distances)
+{
+    Shard& shard = GetShard(key);
+    uint64_t generation = GetGeneration();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        return false;
+    }
+    Entry& entry = shard.slots[it->second];
+    if (entry.generation != generation) {
+        Evict(&shard, it->second);
+        return false;
+    }
+    entry.referenced = true;
+    point_ids->assign(entry.point_ids.begin(), entry.point_ids.end());
+    distances->assign(entry.distances.begin(), entry.distances.end());
+    return true;
+}
+
+void KnnCache::Insert(const KnnCacheKey &key,
+        const uint64_t generation,
+        const std::vector<uint32_t> &point_ids,
+        const std::vector<float> &distances)
+{
+    uint64_t bytes = KNN_CACHE_ENTRY_OVERHEAD_BYTES + sizeof(Entry)
+        + point_ids.size() * sizeof(uint32_t)
+        + distances.size() * sizeof(float);
+    if (bytes > shard_budget_bytes_) {
+        return;
+    }
+    Shard& shard = GetShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (generation != GetGeneration()) {
+        return;
+    }
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        Entry& entry = shard.slots[it->second];
+        if (entry.generation == generation) {
+            // Another thread computed the same answer first.
+            entry.referenced = true;
+            return;
+        }
+        Evict(&shard, it->second);
+    }
+    if (!MakeRoom(&shard, bytes)) {
+        return;
+    }
+    uint32_t slot;
+    if (!shard.free_slots.empty()) {
+        slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+    } else {
+        slot = shard.slots.size();
+        shard.slots.emplace_back();
+    }
+    Entry& entry = shard.slots[slot];
+    entry.key = key;
+    entry.generation = generation;
+    entry.point_ids.assign(point_ids.begin(), point_ids.end());
+    entry.distances.assign(distances.begin(), distances.end());
+    entry.bytes = bytes;
+    // New entries get one sweep of the clock hand to prove themselves.
+    entry.referenced = false;
+    entry.occupied = true;
+    shard.index.emplace(key, slot);
+    shard.bytes += bytes;
+}
+
+void KnnCache::Evict(Shard* shard, const uint32_t slot)
+{
+    Entry& entry = shard->slots[slot];
+    shard->index.erase(entry.key);
+    shard->bytes -= entry.bytes;
+    // Release the answer's memory, the budget no longer counts it.
+    std::vector<uint32_t>().swap(entry.point_ids);
+    std::vector<float>().swap(entry.distances);
+    entry.occupied = false;
+    shard->free_slots.push_back(slot);
+}
+
+bool KnnCache::MakeRoom(Shard* shard, const uint64_t bytes)
+{
+    uint64_t generation = GetGeneration();
+    while ((shard->bytes + bytes > shard_budget_bytes_) && !shard->index.empty())
+    {
+        if (shard->hand >= shard->slots.size()) {
+            shard->hand = 0;
+        }
+        uint32_t slot = shard->hand++;
+        Entry& entry = shard->slots[slot];
+        if (!entry.occupied) {
+            continue;
+        }
+        if (entry.referenced && (entry.generation == generation)) {
+            // Second chance.
+            entry.referenced = false;
+            continue;
+        }
+        Evict(shard, slot);
+    }
+    return (shard->bytes + bytes <= shard_budget_bytes_);
+}
+
+void KnnCache::Invalidate()
+{
+    generation_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+uint64_t KnnCache::GetMemorySize() const
+{
+    uint64_t bytes = 0;
+    for(size_t i = 0; i < shards_.size(); i++)
+    {
+        std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+        bytes += shards_[i]->bytes;
+    }
+    return bytes;
+}
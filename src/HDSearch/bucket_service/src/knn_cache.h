@@ -0,0 +1,110 @@
+#ifndef __KNN_CACHE_H_INCLUDED__
+#define __KNN_CACHE_H_INCLUDED__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Independently locked shards of the cache (a power of two).
+#define KNN_CACHE_NUM_SHARDS 64
+// Bytes charged to an entry on top of its answer, for the index node & slot.
+#define KNN_CACHE_ENTRY_OVERHEAD_BYTES 128
+
+/* A request is answered from the cache only if it asks the same query,
+   over the same (preprocessed) candidates, for the same K, scored the
+   same way.*/
+struct KnnCacheKey {
+    uint64_t query_id;
+    uint64_t candidates_hash;
+    uint32_t num_candidates;
+    uint32_t number_of_nearest_neighbors;
+    uint32_t search_mode;
+
+    bool operator==(const KnnCacheKey &other) const
+    {
+        return (query_id == other.query_id)
+            && (candidates_hash == other.candidates_hash)
+            && (num_candidates == other.num_candidates)
+            && (number_of_nearest_neighbors == other.number_of_nearest_neighbors)
+            && (search_mode == other.search_mode);
+    }
+};
+
+struct KnnCacheKeyHash {
+    size_t operator()(const KnnCacheKey &key) const;
+};
+
+/* Top-K answers of recent queries, shared by all request handler threads.
+   The cache is split in KNN_CACHE_NUM_SHARDS shards, each with its own
+   mutex and an equal part of the memory budget, so threads rarely wait on
+   each other. A shard evicts with CLOCK: a hit only sets the entry's
+   referenced bit (no list to relink under the lock), and the clock hand
+   evicts the first entry that was not referenced since it last passed.
+   Invalidate() starts a new generation: entries of older generations are
+   never returned again, and are reclaimed as the clock hand meets them.*/
+class KnnCache
+{
+    public:
+        KnnCache() = default;
+        KnnCache(const KnnCache&) = delete;
+        KnnCache& operator=(const KnnCache&) = delete;
+        // Memory budget in bytes (0 disables the cache).
+        void Initialize(const uint64_t budget_bytes);
+        bool IsEnabled() const { return budget_bytes_ != 0; }
+        // Hash of a (sorted, duplicate free) candidate list.
+        static uint64_t HashPointIDs(const std::vector<uint32_t> &point_ids);
+        /* Generation to insert the answers computed from now on with; take
+           it before reading the shard, so that answers computed across an
+           Invalidate() are dropped.*/
+        uint64_t GetGeneration() const
+        {
+            return generation_.load(std::memory_order_acquire);
+        }
+        /* In: key.
+           Out: true and the cached point IDs (shard indices) & distances on
+           a hit, false on a miss.*/
+        bool Lookup(const KnnCacheKey &key,
+                std::vector<uint32_t>* point_ids,
+                std::vector<float>* distances);
+        /* In: key, generation the answer was computed in, point IDs & distances.
+           The answer is dropped if the cache was invalidated since.*/
+        void Insert(const KnnCacheKey &key,
+                const uint64_t generation,
+                const std::vector<uint32_t> &point_ids,
+                const std::vector<float> &distances);
+        // Forgets every cached answer: call whenever the shard changes.
+        void Invalidate();
+        uint64_t GetMemorySize() const;
+    private:
+        struct Entry {
+            KnnCacheKey key;
+            uint64_t generation;
+            std::vector<uint32_t> point_ids;
+            std::vector<float> distances;
+            uint64_t bytes;
+            bool referenced;
+            bool occupied;
+        };
+        struct Shard {
+            std::mutex mutex;
+            std::vector<Entry> slots;
+            std::vector<uint32_t> free_slots;
+            std::unordered_map<KnnCacheKey, uint32_t, KnnCacheKeyHash> index;
+            size_t hand = 0;
+            uint64_t bytes = 0;
+        };
+        Shard& GetShard(const KnnCacheKey &key);
+        // Removes the entry in a slot (the shard's mutex is held).
+        void Evict(Shard* shard, const uint32_t slot);
+        // Evicts entries until bytes more fit in the shard (the mutex is held).
+        bool MakeRoom(Shard* shard, const uint64_t bytes);
+
+        std::vector<std::unique_ptr<Shard>> shards_;
+        uint64_t budget_bytes_ = 0;
+        uint64_t shard_budget_bytes_ = 0;
+        std::atomic<uint64_t> generation_{0};
+};
+#endif //__KNN_CACHE_H_INCLUDED__
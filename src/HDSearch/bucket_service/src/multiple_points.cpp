@@ -1,5 +1,197 @@
 #include <iterator>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "distance_kernels.h"
 #include "multiple_points.h"
+#include "numa_placement.h"
+
+// Number of floats that make up one ROW_ALIGNMENT_BYTES block.
+#define FLOATS_PER_ALIGNED_BLOCK (ROW_ALIGNMENT_BYTES/sizeof(float))
+
+MultiplePoints::MultiplePoints(const MultiplePoints &other)
+{
+    // Before allocating: a copy of a huge page backed set is backed by huge pages too.
+    use_huge_pages_ = other.use_huge_pages_;
+    Reallocate(other.size_, other.dimension_);
+    if (other.size_ != 0) {
+        memcpy(data_, other.data_, other.size_ * other.stride_ * sizeof(float));
+    }
+    size_ = other.size_;
+    squared_norms_ = other.squared_norms_;
+    keep_squared_norms_ = other.keep_squared_norms_;
+}
+
+MultiplePoints::MultiplePoints(MultiplePoints &&other) noexcept
+    : data_(other.data_), size_(other.size_), capacity_(other.capacity_),
+    dimension_(other.dimension_), stride_(other.stride_),
+    use_huge_pages_(other.use_huge_pages_),
+    squared_norms_(std::move(other.squared_norms_)),
+    keep_squared_norms_(other.keep_squared_norms_)
+{
+    other.data_ = nullptr;
+    other.size_ = other.capacity_ = 0;
+    other.dimension_ = other.stride_ = 0;
+}
+
+MultiplePoints& MultiplePoints::operator=(MultiplePoints other)
+{
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(dimension_, other.dimension_);
+    std::swap(stride_, other.stride_);
+    std::swap(use_huge_pages_, other.use_huge_pages_);
+    std::swap(squared_norms_, other.squared_norms_);
+    std::swap(keep_squared_norms_, other.keep_squared_norms_);
+    return *this;
+}
+
+MultiplePoints::~MultiplePoints()
+{
+    free(data_);
+}
+
+void MultiplePoints::Reallocate(const size_t capacity, const unsigned dimension)
+{
+    unsigned stride = ((dimension + FLOATS_PER_ALIGNED_BLOCK - 1)/FLOATS_PER_ALIGNED_BLOCK) * FLOATS_PER_ALIGNED_BLOCK;
+    float* data = nullptr;
+    size_t num_floats = capacity * stride;
+    if (num_floats != 0) {
+        void* mem = nullptr;
+        size_t alignment = use_huge_pages_ ? HUGE_PAGE_BYTES : ROW_ALIGNMENT_BYTES;
+        CHECK((posix_memalign(&mem, alignment, num_floats * sizeof(float)) == 0), "ERROR: Could not allocate aligned memory for points\n");
+        data = static_cast<float*>(mem);
+        if (use_huge_pages_) {
+            // Best effort: the kernel may not have THP enabled.
+            madvise(mem, num_floats * sizeof(float), MADV_HUGEPAGE);
+        }
+        memset(data, 0, num_floats * sizeof(float));
+    }
+    // Move the rows that survive into the new slab.
+    size_t rows_to_copy = std::min(size_, capacity);
+    unsigned floats_to_copy = std::min(dimension_, dimension);
+    for(size_t i = 0; i < rows_to_copy; i++)
+    {
+        memcpy(data + i * stride, data_ + i * stride_, floats_to_copy * sizeof(float));
+    }
+    free(data_);
+    data_ = data;
+    size_ = rows_to_copy;
+    capacity_ = capacity;
+    dimension_ = dimension;
+    stride_ = stride;
+}
+
+void MultiplePoints::SplitAcrossNumaNodes()
+{
+    unsigned num_nodes = GetNumNumaNodes();
+    if ((num_nodes == 1) || (capacity_ == 0)) {
+        return;
+    }
+    size_t num_floats = capacity_ * stride_;
+    void* mem = nullptr;
+    size_t alignment = use_huge_pages_ ? HUGE_PAGE_BYTES : ROW_ALIGNMENT_BYTES;
+    CHECK((posix_memalign(&mem, alignment, num_floats * sizeof(float)) == 0), "ERROR: Could not allocate aligned memory for points\n");
+    if (use_huge_pages_) {
+        madvise(mem, num_floats * sizeof(float), MADV_HUGEPAGE);
+    }
+    float* data = static_cast<float*>(mem);
+    // Not touched until here: every page lands on the node that copies into it.
+    RunOnEveryNumaNode([this, data, num_nodes](unsigned node) {
+            size_t first_row = GetFirstRowOfNumaNode(node, size_, num_nodes);
+            // The last node also takes the (zeroed) spare capacity.
+            size_t last_row = (node + 1 == num_nodes) ? capacity_ : GetFirstRowOfNumaNode(node + 1, size_, num_nodes);
+            if (last_row > first_row) {
+                memcpy(data + first_row * stride_,
+                        data_ + first_row * stride_,
+                        (last_row - first_row) * stride_ * sizeof(float));
+            }
+            });
+    free(data_);
+    data_ = data;
+}
+
+void MultiplePoints::ComputeSquaredNorms()
+{
+    keep_squared_norms_ = true;
+    squared_norms_.resize(size_);
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < (long)size_; i++)
+    {
+        const float* row = GetRowAtIndex(i);
+        squared_norms_[i] = InnerProduct(row, row, stride_);
+    }
+}
+
+void MultiplePoints::UpdateSquaredNorm(const size_t index)
+{
+    if (!keep_squared_norms_) {
+        return;
+    }
+    squared_norms_.resize(size_);
+    const float* row = GetRowAtIndex(index);
+    squared_norms_[index] = InnerProduct(row, row, stride_);
+}
+
+void MultiplePoints::GetDimensionsByDecreasingVariance(std::vector<unsigned>* dimensions) const
+{
+    std::vector<double> sums(dimension_, 0.0), squared_sums(dimension_, 0.0);
+#pragma omp parallel
+    {
+        std::vector<double> thread_sums(dimension_, 0.0), thread_squared_sums(dimension_, 0.0);
+#pragma omp for schedule(static)
+        for(long i = 0; i < (long)size_; i++)
+        {
+            const float* row = GetRowAtIndex(i);
+            for(unsigned d = 0; d < dimension_; d++)
+            {
+                thread_sums[d] += row[d];
+                thread_squared_sums[d] += (double)row[d] * row[d];
+            }
+        }
+#pragma omp critical
+        {
+            for(unsigned d = 0; d < dimension_; d++)
+            {
+                sums[d] += thread_sums[d];
+                squared_sums[d] += thread_squared_sums[d];
+            }
+        }
+    }
+    std::vector<double> variances(dimension_, 0.0);
+    for(unsigned d = 0; (d < dimension_) && (size_ != 0); d++)
+    {
+        double mean = sums[d]/size_;
+        variances[d] = (squared_sums[d]/size_) - (mean * mean);
+    }
+    dimensions->resize(dimension_);
+    for(unsigned d = 0; d < dimension_; d++)
+    {
+        (*dimensions)[d] = d;
+    }
+    std::stable_sort(dimensions->begin(), dimensions->end(), [&](unsigned a, unsigned b) {
+            return variances[a] > variances[b];
+        });
+}
+
+void MultiplePoints::PermuteDimensions(const std::vector<unsigned> &dimensions)
+{
+    CHECK((dimensions.size() == dimension_), "ERROR: A dimension permutation must have one entry per dimension\n");
+#pragma omp parallel
+    {
+        std::vector<float> old_row(dimension_);
+#pragma omp for schedule(static)
+        for(long i = 0; i < (long)size_; i++)
+        {
+            float* row = GetMutableRowAtIndex(i);
+            std::copy(row, row + dimension_, old_row.begin());
+            for(unsigned d = 0; d < dimension_; d++)
+            {
+                row[d] = old_row[dimensions[d]];
+            }
+        }
+    }
+}
 
 // Read input file and create dataset.
 void MultiplePoints::CreateMultiplePoints(const std::string &file_name)
@@ -25,9 +217,10 @@ void MultiplePoints::CreateMultiplePoints(const std::string &file_name)
         // Current dimension must match the first point.
         CHECK((dimension == tokens.size()), "ERROR: Dimensions of all points (dataset & queries) must be equal\n");
 
-        // Read values and return a point at the end of multiple_points_.
-        multiple_points_.push_back(Point());
-        CreatePoint(tokens, &multiple_points_.back());
+        // Read values and copy the point to the end of the arena.
+        Point p;
+        CreatePoint(tokens, &p);
+        PushBack(p);
     }
 
 }
@@ -49,23 +242,17 @@ void MultiplePoints::CreateMultiplePointsFromBinFile(const std::string &file_nam
     CHECK((dataset_size >= 0), "ERROR: Dataset cannot have negative number of points\n");
     CHECK((dataset_dimensions >= 0), "ERROR: Number of dataset dimensions cannot be negative\n");
 
-    //Read each individual float value and store it in the dataset matrix.
-    float value;
-    Point p(dataset_dimensions, 0.0);
-    multiple_points_.resize(dataset_size, p);
+    // Read each point straight into its (aligned) row of the arena.
+    Resize(dataset_size, dataset_dimensions);
 
     for(long m = 0; m < dataset_size; m++)
     {
-        for(int n = 0; n < dataset_dimensions; n++)
+        if(fread((void*)GetMutableRowAtIndex(m), sizeof(float), dataset_dimensions, dataset_binary) != dataset_dimensions)
         {
-            if(fread((void*)(&value), sizeof(value), 1, dataset_binary) == 1)
-            {
-                multiple_points_[m].AddValueToIndex(n, static_cast<float>(value));
-            } else {
-                break;
-            }
+            break;
         }
     }
+    fclose(dataset_binary);
 
 }
 
@@ -108,69 +295,116 @@ void MultiplePoints::CreatePoint(const std::vector<std::string> &tokens,
 
 unsigned MultiplePoints::GetSize() const
 {
-    return multiple_points_.size();
+    return size_;
 }
 
 void MultiplePoints::Resize(const int size, const Point &p)
 {
-    multiple_points_.resize(size, p);
+    size_t old_size = size_;
+    Resize(size, p.GetSize());
+    for(size_t i = old_size; i < size_; i++)
+    {
+        std::copy(p.point_.begin(), p.point_.end(), GetMutableRowAtIndex(i));
+        UpdateSquaredNorm(i);
+    }
+}
+
+void MultiplePoints::Resize(const int size, const unsigned dimension)
+{
+    CHECK(((size_ == 0) || (dimension == dimension_)), "Dimensions of all points (dataset & queries) must be equal");
+    size_t old_size = size_;
+    if (((size_t)size > capacity_) || (dimension != dimension_)) {
+        Reallocate(size, dimension);
+    }
+    // Rows beyond the old size may hold stale values from a shrink.
+    for(size_t i = old_size; i < (size_t)size; i++)
+    {
+        memset(GetMutableRowAtIndex(i), 0, stride_ * sizeof(float));
+    }
+    size_ = size;
+    if (keep_squared_norms_) {
+        // New rows are all zeros.
+        squared_norms_.resize(size_, 0.0);
+        std::fill(squared_norms_.begin() + std::min(old_size, size_), squared_norms_.end(), 0.0);
+    }
 }
 
 unsigned MultiplePoints::GetPointDimension() const
 {
     /* Assumption: All points have equal dimension -
        because this is checked for while loading the file. */
-    CHECK((multiple_points_.size() != 0), "Dataset/Queries cannot be an empty file");
-    return multiple_points_[0].GetSize();
+    CHECK((size_ != 0), "Dataset/Queries cannot be an empty file");
+    return dimension_;
 }
 
 void MultiplePoints::Clear()
 {
-    multiple_points_.clear();
+    size_ = 0;
+    squared_norms_.clear();
 }
 
-const Point& MultiplePoints::GetPointAtIndex(const int index) const
+Point MultiplePoints::GetPointAtIndex(const int index) const
 {
-    return multiple_points_[index];
+    Point p;
+    const float* row = GetRowAtIndex(index);
+    p.point_.assign(row, row + dimension_);
+    return p;
 }
 
 void MultiplePoints::PushBack(const Point &point)
 {
-    multiple_points_.emplace_back(point);
+    PushBack(point.GetView());
 }
 
-Point& MultiplePoints::GetPointAtBack()
+void MultiplePoints::PushBack(const PointView &point)
 {
-    return multiple_points_.back();
+    if (size_ == 0) {
+        // The first point decides the dimension of the collection.
+        if (point.GetSize() != dimension_) {
+            Reallocate(capacity_, point.GetSize());
+        }
+    }
+    CHECK((point.GetSize() == dimension_), "Dimensions of all points (dataset & queries) must be equal");
+    if (size_ == capacity_) {
+        Reallocate(std::max((size_t)1, capacity_ * 2), dimension_);
+    }
+    size_++;
+    SetPoint(size_ - 1, point);
 }
 
 void MultiplePoints::SetPoint(const unsigned int index, 
         const Point &point)
 {
-    CHECK((multiple_points_.size() >= index), "ERROR: Trying to add point to a non-existent MultiplePoints index\n");
-    multiple_points_[index] = point;
+    SetPoint(index, point.GetView());
 }
 
-void MultiplePoints::Erase(std::vector<Point>::iterator element)
+void MultiplePoints::SetPoint(const unsigned int index, 
+        const PointView &point)
 {
-    multiple_points_.erase(element);
+    CHECK((size_ > index), "ERROR: Trying to add point to a non-existent MultiplePoints index\n");
+    CHECK((point.GetSize() == dimension_), "Dimensions of all points (dataset & queries) must be equal");
+    memcpy(GetMutableRowAtIndex(index), point.GetData(), dimension_ * sizeof(float));
+    UpdateSquaredNorm(index);
 }
 
 void MultiplePoints::PopBack()
 {
-    multiple_points_.pop_back();
-}
-
-std::vector<Point>::iterator MultiplePoints::Begin()
-{
-    return multiple_points_.begin();
+    CHECK((size_ != 0), "ERROR: Cannot pop a point from empty MultiplePoints\n");
+    size_--;
+    if (keep_squared_norms_) {
+        squared_norms_.resize(size_);
+    }
 }
 
 void MultiplePoints::Print() const
 {
-    for(auto& point : multiple_points_)
+    for(size_t i = 0; i < size_; i++)
     {
-        point.PrintPoint();
+        const float* row = GetRowAtIndex(i);
+        for(unsigned j = 0; j < dimension_; j++)
+        {
+            std::cout << row[j] << " ";
+        }
         std::cout << std::endl;
     }
 }
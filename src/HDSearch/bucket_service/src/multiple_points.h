@@ -8,6 +8,18 @@
 #include <string.h>
 #include "point.h"
 
+/* Every row of the arena starts on a boundary of this many bytes, so
+   that distance kernels can use aligned vector loads on any row.*/
+#define ROW_ALIGNMENT_BYTES 64
+// Alignment of the whole slab when it is backed by transparent huge pages.
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)
+/* Bytes of a row that PrefetchPointAtIndex() requests: the start of a long
+   row, the hardware prefetcher streams the rest once it is being read.*/
+#define ROW_PREFETCH_MAX_BYTES 1024
+
+/* Collection of equal-dimension points, stored row-major in one
+   contiguous, aligned slab of floats. Each row is padded (with zeros)
+   up to a multiple of ROW_ALIGNMENT_BYTES, so rows never share a cache line.*/
 class MultiplePoints
 {
     public:
@@ -15,8 +27,12 @@ class MultiplePoints
         // Second constructor to initialize "size"# points to a value.
         MultiplePoints(int size, const Point &p)
         {
-            multiple_points_.assign(size, p);
+            Resize(size, p);
         }
+        MultiplePoints(const MultiplePoints &other);
+        MultiplePoints(MultiplePoints &&other) noexcept;
+        MultiplePoints& operator=(MultiplePoints other);
+        ~MultiplePoints();
         /* Read text file and create a structure: vector of points. 
            file format: float11 float12 float13 ... --> all dimensions of pt 1.
            float21 float22 float23 ... --> all dimensions of pt 2.
@@ -38,26 +54,90 @@ class MultiplePoints
 In: new size, new points
 Out: the multiplepoints private member gets modified.*/
         void Resize(const int size, const Point &p);
+        // Resize to "size"# zero-valued points of the given dimension.
+        void Resize(const int size, const unsigned dimension);
         // Return the dimension of each point (points must have equal dimension).
         unsigned GetPointDimension() const;
         // Remove all points, makes data structure empty.
         void Clear();
-        // Get the Point at a given index.
-        const Point& GetPointAtIndex(const int index) const;
-        // Add a point to the end of the vector.
+        /* Get a copy of the Point at a given index. Copies all floats,
+           so hot paths should use GetPointViewAtIndex() instead.*/
+        Point GetPointAtIndex(const int index) const;
+        // Get a read-only view of the point at a given index (no copy).
+        PointView GetPointViewAtIndex(const int index) const
+        {
+            return PointView(GetRowAtIndex(index), dimension_);
+        }
+        // Get a pointer to the (aligned) first float of a row.
+        const float* GetRowAtIndex(const int index) const
+        {
+            return data_ + (size_t)index * stride_;
+        }
+        float* GetMutableRowAtIndex(const int index)
+        {
+            return data_ + (size_t)index * stride_;
+        }
+        // Software prefetch of (the start of) a row that is about to be read.
+        void PrefetchPointAtIndex(const int index) const
+        {
+            const char* row = reinterpret_cast<const char*>(GetRowAtIndex(index));
+            size_t num_bytes = std::min((size_t)stride_ * sizeof(float), (size_t)ROW_PREFETCH_MAX_BYTES);
+            for(size_t offset = 0; offset < num_bytes; offset += ROW_ALIGNMENT_BYTES)
+            {
+                __builtin_prefetch(row + offset);
+            }
+        }
+        /* Distance in floats between the starts of two consecutive rows
+           (dimension rounded up to the row alignment).*/
+        unsigned GetStride() const { return stride_; }
+        /* Back future allocations of the slab with transparent huge pages
+           (2MB aligned + MADV_HUGEPAGE). Call before Resize() so that the
+           pages are huge when they are first touched.*/
+        void UseHugePages(const bool use_huge_pages) { use_huge_pages_ = use_huge_pages; }
+        /* Moves the rows to memory split across the NUMA nodes: each node
+           holds one contiguous range of rows (see GetNumaNodeOfRow), first
+           touched by a thread pinned to it.*/
+        void SplitAcrossNumaNodes();
+        /* Precomputes ||x||^2 of every row (used to turn a tile of inner
+           products into squared euclidean distances). From then on the norms
+           are kept up to date by Resize(), PushBack() & SetPoint(); rows
+           written through GetMutableRowAtIndex() need another call.*/
+        void ComputeSquaredNorms();
+        bool HasSquaredNorms() const { return keep_squared_norms_; }
+        float GetSquaredNormAtIndex(const int index) const
+        {
+            return squared_norms_[index];
+        }
+        /* Orders the dimensions by decreasing variance over all rows.
+        Out: dimension IDs, the one with the largest variance first.*/
+        void GetDimensionsByDecreasingVariance(std::vector<unsigned>* dimensions) const;
+        /* Reorders the dimensions of every row: new row[d] = old row[dimensions[d]]
+           (squared norms do not change).*/
+        void PermuteDimensions(const std::vector<unsigned> &dimensions);
+        // Add a point to the end of the collection.
         void PushBack(const Point &point);
-        // Get point at back.
-        Point& GetPointAtBack();
-        
+        void PushBack(const PointView &point);
         // Add point to a given index.
         void SetPoint(const unsigned int index, const Point &point);
-        std::vector<Point>::iterator Begin();
-        void Erase(std::vector<Point>::iterator element);
+        void SetPoint(const unsigned int index, const PointView &point);
         void PopBack();
         // Prints a collection of points.
         void Print() const;
     private:
-        // Define a data structure that stores a collection of points.
-        std::vector<Point> multiple_points_;
+        /* Moves the rows into a new slab that can hold "capacity"# rows
+           of the given dimension. Padding and new rows are zeroed.*/
+        void Reallocate(const size_t capacity, const unsigned dimension);
+        // Recomputes the squared norm of a row, if norms are being kept.
+        void UpdateSquaredNorm(const size_t index);
+        // Aligned slab holding capacity_ rows of stride_ floats each.
+        float* data_ = nullptr;
+        size_t size_ = 0;
+        size_t capacity_ = 0;
+        unsigned dimension_ = 0;
+        unsigned stride_ = 0;
+        bool use_huge_pages_ = false;
+        // ||row||^2 of every row, valid when keep_squared_norms_ is set.
+        std::vector<float> squared_norms_;
+        bool keep_squared_norms_ = false;
 };
 #endif // __MULTIPLE_POINTS_H_INCLUDED__
@@ -0,0 +1,137 @@
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <thread>
+#include "numa_placement.h"
+
+bool ParseNumaMode(const std::string &name, NumaMode* numa_mode)
+{
+    if (name == "off") {
+        *numa_mode = NUMA_OFF;
+    } else if (name == "replicate") {
+        *numa_mode = NUMA_REPLICATE;
+    } else if (name == "split") {
+        *numa_mode = NUMA_SPLIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses a sysfs list such as "0-15,32-47".
+static std::vector<unsigned> ParseCpuList(const std::string &list)
+{
+    std::vector<unsigned> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ','))
+    {
+        if (range.empty() || (range[0] < '0') || (range[0] > '9')) {
+            continue;
+        }
+        size_t dash = range.find('-');
+        unsigned first = std::stoul(range.substr(0, dash));
+        unsigned last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+        for(unsigned cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// CPUs of every node, read once.
+static const std::vector<std::vector<unsigned>>& GetTopology()
+{
+    static const std::vector<std::vector<unsigned>> topology = [] {
+        std::vector<std::vector<unsigned>> nodes;
+        std::ifstream online_file("/sys/devices/system/node/online");
+        std::string online;
+        if (std::getline(online_file, online)) {
+            for(unsigned node : ParseCpuList(online))
+            {
+                std::ifstream cpu_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::string cpu_list;
+                std::getline(cpu_file, cpu_list);
+                std::vector<unsigned> cpus = ParseCpuList(cpu_list);
+                // Memory only nodes have no CPU to place anything from.
+                if (!cpus.empty()) {
+                    nodes.push_back(cpus);
+                }
+            }
+        }
+        if (nodes.empty()) {
+            nodes.emplace_back();
+            for(unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+            {
+                nodes.back().push_back(cpu);
+            }
+        }
+        return nodes;
+    }();
+    return topology;
+}
+
+unsigned GetNumNumaNodes()
+{
+    return GetTopology().size();
+}
+
+const std::vector<unsigned>& GetNumaNodeCpus(const unsigned node)
+{
+    return GetTopology()[node];
+}
+
+// Node the calling thread was pinned to (-1: not pinned).
+static thread_local int pinned_node = -1;
+
+bool PinThreadToNumaNode(const unsigned node)
+{
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for(unsigned cpu : GetNumaNodeCpus(node))
+    {
+        CPU_SET(cpu, &cpu_set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+        return false;
+    }
+    pinned_node = node;
+    return true;
+}
+
+unsigned GetCurrentNumaNode()
+{
+    if (pinned_node >= 0) {
+        return pinned_node;
+    }
+    int cpu = sched_getcpu();
+    const std::vector<std::vector<unsigned>>& topology = GetTopology();
+    for(unsigned node = 0; node < topology.size(); node++)
+    {
+        for(unsigned node_cpu : topology[node])
+        {
+            if ((int)node_cpu == cpu) {
+                return node;
+            }
+        }
+    }
+    return 0;
+}
+
+void RunOnEveryNumaNode(const std::function<void(unsigned)> &fn)
+{
+    std::vector<std::thread> threads;
+    for(unsigned node = 0; node < GetNumNumaNodes(); node++)
+    {
+        threads.emplace_back([&fn, node] {
+                PinThreadToNumaNode(node);
+                fn(node);
+                });
+    }
+    for(auto& thread : threads)
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __NUMA_PLACEMENT_H_INCLUDED__
+#define __NUMA_PLACEMENT_H_INCLUDED__
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// How a bucket server places its shard on a multi-socket machine.
+enum NumaMode {
+    // Wherever the loading thread first touches it.
+    NUMA_OFF = 0,
+    // One copy of the shard per NUMA node: every request reads local memory.
+    NUMA_REPLICATE = 1,
+    /* The shard's rows are split in one contiguous range per node, and
+       requests are steered to the node that holds most of their candidates.*/
+    NUMA_SPLIT = 2
+};
+
+/* Parses "off", "replicate" or "split".
+Out: true if the name is valid.*/
+bool ParseNumaMode(const std::string &name, NumaMode* numa_mode);
+
+/* NUMA topology, read from /sys/devices/system/node (no libnuma needed).
+   A machine without that directory is one node holding every CPU.*/
+unsigned GetNumNumaNodes();
+// CPUs of a node (node < GetNumNumaNodes()).
+const std::vector<unsigned>& GetNumaNodeCpus(const unsigned node);
+
+/* Pins the calling thread to the CPUs of a node: memory it touches first is
+   then allocated on that node. Returns false if the affinity could not be set.*/
+bool PinThreadToNumaNode(const unsigned node);
+
+/* Node of the calling thread: the one it was pinned to, or the node of the
+   CPU it runs on right now.*/
+unsigned GetCurrentNumaNode();
+
+/* Runs fn(node) on one thread per node, each pinned to its node, and returns
+   once they are all done.*/
+void RunOnEveryNumaNode(const std::function<void(unsigned)> &fn);
+
+/* Node whose range holds a row, when size rows are split across
+   num_nodes nodes (see NUMA_SPLIT).*/
+inline unsigned GetNumaNodeOfRow(const size_t row,
+        const size_t size,
+        const unsigned num_nodes)
+{
+    return (size == 0) ? 0 : (unsigned)((row * num_nodes) / size);
+}
+
+// First row of a node's range, when size rows are split across num_nodes nodes.
+inline size_t GetFirstRowOfNumaNode(const unsigned node,
+        const size_t size,
+        const unsigned num_nodes)
+{
+    // Smallest row with row * num_nodes / size >= node.
+    return ((size_t)node * size + num_nodes - 1) / num_nodes;
+}
+#endif //__NUMA_PLACEMENT_H_INCLUDED__
@@ -5,6 +5,26 @@
 
 #define CHECK(condition, error_message) if (!condition) {std::cerr << __FILE__ << ": " << __LINE__ << ": " << error_message << "\n"; exit(-1);}
 
+/* Read-only view of a point whose floats live elsewhere (e.g a row of
+   MultiplePoints). It does not own the floats, so it must not outlive
+   the storage it was created from.*/
+class PointView
+{
+    public:
+        PointView() = default;
+        PointView(const float* data, const unsigned size)
+            : data_(data), size_(size) {}
+        // Returns the float at a particular dimension (index).
+        float GetValueAtIndex(const int index) const { return data_[index]; }
+        // Returns the number of floats in the point (dimension).
+        unsigned GetSize() const { return size_; }
+        // Returns a pointer to the first float of the point.
+        const float* GetData() const { return data_; }
+    private:
+        const float* data_ = nullptr;
+        unsigned size_ = 0;
+};
+
 // Class to define/access a Point: floats for each dimension.
 class Point
 {
@@ -30,6 +50,8 @@ Out: the point object itself.*/
                 const int float_arr_size);
         // Returns the number of floats in the point (dimension).
         unsigned GetSize() const; 
+        // Returns a read-only view of this point.
+        PointView GetView() const { return PointView(point_.data(), point_.size()); }
         // Check if two points are equal.
         bool Equal(const Point &p) const;
         // Prints a point to terminal.
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "distance_kernels.h"
+#include "multiple_points.h"
+#include "product_quantizer.h"
+
+ProductQuantizer::~ProductQuantizer()
+{
+    free(codes_);
+}
+
+void ProductQuantizer::Train(const float* rows,
+        const size_t num_rows,
+        const unsigned dimension,
+        const unsigned num_subspaces,
+        const unsigned iterations,
+        const unsigned seed)
+{
+    CHECK(((num_subspaces != 0) && ((num_subspaces % 2) == 0) && (num_subspaces <= PQ_MAX_SUBSPACES)), "ERROR: Number of PQ subspaces must be even and at most " << PQ_MAX_SUBSPACES << "\n");
+    CHECK(((dimension % num_subspaces) == 0), "ERROR: Number of PQ subspaces must divide the number of dimensions\n");
+    CHECK((num_rows >= PQ_NUM_CENTROIDS), "ERROR: PQ training needs at least " << PQ_NUM_CENTROIDS << " points\n");
+    dimension_ = dimension;
+    num_subspaces_ = num_subspaces;
+    sub_dimension_ = dimension/num_subspaces;
+    centroids_.assign((size_t)num_subspaces_ * PQ_NUM_CENTROIDS * sub_dimension_, 0.0);
+
+    // Subspaces are independent k-means problems.
+#pragma omp parallel for schedule(dynamic)
+    for(int m = 0; m < (int)num_subspaces_; m++)
+    {
+        std::mt19937 random_engine(seed + m);
+        float* centroids = centroids_.data() + (size_t)m * PQ_NUM_CENTROIDS * sub_dimension_;
+        // Start from distinct random training points.
+        std::vector<size_t> picked;
+        while (picked.size() < PQ_NUM_CENTROIDS)
+        {
+            size_t row = random_engine() % num_rows;
+            if (std::find(picked.begin(), picked.end(), row) == picked.end()) {
+                memcpy(centroids + picked.size() * sub_dimension_, rows + row * dimension_ + m * sub_dimension_, sub_dimension_ * sizeof(float));
+                picked.push_back(row);
+            }
+        }
+        std::vector<double> sums(PQ_NUM_CENTROIDS * sub_dimension_);
+        std::vector<size_t> counts(PQ_NUM_CENTROIDS);
+        for(unsigned iteration = 0; iteration < iterations; iteration++)
+        {
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(counts.begin(), counts.end(), 0);
+            for(size_t r = 0; r < num_rows; r++)
+            {
+                const float* sub_vector = rows + r * dimension_ + m * sub_dimension_;
+                unsigned centroid = GetClosestCentroid(m, sub_vector);
+                counts[centroid]++;
+                for(unsigned d = 0; d < sub_dimension_; d++)
+                {
+                    sums[centroid * sub_dimension_ + d] += sub_vector[d];
+                }
+            }
+            for(unsigned c = 0; c < PQ_NUM_CENTROIDS; c++)
+            {
+                if (counts[c] == 0) {
+                    // Empty cluster: restart it from a random point.
+                    size_t row = random_engine() % num_rows;
+                    memcpy(centroids + c * sub_dimension_, rows + row * dimension_ + m * sub_dimension_, sub_dimension_ * sizeof(float));
+                    continue;
+                }
+                for(unsigned d = 0; d < sub_dimension_; d++)
+                {
+                    centroids[c * sub_dimension_ + d] = sums[c * sub_dimension_ + d]/counts[c];
+                }
+            }
+        }
+    }
+}
+
+void ProductQuantizer::SaveCodebook(const std::string &file_name) const
+{
+    FILE* file = fopen(file_name.c_str(), "wb");
+    CHECK((file != NULL), "ERROR: Could not create PQ codebook file\n");
+    PqCodebookHeader header;
+    memset(header.magic, 0, sizeof(header.magic));
+    memcpy(header.magic, PQ_CODEBOOK_MAGIC, strlen(PQ_CODEBOOK_MAGIC));
+    header.dimensions = dimension_;
+    header.num_subspaces = num_subspaces_;
+    CHECK((fwrite(&header, sizeof(header), 1, file) == 1), "ERROR: Could not write PQ codebook header\n");
+    CHECK((fwrite(centroids_.data(), sizeof(float), centroids_.size(), file) == centroids_.size()), "ERROR: Could not write PQ codebook\n");
+    fclose(file);
+}
+
+void ProductQuantizer::LoadCodebook(const std::string &file_name)
+{
+    FILE* file = fopen(file_name.c_str(), "rb");
+    CHECK((file != NULL), "ERROR: Could not open PQ codebook file\n");
+    PqCodebookHeader header;
+    CHECK((fread(&header, sizeof(header), 1, file) == 1), "ERROR: Could not read PQ codebook header\n");
+    CHECK((memcmp(header.magic, PQ_CODEBOOK_MAGIC, strlen(PQ_CODEBOOK_MAGIC) + 1) == 0), "ERROR: Not a PQ codebook file\n");
+    CHECK((header.version == PQ_CODEBOOK_VERSION), "ERROR: Unsupported PQ codebook version\n");
+    CHECK((header.num_centroids == PQ_NUM_CENTROIDS), "ERROR: PQ codebook must have " << PQ_NUM_CENTROIDS << " centroids per subspace\n");
+    CHECK(((header.num_subspaces != 0) && ((header.num_subspaces % 2) == 0) && (header.num_subspaces <= PQ_MAX_SUBSPACES)
+                && ((header.dimensions % header.num_subspaces) == 0)), "ERROR: PQ codebook has an invalid number of subspaces\n");
+    dimension_ = header.dimensions;
+    num_subspaces_ = header.num_subspaces;
+    sub_dimension_ = dimension_/num_subspaces_;
+    centroids_.resize((size_t)num_subspaces_ * PQ_NUM_CENTROIDS * sub_dimension_);
+    CHECK((fread(centroids_.data(), sizeof(float), centroids_.size(), file) == centroids_.size()), "ERROR: PQ codebook file is truncated\n");
+    fclose(file);
+}
+
+unsigned ProductQuantizer::GetClosestCentroid(const unsigned subspace, const float* sub_vector) const
+{
+    unsigned closest = 0;
+    float closest_distance = INFINITY;
+    for(unsigned c = 0; c < PQ_NUM_CENTROIDS; c++)
+    {
+        float distance = SquaredL2Distance(sub_vector, GetCentroid(subspace, c), sub_dimension_);
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest = c;
+        }
+    }
+    return closest;
+}
+
+void ProductQuantizer::Encode(const float* rows,
+        const size_t num_points,
+        const bool use_huge_pages)
+{
+    CHECK((num_subspaces_ != 0), "ERROR: PQ codebook must be trained or loaded before encoding\n");
+    CHECK((codes_ == nullptr), "ERROR: Points are already PQ encoded\n");
+    rows_ = rows;
+    size_ = num_points;
+    code_bytes_ = num_subspaces_/2;
+    size_t num_bytes = size_ * code_bytes_;
+    if (num_bytes == 0) {
+        return;
+    }
+    void* mem = nullptr;
+    size_t alignment = use_huge_pages ? HUGE_PAGE_BYTES : ROW_ALIGNMENT_BYTES;
+    CHECK((posix_memalign(&mem, alignment, num_bytes) == 0), "ERROR: Could not allocate memory for PQ codes\n");
+    if (use_huge_pages) {
+        // Best effort: the kernel may not have THP enabled.
+        madvise(mem, num_bytes, MADV_HUGEPAGE);
+    }
+    codes_ = static_cast<uint8_t*>(mem);
+    memset(codes_, 0, num_bytes);
+
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < (long)size_; i++)
+    {
+        const float* row = rows_ + (size_t)i * dimension_;
+        uint8_t* codes = codes_ + (size_t)i * code_bytes_;
+        for(unsigned m = 0; m < num_subspaces_; m++)
+        {
+            unsigned centroid = GetClosestCentroid(m, row + m * sub_dimension_);
+            codes[m/2] |= ((m % 2) == 0) ? centroid : (centroid << 4);
+        }
+    }
+}
+
+void ProductQuantizer::PrepareQuery(const PointView &query, PqQuery* prepared) const
+{
+    static thread_local std::vector<float> distances;
+    distances.resize((size_t)num_subspaces_ * PQ_NUM_CENTROIDS);
+    const float* values = query.GetData();
+    /* 8-bit tables: every subspace is shifted by its smallest distance (the
+       shifts add up to the bias) and all share one scale.*/
+    prepared->bias = 0.0;
+    float max_range = 0.0;
+    for(unsigned m = 0; m < num_subspaces_; m++)
+    {
+        float* subspace_distances = distances.data() + m * PQ_NUM_CENTROIDS;
+        for(unsigned c = 0; c < PQ_NUM_CENTROIDS; c++)
+        {
+            subspace_distances[c] = SquaredL2Distance(values + m * sub_dimension_, GetCentroid(m, c), sub_dimension_);
+        }
+        float minimum = *std::min_element(subspace_distances, subspace_distances + PQ_NUM_CENTROIDS);
+        float maximum = *std::max_element(subspace_distances, subspace_distances + PQ_NUM_CENTROIDS);
+        prepared->bias += minimum;
+        max_range = std::max(max_range, maximum - minimum);
+        for(unsigned c = 0; c < PQ_NUM_CENTROIDS; c++)
+        {
+            subspace_distances[c] -= minimum;
+        }
+    }
+    prepared->scale = (max_range == 0.0) ? 1.0 : (max_range/255);
+    prepared->tables.resize(distances.size());
+    for(size_t i = 0; i < distances.size(); i++)
+    {
+        prepared->tables[i] = (uint8_t)std::min(255.0f, std::round(distances[i]/prepared->scale));
+    }
+}
+
+void ProductQuantizer::ApproximateSquaredDistances(const PqQuery &query,
+        const uint32_t* point_ids,
+        const size_t num_point_ids,
+        float* distances) const
+{
+    // Codes of a block of candidates, transposed for the lookup kernel.
+    static thread_local std::vector<uint8_t> block_codes;
+    uint16_t sums[PQ_LOOKUP_BLOCK_SIZE];
+    block_codes.assign(code_bytes_ * PQ_LOOKUP_BLOCK_SIZE, 0);
+    const PqLookupKernel pq_lookup = GetDistanceKernels().pq_lookup;
+    for(size_t block_start = 0; block_start < num_point_ids; block_start += PQ_LOOKUP_BLOCK_SIZE)
+    {
+        size_t block_size = std::min((size_t)PQ_LOOKUP_BLOCK_SIZE, num_point_ids - block_start);
+        for(size_t i = 0; i < block_size; i++)
+        {
+            const uint8_t* codes = codes_ + (size_t)point_ids[block_start + i] * code_bytes_;
+            for(size_t j = 0; j < code_bytes_; j++)
+            {
+                block_codes[j * PQ_LOOKUP_BLOCK_SIZE + i] = codes[j];
+            }
+        }
+        pq_lookup(query.tables.data(), num_subspaces_, block_codes.data(), sums);
+        for(size_t i = 0; i < block_size; i++)
+        {
+            distances[block_start + i] = query.bias + (query.scale * sums[i]);
+        }
+    }
+}
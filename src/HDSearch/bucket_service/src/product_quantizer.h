@@ -0,0 +1,103 @@
+#ifndef __PRODUCT_QUANTIZER_H_INCLUDED__
+#define __PRODUCT_QUANTIZER_H_INCLUDED__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "point.h"
+
+#define PQ_CODEBOOK_MAGIC "HDSPQCB"
+#define PQ_CODEBOOK_VERSION 1
+/* 4-bit codes: the lookup table of a subspace (16 distances) fits in one
+   16-byte shuffle, see PqLookupKernel.*/
+#define PQ_NUM_CENTROIDS 16
+// Lookup tables are 8-bit and sums 16-bit, so at most 65535/255 subspaces.
+#define PQ_MAX_SUBSPACES 256
+
+/* Codebook file: header, then num_subspaces x num_centroids centroids of
+   dimensions/num_subspaces floats each (subspace major).*/
+struct PqCodebookHeader {
+    char magic[8];
+    uint32_t version = PQ_CODEBOOK_VERSION;
+    uint32_t dimensions = 0;
+    uint32_t num_subspaces = 0;
+    uint32_t num_centroids = PQ_NUM_CENTROIDS;
+};
+
+/* A query, prepared once for asymmetric distances to every point of a
+   ProductQuantizer shard: for every subspace, the distances from the query's
+   sub-vector to the 16 centroids, quantized to 8 bits
+   (distance ~ bias + scale * sum of table entries).*/
+struct PqQuery {
+    std::vector<uint8_t> tables;
+    float bias = 0.0;
+    float scale = 1.0;
+};
+
+/* Product quantization of a dataset shard: points are split into
+   num_subspaces sub-vectors, and each sub-vector is replaced by the 4-bit ID
+   of its closest centroid (k-means, trained offline by tools/train_pq).
+   A 2048-d point then takes num_subspaces/2 bytes instead of 8KB.
+   Distances are asymmetric (exact query vs quantized point) and are
+   computed with per-query lookup tables. As with QuantizedPoints, the fp32
+   rows are not copied and are only read to re-rank.*/
+class ProductQuantizer
+{
+    public:
+        ProductQuantizer() = default;
+        ProductQuantizer(const ProductQuantizer&) = delete;
+        ProductQuantizer& operator=(const ProductQuantizer&) = delete;
+        ~ProductQuantizer();
+        /* Trains the codebook: k-means with PQ_NUM_CENTROIDS centroids in
+           every subspace.
+        In: training rows (contiguous, "dimension" floats each), number of
+        subspaces (even, divides dimension), k-means iterations, random seed.*/
+        void Train(const float* rows,
+                const size_t num_rows,
+                const unsigned dimension,
+                const unsigned num_subspaces,
+                const unsigned iterations,
+                const unsigned seed);
+        void SaveCodebook(const std::string &file_name) const;
+        void LoadCodebook(const std::string &file_name);
+        /* Encodes "num_points" contiguous rows with the codebook. The rows
+           must outlive this object: they are used to re-rank.*/
+        void Encode(const float* rows,
+                const size_t num_points,
+                const bool use_huge_pages);
+        size_t GetSize() const { return size_; }
+        unsigned GetPointDimension() const { return dimension_; }
+        unsigned GetNumSubspaces() const { return num_subspaces_; }
+        // Bytes taken by the codes.
+        size_t GetMemorySize() const { return size_ * code_bytes_; }
+        void PrepareQuery(const PointView &query, PqQuery* prepared) const;
+        /* Approximate squared distances from a prepared query to some points,
+           scored in blocks of PQ_LOOKUP_BLOCK_SIZE with shuffle-based lookups.
+        Out: distances[i] is the distance to point_ids[i].*/
+        void ApproximateSquaredDistances(const PqQuery &query,
+                const uint32_t* point_ids,
+                const size_t num_point_ids,
+                float* distances) const;
+        // Full precision point, for exact re-ranking (no copy).
+        PointView GetFullPrecisionPointAtIndex(const uint32_t index) const
+        {
+            return PointView(rows_ + (size_t)index * dimension_, dimension_);
+        }
+    private:
+        // Closest centroid of a sub-vector in a subspace.
+        unsigned GetClosestCentroid(const unsigned subspace, const float* sub_vector) const;
+        const float* GetCentroid(const unsigned subspace, const unsigned centroid) const
+        {
+            return centroids_.data() + ((size_t)subspace * PQ_NUM_CENTROIDS + centroid) * sub_dimension_;
+        }
+        unsigned dimension_ = 0;
+        unsigned num_subspaces_ = 0;
+        unsigned sub_dimension_ = 0;
+        std::vector<float> centroids_;
+        // size_ rows of code_bytes_ bytes: subspaces 2j & 2j+1 in the low & high nibble of byte j.
+        uint8_t* codes_ = nullptr;
+        size_t size_ = 0;
+        size_t code_bytes_ = 0;
+        const float* rows_ = nullptr;
+};
+#endif //__PRODUCT_QUANTIZER_H_INCLUDED__
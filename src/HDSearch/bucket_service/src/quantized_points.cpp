@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cmath>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "distance_kernels.h"
+#include "multiple_points.h"
+#include "quantized_points.h"
+
+// Largest 7-bit code (see Int8InnerProductKernel).
+#define INT8_CODE_MAX 127
+// Rows are padded to this many bytes, so kernels never handle tails.
+#define CODE_ROW_ALIGNMENT_BYTES 64
+
+bool ParsePointStorage(const std::string &name, PointStorage* storage)
+{
+    if (name == "fp32") {
+        *storage = FP32_STORAGE;
+    } else if (name == "int8") {
+        *storage = INT8_STORAGE;
+    } else if (name == "fp16") {
+        *storage = FP16_STORAGE;
+    } else if (name == "pq") {
+        *storage = PQ_STORAGE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+QuantizedPoints::~QuantizedPoints()
+{
+    free(codes_);
+}
+
+void QuantizedPoints::Quantize(const float* rows,
+        const size_t num_points,
+        const unsigned dimension,
+        const PointStorage storage,
+        const bool use_huge_pages)
+{
+    CHECK(((storage == INT8_STORAGE) || (storage == FP16_STORAGE)), "ERROR: Quantized points must be stored as int8 or fp16\n");
+    CHECK((codes_ == nullptr), "ERROR: Points are already quantized\n");
+    rows_ = rows;
+    size_ = num_points;
+    dimension_ = dimension;
+    storage_ = storage;
+    if (storage == INT8_STORAGE) {
+        kernel_dimensions_ = ((dimension + CODE_ROW_ALIGNMENT_BYTES - 1)/CODE_ROW_ALIGNMENT_BYTES) * CODE_ROW_ALIGNMENT_BYTES;
+        row_bytes_ = kernel_dimensions_;
+    } else {
+        // 16 halves per AVX-512 conversion.
+        kernel_dimensions_ = ((dimension + 15)/16) * 16;
+        row_bytes_ = ((kernel_dimensions_ * sizeof(uint16_t) + CODE_ROW_ALIGNMENT_BYTES - 1)/CODE_ROW_ALIGNMENT_BYTES) * CODE_ROW_ALIGNMENT_BYTES;
+    }
+    size_t num_bytes = size_ * row_bytes_;
+    if (num_bytes == 0) {
+        return;
+    }
+    void* mem = nullptr;
+    size_t alignment = use_huge_pages ? HUGE_PAGE_BYTES : CODE_ROW_ALIGNMENT_BYTES;
+    CHECK((posix_memalign(&mem, alignment, num_bytes) == 0), "ERROR: Could not allocate aligned memory for quantized points\n");
+    if (use_huge_pages) {
+        // Best effort: the kernel may not have THP enabled.
+        madvise(mem, num_bytes, MADV_HUGEPAGE);
+    }
+    codes_ = static_cast<unsigned char*>(mem);
+    memset(codes_, 0, num_bytes);
+
+    if (storage == FP16_STORAGE) {
+#pragma omp parallel for schedule(static)
+        for(long i = 0; i < (long)size_; i++)
+        {
+            const float* row = rows_ + (size_t)i * dimension_;
+            uint16_t* codes = reinterpret_cast<uint16_t*>(codes_ + (size_t)i * row_bytes_);
+            for(unsigned d = 0; d < dimension_; d++)
+            {
+                codes[d] = FloatToHalf(row[d]);
+            }
+        }
+        return;
+    }
+
+    // int8: per-dimension range over the shard.
+    minimums_.assign(dimension_, INFINITY);
+    std::vector<float> maximums(dimension_, -INFINITY);
+#pragma omp parallel
+    {
+        std::vector<float> thread_minimums(dimension_, INFINITY), thread_maximums(dimension_, -INFINITY);
+#pragma omp for schedule(static)
+        for(long i = 0; i < (long)size_; i++)
+        {
+            const float* row = rows_ + (size_t)i * dimension_;
+            for(unsigned d = 0; d < dimension_; d++)
+            {
+                thread_minimums[d] = std::min(thread_minimums[d], row[d]);
+                thread_maximums[d] = std::max(thread_maximums[d], row[d]);
+            }
+        }
+#pragma omp critical
+        {
+            for(unsigned d = 0; d < dimension_; d++)
+            {
+                minimums_[d] = std::min(minimums_[d], thread_minimums[d]);
+                maximums[d] = std::max(maximums[d], thread_maximums[d]);
+            }
+        }
+    }
+    scales_.resize(dimension_);
+    for(unsigned d = 0; d < dimension_; d++)
+    {
+        scales_[d] = (maximums[d] - minimums_[d])/INT8_CODE_MAX;
+    }
+
+    squared_norms_.resize(size_);
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < (long)size_; i++)
+    {
+        const float* row = rows_ + (size_t)i * dimension_;
+        unsigned char* codes = codes_ + (size_t)i * row_bytes_;
+        float squared_norm = 0.0;
+        for(unsigned d = 0; d < dimension_; d++)
+        {
+            float code = (scales_[d] == 0.0) ? 0.0 : std::round((row[d] - minimums_[d])/scales_[d]);
+            code = std::min(std::max(code, 0.0f), (float)INT8_CODE_MAX);
+            codes[d] = (unsigned char)code;
+            // Norm of what the codes represent, so approximate distances stay consistent.
+            float value = minimums_[d] + (scales_[d] * code);
+            squared_norm += value * value;
+        }
+        squared_norms_[i] = squared_norm;
+    }
+}
+
+void QuantizedPoints::PrepareQuery(const PointView &query,
+        QuantizedQuery* prepared) const
+{
+    const float* values = query.GetData();
+    prepared->squared_norm = 0.0;
+    for(unsigned d = 0; d < dimension_; d++)
+    {
+        prepared->squared_norm += values[d] * values[d];
+    }
+    if (storage_ == FP16_STORAGE) {
+        prepared->values.assign(kernel_dimensions_, 0.0);
+        std::copy(values, values + dimension_, prepared->values.begin());
+        return;
+    }
+    /* <q, x> = sum(q[d] * minimum[d]) + sum(q[d] * scale[d] * code[d]):
+       the first sum is per query, the second is an int8 inner product
+       once q[d] * scale[d] is quantized too (symmetric, per query).*/
+    prepared->offset_dot = 0.0;
+    float max_magnitude = 0.0;
+    for(unsigned d = 0; d < dimension_; d++)
+    {
+        prepared->offset_dot += values[d] * minimums_[d];
+        max_magnitude = std::max(max_magnitude, std::fabs(values[d] * scales_[d]));
+    }
+    prepared->code_scale = max_magnitude/INT8_CODE_MAX;
+    prepared->codes.assign(kernel_dimensions_, 0);
+    if (prepared->code_scale == 0.0) {
+        return;
+    }
+    for(unsigned d = 0; d < dimension_; d++)
+    {
+        prepared->codes[d] = (int8_t)std::round((values[d] * scales_[d])/prepared->code_scale);
+    }
+}
+
+float QuantizedPoints::ApproximateSquaredDistance(const QuantizedQuery &query,
+        const uint32_t index) const
+{
+    if (storage_ == FP16_STORAGE) {
+        return GetDistanceKernels().half_squared_l2(query.values.data(),
+                reinterpret_cast<const uint16_t*>(GetCodesAtIndex(index)),
+                kernel_dimensions_);
+    }
+    int32_t code_dot = GetDistanceKernels().int8_inner_product(GetCodesAtIndex(index),
+            query.codes.data(),
+            kernel_dimensions_);
+    float dot = query.offset_dot + (query.code_scale * code_dot);
+    return query.squared_norm + squared_norms_[index] - (2 * dot);
+}
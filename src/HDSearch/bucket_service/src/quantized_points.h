@@ -0,0 +1,91 @@
+#ifndef __QUANTIZED_POINTS_H_INCLUDED__
+#define __QUANTIZED_POINTS_H_INCLUDED__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "point.h"
+
+// How a bucket server keeps its dataset shard in memory.
+enum PointStorage {
+    FP32_STORAGE = 0,
+    INT8_STORAGE = 1,
+    FP16_STORAGE = 2,
+    // Product quantization codes (see ProductQuantizer).
+    PQ_STORAGE = 3
+};
+
+/* Parses "fp32", "int8", "fp16" or "pq".
+Out: true if the name is valid.*/
+bool ParsePointStorage(const std::string &name, PointStorage* storage);
+
+/* A query, prepared once for approximate distances to every point of a
+   QuantizedPoints shard.*/
+struct QuantizedQuery {
+    // int8: codes of query[d] * scale[d], <query, x> ~ offset_dot + code_scale * <codes, x codes>.
+    std::vector<int8_t> codes;
+    float code_scale = 0.0;
+    float offset_dot = 0.0;
+    // fp16: the query, zero padded to the kernel's dimensions.
+    std::vector<float> values;
+    float squared_norm = 0.0;
+};
+
+/* Dataset shard kept as int8 (4x smaller than fp32) or fp16 (2x smaller)
+   codes, for approximate distances with integer/F16C kernels.
+   The fp32 rows are not copied: they stay where they come from (e.g the
+   mapped dataset file, i.e on disk) and are only read to re-rank the best
+   approximate candidates with exact distances.
+   int8: every dimension d is quantized over its range in the shard,
+   x[d] ~ minimum[d] + scale[d] * code[d], with 7-bit codes (see
+   Int8InnerProductKernel). Rows are zero padded to 64 bytes.*/
+class QuantizedPoints
+{
+    public:
+        QuantizedPoints() = default;
+        QuantizedPoints(const QuantizedPoints&) = delete;
+        QuantizedPoints& operator=(const QuantizedPoints&) = delete;
+        ~QuantizedPoints();
+        /* Quantizes "num_points" contiguous rows of "dimension" floats.
+           In: the rows (must outlive this object: they are used to re-rank),
+           storage (INT8_STORAGE or FP16_STORAGE), whether to back the codes
+           with transparent huge pages.*/
+        void Quantize(const float* rows,
+                const size_t num_points,
+                const unsigned dimension,
+                const PointStorage storage,
+                const bool use_huge_pages);
+        size_t GetSize() const { return size_; }
+        unsigned GetPointDimension() const { return dimension_; }
+        PointStorage GetStorage() const { return storage_; }
+        // Bytes taken by the codes.
+        size_t GetMemorySize() const { return size_ * row_bytes_; }
+        void PrepareQuery(const PointView &query, QuantizedQuery* prepared) const;
+        // Approximate squared euclidean distance between a prepared query and a point.
+        float ApproximateSquaredDistance(const QuantizedQuery &query,
+                const uint32_t index) const;
+        // Full precision point, for exact re-ranking (no copy).
+        PointView GetFullPrecisionPointAtIndex(const uint32_t index) const
+        {
+            return PointView(rows_ + (size_t)index * dimension_, dimension_);
+        }
+    private:
+        const unsigned char* GetCodesAtIndex(const uint32_t index) const
+        {
+            return codes_ + (size_t)index * row_bytes_;
+        }
+        // Aligned slab of size_ rows of row_bytes_ bytes each.
+        unsigned char* codes_ = nullptr;
+        size_t size_ = 0;
+        size_t row_bytes_ = 0;
+        unsigned dimension_ = 0;
+        // Dimensions the kernels run over (dimension_ rounded up, zero padded).
+        unsigned kernel_dimensions_ = 0;
+        PointStorage storage_ = FP32_STORAGE;
+        // int8: per-dimension range, and ||x||^2 of the dequantized rows.
+        std::vector<float> minimums_;
+        std::vector<float> scales_;
+        std::vector<float> squared_norms_;
+        const float* rows_ = nullptr;
+};
+#endif //__QUANTIZED_POINTS_H_INCLUDED__
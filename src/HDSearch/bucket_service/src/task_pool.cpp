@@ -0,0 +1,142 @@
+#include <algorithm>
+#include "task_pool.h"
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for(auto& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+void TaskPool::Start(const unsigned num_workers, const unsigned num_cores)
+{
+    num_cores_ = num_cores;
+    for(unsigned i = 0; i < num_workers; i++)
+    {
+        queues_.emplace_back(new WorkerQueue());
+    }
+    // All deques exist before any worker starts stealing from them.
+    for(unsigned i = 0; i < num_workers; i++)
+    {
+        workers_.emplace_back(&TaskPool::WorkerLoop, this, i);
+    }
+}
+
+unsigned TaskPool::GetIdleCores() const
+{
+    int idle_cores = (int)num_cores_ - busy_.load(std::memory_order_relaxed);
+    return (idle_cores > 0) ? idle_cores : 0;
+}
+
+void TaskPool::Run(const unsigned num_tasks,
+        const unsigned num_helpers,
+        const std::function<void(unsigned)> &task)
+{
+    unsigned helpers = std::min(num_helpers, GetNumWorkers());
+    if ((helpers == 0) || (num_tasks < 2)) {
+        for(unsigned i = 0; i < num_tasks; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    TaskGroup group;
+    group.task = &task;
+    group.remaining.store(num_tasks);
+    // Deal the tasks out round robin over the helpers' deques.
+    unsigned first_queue = next_queue_.fetch_add(helpers) % GetNumWorkers();
+    for(unsigned h = 0; h < helpers; h++)
+    {
+        WorkerQueue* queue = queues_[(first_queue + h) % GetNumWorkers()].get();
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        for(unsigned i = h; i < num_tasks; i += helpers)
+        {
+            queue->tasks.push_back(Task{&group, i});
+        }
+    }
+    queued_ += num_tasks;
+    {
+        // Taking the lock orders the wake up after a worker's emptiness check.
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_all();
+
+    // The calling thread works too, until the whole group is done.
+    while (group.remaining.load(std::memory_order_acquire) != 0)
+    {
+        Task stolen_task;
+        if (StealTask(first_queue, &group, &stolen_task)) {
+            RunTask(stolen_task);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void TaskPool::WorkerLoop(const unsigned worker)
+{
+    while (true)
+    {
+        Task task;
+        if (PopTask(worker, &task) || StealTask(worker + 1, nullptr, &task)) {
+            busy_++;
+            RunTask(task);
+            busy_--;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this]() { return stop_ || (queued_.load() != 0); });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+bool TaskPool::PopTask(const unsigned worker, Task* task)
+{
+    WorkerQueue* queue = queues_[worker].get();
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (queue->tasks.empty()) {
+        return false;
+    }
+    *task = queue->tasks.back();
+    queue->tasks.pop_back();
+    queued_--;
+    return true;
+}
+
+bool TaskPool::StealTask(const unsigned first_worker,
+        const TaskGroup* group,
+        Task* task)
+{
+    unsigned num_workers = GetNumWorkers();
+    for(unsigned i = 0; i < num_workers; i++)
+    {
+        WorkerQueue* queue = queues_[(first_worker + i) % num_workers].get();
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        for(auto it = queue->tasks.begin(); it != queue->tasks.end(); ++it)
+        {
+            if ((group == nullptr) || (it->group == group)) {
+                *task = *it;
+                queue->tasks.erase(it);
+                queued_--;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void TaskPool::RunTask(const Task &task)
+{
+    (*task.group->task)(task.index);
+    // Release: the caller may read what the task wrote once remaining is 0.
+    task.group->remaining.fetch_sub(1, std::memory_order_release);
+}
@@ -0,0 +1,96 @@
+#ifndef __TASK_POOL_H_INCLUDED__
+#define __TASK_POOL_H_INCLUDED__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Persistent pool of worker threads, used to split the work of one request
+   across cores that are idle. Threads are started once, so nothing is
+   created per request (unlike a nested OpenMP region, which also stacks its
+   threads on top of the request handler threads under load).
+   Each worker owns a task deque: it runs its own tasks newest first and,
+   once it runs dry, steals the oldest tasks of the other workers. The thread
+   that submits a group of tasks runs (steals) tasks of that group too, until
+   the group is done. It never picks up tasks of other groups, so a task may
+   itself call Run() (e.g a query task that splits its candidate scan) while
+   the thread's per-thread scratch space is in use.*/
+class TaskPool
+{
+    public:
+        TaskPool() = default;
+        TaskPool(const TaskPool&) = delete;
+        TaskPool& operator=(const TaskPool&) = delete;
+        ~TaskPool();
+        /* Starts num_workers threads. num_cores is the number of cores the
+           process may use, request handler threads included (see GetIdleCores).*/
+        void Start(const unsigned num_workers, const unsigned num_cores);
+        unsigned GetNumWorkers() const { return queues_.size(); }
+        /* Number of cores that are neither running a request (see BusyScope)
+           nor a task right now, i.e how many helpers a request can use without
+           oversubscribing the machine.*/
+        unsigned GetIdleCores() const;
+        /* Runs task(0) ... task(num_tasks - 1) on the calling thread and on
+           (at most) num_helpers workers. Returns once every task is done.*/
+        void Run(const unsigned num_tasks,
+                const unsigned num_helpers,
+                const std::function<void(unsigned)> &task);
+
+        // Counts the calling thread as busy while the scope is alive.
+        class BusyScope
+        {
+            public:
+                explicit BusyScope(TaskPool* task_pool) : task_pool_(task_pool)
+                {
+                    task_pool_->busy_++;
+                }
+                ~BusyScope()
+                {
+                    task_pool_->busy_--;
+                }
+            private:
+                TaskPool* task_pool_;
+        };
+    private:
+        // Tasks submitted by one call to Run().
+        struct TaskGroup {
+            const std::function<void(unsigned)>* task;
+            std::atomic<unsigned> remaining;
+        };
+        struct Task {
+            TaskGroup* group;
+            unsigned index;
+        };
+        struct WorkerQueue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+        void WorkerLoop(const unsigned worker);
+        // Pops the newest task of a worker's own deque.
+        bool PopTask(const unsigned worker, Task* task);
+        /* Takes the oldest task of any deque, starting at the given one.
+           Only tasks of the given group, if one is given.*/
+        bool StealTask(const unsigned first_worker,
+                const TaskGroup* group,
+                Task* task);
+        void RunTask(const Task &task);
+
+        std::vector<std::thread> workers_;
+        std::vector<std::unique_ptr<WorkerQueue>> queues_;
+        // Tasks sitting in the deques; workers sleep while it is 0.
+        std::atomic<unsigned> queued_{0};
+        // Request handlers + workers that are running something.
+        std::atomic<int> busy_{0};
+        // Deque the next group starts filling, so groups spread over workers.
+        std::atomic<unsigned> next_queue_{0};
+        std::mutex sleep_mutex_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+        unsigned num_cores_ = 1;
+};
+#endif //__TASK_POOL_H_INCLUDED__
@@ -1,6 +1,16 @@
+#include <pthread.h>
+#include <sched.h>
 #include <thread>
 
 unsigned int GetNumProcs()
 {
     return std::thread::hardware_concurrency();
 }
+
+bool PinThreadToCore(const unsigned int core)
+{
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(core % GetNumProcs(), &cpu_set);
+    return (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0);
+}
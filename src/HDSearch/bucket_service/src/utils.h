@@ -2,5 +2,8 @@
 #define __UTILS_H_INCLUDED__
 
 unsigned int GetNumProcs();
+/* Pin the calling thread to a core (modulo the number of cores).
+   Returns false if the affinity could not be set.*/
+bool PinThreadToCore(const unsigned int core);
 
 #endif //__UTILS_H_INCLUDED__
@@ -0,0 +1,57 @@
+/* Converts a legacy binary dataset (raw float32 values, nothing else) into
+   the versioned dataset format read by bucket_server: a header with the
+   number of points, dimensions, value type and a shard table, followed by
+   the points themselves (see bucket_service/src/dataset_file.h).*/
+
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include "bucket_service/src/dataset_file.h"
+
+int main(int argc, char** argv) {
+    if (argc != 5) {
+        CHECK(false, "Format: ./<convert_dataset> <legacy binary dataset file> <number of dimensions> <number of shards (bucket servers)> <output dataset file>\n");
+    }
+    std::string input_file_name = argv[1];
+    std::string output_file_name = argv[4];
+    unsigned int dimensions = 0, num_shards = 0;
+    try
+    {
+        dimensions = std::stoul(argv[2], nullptr, 0);
+        num_shards = std::stoul(argv[3], nullptr, 0);
+    }
+    catch (...)
+    {
+        CHECK(false, "Enter a valid number for number of dimensions/ number of shards\n");
+    }
+    CHECK(((dimensions > 0) && (num_shards > 0)), "ERROR: Number of dimensions and shards must be positive\n");
+
+    FILE* input = fopen(input_file_name.c_str(), "rb");
+    CHECK((input != NULL), "ERROR: Could not open legacy dataset file\n");
+    struct stat file_stat;
+    CHECK((fstat(fileno(input), &file_stat) == 0), "ERROR: Could not get the size of the legacy dataset file\n");
+    uint64_t num_points = (file_stat.st_size/sizeof(float))/dimensions;
+    if ((num_points * dimensions * sizeof(float)) != (uint64_t)file_stat.st_size) {
+        std::cout << "Ignoring trailing bytes that do not make up a whole point\n";
+    }
+
+    FILE* output = fopen(output_file_name.c_str(), "wb");
+    CHECK((output != NULL), "ERROR: Could not create output dataset file\n");
+    WriteDatasetFileHeader(output, num_points, dimensions, num_shards);
+
+    // Copy points in chunks of 4096.
+    std::vector<float> chunk(4096 * (size_t)dimensions);
+    uint64_t points_left = num_points;
+    while (points_left > 0)
+    {
+        size_t points_in_chunk = std::min<uint64_t>(points_left, 4096);
+        size_t floats_in_chunk = points_in_chunk * dimensions;
+        CHECK((fread(chunk.data(), sizeof(float), floats_in_chunk, input) == floats_in_chunk), "ERROR: Could not read legacy dataset file\n");
+        CHECK((fwrite(chunk.data(), sizeof(float), floats_in_chunk, output) == floats_in_chunk), "ERROR: Could not write output dataset file\n");
+        points_left -= points_in_chunk;
+    }
+    fclose(input);
+    CHECK((fclose(output) == 0), "ERROR: Could not write output dataset file\n");
+    std::cout << "Wrote " << num_points << " points of " << dimensions << " dimensions in " << num_shards << " shards\n";
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* Trains the product quantization codebook that bucket_server encodes its
+   shard with when it runs with --storage=pq: k-means with 16 centroids in
+   each subspace, over a sample of the dataset's points
+   (see bucket_service/src/product_quantizer.h).*/
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string.h>
+#include "bucket_service/src/dataset_file.h"
+#include "bucket_service/src/product_quantizer.h"
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        CHECK(false, "Format: ./<train_pq> <dataset file> <number of subspaces> <output codebook file> [--dimensions=<dimensions of a legacy binary dataset>] [--iterations=N] [--max_training_points=N]\n");
+    }
+    std::string dataset_file_name = argv[1];
+    std::string codebook_file_name = argv[3];
+    unsigned int num_subspaces = 0, dimensions = 2048, iterations = 25;
+    uint64_t max_training_points = 65536;
+    try
+    {
+        num_subspaces = std::stoul(argv[2], nullptr, 0);
+        for(int i = 4; i < argc; i++)
+        {
+            std::string flag = argv[i];
+            std::string value = "";
+            size_t equals = flag.find('=');
+            if (equals != std::string::npos) {
+                value = flag.substr(equals + 1);
+                flag = flag.substr(0, equals);
+            }
+            if (flag == "--dimensions") {
+                dimensions = std::stoul(value, nullptr, 0);
+            } else if (flag == "--iterations") {
+                iterations = std::stoul(value, nullptr, 0);
+            } else if (flag == "--max_training_points") {
+                max_training_points = std::stoull(value, nullptr, 0);
+            } else {
+                CHECK(false, "ERROR: Unknown train_pq flag " << flag << "\n");
+            }
+        }
+    }
+    catch (...)
+    {
+        CHECK(false, "Enter a valid number for number of subspaces/ dimensions/ iterations/ max training points\n");
+    }
+
+    DatasetFile corpus;
+    corpus.Open(dataset_file_name, dimensions);
+    dimensions = corpus.GetPointDimension();
+    // Uniform sample (without replacement) of the whole corpus.
+    std::vector<uint64_t> sample(corpus.GetSize());
+    for(uint64_t i = 0; i < sample.size(); i++)
+    {
+        sample[i] = i;
+    }
+    std::mt19937_64 random_engine(0);
+    if (sample.size() > max_training_points) {
+        std::shuffle(sample.begin(), sample.end(), random_engine);
+        sample.resize(max_training_points);
+        std::sort(sample.begin(), sample.end());
+    }
+    std::vector<float> training_points(sample.size() * dimensions);
+    for(size_t i = 0; i < sample.size(); i++)
+    {
+        memcpy(training_points.data() + i * dimensions,
+                corpus.GetPointViewAtIndex(sample[i]).GetData(),
+                dimensions * sizeof(float));
+    }
+    std::cout << "Training " << num_subspaces << " subspaces on " << sample.size() << " points of " << dimensions << " dimensions\n";
+
+    ProductQuantizer pq;
+    pq.Train(training_points.data(), sample.size(), dimensions, num_subspaces, iterations, 0);
+    pq.SaveCodebook(codebook_file_name);
+    std::cout << "Wrote codebook: " << (num_subspaces/2) << " bytes per point\n";
+    return 0;
+}
@@ -58,7 +58,7 @@ class LoadGenIndexClient {
                 const bool last_request) {
             uint64_t start = GetTimeInMicro();
             // Get the dimension
-            int dimension = queries->GetPointAtIndex(0).GetSize();
+            int dimension = queries->GetPointDimension();
             // Declare the set of queries & #NN that must be sent.
             LoadGenRequest load_gen_request;
 
@@ -284,7 +284,7 @@ class LoadGenIndexClient {
                             last_request);
                     requests_sent++;
                     query_id = rand() % QUERIES_TOTAL;
-                    query.SetPoint(0, queries.GetPointAtIndex(query_id));
+                    query.SetPoint(0, queries.GetPointViewAtIndex(query_id));
                 }
                 curr_time = (double)GetTimeInMicro();
             }
@@ -321,7 +321,7 @@ class LoadGenIndexClient {
                     }
                     requests_sent++;
                     query_id = rand() % QUERIES_TOTAL;
-                    query.SetPoint(0, queries.GetPointAtIndex(query_id));
+                    query.SetPoint(0, queries.GetPointViewAtIndex(query_id));
                 }
                 curr_time = (double)GetTimeInMicro();
             }
@@ -59,7 +59,7 @@ class LoadGenIndexClient {
                 const bool kill) {
             uint64_t start = GetTimeInMicro();
             // Get the dimension
-            int dimension = queries->GetPointAtIndex(0).GetSize();
+            int dimension = queries->GetPointDimension();
             // Declare the set of queries & #NN that must be sent.
             LoadGenRequest load_gen_request;
             load_gen_request.set_kill(kill);
@@ -326,7 +326,7 @@ int main(int argc, char** argv) {
             next_time = distribution(generator) + curr_time;
             index = rand() % queries_size;
 
-            query.SetPoint(0, queries.GetPointAtIndex(index));
+            query.SetPoint(0, queries.GetPointViewAtIndex(index));
         } 
         curr_time = (double)GetTimeInMicro();
     }
@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <math.h>
+#include "budget_controller.h"
+
+static unsigned int Interpolate(const unsigned int min_value,
+        const unsigned int max_value,
+        const double level)
+{
+    return min_value + (unsigned int)lround(level * (max_value - min_value));
+}
+
+void BudgetController::Initialize(const uint64_t p99_target_us,
+        const unsigned int min_candidate_budget,
+        const unsigned int max_candidate_budget,
+        const unsigned int min_probe_budget,
+        const unsigned int max_probe_budget)
+{
+    p99_target_us_ = p99_target_us;
+    min_candidate_budget_ = min_candidate_budget;
+    max_candidate_budget_ = max_candidate_budget;
+    min_probe_budget_ = min_probe_budget;
+    max_probe_budget_ = max_probe_budget;
+    latencies_.reserve(BUDGET_CONTROLLER_WINDOW);
+    level_ = 1;
+    candidate_budget_.store(max_candidate_budget, std::memory_order_relaxed);
+    probe_budget_.store(max_probe_budget, std::memory_order_relaxed);
+}
+
+void BudgetController::RequestStarted()
+{
+    in_flight_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BudgetController::RequestFinished(const uint64_t latency_us)
+{
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    if (!IsEnabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    latencies_.push_back(latency_us);
+    if (latencies_.size() == BUDGET_CONTROLLER_WINDOW) {
+        Adjust();
+        latencies_.clear();
+    }
+}
+
+void BudgetController::GetBudgets(unsigned int* candidate_budget,
+        unsigned int* probe_budget) const
+{
+    *candidate_budget = candidate_budget_.load(std::memory_order_relaxed);
+    *probe_budget = probe_budget_.load(std::memory_order_relaxed);
+}
+
+void BudgetController::Adjust()
+{
+    std::vector<uint64_t>::iterator p99 = latencies_.begin() + ((latencies_.size() * 99) / 100);
+    std::nth_element(latencies_.begin(), p99, latencies_.end());
+    int in_flight = in_flight_.load(std::memory_order_relaxed);
+    bool backlog_growing = (in_flight > in_flight_at_window_start_);
+    in_flight_at_window_start_ = in_flight;
+
+    bool has_headroom = (*p99 < (BUDGET_CONTROLLER_HEADROOM * p99_target_us_));
+    if ((*p99 > p99_target_us_) || (!has_headroom && backlog_growing)) {
+        level_ *= BUDGET_CONTROLLER_DECREASE;
+    } else if (has_headroom && !backlog_growing) {
+        level_ = std::min(1.0, level_ + BUDGET_CONTROLLER_INCREASE);
+    }
+    candidate_budget_.store(Interpolate(min_candidate_budget_, max_candidate_budget_, level_), std::memory_order_relaxed);
+    probe_budget_.store(Interpolate(min_probe_budget_, max_probe_budget_, level_), std::memory_order_relaxed);
+}
@@ -0,0 +1,64 @@
+#ifndef __BUDGET_CONTROLLER_H_INCLUDED__
+#define __BUDGET_CONTROLLER_H_INCLUDED__
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+// Request latencies the controller looks at per decision.
+#define BUDGET_CONTROLLER_WINDOW 256
+// Budgets grow back only while the p99 is below this fraction of the target.
+#define BUDGET_CONTROLLER_HEADROOM 0.8
+// Fraction of the budget range kept on a p99 miss (multiplicative decrease).
+#define BUDGET_CONTROLLER_DECREASE 0.7
+// Fraction of the budget range added back per good window (additive increase).
+#define BUDGET_CONTROLLER_INCREASE 0.05
+
+/* Holds a p99 latency target by trading recall for latency. The candidate
+   and probe budgets move together between their configured bounds, as one
+   level in [0, 1] (1: the maximum budgets, i.e. the best recall). After
+   every BUDGET_CONTROLLER_WINDOW requests, the level shrinks if the
+   window's p99 missed the target, or if the p99 is close to it while the
+   number of requests in flight grew (a backlog building up). It grows back
+   slowly while the p99 has headroom, so that a load spike degrades recall
+   for as long as it lasts, instead of blowing the tail latency.*/
+class BudgetController
+{
+    public:
+        BudgetController() = default;
+        BudgetController(const BudgetController&) = delete;
+        BudgetController& operator=(const BudgetController&) = delete;
+        /* In: p99 target in micro seconds (0 disables the controller),
+           bounds of the candidate and probe budgets. The budgets start at
+           their maximum. A probe budget bound of 0 leaves probes alone.*/
+        void Initialize(const uint64_t p99_target_us,
+                const unsigned int min_candidate_budget,
+                const unsigned int max_candidate_budget,
+                const unsigned int min_probe_budget,
+                const unsigned int max_probe_budget);
+        bool IsEnabled() const { return p99_target_us_ != 0; }
+        // Call when a request starts being processed.
+        void RequestStarted();
+        // Call when a request is answered, with its latency since it arrived.
+        void RequestFinished(const uint64_t latency_us);
+        // Out: budgets to serve the next request with.
+        void GetBudgets(unsigned int* candidate_budget,
+                unsigned int* probe_budget) const;
+    private:
+        // Decides on the level from a full window. Call with mutex_ held.
+        void Adjust();
+        uint64_t p99_target_us_ = 0;
+        unsigned int min_candidate_budget_ = 0;
+        unsigned int max_candidate_budget_ = 0;
+        unsigned int min_probe_budget_ = 0;
+        unsigned int max_probe_budget_ = 0;
+        std::mutex mutex_;
+        std::vector<uint64_t> latencies_;
+        double level_ = 1;
+        int in_flight_at_window_start_ = 0;
+        std::atomic<int> in_flight_{0};
+        std::atomic<unsigned int> candidate_budget_{0};
+        std::atomic<unsigned int> probe_budget_{0};
+};
+#endif //__BUDGET_CONTROLLER_H_INCLUDED__
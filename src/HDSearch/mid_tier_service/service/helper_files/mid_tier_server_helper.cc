@@ -1,20 +1,23 @@
 /* Author: Akshitha Sriraman
    Ph.D. Candidate at the University of Michigan - Ann Arbor*/
 
+#include <algorithm>
 #include <fstream>
 #include <iterator>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <unordered_map>
 #include "mid_tier_server_helper.h"
+#include "bucket_service/src/dataset_file.h"
 
 #define NODEBUG
 
 IndexServerCommandLineArgs* ParseIndexServerCommandLine(const int argc, char** argv)
 {
     struct IndexServerCommandLineArgs* index_server_command_line_args = new struct IndexServerCommandLineArgs();
-    if (argc == 13) {
+    if (argc >= 13) {
         try
         {
             index_server_command_line_args->num_hash_tables = std::stoul(argv[1], nullptr, 0);
@@ -35,7 +38,53 @@ IndexServerCommandLineArgs* ParseIndexServerCommandLine(const int argc, char** a
             CHECK(false, "Enter a valid number for num_hash_tables/hash_table_key_length/num_multi_probe_levels/number of bucket servers/file containing bucket server IPS/valid string for dataset path/ mode number/ index server IP address/ number of network poller threads/ number of dispatch threads/ number of async response threads/ get profile stats - this is either 0 or 1");
         }
     } else {
-        CHECK(false, "Format: ./<loadgen_index_server> <num_hash_tables> <hash_table_key_length> <num_multi_probe_levels> <number_of_bucket_servers> <file containing bucket server IPs> <dataset file path> <mode number: 1 - read dataset from text file, 2 - binary file> <index server IP address> <number of network poller threads> <number of dispatch threads> <number of async response threads> <get profile stats>");
+        CHECK(false, "Format: ./<loadgen_index_server> <num_hash_tables> <hash_table_key_length> <num_multi_probe_levels> <number_of_bucket_servers> <file containing bucket server IPs> <dataset file path> <mode number: 1 - read dataset from text file, 2 - binary file> <index server IP address> <number of network poller threads> <number of dispatch threads> <number of async response threads> <get profile stats> [--bucket_streaming] [--probe_budget=<probes>] [--candidate_budget=<candidates>] [--p99_target_us=<us>] [--min_candidate_budget=<candidates>] [--min_probe_budget=<probes>]");
+    }
+
+    // Optional flags: --name or --name=value.
+    for(int i = 13; i < argc; i++)
+    {
+        std::string flag = argv[i];
+        std::string value = "";
+        size_t equals = flag.find('=');
+        if (equals != std::string::npos) {
+            value = flag.substr(equals + 1);
+            flag = flag.substr(0, equals);
+        }
+        try
+        {
+            if (flag == "--bucket_streaming") {
+                index_server_command_line_args->bucket_streaming = true;
+            } else if (flag == "--probe_budget") {
+                index_server_command_line_args->probe_budget = std::stoul(value, nullptr, 0);
+            } else if (flag == "--candidate_budget") {
+                index_server_command_line_args->candidate_budget = std::stoul(value, nullptr, 0);
+            } else if (flag == "--p99_target_us") {
+                index_server_command_line_args->p99_target_us = std::stoull(value, nullptr, 0);
+            } else if (flag == "--min_candidate_budget") {
+                index_server_command_line_args->min_candidate_budget = std::stoul(value, nullptr, 0);
+            } else if (flag == "--min_probe_budget") {
+                index_server_command_line_args->min_probe_budget = std::stoul(value, nullptr, 0);
+            } else {
+                CHECK(false, "ERROR: Unknown index server flag " << flag << "\n");
+            }
+        }
+        catch (...)
+        {
+            CHECK(false, "ERROR: Enter a valid number for index server flag " << flag << "\n");
+        }
+    }
+    /* Under a p99 target, the budgets adapt between their minimum and
+       maximum. An unlimited candidate budget has no range to adapt in; an
+       unlimited probe budget (0) leaves probes alone.*/
+    if (index_server_command_line_args->p99_target_us != 0) {
+        CHECK((index_server_command_line_args->candidate_budget != 0), "ERROR: A p99 target needs a maximum --candidate_budget\n");
+        // By default, probe at least the query's own bucket in every table.
+        if ((index_server_command_line_args->min_probe_budget == 0) && (index_server_command_line_args->probe_budget != 0)) {
+            index_server_command_line_args->min_probe_budget = std::min(index_server_command_line_args->num_hash_tables, index_server_command_line_args->probe_budget);
+        }
+        CHECK((index_server_command_line_args->min_candidate_budget <= index_server_command_line_args->candidate_budget), "ERROR: --min_candidate_budget must be <= --candidate_budget\n");
+        CHECK((index_server_command_line_args->min_probe_budget <= index_server_command_line_args->probe_budget), "ERROR: --min_probe_budget must be <= --probe_budget\n");
     }
     return index_server_command_line_args;
 }
@@ -80,29 +129,26 @@ void LoadLshIndexFromFile(const std::string &index_file_name,
 }
 
 void UnpackLoadgenServiceRequest(const loadgen_index::LoadGenRequest &load_gen_request,
-        const MultiplePoints &dataset,
+        const flann::Matrix<unsigned char> &dataset,
         const unsigned int queries_size,
         const unsigned int query_dimensions,
         flann::Matrix<unsigned char>* queries, 
-        MultiplePoints* queries_multiple_points,
         uint64_t* query_id,
         bucket::NearestNeighborRequest* request_to_bucket)
 {
     // UnPacking Queries.
-    Point dataset_point(2048, 0.0);
     for(unsigned int i = 0; i < queries_size; i++)
     {
         *(query_id) = load_gen_request.query_id(i);
         request_to_bucket->add_queries(*(query_id));
-        dataset_point = dataset.GetPointAtIndex(*(query_id));
-        queries_multiple_points->SetPoint(i, dataset_point);
-
-        for(unsigned int j = 0; j < query_dimensions; j++) {
-
-            /* Casting float to unsigned because flann's LSH works 
-               only for unsigned char.*/
-            (*queries)[i][j] = static_cast<unsigned char>(dataset_point.GetValueAtIndex(j)*255);
-        }
+        /* The dataset already holds the points as the unsigned chars
+           flann's LSH works with.*/
+        std::copy(dataset[*(query_id)], dataset[*(query_id)] + query_dimensions, (*queries)[i]);
+    }
+    // Unknown modes fall back to exact search.
+    int search_mode = load_gen_request.search_mode();
+    if (bucket::SearchMode_IsValid(search_mode)) {
+        request_to_bucket->set_search_mode(static_cast<bucket::SearchMode>(search_mode));
     }
 }
 
@@ -113,7 +159,7 @@ flann::Matrix<unsigned char>* CreateDatasetFromTextFile(const std::string &file_
     MultiplePoints dataset_multiple_points;
     dataset_multiple_points.CreateMultiplePoints(file_name);
     (*dataset_size) = dataset_multiple_points.GetSize();
-    (*dataset_dimensions) = dataset_multiple_points.GetPointAtIndex(0).GetSize();
+    (*dataset_dimensions) = dataset_multiple_points.GetPointDimension();
 
     // Define dataset Matrix.
     flann::Matrix<unsigned char> dataset(new unsigned char[(*dataset_size) * (*dataset_dimensions)], 
@@ -121,9 +167,10 @@ flann::Matrix<unsigned char>* CreateDatasetFromTextFile(const std::string &file_
             (*dataset_dimensions));
     for(unsigned int m = 0; m < (*dataset_size); m++)
     {
+        const float* row = dataset_multiple_points.GetRowAtIndex(m);
         for(unsigned int n = 0; n < (*dataset_dimensions); n++)
         {
-            dataset[m][n] = static_cast<unsigned char>(dataset_multiple_points.GetPointAtIndex(m).GetValueAtIndex(n)*255);
+            dataset[m][n] = static_cast<unsigned char>(row[n]*255);
         }
     }
     return &dataset;
@@ -134,39 +181,29 @@ void CreateDatasetFromBinaryFile(const std::string &file_name,
         unsigned int* dataset_dimensions,
         flann::Matrix<unsigned char>* dataset)
 {
-    (*dataset_dimensions) = 2048;
-    FILE *dataset_binary = fopen(file_name.c_str(), "r");
-    if(!dataset_binary)
-    {
-        CHECK(false, "ERROR: Could not open dataset file\n");
-    }
-    /* Get the size of the file, so that we can initialize number
-       of points, given 2048 dimensions.*/
-    std::ifstream stream_to_get_size(file_name, std::ios::binary | std::ios::in);
-    stream_to_get_size.seekg(0, std::ios::end);
-    long size = stream_to_get_size.tellg();
-    (*dataset_size) = (size/sizeof(float))/(*dataset_dimensions);
+    /* Map the file instead of reading it one float at a time: each thread
+       quantizes its own range of points straight from the page cache, and
+       no float copy of the corpus is ever made. Legacy (headerless) files
+       hold 2048 dimensions per point.*/
+    DatasetFile dataset_file;
+    dataset_file.Open(file_name, 2048);
+    (*dataset_size) = dataset_file.GetSize();
+    (*dataset_dimensions) = dataset_file.GetPointDimension();
     CHECK(((*dataset_size) >= 0), "ERROR: Dataset cannot have negative number of points\n");
-    CHECK(((*dataset_dimensions) >= 0), "ERROR: Number of dataset dimensions cannot be negative\n");
+    // Each thread streams through a contiguous range of the file.
+    dataset_file.AdviseRange(0, (*dataset_size), MADV_SEQUENTIAL);
 
-    //Read each individual float value and store it in the dataset matrix.
-    float value;
     *dataset = flann::Matrix<unsigned char>(new unsigned char[(*dataset_size) * (*dataset_dimensions)],
             (*dataset_size),
             (*dataset_dimensions));
-    /*flann::Matrix<unsigned char> dataset(new unsigned char[(*dataset_size) * (*dataset_dimensions)],
-      (*dataset_size),
-      (*dataset_dimensions));*/
+#pragma omp parallel for schedule(static)
     for(long m = 0; m < (*dataset_size); m++)
     {
+        const float* row = dataset_file.GetPointViewAtIndex(m).GetData();
+        unsigned char* quantized_row = (*dataset)[m];
         for(unsigned int n = 0; n < (*dataset_dimensions); n++)
         {
-            if(fread((void*)(&value), sizeof(value), 1, dataset_binary) == 1)
-            {
-                (*dataset)[m][n] = static_cast<unsigned char>(value*255);
-            } else {
-                break;
-            }
+            quantized_row[n] = static_cast<unsigned char>(row[n]*255);
         }
     }
 }
@@ -243,18 +280,13 @@ void CreateMultiplePointsFromBinaryFile(const std::string &file_name, MultiplePo
     CHECK((dataset_size >= 0), "ERROR: Negative number of points in the dataset\n");
     /* Initialize dataset to contain 0s, 
        this is so that we can directly index every point/value after this.*/
-    Point p(dataset_dimensions, 0.0);
-    dataset->Resize(dataset_size, p);
+    dataset->Resize(dataset_size, dataset_dimensions);
 
-    //Read each point (dimensions = 2048) and create a set of multiple points.
-    float values[dataset_dimensions];
+    //Read each point (dimensions = 2048) straight into its row of the dataset.
     for(int i = 0; i < dataset_size; i++)
     {
-        if(fread(values, sizeof(float), dataset_dimensions, dataset_binary) == dataset_dimensions)
+        if(fread(dataset->GetMutableRowAtIndex(i), sizeof(float), dataset_dimensions, dataset_binary) != dataset_dimensions)
         {
-            p.CreatePointFromFloatArray(values, dataset_dimensions);
-            dataset->SetPoint(i, p);
-        } else {
             break;
         }
     }
@@ -406,8 +438,7 @@ void Merge(const struct ThreadArgs* thread_args,
     knn_answer->DistanceCalculation(dataset,
             queries_multiple_points,
             knn_all_queries,
-            number_of_nearest_neighbors,
-            1);
+            number_of_nearest_neighbors);
 
     (*create_bucket_req_time) = (*create_bucket_req_time)/number_of_bucket_servers;
     (*unpack_bucket_resp_time) = (*unpack_bucket_resp_time)/number_of_bucket_servers;
@@ -417,10 +448,7 @@ void Merge(const struct ThreadArgs* thread_args,
 }
 
 void MergeAndPack(const std::vector<ResponseData> &response_data,
-        const MultiplePoints &dataset,
-        const MultiplePoints &queries_multiple_points,
         const unsigned int queries_size,
-        const unsigned int query_dimensions,
         const unsigned int number_of_bucket_servers,
         const unsigned int number_of_nearest_neighbors,
         loadgen_index::ResponseIndexKnnQueries* index_reply)
@@ -431,10 +459,7 @@ void MergeAndPack(const std::vector<ResponseData> &response_data,
     gettimeofday(&tv, NULL);
     uint64_t start_time = tv.tv_sec*(uint64_t)1000000+tv.tv_usec;
     MergeFromResponseMap(response_data,
-            dataset,
-            queries_multiple_points,
             queries_size,
-            query_dimensions,
             number_of_bucket_servers,
             number_of_nearest_neighbors,
             &knn_answer,
@@ -464,11 +489,23 @@ void MergeAndPack(const std::vector<ResponseData> &response_data,
     index_reply->set_number_of_bucket_servers(number_of_bucket_servers);
 }
 
+// Next neighbor of a bucket's answer to merge.
+struct MergeHead {
+    float distance;
+    uint32_t point_id;
+    unsigned int bucket;
+    unsigned int position;
+};
+
+/* Heap order: the root is the closest head (ties broken by point ID, like
+   the buckets' priority queues).*/
+static bool IsFartherHead(const MergeHead &a, const MergeHead &b)
+{
+    return (a.distance > b.distance) || ((a.distance == b.distance) && (a.point_id > b.point_id));
+}
+
 void MergeFromResponseMap(const std::vector<ResponseData> &response_data,
-        const MultiplePoints &dataset,
-        const MultiplePoints &queries_multiple_points,
         const unsigned int queries_size,
-        const unsigned int query_dimensions,
         const unsigned int number_of_bucket_servers,
         const unsigned int number_of_nearest_neighbors,
         DistCalc* knn_answer,
@@ -478,28 +515,47 @@ void MergeFromResponseMap(const std::vector<ResponseData> &response_data,
         uint64_t* calculate_knn_time,
         uint64_t* pack_bucket_resp_time)
 {
-    std::vector<std::vector<uint32_t>> knn_all_queries;
-    std::vector<uint32_t> knn;
+    std::vector<MergeHead> heads;
+    heads.reserve(number_of_bucket_servers);
+    PointIDs knn;
+    std::vector<float> distances;
     for(unsigned int i = 0; i < queries_size; i++)
     {
+        heads.clear();
         for(unsigned int j = 0; j < number_of_bucket_servers; j++)
         {
-            unsigned int neighbors_size = response_data[j].knn_answer->GetValueAtIndex(i).size();
-            for(unsigned int k = 0; k < neighbors_size; k++)
-            {
-                knn.emplace_back(response_data[j].knn_answer->GetValueAtIndex(i).at(k));
+            // A bucket that rejected the request answers no query.
+            if (i >= response_data[j].knn_answer->GetSize()) {
+                continue;
+            }
+            const PointIDs &bucket_knn = response_data[j].knn_answer->GetValueAtIndex(i);
+            const std::vector<float> &bucket_distances = response_data[j].knn_answer->GetDistancesAtIndex(i);
+            CHECK((bucket_distances.size() == bucket_knn.size()), "ERROR: Bucket responses must carry the distances of their neighbors\n");
+            if (!bucket_knn.empty()) {
+                heads.push_back({bucket_distances[0], bucket_knn[0], j, 0});
             }
         }
-        knn_all_queries.emplace_back(knn);
-        if (queries_size != 1) {
-            knn.clear();
+        std::make_heap(heads.begin(), heads.end(), IsFartherHead);
+        knn.clear();
+        distances.clear();
+        while (!heads.empty() && (knn.size() < number_of_nearest_neighbors))
+        {
+            std::pop_heap(heads.begin(), heads.end(), IsFartherHead);
+            MergeHead &head = heads.back();
+            knn.push_back(head.point_id);
+            distances.push_back(head.distance);
+            const PointIDs &bucket_knn = response_data[head.bucket].knn_answer->GetValueAtIndex(i);
+            head.position++;
+            if (head.position < bucket_knn.size()) {
+                head.distance = response_data[head.bucket].knn_answer->GetDistancesAtIndex(i)[head.position];
+                head.point_id = bucket_knn[head.position];
+                std::push_heap(heads.begin(), heads.end(), IsFartherHead);
+            } else {
+                heads.pop_back();
+            }
         }
+        knn_answer->AddValueToBack(knn, distances);
     }
-    knn_answer->DistanceCalculation(dataset,
-            queries_multiple_points,
-            knn_all_queries,
-            number_of_nearest_neighbors,
-            1);
     /* Calculate the avergae time for all components from different
        bucket servers and send the mean as the final time.*/
     for(unsigned int i = 0; i < number_of_bucket_servers; i++)
@@ -18,6 +18,11 @@ struct ResponseMetaData {
     std::vector<ResponseData> response_data;
     int responses_recvd = 0;
     uint64_t id = 0;
+    // When the request was taken off the completion queue.
+    uint64_t arrival_time = 0;
+    // Shape of the final answer, as the load generator asked for it.
+    unsigned int queries_size = 0;
+    unsigned int number_of_nearest_neighbors = 0;
     loadgen_index::ResponseIndexKnnQueries* index_reply = new loadgen_index::ResponseIndexKnnQueries();
 };
 #if 0
@@ -80,6 +85,21 @@ struct IndexServerCommandLineArgs {
     int dispatch_parallelism = 0;
     int number_of_async_response_threads = 0;
     int get_profile_stats = 0;
+    /* Send bucket requests on one long-lived stream per dispatch thread and
+       bucket server, instead of one unary RPC each.*/
+    bool bucket_streaming = false;
+    /* LSH buckets probed per query, best first (0: every multi-probe
+       bucket of every table), unless the request sets its own.*/
+    unsigned int probe_budget = 0;
+    /* Candidates sent per query to each bucket server (0: unlimited),
+       unless the request sets its own.*/
+    unsigned int candidate_budget = 10;
+    /* p99 latency target in micro seconds (0: off). The budgets then adapt
+       between the minimums below and the budgets above.*/
+    uint64_t p99_target_us = 0;
+    unsigned int min_candidate_budget = 1;
+    // 0: one probe per hash table.
+    unsigned int min_probe_budget = 0;
 };
 
 struct Key {
@@ -89,6 +109,7 @@ struct Key {
 struct DispatchedData {
     void* tag = NULL;
     int index_tid = 0;
+    uint64_t arrival_time = 0;
 };
 
 struct ReqToBucketSrv {
@@ -209,15 +230,16 @@ void LoadLshIndexFromFile(const std::string &index_file_name,
    a collection of query points (can either be a batch or single query).
    Function converts float value of each point dimension into
    unsigned char, because flann's LSH supports only unsigned chars.
-In: query request(s) from the load generator, number of queries, and
-#dimensions of each query point.
-Out: collection of query points in 2 formats - Matrix and MultiplePoints.*/
+In: query request(s) from the load generator, the (unsigned char) dataset
+the queries are points of, number of queries, and #dimensions of each
+query point.
+Out: collection of query points as a Matrix, and the query IDs & search
+mode of the request to the buckets.*/
 void UnpackLoadgenServiceRequest(const loadgen_index::LoadGenRequest &load_gen_request, 
-        const MultiplePoints &dataset,
+        const flann::Matrix<unsigned char> &dataset,
         const unsigned int queries_size,
         const unsigned int query_dimensions,
         flann::Matrix<unsigned char>* queries, 
-        MultiplePoints* queries_multiple_points,
         uint64_t* query_id,
         bucket::NearestNeighborRequest* request_to_bucket);
 
@@ -233,7 +255,8 @@ flann::Matrix<unsigned char>* CreateDatasetFromTextFile(const std::string &file_
 
 /* Read a binary file and create a collection of points - used to load the 
    dataset into memory. Throws exception if file does not or if the dataset
-   size/dimension is a negative value.
+   size/dimension is a negative value. The file is mmap'ed and quantized in
+   parallel; both legacy and versioned (see DatasetFile) files are read.
 In: path to dataset file
 Out: dataset Matrix, number of points in the dataset, and the 
 dimension of each point.*/
@@ -346,17 +369,12 @@ void Merge(const struct ThreadArgs* thread_args,
    async code - when the async client thread receives all responses,
    this function is called so that the index_reply can be populated.
 In: Map containing unique request and corresponding response meta data,
-dataset in the form of multiple points,
-queries,
-query size, dimensions, number of bucket servers and neighbors to be computed.
+query size, number of bucket servers and neighbors to be computed.
 Out: Index_reply - the data structure that must be populated and sent so that
 the request can be marked as "finished" and the response can then be sent to the
 load generator.*/
 void MergeAndPack(const std::vector<ResponseData> &response_data,
-        const MultiplePoints &dataset,
-        const MultiplePoints &queries_multiple_points,
         const unsigned int queries_size,
-        const unsigned int query_dimensions,
         const unsigned int number_of_bucket_servers,
         const unsigned int number_of_nearest_neighbors,
         loadgen_index::ResponseIndexKnnQueries* index_reply);
@@ -366,12 +384,12 @@ void MergeAndPack(const std::vector<ResponseData> &response_data,
    is a need for a different merge function because we merge
    only when all responses corresponding to a unique request id are
    received, So, the global map structure is read to accumulate all
-   individual bucket responses collected so far.*/
+   individual bucket responses collected so far.
+   Each bucket's answer is sorted by distance and the shards are disjoint,
+   so the K nearest neighbors are found by a K-way merge of the answers
+   (a heap of their heads): no distance is computed again.*/
 void MergeFromResponseMap(const std::vector<ResponseData> &response_data,
-        const MultiplePoints &dataset,
-        const MultiplePoints &queries_multiple_points,
         const unsigned int queries_size,
-        const unsigned int query_dimensions,
         const unsigned int number_of_bucket_servers,
         const unsigned int number_of_nearest_neighbors,
         DistCalc* knn_answer,
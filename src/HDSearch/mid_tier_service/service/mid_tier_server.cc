@@ -1,6 +1,7 @@
 /* Author: Akshitha Sriraman
    Ph.D. Candidate at the University of Michigan - Ann Arbor*/
 
+#include <algorithm>
 #include <memory>
 #include <omp.h>
 #include <iostream>
@@ -10,12 +11,11 @@
 #include <grpc++/grpc++.h>
 
 #include "bucket_service/service/helper_files/client_helper.h"
+#include "mid_tier_service/service/helper_files/budget_controller.h"
 #include "mid_tier_service/service/helper_files/mid_tier_server_helper.h"
 #include "mid_tier_service/service/helper_files/timing.h"
 #include "mid_tier_service/service/helper_files/utils.h"
 
-#define FIXEDCOMP 10
-
 using namespace flann;
 
 using grpc::Server;
@@ -30,6 +30,7 @@ using loadgen_index::ResponseIndexKnnQueries;
 using loadgen_index::LoadGenIndex;
 
 using grpc::Channel;
+using grpc::ClientAsyncReaderWriter;
 using grpc::ClientAsyncResponseReader;
 using grpc::ClientContext;
 using grpc::CompletionQueue;
@@ -40,6 +41,8 @@ using bucket::PointIdList;
 using bucket::NearestNeighborRequest;
 using bucket::TimingDataInMicro;
 using bucket::NearestNeighborResponse;
+using bucket::NearestNeighborRequestBatch;
+using bucket::NearestNeighborResponseBatch;
 using bucket::DistanceService;
 
 // Class declarations.
@@ -49,7 +52,8 @@ class DistanceServiceClient;
 // Function declarations.
 void ProcessRequest(LoadGenRequest &load_gen_request,
         uint64_t unique_request_id_value,
-        int tid);
+        int tid,
+        uint64_t arrival_time);
 
 // Global variable declarations.
 /* dataset_dim is global so that we can validate query dimensions whenever 
@@ -63,8 +67,13 @@ std::vector<std::string> bucket_server_ips;
    beginning, before it accepts any queries. Subsequent queries can then use 
    this index structure already built, to get point IDs.*/
 Index<L2<unsigned char> > lsh_index;
-std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors = new std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >();
-MultiplePoints dataset_multiple_points;
+/* Flat copies of lsh_index's hash tables, whose buckets hold the point IDs
+   grouped by the bucket server they must be sent to.*/
+std::vector<lsh::ShardedTable> sharded_lsh_tables;
+/* The dataset as the unsigned chars flann's LSH works with: the index is
+   built from it, and queries (which arrive as dataset point IDs) are read
+   from it. No float copy is kept: buckets return their neighbors' distances.*/
+Matrix<unsigned char> lsh_dataset;
 uint64_t num_requests = 0;
 std::vector<DistanceServiceClient*> bucket_connections;
 /* Server object is global so that the async bucket client
@@ -81,6 +90,13 @@ std::vector<mutex_wrapper> bucket_conn_mutex;
 std::map<uint64_t, std::unique_ptr<std::mutex> > map_fine_mutex;
 int get_profile_stats = 0;
 bool first_req = false;
+bool bucket_streaming = false;
+/* LSH probes per query, and candidates per query and bucket server, for
+   requests that do not set their own budgets.*/
+unsigned int default_probe_budget = 0, default_candidate_budget = 10;
+/* Adapts the budgets of requests that do not set their own, to hold a
+   p99 latency target (when one is given).*/
+BudgetController budget_controller;
 
 CompletionQueue* bucket_cq = new CompletionQueue();
 
@@ -170,7 +186,9 @@ class ServerImpl final {
                         Proceed(tid);
                     }
 
-                void Proceed(int tid) {
+                /* In: thread ID, time the request (or completion) was taken
+                   off the completion queue.*/
+                void Proceed(int tid, uint64_t arrival_time = 0) {
                     if (status_ == CREATE) {
                         // Make this instance progress to the PROCESS state.
                         status_ = PROCESS;
@@ -192,7 +210,8 @@ class ServerImpl final {
                         // The actual processing.
                         ProcessRequest(load_gen_request_, 
                                 unique_request_id_value, 
-                                tid);
+                                tid,
+                                arrival_time);
                         // And we are done! Let the gRPC runtime know we've finished, using the
                         // memory address of this instance as the uniquely identifying tag for
                         // the event.
@@ -248,7 +267,7 @@ class ServerImpl final {
                    that we keep waiting for a request when there is
                    nothing in the queue.*/
                 DispatchedData* dispatched_request = dispatched_data_queue.pop();
-                static_cast<CallData*>(dispatched_request->tag)->Proceed(worker_tid);
+                static_cast<CallData*>(dispatched_request->tag)->Proceed(worker_tid, dispatched_request->arrival_time);
                 delete dispatched_request;
             }
         }
@@ -274,6 +293,7 @@ class ServerImpl final {
                    to the dispatch queue.*/
                 DispatchedData* request_to_be_dispatched = new DispatchedData();
                 request_to_be_dispatched->tag = tag;
+                request_to_be_dispatched->arrival_time = GetTimeInMicro();
                 dispatched_data_queue.push(request_to_be_dispatched);
                 //GPR_ASSERT(ok);
             }
@@ -289,12 +309,21 @@ class ServerImpl final {
    invoke the bucket client to send the queries+PointIDs to the bucket server.*/
 class DistanceServiceClient {
     public:
-        explicit DistanceServiceClient(std::shared_ptr<Channel> channel)
-            : stub_(DistanceService::NewStub(channel)) {}
+        DistanceServiceClient(std::shared_ptr<Channel> channel,
+                const bool streaming)
+            : stub_(DistanceService::NewStub(channel)),
+            streaming_(streaming),
+            start_tag_{BucketTag::STREAM_START, this},
+            write_tag_{BucketTag::STREAM_WRITE, this},
+            read_tag_{BucketTag::STREAM_READ, this} {
+                if (streaming_) {
+                    // Responses arrive on bucket_cq, like those of unary calls.
+                    stream_ = stub_->AsyncStreamNearestNeighbors(&stream_context_, bucket_cq, &start_tag_);
+                }
+            }
         /* Assambles the client's payload, sends it and presents the response back
            from the server.*/
-        void GetNearestNeighbors(const MultiplePoints &queries,
-                const std::vector<std::vector<uint32_t>> &point_ids,
+        void GetNearestNeighbors(const std::vector<std::vector<uint32_t>> &point_ids,
                 const unsigned int &queries_size,
                 const int &number_of_nearest_neighbors,
                 const uint32_t bucket_server_id,
@@ -303,16 +332,11 @@ class DistanceServiceClient {
                 uint64_t request_id,
                 NearestNeighborRequest &request_to_bucket)
         {
-            // Get the dimension.
-            int dimension = queries.GetPointAtIndex(0).GetSize();
-            // Declare the set of queries that must be sent.
             uint64_t start_time = GetTimeInMicro();
-            // Create RCP request by adding queries, point IDs, and number of NN.
-            CreateBucketServiceRequest(queries,
-                    point_ids,
+            // Create RCP request by adding point IDs, and number of NN.
+            CreateBucketServiceRequest(point_ids,
                     queries_size,
                     number_of_nearest_neighbors,
-                    dimension,
                     bucket_server_id,
                     shard_size,
                     util_present,
@@ -320,12 +344,24 @@ class DistanceServiceClient {
             request_to_bucket.set_request_id(request_id);
             uint64_t end_time = GetTimeInMicro();
             //bucket_timing_info->create_bucket_request_time = end_time - start_time;
+            if (streaming_) {
+                /* Requests issued while a frame is being written are sent
+                   together in the next frame.*/
+                std::lock_guard<std::mutex> lock(stream_mutex_);
+                *pending_.add_requests() = request_to_bucket;
+                if (stream_ready_ && !write_in_flight_) {
+                    StartWrite();
+                }
+                return;
+            }
             // Container for the data we expect from the server.
             NearestNeighborResponse reply;
             // Context for the client. 
             ClientContext context;
             // Call object to store rpc data
             AsyncClientCall* call = new AsyncClientCall;
+            call->kind = BucketTag::UNARY_CALL;
+            call->client = this;
             // stub_->AsyncSayHello() performs the RPC call, returning an instance to
             // store in "call". Because we are using the asynchronous API, we need to
             // hold on to the "call" instance in order to get updates on the ongoing RPC.
@@ -345,114 +381,167 @@ class DistanceServiceClient {
             //auto r = cq_.AsyncNext(&got_tag, &ok, gpr_time_0(GPR_CLOCK_REALTIME));
             //if (r == ServerCompletionQueue::TIMEOUT) return;
             //if (r == ServerCompletionQueue::GOT_EVENT) {
-            // The tag in this example is the memory location of the call object
-            AsyncClientCall* call = static_cast<AsyncClientCall*>(got_tag);
+            BucketTag* tag = static_cast<BucketTag*>(got_tag);
+            switch (tag->kind) {
+                case BucketTag::UNARY_CALL:
+                    {
+                        AsyncClientCall* call = static_cast<AsyncClientCall*>(tag);
+                        CHECK((call->status.ok()), "Bucket request failed: " << call->status.error_message() << "\n");
+                        HandleBucketResponse(call->reply);
+                        // Once we're complete, deallocate the call object.
+                        delete call;
+                        break;
+                    }
+                case BucketTag::STREAM_START:
+                    tag->client->StreamStarted(ok);
+                    break;
+                case BucketTag::STREAM_WRITE:
+                    tag->client->StreamWritten(ok);
+                    break;
+                case BucketTag::STREAM_READ:
+                    tag->client->StreamRead(ok);
+                    break;
+            }
+        }
 
-            // Verify that the request was completed successfully. Note that "ok"
-            // corresponds solely to the request for updates introduced by Finish().
-            //GPR_ASSERT(ok);
+            private:
+        // Completion queue tag: a unary call, or an operation on a client's stream.
+        struct BucketTag {
+            enum Kind {UNARY_CALL, STREAM_START, STREAM_WRITE, STREAM_READ};
+            Kind kind;
+            DistanceServiceClient* client;
+        };
 
-            if (call->status.ok())
-            {
-                uint64_t s1 = GetTimeInMicro();
-                uint64_t unique_request_id = call->reply.request_id();
-                int number_of_nearest_neighbors = call->reply.neighbor_ids(0).point_id_size();
-                /* When this is not the last response, we need to decrement the count
-                   as well as collect response meta data - knn answer, bucket util, and
-                   bucket timing info.
-                   When this is the last request, we remove this request from the map and 
-                   merge responses from all buckets.*/
-                /* Create local DistCalc, BucketTimingInfo, BucketUtil variables,
-                   so that this thread can unpack received bucket data into these variables
-                   and then grab a lock to append to the response array in the map.*/
-                DistCalc knn_answer;
-                BucketTimingInfo bucket_timing_info;
-                BucketUtil bucket_util;
-                uint64_t start_time = GetTimeInMicro();
-                UnpackBucketServiceResponse(call->reply,
-                        number_of_nearest_neighbors,
-                        &knn_answer,
-                        &bucket_timing_info,
-                        &bucket_util);
-                uint64_t end_time = GetTimeInMicro();
-                // Make sure that the map entry corresponding to request id exists.
-                map_coarse_mutex.lock();
-                try {
-                    response_count_down_map.at(unique_request_id);
-                } catch( ... ) {
-                    CHECK(false, "ERROR: Map entry corresponding to request id does not exist\n");
-                }
-                map_coarse_mutex.unlock();
+        /* Merges a bucket server's response into its request's entry of
+           the response map, and answers the load generator once every bucket
+           server has responded.*/
+        static void HandleBucketResponse(const NearestNeighborResponse &reply)
+        {
+            uint64_t s1 = GetTimeInMicro();
+            uint64_t unique_request_id = reply.request_id();
+            /* When this is not the last response, we need to decrement the count
+               as well as collect response meta data - knn answer, bucket util, and
+               bucket timing info.
+               When this is the last request, we remove this request from the map and 
+               merge responses from all buckets.*/
+            /* Create local DistCalc, BucketTimingInfo, BucketUtil variables,
+               so that this thread can unpack received bucket data into these variables
+               and then grab a lock to append to the response array in the map.*/
+            DistCalc knn_answer;
+            BucketTimingInfo bucket_timing_info;
+            BucketUtil bucket_util;
+            uint64_t start_time = GetTimeInMicro();
+            UnpackBucketServiceResponse(reply,
+                    &knn_answer,
+                    &bucket_timing_info,
+                    &bucket_util);
+            uint64_t end_time = GetTimeInMicro();
+            // Make sure that the map entry corresponding to request id exists.
+            map_coarse_mutex.lock();
+            try {
+                response_count_down_map.at(unique_request_id);
+            } catch( ... ) {
+                CHECK(false, "ERROR: Map entry corresponding to request id does not exist\n");
+            }
+            map_coarse_mutex.unlock();
 
-                map_fine_mutex[unique_request_id]->lock();
-                int bucket_resp_id = response_count_down_map[unique_request_id].responses_recvd;
-                *(response_count_down_map[unique_request_id].response_data[bucket_resp_id].knn_answer) = knn_answer;
-                *(response_count_down_map[unique_request_id].response_data[bucket_resp_id].bucket_timing_info) = bucket_timing_info;
-                *(response_count_down_map[unique_request_id].response_data[bucket_resp_id].bucket_util) = bucket_util;
-                response_count_down_map[unique_request_id].response_data[bucket_resp_id].bucket_timing_info->unpack_bucket_resp_time = end_time - start_time;
+            map_fine_mutex[unique_request_id]->lock();
+            int bucket_resp_id = response_count_down_map[unique_request_id].responses_recvd;
+            *(response_count_down_map[unique_request_id].response_data[bucket_resp_id].knn_answer) = knn_answer;
+            *(response_count_down_map[unique_request_id].response_data[bucket_resp_id].bucket_timing_info) = bucket_timing_info;
+            *(response_count_down_map[unique_request_id].response_data[bucket_resp_id].bucket_util) = bucket_util;
+            response_count_down_map[unique_request_id].response_data[bucket_resp_id].bucket_timing_info->unpack_bucket_resp_time = end_time - start_time;
 #if 0
-                if (response_count_down_map[unique_request_id].responses_recvd == 2) {
-                    uint64_t bucket_resp_start_time = response_count_down_map[unique_request_id].index_reply->get_bucket_responses_time();
-                    response_count_down_map[unique_request_id].index_reply->set_get_bucket_responses_time(GetTimeInMicro() - bucket_resp_start_time);
-                }
+            if (response_count_down_map[unique_request_id].responses_recvd == 2) {
+                uint64_t bucket_resp_start_time = response_count_down_map[unique_request_id].index_reply->get_bucket_responses_time();
+                response_count_down_map[unique_request_id].index_reply->set_get_bucket_responses_time(GetTimeInMicro() - bucket_resp_start_time);
+            }
 #endif
-                if (response_count_down_map[unique_request_id].responses_recvd != (number_of_bucket_servers - 1)) {
-                    response_count_down_map[unique_request_id].responses_recvd++;
-                    map_fine_mutex[unique_request_id]->unlock();
-                } else {
-                    uint64_t bucket_resp_start_time = response_count_down_map[unique_request_id].index_reply->get_bucket_responses_time();
-                    //response_count_down_map[unique_request_id].index_reply->set_get_bucket_responses_time(GetTimeInMicro() - bucket_resp_start_time);
-                    /* Time to merge all responses received and then 
-                       call terminate so that the response can be sent back
-                       to the load generator.*/
-                    /* We now know that all buckets have responded, hence we can 
-                       proceed to merge responses.*/
-                    unsigned int queries_size = call->reply.queries_size();
-                    unsigned int query_dimensions = 2048;
-
-                    /* We now know that all buckets have responded, hence we can 
-                       proceed to merge responses.*/
-                    Point p(query_dimensions, 0.0);
-                    MultiplePoints queries_multiple_points(queries_size, p);
-                    for (int i = 0; i < queries_size; i++) {
-                        queries_multiple_points.SetPoint(i, dataset_multiple_points.GetPointAtIndex(call->reply.queries(i)));
-                    }
-
-                    start_time = GetTimeInMicro();
-                    MergeAndPack(response_count_down_map[unique_request_id].response_data,
-                            dataset_multiple_points,
-                            queries_multiple_points,
-                            queries_size,
-                            query_dimensions,
-                            number_of_bucket_servers,
-                            number_of_nearest_neighbors,
-                            response_count_down_map[unique_request_id].index_reply);
-                    end_time = GetTimeInMicro();
-                    response_count_down_map[unique_request_id].index_reply->set_merge_time(end_time - start_time);
-                    response_count_down_map[unique_request_id].index_reply->set_pack_index_resp_time(end_time - start_time); 
-                    //response_count_down_map[unique_request_id].index_reply->set_index_time(index_times[unique_request_id]);
-                    /* Call server finish for this particular request,
-                       and pass the response so that it can be sent
-                       by the server to the frontend.*/
-                    uint64_t prev_rec = response_count_down_map[unique_request_id].index_reply->index_time();
-                    response_count_down_map[unique_request_id].index_reply->set_index_time(prev_rec + (GetTimeInMicro() - s1));
-                    map_fine_mutex[unique_request_id]->unlock();
-
-                    map_coarse_mutex.lock();
-                    server->Finish(unique_request_id, 
-                            response_count_down_map[unique_request_id].index_reply);
-                    map_coarse_mutex.unlock();
-                }
+            if (response_count_down_map[unique_request_id].responses_recvd != (number_of_bucket_servers - 1)) {
+                response_count_down_map[unique_request_id].responses_recvd++;
+                map_fine_mutex[unique_request_id]->unlock();
             } else {
-                CHECK(false, "Bucket no longer exists\n");
+                uint64_t bucket_resp_start_time = response_count_down_map[unique_request_id].index_reply->get_bucket_responses_time();
+                //response_count_down_map[unique_request_id].index_reply->set_get_bucket_responses_time(GetTimeInMicro() - bucket_resp_start_time);
+                /* Time to merge all responses received and then 
+                   call terminate so that the response can be sent back
+                   to the load generator.*/
+                /* We now know that all buckets have responded, hence we can 
+                   proceed to merge responses.*/
+                start_time = GetTimeInMicro();
+                MergeAndPack(response_count_down_map[unique_request_id].response_data,
+                        response_count_down_map[unique_request_id].queries_size,
+                        number_of_bucket_servers,
+                        response_count_down_map[unique_request_id].number_of_nearest_neighbors,
+                        response_count_down_map[unique_request_id].index_reply);
+                end_time = GetTimeInMicro();
+                response_count_down_map[unique_request_id].index_reply->set_merge_time(end_time - start_time);
+                response_count_down_map[unique_request_id].index_reply->set_pack_index_resp_time(end_time - start_time); 
+                //response_count_down_map[unique_request_id].index_reply->set_index_time(index_times[unique_request_id]);
+                /* Call server finish for this particular request,
+                   and pass the response so that it can be sent
+                   by the server to the frontend.*/
+                uint64_t prev_rec = response_count_down_map[unique_request_id].index_reply->index_time();
+                response_count_down_map[unique_request_id].index_reply->set_index_time(prev_rec + (GetTimeInMicro() - s1));
+                budget_controller.RequestFinished(GetTimeInMicro() - response_count_down_map[unique_request_id].arrival_time);
+                map_fine_mutex[unique_request_id]->unlock();
+
+                map_coarse_mutex.lock();
+                server->Finish(unique_request_id, 
+                        response_count_down_map[unique_request_id].index_reply);
+                map_coarse_mutex.unlock();
             }
-            // Once we're complete, deallocate the call object.
-            delete call;
         }
 
-            private:
+        // The stream is open: start reading responses, and send what is pending.
+        void StreamStarted(const bool ok)
+        {
+            CHECK(ok, "Bucket no longer exists\n");
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            stream_ready_ = true;
+            stream_->Read(&read_batch_, &read_tag_);
+            if (pending_.requests_size() != 0) {
+                StartWrite();
+            }
+        }
+
+        /* A frame was handed to the transport: flow control lets the next one
+           go, with every request queued meanwhile.*/
+        void StreamWritten(const bool ok)
+        {
+            CHECK(ok, "Bucket no longer exists\n");
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            write_in_flight_ = false;
+            in_flight_.Clear();
+            if (pending_.requests_size() != 0) {
+                StartWrite();
+            }
+        }
+
+        /* Keeps a read posted while the responses of a frame are merged, so
+           another response thread can merge the next frame meanwhile.*/
+        void StreamRead(const bool ok)
+        {
+            CHECK(ok, "Bucket no longer exists\n");
+            NearestNeighborResponseBatch batch;
+            batch.Swap(&read_batch_);
+            stream_->Read(&read_batch_, &read_tag_);
+            for(int i = 0; i < batch.responses_size(); i++)
+            {
+                HandleBucketResponse(batch.responses(i));
+            }
+        }
+
+        // Sends the pending requests as one frame (stream_mutex_ is held).
+        void StartWrite()
+        {
+            in_flight_.Swap(&pending_);
+            write_in_flight_ = true;
+            stream_->Write(in_flight_, &write_tag_);
+        }
+
         // struct for keeping state and data information
-        struct AsyncClientCall {
+        struct AsyncClientCall : BucketTag {
             // Container for the data we expect from the server.
             NearestNeighborResponse reply;
             // Context for the client. It could be used to convey extra information to
@@ -467,6 +556,22 @@ class DistanceServiceClient {
         // server's exposed services.
         std::unique_ptr<DistanceService::Stub> stub_;
 
+        /* Stream to the bucket server (--bucket_streaming). One frame is
+           written and one read at a time; the request IDs tag the responses.*/
+        bool streaming_;
+        ClientContext stream_context_;
+        std::unique_ptr<ClientAsyncReaderWriter<NearestNeighborRequestBatch, NearestNeighborResponseBatch> > stream_;
+        BucketTag start_tag_;
+        BucketTag write_tag_;
+        BucketTag read_tag_;
+        std::mutex stream_mutex_;
+        bool stream_ready_ = false;
+        bool write_in_flight_ = false;
+        // Requests waiting for the next frame, and the frame being written.
+        NearestNeighborRequestBatch pending_;
+        NearestNeighborRequestBatch in_flight_;
+        NearestNeighborResponseBatch read_batch_;
+
         // The producer-consumer queue we use to communicate asynchronously with the
         // gRPC runtime.
         CompletionQueue cq_;
@@ -474,7 +579,8 @@ class DistanceServiceClient {
 
         void ProcessRequest(LoadGenRequest &load_gen_request, 
                 uint64_t unique_request_id_value,
-                int tid)
+                int tid,
+                uint64_t arrival_time)
         {
             uint64_t s1 =0, e1 =0;
             s1 = GetTimeInMicro();
@@ -503,6 +609,10 @@ class DistanceServiceClient {
                 sleep(4);
                 CHECK(false, "Exit signal received\n");
             }
+            budget_controller.RequestStarted();
+            response_count_down_map[unique_request_id_value].arrival_time = arrival_time;
+            response_count_down_map[unique_request_id_value].queries_size = load_gen_request.query_id_size();
+            response_count_down_map[unique_request_id_value].number_of_nearest_neighbors = number_of_nearest_neighbors;
             response_count_down_map[unique_request_id_value].responses_recvd = 0;
             response_count_down_map[unique_request_id_value].response_data.resize(number_of_bucket_servers, ResponseData());
             response_count_down_map[unique_request_id_value].index_reply->set_request_id(load_gen_request.request_id());
@@ -541,16 +651,12 @@ class DistanceServiceClient {
             Matrix<unsigned char> queries(new unsigned char[queries_size*query_dimensions],
                     queries_size,
                     query_dimensions);
-            // Create a MultiplePoints structure to unpack queries into.
-            Point p(query_dimensions, 0.0);
-            MultiplePoints queries_multiple_points(queries_size, p);
             NearestNeighborRequest request_to_bucket;
             UnpackLoadgenServiceRequest(load_gen_request,
-                    dataset_multiple_points,
+                    lsh_dataset,
                     queries_size,
                     query_dimensions,
                     &queries,
-                    &queries_multiple_points,
                     &query_id,
                     &request_to_bucket);
             // Dataset dimension must be equal to queries dimension.
@@ -563,30 +669,34 @@ class DistanceServiceClient {
             //float points_sent_percent = PercentDataSent(point_ids, queries_size, dataset_size);
             //printf("Amount of dataset sent to bucket server in the form of point IDs = %.5f\n", points_sent_percent);
             //(*response_count_down_map)[unique_request_id_value]->index_reply->set_percent_data_sent(points_sent_percent);
-            std::vector<std::vector<uint32_t> > point_ids;
-            std::vector<std::vector<std::vector<uint32_t> > > point_ids_for_all_bucket_servers(number_of_bucket_servers, point_ids);
+            std::vector<std::vector<std::vector<uint32_t> > > point_ids_for_all_bucket_servers;
 
             start_time = GetTimeInMicro();
-            for(unsigned int i = 0; i < number_of_bucket_servers; i++)
-            {
-                int bucket_server_id = i;
-                lsh_index.getPointIDs(queries,
-                        tables_of_vectors,
-                        bucket_server_id,
-                        flann::SearchParams(128),
-                        &point_ids_for_all_bucket_servers[i]);
-                //float points_sent_percent = PercentDataSent(point_ids_for_all_bucket_servers[i], queries_size, dataset_size);
-                //printf("Amount of dataset sent to bucket server in the form of point IDs = %.5f\n", points_sent_percent);
-                /* It is possible for no point IDs to be returned for a query.
-                   i.e the query did not hash to any bucket.
-                   LSH parameters must be chosen in a better fashion in such cases.*/
-                /* We fix the number of computations that HDSearch performs 
-                   to study overheads when query compute is equal. Note this this affects
-                   accuracy. With our current setup, our responses are 93% accurate.
-                   You can increase the FIXEDCOMP or remove the following line to vary
-                   HDSearch's computations.*/
-                point_ids_for_all_bucket_servers[i][0].resize(FIXEDCOMP);
+            /* The candidate budget bounds the computations that HDSearch
+               performs per query, so that overheads can be studied with query
+               compute kept equal. Probes are made best first, so a budget
+               keeps the candidates most likely to be neighbors.*/
+            unsigned int probe_budget = default_probe_budget, candidate_budget = default_candidate_budget;
+            if (budget_controller.IsEnabled()) {
+                budget_controller.GetBudgets(&candidate_budget, &probe_budget);
+            }
+            if (load_gen_request.probe_budget() != 0) {
+                probe_budget = load_gen_request.probe_budget();
             }
+            if (load_gen_request.candidate_budget() != 0) {
+                candidate_budget = load_gen_request.candidate_budget();
+            }
+            response_count_down_map[unique_request_id_value].index_reply->set_probe_budget(probe_budget);
+            response_count_down_map[unique_request_id_value].index_reply->set_candidate_budget(candidate_budget);
+            lsh_index.getPointIDs(queries,
+                    &sharded_lsh_tables,
+                    number_of_bucket_servers,
+                    probe_budget,
+                    candidate_budget,
+                    &point_ids_for_all_bucket_servers);
+            /* It is possible for no point IDs to be returned for a query.
+               i.e the query did not hash to any bucket.
+               LSH parameters must be chosen in a better fashion in such cases.*/
             //map_fine_mutex[unique_request_id_value]->lock();
             response_count_down_map[unique_request_id_value].index_reply->set_get_point_ids_time(GetTimeInMicro() - start_time);
             response_count_down_map[unique_request_id_value].index_reply->set_get_bucket_responses_time(GetTimeInMicro());
@@ -595,8 +705,7 @@ class DistanceServiceClient {
 
             for(int i = 0; i < number_of_bucket_servers; i++) {
                 int index = (tid*number_of_bucket_servers) + i;
-                bucket_connections[index]->GetNearestNeighbors(queries_multiple_points,
-                        point_ids_for_all_bucket_servers[i],
+                bucket_connections[index]->GetNearestNeighbors(point_ids_for_all_bucket_servers[i],
                         queries_size,                                   
                         number_of_nearest_neighbors,                                    
                         i,
@@ -759,30 +868,35 @@ class DistanceServiceClient {
             dispatch_parallelism = index_server_command_line_args->dispatch_parallelism;
             number_of_response_threads = index_server_command_line_args->number_of_async_response_threads;
             get_profile_stats = index_server_command_line_args->get_profile_stats;
+            bucket_streaming = index_server_command_line_args->bucket_streaming;
+            default_probe_budget = index_server_command_line_args->probe_budget;
+            default_candidate_budget = index_server_command_line_args->candidate_budget;
+            if (index_server_command_line_args->p99_target_us != 0) {
+                budget_controller.Initialize(index_server_command_line_args->p99_target_us,
+                        index_server_command_line_args->min_candidate_budget,
+                        default_candidate_budget,
+                        index_server_command_line_args->min_probe_budget,
+                        default_probe_budget);
+            }
             // Load bucket server IPs into a string vector
             GetBucketServerIPs(bucket_server_ips_file, &bucket_server_ips);
 
             /* Before server starts for the 1st time, construct index for dataset.
                Offline action*/
             // Read dataset file and create a dataset matrix.
-            Matrix<unsigned char> dataset;
             if (mode == 1)
             {
-                dataset = *(CreateDatasetFromTextFile(
+                lsh_dataset = *(CreateDatasetFromTextFile(
                             dataset_file_name,
                             &dataset_size,
                             &dataset_dimensions));
-                dataset_multiple_points.CreateMultiplePoints(dataset_file_name);
             } else if (mode == 2)
             {
                 CreateDatasetFromBinaryFile(
                         dataset_file_name,
                         &dataset_size,
                         &dataset_dimensions,
-                        &dataset);
-                CreateMultiplePointsFromBinaryFile(
-                        dataset_file_name,
-                        &dataset_multiple_points);
+                        &lsh_dataset);
             } else {
                 CHECK(false, "ERROR: Mode must be either 1 (text file) or 2 (binary file)\n");
             }
@@ -794,7 +908,7 @@ class DistanceServiceClient {
             /* You can either build index from scratch here using BuildLshIndex
                or you can load index from file, using LoadLshIndexFromFile.
                Performance depends on size of the dataset.*/
-            BuildLshIndex(dataset,
+            BuildLshIndex(lsh_dataset,
                     num_hash_tables,
                     hash_table_key_length,
                     num_multi_probe_levels,
@@ -802,14 +916,14 @@ class DistanceServiceClient {
             unsigned int shard_size = dataset_size/number_of_bucket_servers;
             lsh_index.ChangeTablesStructure(number_of_bucket_servers,
                     shard_size,
-                    tables_of_vectors);
+                    &sharded_lsh_tables);
             for(int i = 0; i < dispatch_parallelism; i++)
             {
                 for(unsigned int j = 0; j < number_of_bucket_servers; j++)
                 {
                     std::string ip = bucket_server_ips[j];
                     bucket_connections.emplace_back(new DistanceServiceClient(grpc::CreateChannel(
-                                    ip, grpc::InsecureChannelCredentials())));
+                                    ip, grpc::InsecureChannelCredentials()), bucket_streaming));
                 }
             }
             std::vector<std::thread> response_threads;
@@ -38,7 +38,9 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <map>
+#include <queue>
 #include <vector>
 
 #include "flann/general.h"
@@ -120,7 +122,8 @@ namespace flann
             table_number_(other.table_number_),
             key_size_(other.key_size_),
             multi_probe_level_(other.multi_probe_level_),
-            xor_masks_(other.xor_masks_)
+            xor_masks_(other.xor_masks_),
+            key_blocks_(other.key_blocks_)
         {
         }
 
@@ -185,6 +188,7 @@ namespace flann
                     ar & tables_;
 
                     if (Archive::is_loading::value) {
+                        initializeKeyBlocks();
                         index_params_["algorithm"] = getType();
                         index_params_["table_number"] = table_number_;
                         index_params_["key_size"] = key_size_;
@@ -216,16 +220,15 @@ namespace flann
             // A.S
             void ChangeTablesStructure(unsigned int number_of_bucket_servers,
                     unsigned int shard_size,
-                    std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors)
+                    std::vector<lsh::ShardedTable>* sharded_tables)
             {
-                std::map<unsigned int, std::vector<std::vector<unsigned int> > > tmp_map;
-                tables_of_vectors->resize(table_number_, tmp_map);
-
+                sharded_tables->resize(table_number_);
                 for (unsigned int i = 0; i < table_number_; ++i) {
-                    lsh::LshTable<ElementType>& table = tables_[i];
-                    table.ChangeTableStructure(number_of_bucket_servers,
+                    tables_[i].ChangeTableStructure(number_of_bucket_servers,
                             shard_size,
-                            &tables_of_vectors->at(i));
+                            &sharded_tables->at(i));
+                    // The sharded tables are the index from now on: do not keep every point ID twice.
+                    tables_[i].releaseBuckets();
                 }
             }
             // A.S
@@ -238,30 +241,33 @@ namespace flann
             }
 
 
+            /** A.S Get the candidate point IDs of every query, for every bucket server
+             * @param queries
+             * @param sharded_tables the tables built by ChangeTablesStructure
+             * @param number_of_bucket_servers
+             * @param probe_budget the number of buckets to probe per query, across all
+             * the tables (0: every multi-probe xor mask, in every table)
+             * @param candidate_budget the maximum number of candidates per query and
+             * bucket server (0: unlimited)
+             * @param point_ids_vec the point IDs, per bucket server then per query
+             */
             int getPointIDs(const Matrix<ElementType>& queries, 
-                    std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors,
-                    const unsigned int bucket_server_id,
-                    const SearchParams& params,
-                    std::vector<std::vector<uint32_t> >* point_ids_vec) const
+                    const std::vector<lsh::ShardedTable>* sharded_tables,
+                    const unsigned int number_of_bucket_servers,
+                    const unsigned int probe_budget,
+                    const unsigned int candidate_budget,
+                    std::vector<std::vector<std::vector<uint32_t> > >* point_ids_vec) const
             {
                 assert(queries.cols == veclen_);
-                std::vector<uint32_t> point_id_vec;
-                // Printing hash table info.
-                /*typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-                  typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-                  for (; table != table_end; ++table) {
-                  std::cout << table->getStats() << std::endl;
-                  }*/
-                point_ids_vec->resize((int)queries.rows, point_id_vec);
-
-                for (int i = 0; i < (int)queries.rows; i++) {
-                    findPointIDs(queries[i], 
-                            tables_of_vectors, 
-                            bucket_server_id,
-                            params, 
-                            &point_id_vec);
-                    point_ids_vec->at(i) = point_id_vec;
-                    point_id_vec.clear();
+                point_ids_vec->assign(number_of_bucket_servers, std::vector<std::vector<uint32_t> >(queries.rows));
+                std::vector<std::pair<unsigned int, lsh::BucketKey> > probes;
+                for (size_t i = 0; i < queries.rows; i++) {
+                    getProbes(queries[i], probe_budget, &probes);
+                    calculatePointIDs(probes,
+                            sharded_tables,
+                            candidate_budget,
+                            i,
+                            point_ids_vec);
                 }
                 return 0;
             }
@@ -384,17 +390,75 @@ namespace flann
             }
 
 
-            // A.S.
-            void findPointIDs(const ElementType* vec,
-                    std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors,
-                    const unsigned int bucket_server_id,
-                    const SearchParams&, /*searchParams*/
-                    std::vector<uint32_t>* point_id_vec) const
+            /** A.S The buckets to probe for a query, best first (query-directed
+             * multi-probe). The bucket of the query comes first in every table.
+             * Then come the buckets whose keys differ in the bits the query is
+             * closest to flipping: flipping a set of key bits costs the sum of the
+             * squared changes of the feature bytes it needs, and the perturbations
+             * of all the tables are generated in increasing cost.
+             * @param vec the query
+             * @param probe_budget the number of probes (0: every xor mask in every table)
+             * @param probes (table, key) pairs
+             */
+            void getProbes(const ElementType* vec,
+                    const unsigned int probe_budget,
+                    std::vector<std::pair<unsigned int, lsh::BucketKey> >* probes) const
             {
-                calculatePointIDs(vec, 
-                        tables_of_vectors, 
-                        bucket_server_id,
-                        point_id_vec);
+                probes->clear();
+                std::vector<size_t> keys(table_number_);
+                getKeys(vec, &keys[0]);
+                if ((probe_budget == 0) || key_blocks_.empty()) {
+                    for (unsigned int i = 0; i < table_number_; ++i) {
+                        for (size_t j = 0; j < xor_masks_.size(); ++j) {
+                            probes->push_back(std::make_pair(i, lsh::BucketKey(keys[i] ^ xor_masks_[j])));
+                        }
+                    }
+                    return;
+                }
+                for (unsigned int i = 0; (i < table_number_) && (probes->size() < probe_budget); ++i) {
+                    probes->push_back(std::make_pair(i, lsh::BucketKey(keys[i])));
+                }
+
+                // The cost of flipping each key bit of each table, cheapest first.
+                std::vector<std::vector<std::pair<float, lsh::BucketKey> > > flips(table_number_);
+                const unsigned char* feature = reinterpret_cast<const unsigned char*>(vec);
+                for (size_t i = 0; i < key_blocks_.size(); ++i) {
+                    const lsh::KeyBlock& key_block = key_blocks_[i];
+                    size_t mask_block = key_block.mask;
+                    lsh::BucketKey key_bit = lsh::BucketKey(1) << key_block.shift;
+                    for (; mask_block; mask_block &= mask_block - 1, key_bit <<= 1) {
+                        size_t feature_bit = key_block.block * sizeof(size_t) * CHAR_BIT + __builtin_ctzll(mask_block);
+                        float cost = getFlipCost(feature[feature_bit / CHAR_BIT], feature_bit % CHAR_BIT);
+                        flips[key_block.table].push_back(std::make_pair(cost * cost, key_bit));
+                    }
+                }
+
+                /* A perturbation is a set of flips of a table, as a bit mask over its
+                   sorted flips. From the set whose last flip is j, "shift" replaces j
+                   with j + 1 and "expand" adds j + 1: starting from {0}, this generates
+                   every set exactly once, each after the sets that cost less.*/
+                std::priority_queue<Perturbation, std::vector<Perturbation>, std::greater<Perturbation> > perturbations;
+                for (unsigned int i = 0; i < table_number_; ++i) {
+                    if (flips[i].empty()) continue;
+                    std::sort(flips[i].begin(), flips[i].end());
+                    perturbations.push(Perturbation(flips[i][0].first, i, 1));
+                }
+                while ((probes->size() < probe_budget) && !perturbations.empty()) {
+                    Perturbation perturbation = perturbations.top();
+                    perturbations.pop();
+                    const std::vector<std::pair<float, lsh::BucketKey> >& table_flips = flips[perturbation.table];
+                    lsh::BucketKey key = keys[perturbation.table];
+                    for (uint64_t set = perturbation.set; set; set &= set - 1) key ^= table_flips[__builtin_ctzll(set)].second;
+                    probes->push_back(std::make_pair(perturbation.table, key));
+
+                    unsigned int last = 63 - __builtin_clzll(perturbation.set);
+                    if (last + 1 < table_flips.size()) {
+                        uint64_t next = uint64_t(1) << (last + 1);
+                        perturbations.push(Perturbation(perturbation.score + table_flips[last + 1].first, perturbation.table, perturbation.set | next));
+                        perturbations.push(Perturbation(perturbation.score - table_flips[last].first + table_flips[last + 1].first,
+                                    perturbation.table, (perturbation.set ^ (uint64_t(1) << last)) | next));
+                    }
+                }
             }
 
             /**
@@ -431,6 +495,7 @@ namespace flann
                     // Add the features to the table
                     table.add(features);
                 }
+                initializeKeyBlocks();
             }
 
             void freeIndex()
@@ -585,64 +650,130 @@ namespace flann
                 }
             }
 
-            // A.S 
-            void calculatePointIDs(const ElementType* vec, 
-                    std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors,
-                    const unsigned int bucket_server_id,
-                    std::vector<uint32_t>* point_id_vec) const
+            /** A.S Compute the keys of a feature in every table at once: the key
+             * blocks of all the tables are sorted by block, so the feature is
+             * read in a single pass.
+             * @param vec the feature
+             * @param keys table_number_ keys
+             */
+            void getKeys(const ElementType* vec, size_t* keys) const
             {
-                typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
-                typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
-                int table_number = 0;
-                for (; table != table_end; ++table) {
-                    size_t key = table->getKey(vec);
-                    std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
-                    std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
-                    for (; xor_mask != xor_mask_end; ++xor_mask) {
-                        size_t sub_key = key ^ (*xor_mask);
-                        std::map<unsigned int, std::vector<std::vector<unsigned int> > >::iterator it = (tables_of_vectors->at(table_number)).find(sub_key);
-                        if(it == (tables_of_vectors->at(table_number)).end()) {
-                            continue;
-                        }
+                if (key_blocks_.empty()) {
+                    for (unsigned int i = 0; i < table_number_; ++i) keys[i] = tables_[i].getKey(vec);
+                    return;
+                }
+                std::fill(keys, keys + table_number_, 0);
+                lsh::computeKeys(key_blocks_, reinterpret_cast<const unsigned char*>(vec), keys);
+            }
 
-                        for(int j = 0; j < ((tables_of_vectors->at(table_number)).at(sub_key).at(bucket_server_id).size()); j++)
-                        {
-                            point_id_vec->push_back(static_cast<uint32_t>((tables_of_vectors->at(table_number)).at(sub_key).at(bucket_server_id).at(j)));
-                        }
-                        /*const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
-                        if (bucket == 0) {
-                            std::cout << "2 couldn't find sub key\n";
-                            continue;
-                        }
-                        std::cout << "2 exists\n";
-                        // Go over each descriptor index
-                        std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
-                        std::vector<lsh::FeatureIndex>::const_iterator last_training_index = bucket->end();
-                        DistanceType hamming_distance;
+            void initializeKeyBlocks()
+            {
+                // Only the unsigned char tables have key blocks.
+                key_blocks_.clear();
+                for (unsigned int i = 0; i < tables_.size(); ++i) {
+                    const std::vector<lsh::KeyBlock>& table_key_blocks = tables_[i].getKeyBlocks();
+                    for (size_t j = 0; j < table_key_blocks.size(); ++j) {
+                        key_blocks_.push_back(table_key_blocks[j]);
+                        key_blocks_.back().table = i;
+                    }
+                }
+                std::stable_sort(key_blocks_.begin(), key_blocks_.end(), compareKeyBlocks);
+            }
 
-                        // Process the rest of the candidates
-                        for (; training_index < last_training_index; ++training_index) {
-                            if (removed_ && removed_points_.test(*training_index)) continue;
-                            point_id_vec->push_back(static_cast<uint32_t>(*training_index));*/
-                            //printf("2 %u ", (*training_index));
-                            // A.S If point ID is not present in the vector, add it.
-                            /*if (seen_ids[static_cast<uint32_t>(*training_index)] == 0)
-                              {
-                              seen_ids[static_cast<uint32_t>(*training_index)] = 1;
-                              point_id_vec->push_back(static_cast<uint32_t>(*training_index));
-                              } else if (seen_ids[static_cast<uint32_t>(*training_index)] == 1)
-                              {
-                              continue;
-                              } else {
-                              std::cout << "Assert Fail \n";
-                              }*/
-                            /*if ( !(std::find(point_id_vec->begin(), point_id_vec->end(), static_cast<uint32_t>(*training_index)) != point_id_vec->end()) ) {
-                              point_id_vec->push_back(static_cast<uint32_t>(*training_index));
-                              }*/
+            static bool compareKeyBlocks(const lsh::KeyBlock& a, const lsh::KeyBlock& b)
+            {
+                return a.block < b.block;
+            }
+
+            // A.S 
+            void calculatePointIDs(const std::vector<std::pair<unsigned int, lsh::BucketKey> >& probes,
+                    const std::vector<lsh::ShardedTable>* sharded_tables,
+                    const unsigned int candidate_budget,
+                    const size_t query,
+                    std::vector<std::vector<std::vector<uint32_t> > >* point_ids_vec) const
+            {
+                assert(sharded_tables->size() == table_number_);
+                /* Start fetching the slots of all the probes first, so that their
+                   cache misses overlap instead of being taken one probe at a time.*/
+                for (size_t k = 0; k < probes.size(); ++k) {
+                    (*sharded_tables)[probes[k].first].prefetch(probes[k].second);
+                }
+                std::vector<std::pair<const lsh::ShardedTable*, const uint32_t*> > buckets;
+                buckets.reserve(probes.size());
+                for (size_t k = 0; k < probes.size(); ++k) {
+                    const lsh::ShardedTable& sharded_table = (*sharded_tables)[probes[k].first];
+                    const uint32_t* bucket = sharded_table.findBucket(probes[k].second);
+                    if (bucket == 0) continue;
+                    sharded_table.prefetch(bucket);
+                    buckets.push_back(std::make_pair(&sharded_table, bucket));
+                }
+
+                /* Probes overlap: a point found by several of them is sent once.
+                   Bucket servers hold disjoint points, so they share one set of
+                   seen points.*/
+                static thread_local DynamicBitset seen;
+                if (seen.size() < size_) seen.resize(size_);
+                for (size_t j = 0; j < point_ids_vec->size(); ++j) {
+                    std::vector<uint32_t>& point_ids = (*point_ids_vec)[j][query];
+                    for (size_t k = 0; k < buckets.size(); ++k) {
+                        size_t size = 0;
+                        const uint8_t* block = buckets[k].first->getShardBlock(buckets[k].second, j, &size);
+                        if (size == 0) continue;
+                        size_t offset = point_ids.size();
+                        point_ids.resize(offset + size);
+                        lsh::ShardedTable::decodeBlock(block, size, &point_ids[offset]);
+                        // Keep the points not seen yet, up to the budget.
+                        size_t end = offset;
+                        for (size_t l = offset; (l < point_ids.size()) && ((candidate_budget == 0) || (end < candidate_budget)); ++l) {
+                            if (seen.test(point_ids[l])) continue;
+                            seen.set(point_ids[l]);
+                            point_ids[end++] = point_ids[l];
                         }
-                    table_number++;
+                        point_ids.resize(end);
+                        if ((candidate_budget != 0) && (end >= candidate_budget)) break;
                     }
                 }
+                for (size_t j = 0; j < point_ids_vec->size(); ++j) {
+                    const std::vector<uint32_t>& point_ids = (*point_ids_vec)[j][query];
+                    for (size_t l = 0; l < point_ids.size(); ++l) seen.reset(point_ids[l]);
+                }
+            }
+
+            /** A.S The smallest change of a byte that flips one of its bits
+             * @param value the byte
+             * @param bit the bit
+             * @return the distance to the nearest byte in which the bit differs
+             */
+            static float getFlipCost(unsigned int value, unsigned int bit)
+            {
+                // The bit repeats with period 2^(bit + 1): clear in the lower half, set in the upper one.
+                unsigned int period = 2u << bit;
+                unsigned int half = 1u << bit;
+                unsigned int low = value & (period - 1);
+                unsigned int up = (low >= half) ? (period - low) : (half - low);
+                unsigned int down = (low >= half) ? (low - half + 1) : (low + 1);
+                if (value + up > UCHAR_MAX) return down;
+                if (down > value) return up;
+                return std::min(up, down);
+            }
+
+            /** A.S A set of flips of the key of a table, and its cost */
+            struct Perturbation
+            {
+                Perturbation(float score_, unsigned int table_, uint64_t set_) :
+                    score(score_), table(table_), set(set_)
+                {
+                }
+                bool operator>(const Perturbation& other) const
+                {
+                    if (score != other.score) return score > other.score;
+                    if (table != other.table) return table > other.table;
+                    return set > other.set;
+                }
+                float score;
+                unsigned int table;
+                uint64_t set;
+            };
 
             void swap(LshIndex& other)
             {
@@ -653,6 +784,7 @@ namespace flann
                 std::swap(key_size_, other.key_size_);
                 std::swap(multi_probe_level_, other.multi_probe_level_);
                 std::swap(xor_masks_, other.xor_masks_);
+                std::swap(key_blocks_, other.key_blocks_);
             }
 
             /** The different hash tables */
@@ -668,6 +800,9 @@ namespace flann
             /** The XOR masks to apply to a key to get the neighboring buckets */
             std::vector<lsh::BucketKey> xor_masks_;
 
+            /** A.S The key blocks of all the tables, sorted by block (see getKeys) */
+            std::vector<lsh::KeyBlock> key_blocks_;
+
             USING_BASECLASS_SYMBOLS
     };
 }
@@ -40,6 +40,7 @@
 #include "flann/util/params.h"
 #include "flann/util/result_set.h"
 #include "flann/util/dynamic_bitset.h"
+#include "flann/util/lsh_table.h"
 #include "flann/util/saving.h"
 
 namespace flann
@@ -362,11 +363,11 @@ namespace flann
             // A.S
             virtual void ChangeTablesStructure(unsigned int number_of_bucket_servers,
                 unsigned int shard_size,
-                std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors)
+                std::vector<lsh::ShardedTable>* sharded_tables)
             {
                 ChangeTablesStructure(number_of_bucket_servers,
                         shard_size,
-                        tables_of_vectors);
+                        sharded_tables);
             }
             // A.S 
             virtual void PrintLshTables()
@@ -376,15 +377,17 @@ namespace flann
 
             // A.S Get point ID.
             virtual int getPointIDs(const Matrix<ElementType>& queries, 
-                    std::vector<std::map<unsigned int, std::vector<std::vector<unsigned int> > > >* tables_of_vectors,
-                    const unsigned int bucket_server_id,
-                    const SearchParams& params,
-                    std::vector<std::vector<uint32_t> >* point_ids_vec) const
+                    const std::vector<lsh::ShardedTable>* sharded_tables,
+                    const unsigned int number_of_bucket_servers,
+                    const unsigned int probe_budget,
+                    const unsigned int candidate_budget,
+                    std::vector<std::vector<std::vector<uint32_t> > >* point_ids_vec) const
             {
                 int result = getPointIDs(queries, 
-                        tables_of_vectors,
-                        bucket_server_id,
-                        params,
+                        sharded_tables,
+                        number_of_bucket_servers,
+                        probe_budget,
+                        candidate_budget,
                         point_ids_vec);
                 return result;
             }
@@ -47,6 +47,13 @@
 #endif
 #include <math.h>
 #include <stddef.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "flann/util/dynamic_bitset.h"
 #include "flann/util/matrix.h"
@@ -114,6 +121,314 @@ namespace flann
         }
 
 
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+        /** A.S A non-zero 64 bit block of the mask of an LshTable: the bits it
+         * selects in block "block" of a feature form bits [shift, shift + popcount(mask))
+         * of the key of table "table".
+         */
+        struct KeyBlock
+        {
+            uint32_t block;
+            uint32_t table;
+            uint32_t shift;
+            size_t mask;
+        };
+
+        /** A.S Read a block of a feature
+         */
+        inline size_t loadFeatureBlock(const unsigned char* feature, uint32_t block)
+        {
+            size_t feature_block;
+            memcpy(&feature_block, feature + block * sizeof(size_t), sizeof(size_t));
+            return feature_block;
+        }
+
+        inline void computeKeysPortable(const std::vector<KeyBlock>& key_blocks, const unsigned char* feature, size_t* keys)
+        {
+            for (std::vector<KeyBlock>::const_iterator key_block = key_blocks.begin(); key_block != key_blocks.end(); ++key_block) {
+                size_t feature_block = loadFeatureBlock(feature, key_block->block);
+                size_t mask_block = key_block->mask;
+                size_t bit_index = size_t(1) << key_block->shift;
+                while (mask_block) {
+                    size_t lowest_bit = mask_block & (-(ptrdiff_t)mask_block);
+                    keys[key_block->table] += (feature_block & lowest_bit) ? bit_index : 0;
+                    mask_block ^= lowest_bit;
+                    bit_index <<= 1;
+                }
+            }
+        }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+        /** A.S PEXT packs the bits a mask selects in a block in one instruction.
+         * Built for BMI2 whatever the compiler flags, and only called if the CPU has it.
+         */
+        __attribute__((target("bmi2")))
+        inline void computeKeysBmi2(const std::vector<KeyBlock>& key_blocks, const unsigned char* feature, size_t* keys)
+        {
+            for (std::vector<KeyBlock>::const_iterator key_block = key_blocks.begin(); key_block != key_blocks.end(); ++key_block) {
+                keys[key_block->table] |= size_t(_pext_u64(loadFeatureBlock(feature, key_block->block), key_block->mask)) << key_block->shift;
+            }
+        }
+
+        inline bool hasBmi2()
+        {
+            static const bool has_bmi2 = __builtin_cpu_supports("bmi2");
+            return has_bmi2;
+        }
+#endif
+
+        /** A.S Compute the keys of a feature from the key blocks of one or more
+         * tables. Feature blocks are read in the order of the key blocks, so
+         * sorting the key blocks of several tables by block computes all their
+         * keys in a single pass over the feature.
+         * @param key_blocks
+         * @param feature
+         * @param keys the keys, indexed by KeyBlock::table; they must be zeroed
+         */
+        inline void computeKeys(const std::vector<KeyBlock>& key_blocks, const unsigned char* feature, size_t* keys)
+        {
+#if defined(__GNUC__) && defined(__x86_64__)
+            if (hasBmi2()) {
+                computeKeysBmi2(key_blocks, feature, keys);
+                return;
+            }
+#endif
+            computeKeysPortable(key_blocks, feature, keys);
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+        /** A.S Flat copy of an LshTable for the index server, whose corpus is
+         * sharded across bucket servers. Once built, it is the only copy of the
+         * table's buckets. The point IDs of every non-empty bucket are stored
+         * grouped by bucket server in one contiguous array, so that the IDs a
+         * bucket server needs from a bucket are a single block. A block holds
+         * its sorted IDs delta encoded and bit packed:
+         *   [count: varint][first ID: varint][width: 1 byte][count - 1 deltas of width bits]
+         * Buckets are found through an open-addressing (linear probing) hash
+         * of their key.
+         */
+        class ShardedTable
+        {
+            public:
+                ShardedTable() : number_of_bucket_servers_(0), shift_(31)
+                {
+                }
+
+                /** Build the table
+                 * @param buckets the non-empty buckets of an LshTable, with their keys
+                 * @param number_of_bucket_servers
+                 * @param shard_size the number of points each bucket server holds;
+                 * the left over points are held by the last bucket server
+                 */
+                void build(const std::vector<std::pair<BucketKey, const Bucket*> >& buckets,
+                        unsigned int number_of_bucket_servers,
+                        unsigned int shard_size)
+                {
+                    number_of_bucket_servers_ = number_of_bucket_servers;
+                    // Keep the load factor at most 1/2, so that probe sequences stay short.
+                    size_t capacity = 2;
+                    shift_ = 31;
+                    while (capacity < 2 * buckets.size()) {
+                        capacity <<= 1;
+                        --shift_;
+                    }
+                    slots_.assign(capacity, Slot());
+                    offsets_.clear();
+                    offsets_.reserve(buckets.size() * (number_of_bucket_servers + 1));
+                    postings_.clear();
+
+                    std::vector<std::vector<FeatureIndex> > shards(number_of_bucket_servers);
+                    for (size_t b = 0; b < buckets.size(); ++b) {
+                        const Bucket& bucket = *buckets[b].second;
+                        size_t slot = hash(buckets[b].first);
+                        while (slots_[slot].first != kEmptySlot) slot = (slot + 1) & (capacity - 1);
+                        slots_[slot].key = buckets[b].first;
+                        slots_[slot].first = offsets_.size();
+
+                        for (unsigned int j = 0; j < number_of_bucket_servers; ++j) shards[j].clear();
+                        for (size_t i = 0; i < bucket.size(); ++i) shards[getBucketServer(bucket[i], shard_size)].push_back(bucket[i]);
+                        for (unsigned int j = 0; j < number_of_bucket_servers; ++j) {
+                            offsets_.push_back(postings_.size());
+                            encodeBlock(&shards[j]);
+                        }
+                        offsets_.push_back(postings_.size());
+                    }
+                    // decodeBlock reads the packed deltas 8 bytes at a time.
+                    postings_.resize(postings_.size() + sizeof(uint64_t), 0);
+                    std::vector<uint8_t>(postings_).swap(postings_);
+                }
+
+                /** Find a bucket
+                 * @param key the key of the bucket
+                 * @return the bucket (for getShardBlock), 0 if it is empty
+                 */
+                inline const uint32_t* findBucket(BucketKey key) const
+                {
+                    if (slots_.empty()) return 0;
+                    for (size_t slot = hash(key); slots_[slot].first != kEmptySlot; slot = (slot + 1) & (slots_.size() - 1)) {
+                        if (slots_[slot].key == key) return &offsets_[slots_[slot].first];
+                    }
+                    return 0;
+                }
+
+                /** Find the point IDs a bucket server holds in a bucket
+                 * @param bucket a bucket found by findBucket
+                 * @param bucket_server_id
+                 * @param size the number of point IDs
+                 * @return the block of the point IDs (for decodeBlock), 0 if there is none
+                 */
+                inline const uint8_t* getShardBlock(const uint32_t* bucket, unsigned int bucket_server_id, size_t* size) const
+                {
+                    *size = 0;
+                    const uint32_t* offsets = bucket + bucket_server_id;
+                    if (offsets[0] == offsets[1]) return 0;
+                    const uint8_t* block = &postings_[offsets[0]];
+                    *size = readVarint(&block);
+                    return block;
+                }
+
+                /** Start fetching the point IDs of a bucket, ahead of getShardBlock
+                 * @param bucket a bucket found by findBucket
+                 */
+                inline void prefetch(const uint32_t* bucket) const
+                {
+                    __builtin_prefetch(&postings_[bucket[0]]);
+                }
+
+                /** Decode a block found by getShardBlock
+                 * @param block
+                 * @param size the number of point IDs in the block
+                 * @param point_ids where to write the point IDs
+                 */
+                static inline void decodeBlock(const uint8_t* block, size_t size, FeatureIndex* point_ids)
+                {
+                    uint32_t value = readVarint(&block);
+                    const unsigned int width = *block++;
+                    const uint64_t mask = (uint64_t(1) << width) - 1;
+                    uint64_t bit = 0;
+                    point_ids[0] = value;
+                    size_t i = 1;
+#ifdef __SSE2__
+                    // Unpack 4 deltas at a time and prefix sum them in a register.
+                    __m128i previous = _mm_set1_epi32(value);
+                    for (; i + 4 <= size; i += 4) {
+                        uint32_t deltas[4];
+                        for (int k = 0; k < 4; ++k) {
+                            deltas[k] = (load64(block + (bit >> 3)) >> (bit & 7)) & mask;
+                            bit += width;
+                        }
+                        __m128i x = _mm_loadu_si128((const __m128i*)deltas);
+                        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+                        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+                        x = _mm_add_epi32(x, previous);
+                        _mm_storeu_si128((__m128i*)(point_ids + i), x);
+                        previous = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+                    }
+                    value = point_ids[i - 1];
+#endif
+                    for (; i < size; ++i) {
+                        value += (load64(block + (bit >> 3)) >> (bit & 7)) & mask;
+                        bit += width;
+                        point_ids[i] = value;
+                    }
+                }
+
+                /** Start fetching the slot of a key, ahead of getShardBlock
+                 * @param key
+                 */
+                inline void prefetch(BucketKey key) const
+                {
+                    if (!slots_.empty()) __builtin_prefetch(&slots_[hash(key)]);
+                }
+
+                /** Memory used by the table, in bytes */
+                size_t usedMemory() const
+                {
+                    return slots_.size() * sizeof(Slot) + offsets_.size() * sizeof(uint32_t) + postings_.size();
+                }
+
+            private:
+                static const uint32_t kEmptySlot = 0xFFFFFFFF;
+
+                struct Slot
+                {
+                    Slot() : key(0), first(kEmptySlot)
+                    {
+                    }
+                    BucketKey key;
+                    /** Index in offsets_ of the bucket's first offset, kEmptySlot if the slot is free */
+                    uint32_t first;
+                };
+
+                /** Fibonacci hashing: the top bits of the product index the slots */
+                inline size_t hash(BucketKey key) const
+                {
+                    return (uint32_t)(key * 2654435769U) >> shift_;
+                }
+
+                inline unsigned int getBucketServer(FeatureIndex point_id, unsigned int shard_size) const
+                {
+                    unsigned int bucket_server = point_id / shard_size;
+                    return (bucket_server >= number_of_bucket_servers_) ? (number_of_bucket_servers_ - 1) : bucket_server;
+                }
+
+                /** Append the block of a list of point IDs to postings_ (nothing if the list is empty) */
+                void encodeBlock(std::vector<FeatureIndex>* point_ids)
+                {
+                    if (point_ids->empty()) return;
+                    // Points are added to the LshTable in order, so this normally finds them sorted already.
+                    std::sort(point_ids->begin(), point_ids->end());
+                    writeVarint(point_ids->size());
+                    writeVarint(point_ids->front());
+                    unsigned int width = 0;
+                    for (size_t i = 1; i < point_ids->size(); ++i) {
+                        uint32_t delta = (*point_ids)[i] - (*point_ids)[i - 1];
+                        while ((width < 32) && (delta >> width)) ++width;
+                    }
+                    postings_.push_back(width);
+                    uint64_t bits = 0;
+                    unsigned int number_of_bits = 0;
+                    for (size_t i = 1; i < point_ids->size(); ++i) {
+                        bits |= uint64_t((*point_ids)[i] - (*point_ids)[i - 1]) << number_of_bits;
+                        number_of_bits += width;
+                        for (; number_of_bits >= 8; number_of_bits -= 8, bits >>= 8) postings_.push_back(bits & 0xFF);
+                    }
+                    if (number_of_bits > 0) postings_.push_back(bits & 0xFF);
+                }
+
+                void writeVarint(uint32_t value)
+                {
+                    for (; value >= 0x80; value >>= 7) postings_.push_back((value & 0x7F) | 0x80);
+                    postings_.push_back(value);
+                }
+
+                static inline uint32_t readVarint(const uint8_t** data)
+                {
+                    uint32_t value = 0;
+                    for (unsigned int shift = 0; ; shift += 7) {
+                        uint8_t byte = *(*data)++;
+                        value |= uint32_t(byte & 0x7F) << shift;
+                        if (!(byte & 0x80)) return value;
+                    }
+                }
+
+                static inline uint64_t load64(const uint8_t* data)
+                {
+                    uint64_t value;
+                    memcpy(&value, data, sizeof(value));
+                    return value;
+                }
+
+                std::vector<Slot> slots_;
+                /** number_of_bucket_servers_ + 1 offsets in postings_ per bucket: the block of bucket server j is [offsets[j], offsets[j + 1]) */
+                std::vector<uint32_t> offsets_;
+                std::vector<uint8_t> postings_;
+                unsigned int number_of_bucket_servers_;
+                unsigned int shift_;
+        };
+
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
         /** Lsh hash table. As its key is a sub-feature, and as usually
@@ -239,56 +554,42 @@ namespace flann
                     }
 
                     /* A.S In order to optimize the index server, we want each 
-                       hash table entry to hold a 2D vector - list of point IDs that
+                       hash table entry to hold the list of point IDs that
                        need to go to each bucket server.*/
                     void ChangeTableStructure(unsigned int number_of_bucket_servers, 
                             unsigned int shard_size,
-                            std::map<unsigned int, std::vector<std::vector<unsigned int> > >* table_of_vectors)
+                            ShardedTable* sharded_table) const
                     {
-                        int which_bucket = 0;
-                        unsigned int key = 0;
-                        if (!buckets_speed_.empty()) {
-                            for (BucketsSpeed::const_iterator pbucket = buckets_speed_.begin(); pbucket != buckets_speed_.end(); ++pbucket) {
-                                /* Key is just the current iteration because
-                                   the buckets are stored as a vector of 
-                                   vectors.*/
-                                std::vector<unsigned int> tmp_vec(0, 0);
-                                std::vector<std::vector<unsigned int> > tmp_vec_vec(number_of_bucket_servers, tmp_vec);
-                                table_of_vectors->insert(std::pair<unsigned int, std::vector<std::vector<unsigned int> > >(key, tmp_vec_vec));
-
-                                for(int i = 0; i < pbucket->size(); i++)
-                                {
-                                    /* Identify which bucket server the curr
-                                       point must be sent to. i.e which vector
-                                       it must be added to.*/
-                                    which_bucket = pbucket->at(i)/shard_size;
-                                    /* If the dataset was not evenly divisible 
-                                       by the number of bucket servers, we must
-                                       put the left over points into the last
-                                       bucket.*/
-                                    if(which_bucket >= number_of_bucket_servers)
-                                    {
-                                        which_bucket = number_of_bucket_servers - 1;
-                                    }
-                                    (table_of_vectors->at(key)).at(which_bucket).push_back(pbucket->at(i));
-                                }
-                                key++;
-                            }
+                        std::vector<std::pair<BucketKey, const Bucket*> > buckets;
+                        /* Key is just the index of the bucket when the buckets
+                           are stored as a vector of vectors.*/
+                        for (size_t key = 0; key < buckets_speed_.size(); ++key) {
+                            if (!buckets_speed_[key].empty()) buckets.push_back(std::make_pair((BucketKey)key, &buckets_speed_[key]));
                         }
-                        // Following for loops just print the new table.
-                        /*for(std::map<unsigned int, std::vector<std::vector<unsigned int> > >::const_iterator it = table_of_vectors->begin(); it != table_of_vectors->end(); ++it)
-                        {
-                            std::cout << "key = " << it->first << ": ";
-                            for(int i = 0; i < number_of_bucket_servers; i++)
-                            {
-                                std::cout << "B" << i << ": ";
-                                for(int j = 0; j < it->second.at(i).size(); j++)
-                                {
-                                    std::cout << it->second.at(i).at(j) << " ";
-                                }
-                                std::cout << std::endl;
-                            }
-                        }*/
+                        for (BucketsSpace::const_iterator x = buckets_space_.begin(); x != buckets_space_.end(); ++x) {
+                            if (!x->second.empty()) buckets.push_back(std::make_pair(x->first, &x->second));
+                        }
+                        sharded_table->build(buckets, number_of_bucket_servers, shard_size);
+                    }
+
+                    /** A.S Free the buckets once a ShardedTable holds them. Only
+                     * the key mask is kept, for getKey: the table finds no
+                     * neighbors anymore.
+                     */
+                    void releaseBuckets()
+                    {
+                        BucketsSpeed().swap(buckets_speed_);
+                        BucketsSpace().swap(buckets_space_);
+                        key_bitset_ = DynamicBitset();
+                        speed_level_ = kHash;
+                    }
+
+                    /** A.S The non-zero blocks of the mask, for computeKeys (unsigned char only)
+                     * @return the key blocks, in block order, with table 0
+                     */
+                    const std::vector<KeyBlock>& getKeyBlocks() const
+                    {
+                        return key_blocks_;
                     }
 
                     // A.S
@@ -445,6 +746,9 @@ namespace flann
 
                             ar & key_size_;
                             ar & mask_;
+                            if (Archive::is_loading::value) {
+                                initializeKeyBlocks();
+                            }
 
                             if (speed_level_==kArray) {
                                 ar & buckets_speed_;
@@ -484,7 +788,25 @@ namespace flann
                      */
                     std::vector<size_t> mask_;
 
-                    // A.S
+                    /** A.S The non-zero blocks of mask_, so that getKey skips the others
+                    */
+                    std::vector<KeyBlock> key_blocks_;
+
+                    void initializeKeyBlocks()
+                    {
+                        key_blocks_.clear();
+                        uint32_t shift = 0;
+                        for (size_t i = 0; i < mask_.size(); ++i) {
+                            if (mask_[i] == 0) continue;
+                            KeyBlock key_block;
+                            key_block.block = i;
+                            key_block.table = 0;
+                            key_block.shift = shift;
+                            key_block.mask = mask_[i];
+                            key_blocks_.push_back(key_block);
+                            shift += __builtin_popcountll(mask_[i]);
+                        }
+                    }
             };
 
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -511,6 +833,7 @@ namespace flann
                     size_t idx = index / divisor; //pick the right size_t index
                     mask_[idx] |= size_t(1) << (index % divisor); //use modulo to find the bit offset
                 }
+                initializeKeyBlocks();
 
                 // Set to 1 if you want to display the mask for debug
 #if 0
@@ -534,33 +857,11 @@ namespace flann
         template<>
             inline size_t LshTable<unsigned char>::getKey(const unsigned char* feature) const
             {
-                // no need to check if T is dividable by sizeof(size_t) like in the Hamming
-                // distance computation as we have a mask
-                const size_t* feature_block_ptr = reinterpret_cast<const size_t*> (feature);
-
                 // Figure out the subsignature of the feature
                 // Given the feature ABCDEF, and the mask 001011, the output will be
                 // 000CEF
                 size_t subsignature = 0;
-                size_t bit_index = 1;
-
-                for (std::vector<size_t>::const_iterator pmask_block = mask_.begin(); pmask_block != mask_.end(); ++pmask_block) {
-                    // get the mask and signature blocks
-                    size_t feature_block = *feature_block_ptr;
-                    size_t mask_block = *pmask_block;
-                    while (mask_block) {
-                        // Get the lowest set bit in the mask block
-                        size_t lowest_bit = mask_block & (-(ptrdiff_t)mask_block);
-                        // Add it to the current subsignature if necessary
-                        subsignature += (feature_block & lowest_bit) ? bit_index : 0;
-                        // Reset the bit in the mask block
-                        mask_block ^= lowest_bit;
-                        // increment the bit index for the subsignature
-                        bit_index <<= 1;
-                    }
-                    // Check the next feature block
-                    ++feature_block_ptr;
-                }
+                computeKeys(key_blocks_, feature, &subsignature);
                 return subsignature;
             }
 